@@ -0,0 +1,827 @@
+/**
+ * @file bench_client.c
+ * @brief Generador de carga y medición de latencia para el servidor clave-valor
+ *
+ * Parte de test_client.c, pero en vez de siete comandos fijos abre varias
+ * conexiones por hilo, mantiene varios pedidos en vuelo por conexión
+ * (pipeline) y mide la latencia de cada uno en un histograma estilo HDR.
+ *
+ * Modo cerrado (por defecto): cada conexión manda un pedido nuevo apenas
+ * le vuelve una respuesta. Modo abierto (-R): los pedidos se programan a
+ * ritmo fijo y la latencia se cuenta desde el momento en que *tenían* que
+ * salir, así una demora del servidor no esconde la cola de latencias
+ * (omisión coordinada).
+ *
+ * Compilar: gcc -Wall -Wextra -O2 -pthread -o bench_client bench_client.c -lm
+ */
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <getopt.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SERVER_PORT 5000
+#define SERVER_IP "127.0.0.1"
+#define MAX_MSG_LENGTH 128
+#define MAX_THREADS 256
+#define BENCH_IN_BUF_LEN (256 * 1024)
+#define BENCH_DRAIN_NS (2ULL * 1000000000ULL)
+#define BENCH_POLL_MAX_MS 100
+#define HIST_SUB_BITS 6
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (2 * HIST_SUB_COUNT + (63 - HIST_SUB_BITS) * HIST_SUB_COUNT)
+#define BIN_MAGIC_REQUEST 0x80
+#define BIN_MAGIC_RESPONSE 0x81
+
+/***************************** tipos *********************************/
+/**
+ * @brief Operaciones que genera el benchmark
+ */
+typedef enum {
+    OP_GET,
+    OP_SET,
+    OP_DEL,
+    OP_COUNT,
+} benchOp_t;
+
+/**
+ * @brief Encabezado del protocolo binario del servidor (ver server_tcp.c)
+ */
+typedef struct __attribute__((packed)) {
+    uint8_t magic;
+    uint8_t opcode;
+    uint16_t keyLen;    /**< En la respuesta: estado */
+    uint32_t valLen;
+    uint32_t opaque;
+} benchBinHeader_t;
+
+/**
+ * @brief Pedido en vuelo
+ */
+typedef struct {
+    uint64_t start;     /**< Momento desde el que se cuenta la latencia (ns) */
+    uint8_t op;         /**< benchOp_t */
+    uint8_t done;       /**< Ya llegó la respuesta (binario: pueden llegar desordenadas) */
+} benchReq_t;
+
+/**
+ * @brief Conexión al servidor
+ *
+ * Los pedidos en vuelo son [head, tail) en un anillo de "pipeline" lugares,
+ * indexado por número de pedido (que en binario viaja como opaque).
+ */
+typedef struct {
+    int fd;                 /**< Socket */
+    benchReq_t* reqs;       /**< Anillo de pedidos en vuelo */
+    uint64_t head;          /**< Pedido más viejo sin respuesta */
+    uint64_t tail;          /**< Próximo número de pedido */
+    char* in;               /**< Respuestas recibidas sin procesar */
+    size_t inLen;           /**< Bytes válidos en in */
+    size_t skipLeft;        /**< Bytes de valor que faltan descartar */
+    uint64_t skipSeq;       /**< Pedido al que corresponde ese valor */
+    char* out;              /**< Pedidos pendientes de enviar */
+    size_t outLen;          /**< Bytes válidos en out */
+    size_t outOff;          /**< Bytes de out ya enviados */
+    size_t outCap;          /**< Capacidad reservada de out */
+    uint64_t nextSend;      /**< Modo abierto: cuándo corresponde el próximo pedido (ns) */
+    uint64_t loadNext;      /**< Carga inicial: próxima clave a escribir */
+    uint64_t loadEnd;       /**< Carga inicial: fin del rango de claves de la conexión */
+} benchConn_t;
+
+/**
+ * @brief Hilo generador de carga, con sus propias conexiones y contadores
+ */
+typedef struct {
+    int id;                         /**< Número de hilo */
+    pthread_t thread;               /**< Identificador del hilo */
+    benchConn_t* conns;             /**< Conexiones del hilo */
+    uint64_t rng;                   /**< Estado del generador aleatorio */
+    uint64_t ops[OP_COUNT];         /**< Respuestas recibidas por operación */
+    uint64_t notFound;              /**< Respuestas NOTFOUND */
+    uint64_t hist[HIST_BUCKETS];    /**< Histograma de latencias (ns) */
+} benchThread_t;
+
+/**
+ * @brief Configuración obtenida de la línea de comandos
+ */
+typedef struct {
+    const char* ip;         /**< IP del servidor */
+    int port;               /**< Puerto del servidor */
+    const char* unixPath;   /**< Socket Unix del servidor, "@nombre" si es abstracto (NULL = TCP) */
+    int threads;            /**< Hilos generadores */
+    int conns;              /**< Conexiones por hilo */
+    int pipeline;           /**< Pedidos en vuelo por conexión */
+    uint64_t keys;          /**< Cantidad de claves distintas */
+    double zipf;            /**< Exponente Zipf (0 = uniforme) */
+    int mix[OP_COUNT];      /**< Proporción de GET/SET/DEL */
+    size_t valMin;          /**< Largo mínimo de valor */
+    size_t valMax;          /**< Largo máximo de valor */
+    double duration;        /**< Duración de la medición (s) */
+    double warmup;          /**< Tiempo inicial que no se mide (s) */
+    double rate;            /**< Pedidos por segundo en total, 0 = modo cerrado */
+    int binary;             /**< 1: protocolo binario */
+    int load;               /**< 1: escribir todas las claves antes de medir */
+} benchConfig_t;
+
+/****************** prototipos funciones auxiliares ******************/
+/**
+ * @brief Se conecta al servidor
+ * @return Descriptor del socket conectado
+ */
+int connectToServer(void);
+
+/**
+ * @brief Punto de entrada de un hilo generador
+ * @param arg Puntero al benchThread_t del hilo
+ * @return NULL
+ */
+static void* benchThreadRun(void* arg);
+
+/**
+ * @brief Genera y encola los pedidos que corresponden a una conexión
+ * @param th Hilo dueño de la conexión
+ * @param conn Conexión
+ * @param now Momento actual (ns)
+ * @param measureEnd Fin de la medición: después no se generan pedidos nuevos
+ */
+static void benchFillPipeline(benchThread_t* th, benchConn_t* conn, uint64_t now, uint64_t measureEnd);
+
+/**
+ * @brief Encola un pedido en el buffer de salida de la conexión
+ * @param conn Conexión
+ * @param op Operación
+ * @param key Número de clave
+ * @param valLen Largo del valor (solo SET)
+ */
+static void benchEncode(benchConn_t* conn, benchOp_t op, uint64_t key, size_t valLen);
+
+/**
+ * @brief Procesa las respuestas completas del buffer de entrada
+ * @param th Hilo dueño de la conexión
+ * @param conn Conexión
+ * @param measureFrom Desde cuándo se registran latencias (ns, para el calentamiento)
+ */
+static void benchParseReplies(benchThread_t* th, benchConn_t* conn, uint64_t measureFrom);
+
+/**
+ * @brief Anota la respuesta del pedido seq
+ */
+static void benchComplete(benchThread_t* th, benchConn_t* conn, uint64_t seq, int notFound, uint64_t measureFrom);
+
+/**
+ * @brief Sortea una clave según la distribución elegida
+ * @param th Hilo (dueño del generador aleatorio)
+ * @return Número de clave en [0, keys)
+ */
+static uint64_t benchNextKey(benchThread_t* th);
+
+/**
+ * @brief Índice del histograma para una latencia
+ *
+ * Log-lineal como HDR Histogram: cada potencia de 2 se divide en
+ * HIST_SUB_COUNT partes iguales, así el error relativo es < 1/64 en
+ * cualquier escala, de nanosegundos a segundos.
+ */
+static int benchHistIndex(uint64_t v);
+
+/**
+ * @brief Mayor valor que cae en un índice del histograma
+ */
+static uint64_t benchHistValue(int idx);
+
+/**
+ * @brief Percentil de un histograma
+ * @param hist Histograma
+ * @param total Cantidad de muestras
+ * @param pct Percentil (0-100)
+ * @return Latencia en ns
+ */
+static uint64_t benchPercentile(const uint64_t* hist, uint64_t total, double pct);
+
+/**
+ * @brief Momento actual en ns (reloj monotónico)
+ */
+static uint64_t benchNow(void);
+
+/**
+ * @brief Número pseudoaleatorio de 64 bits (xorshift64*)
+ */
+static uint64_t benchRand(benchThread_t* th);
+
+/**
+ * @brief Interpreta los argumentos de la línea de comandos
+ */
+static void benchParseArgs(int argc, char* argv[], benchConfig_t* cfg);
+
+/**
+ * @brief Ejecuta una fase (carga inicial o medición) en todos los hilos
+ */
+static void benchRunPhase(void);
+
+/************************* variables globales ************************/
+benchConfig_t config = {
+    .ip = SERVER_IP,
+    .port = SERVER_PORT,
+    .threads = 1,
+    .conns = 1,
+    .pipeline = 1,
+    .keys = 10000,
+    .zipf = 0,
+    .mix = { 90, 10, 0 },
+    .valMin = 16,
+    .valMax = 16,
+    .duration = 10,
+    .warmup = 0,
+    .rate = 0,
+    .binary = 0,
+    .load = 0,
+};
+benchThread_t threads[MAX_THREADS];
+char* valueBuf;             // contenido de todos los valores ('v' repetida)
+int loadPhase;              // 1 mientras se hace la carga inicial
+uint64_t phaseStart;        // comienzo de la fase (ns)
+double zipfZetan, zipfEta, zipfAlpha, zipfHalfPow;
+
+int main(int argc, char* argv[]) {
+    benchParseArgs(argc, argv, &config);
+
+    valueBuf = malloc(config.valMax + 1);
+    if (valueBuf == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    memset(valueBuf, 'v', config.valMax);
+
+    // constantes de la distribución Zipf (Gray et al., "Quickly generating
+    // billion-record synthetic databases"): zeta(n) se calcula una sola vez
+    if (config.zipf > 0) {
+        double zeta2 = 1 + pow(0.5, config.zipf);
+        zipfZetan = 0;
+        for (uint64_t i = 1; i <= config.keys; i++) zipfZetan += 1 / pow((double)i, config.zipf);
+        zipfAlpha = 1 / (1 - config.zipf);
+        zipfEta = (1 - pow(2.0 / config.keys, 1 - config.zipf)) / (1 - zeta2 / zipfZetan);
+        zipfHalfPow = pow(0.5, config.zipf);
+    }
+
+    for (int i = 0; i < config.threads; i++) {
+        benchThread_t* th = &threads[i];
+        th->id = i;
+        th->rng = 0x9E3779B97F4A7C15ULL * (i + 1);
+        th->conns = calloc(config.conns, sizeof(benchConn_t));
+        if (th->conns == NULL) {
+            perror("calloc");
+            exit(EXIT_FAILURE);
+        }
+        for (int c = 0; c < config.conns; c++) {
+            benchConn_t* conn = &th->conns[c];
+            conn->fd = connectToServer();
+            conn->reqs = calloc(config.pipeline, sizeof(benchReq_t));
+            conn->in = malloc(BENCH_IN_BUF_LEN);
+            if (conn->reqs == NULL || conn->in == NULL) {
+                perror("malloc");
+                exit(EXIT_FAILURE);
+            }
+            // cada conexión carga su parte del espacio de claves
+            uint64_t n = (uint64_t)config.threads * config.conns;
+            uint64_t idx = (uint64_t)i * config.conns + c;
+            conn->loadNext = config.keys * idx / n;
+            conn->loadEnd = config.keys * (idx + 1) / n;
+        }
+    }
+
+    if (config.unixPath != NULL) {
+        printf("bench: servidor en %s%s\n", config.unixPath[0] == '@' ? "" : "unix:", config.unixPath);
+    } else {
+        printf("bench: servidor en %s:%d\n", config.ip, config.port);
+    }
+    printf("bench: %d hilos x %d conexiones, pipeline %d, %s, %llu claves (%s",
+           config.threads, config.conns, config.pipeline, config.binary ? "binario" : "texto",
+           (unsigned long long)config.keys, config.zipf > 0 ? "zipf " : "uniforme");
+    if (config.zipf > 0) printf("%.2f", config.zipf);
+    printf("), GET/SET/DEL %d/%d/%d, valores de %zu a %zu bytes, ", config.mix[OP_GET],
+           config.mix[OP_SET], config.mix[OP_DEL], config.valMin, config.valMax);
+    if (config.rate > 0) {
+        printf("modo abierto a %.0f pedidos/s\n", config.rate);
+    } else {
+        printf("modo cerrado\n");
+    }
+
+    if (config.load) {
+        loadPhase = 1;
+        uint64_t t0 = benchNow();
+        benchRunPhase();
+        printf("bench: carga inicial de %llu claves en %.2f s\n", (unsigned long long)config.keys,
+               (benchNow() - t0) / 1e9);
+        loadPhase = 0;
+        for (int i = 0; i < config.threads; i++) {
+            memset(threads[i].ops, 0, sizeof(threads[i].ops));
+            threads[i].notFound = 0;
+            memset(threads[i].hist, 0, sizeof(threads[i].hist));
+        }
+    }
+
+    // el ritmo se calcula sobre la ventana medida: cuentan los pedidos que
+    // salieron dentro de ella, aunque su respuesta llegue un poco después
+    benchRunPhase();
+    double elapsed = config.duration;
+
+    // se juntan los contadores de todos los hilos
+    uint64_t ops[OP_COUNT] = { 0 };
+    uint64_t notFound = 0;
+    uint64_t* hist = calloc(HIST_BUCKETS, sizeof(uint64_t));
+    if (hist == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < config.threads; i++) {
+        for (int o = 0; o < OP_COUNT; o++) ops[o] += threads[i].ops[o];
+        notFound += threads[i].notFound;
+        for (int b = 0; b < HIST_BUCKETS; b++) hist[b] += threads[i].hist[b];
+    }
+    uint64_t total = 0;
+    for (int b = 0; b < HIST_BUCKETS; b++) total += hist[b];
+
+    printf("bench: %llu pedidos en %.2f s: %.1f pedidos/s (GET %llu, SET %llu, DEL %llu, NOTFOUND %llu)\n",
+           (unsigned long long)total, elapsed, total / elapsed, (unsigned long long)ops[OP_GET],
+           (unsigned long long)ops[OP_SET], (unsigned long long)ops[OP_DEL], (unsigned long long)notFound);
+    if (total > 0) {
+        printf("bench: latencia (us): p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  p99.99 %.1f  max %.1f\n",
+               benchPercentile(hist, total, 50) / 1e3, benchPercentile(hist, total, 90) / 1e3,
+               benchPercentile(hist, total, 99) / 1e3, benchPercentile(hist, total, 99.9) / 1e3,
+               benchPercentile(hist, total, 99.99) / 1e3, benchPercentile(hist, total, 100) / 1e3);
+    }
+    free(hist);
+    return 0;
+}
+
+/**
+ * @brief Se conecta al socket Unix (o abstracto) de -u
+ */
+static int connectToUnix(void) {
+    int s = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (s == -1) {
+        perror("socket");
+        exit(EXIT_FAILURE);
+    }
+
+    // el nombre abstracto va con un 0 adelante en lugar de "@" y sin null al final
+    struct sockaddr_un addr = { 0 };
+    addr.sun_family = AF_UNIX;
+    size_t len = strlen(config.unixPath);
+    if (len >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "ERROR ruta de socket muy larga\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(addr.sun_path, config.unixPath, len);
+    if (addr.sun_path[0] == '@') addr.sun_path[0] = '\0';
+    if (connect(s, (const struct sockaddr*)&addr, offsetof(struct sockaddr_un, sun_path) + len) < 0) {
+        fprintf(stderr, "ERROR connecting\n");
+        close(s);
+        exit(EXIT_FAILURE);
+    }
+    return s;
+}
+
+int connectToServer(void) {
+    if (config.unixPath != NULL) return connectToUnix();
+
+    // Creamos socket
+    int s = socket(PF_INET, SOCK_STREAM, 0);
+    if (s == -1) {
+        perror("socket");
+        exit(EXIT_FAILURE);
+    }
+
+    // Cargamos datos de direccion de server
+    struct sockaddr_in serveraddr = { 0 };
+    serveraddr.sin_family = AF_INET;
+    serveraddr.sin_port = htons(config.port);
+    if (inet_pton(AF_INET, config.ip, &(serveraddr.sin_addr)) <= 0) {
+        fprintf(stderr, "ERROR invalid server IP\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Ejecutamos connect()
+    if (connect(s, (const struct sockaddr*)&serveraddr, sizeof(serveraddr)) < 0) {
+        fprintf(stderr, "ERROR connecting\n");
+        close(s);
+        exit(EXIT_FAILURE);
+    }
+
+    // los pedidos chicos salen enseguida, sin esperar a juntar más (Nagle)
+    int opt = 1;
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+    return s;
+}
+
+static void benchRunPhase(void) {
+    phaseStart = benchNow();
+    for (int i = 0; i < config.threads; i++) {
+        for (int c = 0; c < config.conns; c++) {
+            threads[i].conns[c].nextSend = phaseStart;
+        }
+        if (pthread_create(&threads[i].thread, NULL, benchThreadRun, &threads[i]) != 0) {
+            fprintf(stderr, "ERROR creando el hilo %d\n", i);
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int i = 0; i < config.threads; i++) {
+        pthread_join(threads[i].thread, NULL);
+    }
+}
+
+static void* benchThreadRun(void* arg) {
+    benchThread_t* th = arg;
+    uint64_t measureFrom = phaseStart + (uint64_t)(config.warmup * 1e9);
+    uint64_t measureEnd = loadPhase ? UINT64_MAX : measureFrom + (uint64_t)(config.duration * 1e9);
+    uint64_t drainEnd = UINT64_MAX;
+    struct pollfd* fds = calloc(config.conns, sizeof(struct pollfd));
+    if (fds == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    while (1) {
+        uint64_t now = benchNow();
+        int inFlight = 0;
+        uint64_t wake = UINT64_MAX;
+        for (int c = 0; c < config.conns; c++) {
+            benchConn_t* conn = &th->conns[c];
+            benchFillPipeline(th, conn, now, measureEnd);
+
+            // se envía lo que entre sin bloquear; el resto espera a POLLOUT
+            while (conn->outOff < conn->outLen) {
+                ssize_t n = send(conn->fd, conn->out + conn->outOff, conn->outLen - conn->outOff,
+                                 MSG_DONTWAIT | MSG_NOSIGNAL);
+                if (n == -1) {
+                    if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+                    if (errno == EINTR) continue;
+                    perror("send");
+                    exit(EXIT_FAILURE);
+                }
+                conn->outOff += n;
+            }
+            if (conn->outOff == conn->outLen) conn->outOff = conn->outLen = 0;
+
+            fds[c].fd = conn->fd;
+            fds[c].events = POLLIN | (conn->outLen > 0 ? POLLOUT : 0);
+            if (conn->tail > conn->head) inFlight = 1;
+            if (config.rate > 0 && conn->nextSend < measureEnd && conn->nextSend < wake) wake = conn->nextSend;
+        }
+
+        // fin de la fase: se esperan las respuestas que faltan (un tiempo máximo)
+        int loadDone = 1;
+        for (int c = 0; loadPhase && c < config.conns; c++) {
+            if (th->conns[c].loadNext < th->conns[c].loadEnd) loadDone = 0;
+        }
+        if (now >= measureEnd || (loadPhase && loadDone)) {
+            if (!inFlight) break;
+            if (drainEnd == UINT64_MAX) drainEnd = now + BENCH_DRAIN_NS;
+            if (now >= drainEnd) {
+                fprintf(stderr, "bench: hilo %d: quedaron pedidos sin respuesta\n", th->id);
+                break;
+            }
+        }
+
+        // se duerme hasta que llegue algo o toque mandar el próximo pedido
+        // (ppoll() tiene resolución de ns: a ritmos altos poll() giraría en vacío)
+        uint64_t timeout = BENCH_POLL_MAX_MS * 1000000ULL;
+        if (wake != UINT64_MAX) timeout = wake > now ? wake - now : 0;
+        if (measureEnd > now && measureEnd - now < timeout) timeout = measureEnd - now;
+        struct timespec ts = { timeout / 1000000000ULL, timeout % 1000000000ULL };
+        if (ppoll(fds, config.conns, &ts, NULL) == -1 && errno != EINTR) {
+            perror("ppoll");
+            exit(EXIT_FAILURE);
+        }
+
+        for (int c = 0; c < config.conns; c++) {
+            if (!(fds[c].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+            benchConn_t* conn = &th->conns[c];
+            ssize_t n = recv(conn->fd, conn->in + conn->inLen, BENCH_IN_BUF_LEN - conn->inLen, MSG_DONTWAIT);
+            if (n == 0 || (n == -1 && errno != EAGAIN && errno != EINTR)) {
+                fprintf(stderr, "ERROR el servidor cerró la conexión\n");
+                exit(EXIT_FAILURE);
+            }
+            if (n > 0) {
+                conn->inLen += n;
+                benchParseReplies(th, conn, measureFrom);
+            }
+        }
+    }
+    free(fds);
+    return NULL;
+}
+
+static void benchFillPipeline(benchThread_t* th, benchConn_t* conn, uint64_t now, uint64_t measureEnd) {
+    while (conn->tail - conn->head < (uint64_t)config.pipeline) {
+        benchOp_t op;
+        uint64_t key;
+        uint64_t start = now;
+        if (loadPhase) {
+            if (conn->loadNext >= conn->loadEnd) return;
+            op = OP_SET;
+            key = conn->loadNext++;
+        } else {
+            if (now >= measureEnd) return;
+            if (config.rate > 0) {
+                // modo abierto: el pedido cuenta desde cuándo tenía que salir,
+                // aunque salga tarde porque el pipeline estaba lleno
+                if (conn->nextSend > now || conn->nextSend >= measureEnd) return;
+                start = conn->nextSend;
+                conn->nextSend += (uint64_t)(1e9 * config.threads * config.conns / config.rate);
+            }
+            int r = benchRand(th) % (config.mix[OP_GET] + config.mix[OP_SET] + config.mix[OP_DEL]);
+            op = r < config.mix[OP_GET] ? OP_GET : (r < config.mix[OP_GET] + config.mix[OP_SET] ? OP_SET : OP_DEL);
+            key = benchNextKey(th);
+        }
+
+        size_t valLen = config.valMin;
+        if (config.valMax > config.valMin) valLen += benchRand(th) % (config.valMax - config.valMin + 1);
+
+        benchReq_t* req = &conn->reqs[conn->tail % config.pipeline];
+        req->start = start;
+        req->op = op;
+        req->done = 0;
+        benchEncode(conn, op, key, valLen);
+        conn->tail++;
+    }
+}
+
+static void benchEncode(benchConn_t* conn, benchOp_t op, uint64_t key, size_t valLen) {
+    char head[MAX_MSG_LENGTH];
+    char keyStr[32];
+    int keyLen = snprintf(keyStr, sizeof(keyStr), "k%llu", (unsigned long long)key);
+    size_t headLen;
+    if (config.binary) {
+        static const uint8_t opcodes[OP_COUNT] = { 0x00, 0x01, 0x04 };
+        benchBinHeader_t h = { 0 };
+        h.magic = BIN_MAGIC_REQUEST;
+        h.opcode = opcodes[op];
+        h.keyLen = htons(keyLen);
+        h.valLen = htonl(op == OP_SET ? valLen : 0);
+        h.opaque = htonl((uint32_t)conn->tail);
+        memcpy(head, &h, sizeof(h));
+        memcpy(head + sizeof(h), keyStr, keyLen);
+        headLen = sizeof(h) + keyLen;
+    } else if (op == OP_GET) {
+        headLen = snprintf(head, sizeof(head), "GETL %s\n", keyStr);
+    } else if (op == OP_DEL) {
+        headLen = snprintf(head, sizeof(head), "DEL %s\n", keyStr);
+    } else if (keyLen + valLen + 6 < MAX_MSG_LENGTH) {
+        // entra en una línea de SET: es el camino más barato del servidor
+        headLen = snprintf(head, sizeof(head), "SET %s %.*s\n", keyStr, (int)valLen, valueBuf);
+        valLen = 0;
+    } else {
+        headLen = snprintf(head, sizeof(head), "SETL %s %zu\n", keyStr, valLen);
+    }
+    if (op != OP_SET) valLen = 0;
+
+    // se agranda el buffer de salida si hace falta
+    if (conn->outLen + headLen + valLen > conn->outCap) {
+        size_t cap = conn->outCap ? conn->outCap : 4096;
+        while (cap < conn->outLen + headLen + valLen) cap *= 2;
+        char* out = realloc(conn->out, cap);
+        if (out == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        conn->out = out;
+        conn->outCap = cap;
+    }
+    memcpy(conn->out + conn->outLen, head, headLen);
+    memcpy(conn->out + conn->outLen + headLen, valueBuf, valLen);
+    conn->outLen += headLen + valLen;
+}
+
+static void benchParseReplies(benchThread_t* th, benchConn_t* conn, uint64_t measureFrom) {
+    size_t pos = 0;
+    while (pos < conn->inLen) {
+        if (conn->skipLeft > 0) {
+            // valor de un GET: no hace falta guardarlo
+            size_t n = conn->inLen - pos < conn->skipLeft ? conn->inLen - pos : conn->skipLeft;
+            pos += n;
+            conn->skipLeft -= n;
+            // el pedido se da por respondido cuando llegó el valor entero
+            if (conn->skipLeft == 0) benchComplete(th, conn, conn->skipSeq, 0, measureFrom);
+            continue;
+        }
+
+        if (config.binary) {
+            // cada respuesta dice a qué pedido corresponde: pueden venir desordenadas
+            benchBinHeader_t h;
+            if (conn->inLen - pos < sizeof(h)) break;
+            memcpy(&h, conn->in + pos, sizeof(h));
+            size_t valLen = ntohl(h.valLen);
+            if (h.magic != BIN_MAGIC_RESPONSE || ntohs(h.keyLen) > 1) {
+                fprintf(stderr, "ERROR respuesta inválida del servidor: estado %u\n", ntohs(h.keyLen));
+                exit(EXIT_FAILURE);
+            }
+            pos += sizeof(h);
+            // los números de pedido van de a 32 bits: se reconstruye el de 64
+            uint64_t seq = conn->head + (uint32_t)(ntohl(h.opaque) - (uint32_t)conn->head);
+            if (valLen == 0) {
+                benchComplete(th, conn, seq, ntohs(h.keyLen) == 1, measureFrom);
+            } else {
+                // el valor se descarta (si no entra en el buffer, a medida que llega)
+                conn->skipLeft = valLen;
+                conn->skipSeq = seq;
+            }
+            continue;
+        }
+
+        char* line = conn->in + pos;
+        char* nl = memchr(line, '\n', conn->inLen - pos);
+        if (nl == NULL) break;
+        pos = nl + 1 - conn->in;
+
+        if (strncmp(line, "OK ", 3) == 0) {
+            conn->skipLeft = strtoull(line + 3, NULL, 10);
+            conn->skipSeq = conn->head;
+            if (conn->skipLeft == 0) benchComplete(th, conn, conn->head, 0, measureFrom);
+        } else if (strncmp(line, "OK\n", 3) == 0) {
+            benchComplete(th, conn, conn->head, 0, measureFrom);
+        } else if (strncmp(line, "NOTFOUND\n", 9) == 0) {
+            benchComplete(th, conn, conn->head, 1, measureFrom);
+        } else {
+            fprintf(stderr, "ERROR respuesta inesperada del servidor: %.*s\n", (int)(nl - line), line);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // lo que quedó (respuesta incompleta) se corre al comienzo
+    memmove(conn->in, conn->in + pos, conn->inLen - pos);
+    conn->inLen -= pos;
+}
+
+static void benchComplete(benchThread_t* th, benchConn_t* conn, uint64_t seq, int notFound, uint64_t measureFrom) {
+    if (seq < conn->head || seq >= conn->tail) {
+        fprintf(stderr, "ERROR respuesta a un pedido desconocido\n");
+        exit(EXIT_FAILURE);
+    }
+    benchReq_t* req = &conn->reqs[seq % config.pipeline];
+    req->done = 1;
+    if (req->start >= measureFrom) {
+        th->hist[benchHistIndex(benchNow() - req->start)]++;
+        th->ops[req->op]++;
+        th->notFound += notFound;
+    }
+    // el anillo avanza sobre los pedidos ya respondidos
+    while (conn->head < conn->tail && conn->reqs[conn->head % config.pipeline].done) conn->head++;
+}
+
+static uint64_t benchNextKey(benchThread_t* th) {
+    double u = (benchRand(th) >> 11) * (1.0 / 9007199254740992.0); // [0, 1)
+    if (config.zipf <= 0) return (uint64_t)(u * config.keys);
+
+    double uz = u * zipfZetan;
+    if (uz < 1) return 0;
+    if (uz < 1 + zipfHalfPow) return 1;
+    uint64_t k = (uint64_t)(config.keys * pow(zipfEta * u - zipfEta + 1, zipfAlpha));
+    return k < config.keys ? k : config.keys - 1;
+}
+
+static int benchHistIndex(uint64_t v) {
+    if (v < 2 * HIST_SUB_COUNT) return v;
+    int e = 63 - __builtin_clzll(v);    // v está en [2^e, 2^(e+1))
+    int shift = e - HIST_SUB_BITS;
+    return 2 * HIST_SUB_COUNT + (e - HIST_SUB_BITS - 1) * HIST_SUB_COUNT + (int)((v >> shift) - HIST_SUB_COUNT);
+}
+
+static uint64_t benchHistValue(int idx) {
+    if (idx < 2 * HIST_SUB_COUNT) return idx;
+    int e = (idx - 2 * HIST_SUB_COUNT) / HIST_SUB_COUNT + HIST_SUB_BITS + 1;
+    uint64_t sub = (idx - 2 * HIST_SUB_COUNT) % HIST_SUB_COUNT + HIST_SUB_COUNT;
+    int shift = e - HIST_SUB_BITS;
+    return ((sub + 1) << shift) - 1;
+}
+
+static uint64_t benchPercentile(const uint64_t* hist, uint64_t total, double pct) {
+    uint64_t rank = (uint64_t)ceil(pct / 100 * total);
+    if (rank == 0) rank = 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += hist[i];
+        if (seen >= rank) return benchHistValue(i);
+    }
+    return 0;
+}
+
+static uint64_t benchNow(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t benchRand(benchThread_t* th) {
+    th->rng ^= th->rng >> 12;
+    th->rng ^= th->rng << 25;
+    th->rng ^= th->rng >> 27;
+    return th->rng * 0x2545F4914F6CDD1DULL;
+}
+
+static void benchUsage(const char* prog) {
+    printf("Uso: %s [opciones]\n", prog);
+    printf("  -i <ip>          IP del servidor (por defecto %s)\n", SERVER_IP);
+    printf("  -p <puerto>      puerto del servidor (por defecto %d)\n", SERVER_PORT);
+    printf("  -u <ruta>        socket Unix del servidor en lugar de TCP (@nombre: abstracto)\n");
+    printf("  -t <hilos>       hilos generadores (por defecto 1)\n");
+    printf("  -c <conexiones>  conexiones por hilo (por defecto 1)\n");
+    printf("  -P <pedidos>     pedidos en vuelo por conexión (por defecto 1)\n");
+    printf("  -k <claves>      cantidad de claves distintas (por defecto 10000)\n");
+    printf("  -z <exponente>   claves con distribución Zipf (ej. 0.99); sin -z es uniforme\n");
+    printf("  -r <g:s:d>       proporción de GET:SET:DEL (por defecto 90:10:0)\n");
+    printf("  -v <min[-max]>   largo de los valores en bytes, uniforme entre min y max (por defecto 16)\n");
+    printf("  -d <segundos>    duración de la medición (por defecto 10)\n");
+    printf("  -w <segundos>    calentamiento previo que no se mide (por defecto 0)\n");
+    printf("  -R <pedidos/s>   modo abierto: ritmo fijo total; sin -R es modo cerrado\n");
+    printf("  -B               protocolo binario\n");
+    printf("  -L               escribir todas las claves antes de medir\n");
+}
+
+static void benchParseArgs(int argc, char* argv[], benchConfig_t* cfg) {
+    int opt;
+    while ((opt = getopt(argc, argv, "i:p:u:t:c:P:k:z:r:v:d:w:R:BLh")) != -1) {
+        switch (opt) {
+        case 'i':
+            cfg->ip = optarg;
+            break;
+        case 'p':
+            cfg->port = atoi(optarg);
+            break;
+        case 'u':
+            cfg->unixPath = optarg;
+            break;
+        case 't':
+            cfg->threads = atoi(optarg);
+            break;
+        case 'c':
+            cfg->conns = atoi(optarg);
+            break;
+        case 'P':
+            cfg->pipeline = atoi(optarg);
+            break;
+        case 'k':
+            cfg->keys = strtoull(optarg, NULL, 10);
+            break;
+        case 'z':
+            cfg->zipf = atof(optarg);
+            break;
+        case 'r':
+            if (sscanf(optarg, "%d:%d:%d", &cfg->mix[OP_GET], &cfg->mix[OP_SET], &cfg->mix[OP_DEL]) != 3) {
+                fprintf(stderr, "ERROR proporción inválida: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'v':
+            if (sscanf(optarg, "%zu-%zu", &cfg->valMin, &cfg->valMax) == 1) cfg->valMax = cfg->valMin;
+            break;
+        case 'd':
+            cfg->duration = atof(optarg);
+            break;
+        case 'w':
+            cfg->warmup = atof(optarg);
+            break;
+        case 'R':
+            cfg->rate = atof(optarg);
+            break;
+        case 'B':
+            cfg->binary = 1;
+            break;
+        case 'L':
+            cfg->load = 1;
+            break;
+        case 'h':
+            benchUsage(argv[0]);
+            exit(EXIT_SUCCESS);
+        default:
+            benchUsage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (cfg->threads <= 0 || cfg->threads > MAX_THREADS || cfg->conns <= 0 || cfg->pipeline <= 0 ||
+        cfg->keys == 0 || cfg->duration <= 0 || cfg->valMin > cfg->valMax || cfg->zipf == 1 ||
+        cfg->zipf < 0 || cfg->mix[OP_GET] < 0 || cfg->mix[OP_SET] < 0 || cfg->mix[OP_DEL] < 0 ||
+        cfg->mix[OP_GET] + cfg->mix[OP_SET] + cfg->mix[OP_DEL] <= 0) {
+        fprintf(stderr, "ERROR parámetros inválidos (el exponente Zipf no puede ser 1)\n");
+        benchUsage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*********************** end of file ************************/
@@ -0,0 +1,1214 @@
+/**
+ * @file libkv.c
+ * @brief Biblioteca cliente para el servidor clave-valor (ver libkv.h)
+ *
+ * Cada conexión del cliente tiene un buffer de salida, donde se encolan
+ * los comandos de todos los hilos, y una cola FIFO con los pedidos que
+ * esperan respuesta: el servidor responde en orden, así que la respuesta
+ * que llega siempre es la del primero de la cola. Se usa el protocolo de
+ * texto con GETL/SETL, que admite valores de cualquier contenido.
+ *
+ * Las respuestas las procesa un solo hilo por vez en cada conexión (el que
+ * tiene la marca "busy"): espera con poll() sin tomar el lock, lee lo que
+ * llegó y lo interpreta de a pedazos, sin suponer que una respuesta llega
+ * entera. Los demás hilos pueden seguir encolando comandos mientras tanto;
+ * si no los pueden enviar enseguida, despiertan al que atiende con un
+ * eventfd para que los envíe él.
+ */
+
+#define _GNU_SOURCE
+
+#include "libkv.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#define KV_IN_BUF_LEN (64 * 1024)
+#define KV_OUT_BUF_INIT_LEN 4096
+#define KV_LINE_MAX (16 * 1024)        /**< Línea de comando más larga, con el '\n' (CONN_IN_BUF_LEN del servidor) */
+#define KV_BATCH_MAX_KEYS 256          /**< MAX_BATCH_KEYS del servidor */
+#define KV_CMD_LEN 128                 /**< Línea de los comandos de una clave (MAX_MSG_LENGTH del servidor) */
+#define KV_ERR_LEN 128
+
+/***************************** tipos *********************************/
+/**
+ * @brief Operación de un pedido
+ */
+typedef enum {
+    REQ_GET,
+    REQ_SET,
+    REQ_DEL,
+    REQ_INCR,
+    REQ_MGET,
+    REQ_MSET,
+    REQ_MDEL,
+} kvReqType_t;
+
+typedef struct kvConn kvConn_t;
+
+/**
+ * @brief Pedido enviado (o por enviar) que espera su respuesta
+ */
+typedef struct kvReq {
+    struct kvReq* next;     /**< Siguiente en la cola de la conexión, o en la de terminados */
+    kvReqType_t type;       /**< Operación */
+    kvConn_t* conn;         /**< Conexión por la que salió */
+    kvCallback_t cb;        /**< Callback (asincrónico) */
+    void* arg;              /**< Argumento del callback */
+    int sync;               /**< 1: lo espera un hilo en kvExec(), no hay callback */
+    int done;               /**< Sincrónico: ya terminó */
+    kvReply_t reply;        /**< Respuesta que se va armando */
+    char err[KV_ERR_LEN];   /**< Mensaje de ERROR del servidor */
+
+    /* comando */
+    char line[KV_CMD_LEN];  /**< Línea de un comando de una clave */
+    char* cmd;              /**< Línea(s) del comando: line o, en los lotes, malloc */
+    size_t cmdLen;          /**< Largo de cmd */
+    const void* val;        /**< SETL: valor que sigue a la línea (se copia al enviar) */
+    size_t valLen;          /**< SETL: largo del valor */
+
+    /* interpretación de la respuesta */
+    kvValue_t single;       /**< GET: valor recibido */
+    kvValue_t* bodyDst;     /**< Valor cuyo cuerpo se está recibiendo */
+    char* body;             /**< Cuerpo en curso (malloc), NULL si se espera una línea */
+    size_t bodyLen;         /**< Largo del cuerpo */
+    size_t bodyOff;         /**< Bytes del cuerpo ya recibidos */
+    size_t* chunks;         /**< Lotes: claves de cada línea enviada */
+    size_t chunkCount;      /**< Lotes: cantidad de líneas */
+    size_t chunk;           /**< Lotes: próxima línea por responder */
+    size_t chunkLeft;       /**< MGET: respuestas que faltan de la línea actual */
+    size_t item;            /**< MGET: próximo valor por recibir */
+    char** keys;            /**< MGET: claves (para pedir aparte las TOOBIG) */
+    size_t waiting;         /**< MGET: GETL de valores TOOBIG sin terminar */
+    int parsed;             /**< MGET: ya llegó toda su respuesta */
+    struct kvReq* parent;   /**< GETL de un TOOBIG: el MGET al que pertenece */
+    size_t index;           /**< GETL de un TOOBIG: posición del valor en el MGET */
+} kvReq_t;
+
+/**
+ * @brief Conexión del conjunto
+ */
+struct kvConn {
+    kvClient_t* client;     /**< Cliente dueño */
+    pthread_mutex_t lock;   /**< Protege todo lo de abajo */
+    pthread_cond_t cond;    /**< Se señala al soltar busy */
+    int fd;                 /**< Socket, -1 si está cerrada */
+    int wakeFd;             /**< eventfd para despertar al hilo que la atiende */
+    int busy;               /**< Un hilo la está atendiendo (lee y procesa respuestas) */
+    kvReq_t* head;          /**< Pedido más viejo sin respuesta */
+    kvReq_t* tail;          /**< Pedido más nuevo */
+    size_t pending;         /**< Pedidos en la cola (se lee sin lock para elegir conexión) */
+    char* out;              /**< Comandos por enviar */
+    size_t outLen;          /**< Bytes válidos en out */
+    size_t outOff;          /**< Bytes de out ya enviados */
+    size_t outCap;          /**< Capacidad reservada de out */
+    char* in;               /**< Respuestas recibidas sin procesar */
+    size_t inLen;           /**< Bytes válidos en in */
+    size_t inOff;           /**< Bytes de in ya procesados */
+};
+
+/**
+ * @brief Cliente
+ */
+struct kvClient {
+    struct sockaddr_storage addr;   /**< Dirección del servidor */
+    socklen_t addrLen;              /**< Largo de addr */
+    int poolSize;                   /**< Cantidad de conexiones */
+    unsigned next;                  /**< Rotación para elegir conexión */
+    kvConn_t conns[];               /**< Conexiones */
+};
+
+/****************** prototipos funciones auxiliares ******************/
+/**
+ * @brief Interpreta una dirección "<host>:<puerto>", "[<IPv6>]:<puerto>", "unix:<ruta>" o "@<nombre>"
+ * @return 0 si es válida, -1 si no
+ */
+static int kvAddrParse(const char* addr, struct sockaddr_storage* ss, socklen_t* len);
+
+/**
+ * @brief Abre el socket de una conexión (con el lock tomado)
+ * @return 0 o -1
+ */
+static int kvConnOpen(kvConn_t* conn);
+
+/**
+ * @brief Cierra una conexión y termina todos sus pedidos con un error (con el lock tomado)
+ * @param status Error de los pedidos
+ * @param done Lista de pedidos terminados cuyo callback hay que llamar
+ */
+static void kvConnFail(kvConn_t* conn, int status, kvReq_t** done);
+
+/**
+ * @brief Cierra una conexión cuyo envío falló (con el lock tomado)
+ *
+ * Antes lee lo que el servidor alcanzó a responder: uno lleno responde BUSY
+ * y cierra, así que el envío falla pero el motivo ya está en el socket.
+ * @param done Lista de pedidos terminados cuyo callback hay que llamar
+ */
+static void kvConnSendFailed(kvConn_t* conn, kvReq_t** done);
+
+/**
+ * @brief Envía lo que se pueda del buffer de salida sin bloquear
+ * @return 0, o -1 si se cortó la conexión
+ */
+static int kvConnFlush(kvConn_t* conn);
+
+/**
+ * @brief Despierta al hilo que atiende la conexión
+ */
+static void kvConnWake(kvConn_t* conn);
+
+/**
+ * @brief Prepara la espera de una conexión tomada con busy (con el lock tomado)
+ *
+ * Envía lo pendiente y arma los pollfd del socket y del eventfd.
+ * @return 1 si hay algo que esperar, 0 si la conexión está cerrada
+ */
+static int kvConnPrepare(kvConn_t* conn, struct pollfd fds[2], kvReq_t** done);
+
+/**
+ * @brief Atiende lo que indicó poll() en una conexión tomada con busy (con el lock tomado)
+ */
+static void kvConnProcess(kvConn_t* conn, struct pollfd fds[2], kvReq_t** done);
+
+/**
+ * @brief Lee del socket hasta vaciarlo e interpreta las respuestas
+ * @return 0, o un kvStatus_t negativo si hay que cerrar la conexión
+ */
+static int kvConnRead(kvConn_t* conn, kvReq_t** done);
+
+/**
+ * @brief Interpreta las respuestas completas del buffer de entrada
+ * @return 0, o un kvStatus_t negativo si hay que cerrar la conexión
+ */
+static int kvConnParse(kvConn_t* conn, kvReq_t** done);
+
+/**
+ * @brief Interpreta una línea de la respuesta del pedido req
+ * @param line Línea sin el '\n'
+ * @return 1 si el pedido terminó, 0 si falta más, o un kvStatus_t negativo
+ */
+static int kvParseLine(kvConn_t* conn, kvReq_t* req, const char* line, size_t len);
+
+/**
+ * @brief Anota un valor completo (cuerpo de un "OK <largo>")
+ * @return 1 si el pedido terminó, 0 si falta más
+ */
+static int kvBodyDone(kvReq_t* req);
+
+/**
+ * @brief Pide aparte con GETL un valor TOOBIG de un MGET (con el lock tomado)
+ * @return 0 o un kvStatus_t negativo
+ */
+static int kvFetchTooBig(kvConn_t* conn, kvReq_t* req, size_t index);
+
+/**
+ * @brief Termina un pedido que ya salió de la cola
+ *
+ * Un sincrónico se marca como terminado; uno asincrónico pasa a la lista
+ * done, y su callback se llama después de soltar el lock.
+ */
+static void kvReqComplete(kvConn_t* conn, kvReq_t* req, kvReq_t** done);
+
+/**
+ * @brief Llama a los callbacks de los pedidos terminados y los libera
+ * @return Cantidad de pedidos
+ */
+static int kvRunCallbacks(kvReq_t* done);
+
+/**
+ * @brief Agrega bytes al buffer de salida
+ * @return 0 o -1 si no hay memoria
+ */
+static int kvOutAppend(kvConn_t* conn, const void* data, size_t len);
+
+/**
+ * @brief Encola un pedido en la conexión con menos pedidos en vuelo y envía su comando
+ * @return KV_OK, o un error (y el pedido no quedó encolado)
+ */
+static int kvSubmit(kvClient_t* client, kvReq_t* req);
+
+/**
+ * @brief Envía un pedido y espera su respuesta, atendiendo la conexión si nadie lo hace
+ * @return Estado de la respuesta (el pedido queda para que lo lea y libere quien llama)
+ */
+static int kvExec(kvClient_t* client, kvReq_t* req);
+
+/**
+ * @brief Crea un pedido con su línea de comando
+ * @return Pedido o NULL
+ */
+static kvReq_t* kvReqNew(kvReqType_t type, kvCallback_t cb, void* arg);
+
+/**
+ * @brief Libera un pedido y lo que quede de su respuesta
+ */
+static void kvReqFree(kvReq_t* req);
+
+/**
+ * @brief Envía un pedido asincrónico recién armado, o lo libera si no se pudo armar o enviar
+ * @param status Resultado de armarlo
+ * @return KV_OK o el error
+ */
+static int kvSubmitNew(kvClient_t* client, kvReq_t* req, int status);
+
+/**
+ * @brief Arma la línea "<comando> <clave>[ <argumento>]" de un comando de una clave
+ * @return KV_OK o KV_EINVAL
+ */
+static int kvEncodeKey(kvReq_t* req, const char* verb, const char* key, const char* arg);
+
+/**
+ * @brief Arma un SETL; el valor se copia recién al enviarlo
+ */
+static int kvEncodeSet(kvReq_t* req, const char* key, const void* val, size_t len);
+
+/**
+ * @brief Arma un INCR
+ */
+static int kvEncodeIncr(kvReq_t* req, const char* key, int64_t delta);
+
+/**
+ * @brief Arma un MGET y el lugar para sus valores
+ */
+static int kvEncodeMget(kvReq_t* req, const char* const keys[], size_t n);
+
+/**
+ * @brief Arma las líneas de un MGET, MSET o MDEL, partidas según los límites del servidor
+ * @param vals Valores (solo MSET)
+ * @return KV_OK, KV_EINVAL o KV_ENOMEM
+ */
+static int kvBatchEncode(kvReq_t* req, const char* verb, const char* const keys[], const char* const vals[],
+                         size_t n);
+
+/**
+ * @brief Controla que una clave se pueda enviar como palabra de un comando
+ * @return Largo de la clave, o 0 si no es válida
+ */
+static size_t kvKeyCheck(const char* key);
+
+/**
+ * @brief Interpreta "<prefijo><entero>"
+ * @return 0 si la línea es así, -1 si no
+ */
+static int kvLineNum(const char* line, size_t len, const char* prefix, int64_t* out);
+
+/**
+ * @brief Compara una línea con un texto
+ */
+static int kvLineIs(const char* line, size_t len, const char* text);
+
+/************************* funciones públicas ************************/
+kvClient_t* kvClientNew(const char* addr, int poolSize) {
+    if (poolSize < 1 || poolSize > KV_MAX_POOL) return NULL;
+    kvClient_t* client = calloc(1, sizeof(*client) + poolSize * sizeof(kvConn_t));
+    if (client == NULL) return NULL;
+    if (kvAddrParse(addr, &client->addr, &client->addrLen) < 0) {
+        free(client);
+        return NULL;
+    }
+    client->poolSize = poolSize;
+
+    for (int i = 0; i < poolSize; i++) {
+        kvConn_t* conn = &client->conns[i];
+        conn->client = client;
+        conn->fd = -1;
+        pthread_mutex_init(&conn->lock, NULL);
+        pthread_cond_init(&conn->cond, NULL);
+        conn->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        conn->in = malloc(KV_IN_BUF_LEN);
+        if (conn->wakeFd < 0 || conn->in == NULL) {
+            client->poolSize = i + 1;
+            kvClientFree(client);
+            return NULL;
+        }
+    }
+    return client;
+}
+
+void kvClientFree(kvClient_t* client) {
+    if (client == NULL) return;
+    for (int i = 0; i < client->poolSize; i++) {
+        kvConn_t* conn = &client->conns[i];
+        // los pedidos sin respuesta se terminan como en un corte, pero sin callbacks
+        kvReq_t* done = NULL;
+        kvConnFail(conn, KV_EIO, &done);
+        while (done != NULL) {
+            kvReq_t* next = done->next;
+            kvReqFree(done);
+            done = next;
+        }
+        if (conn->wakeFd >= 0) close(conn->wakeFd);
+        pthread_mutex_destroy(&conn->lock);
+        pthread_cond_destroy(&conn->cond);
+        free(conn->out);
+        free(conn->in);
+    }
+    free(client);
+}
+
+int kvPoll(kvClient_t* client, int timeoutMs) {
+    struct pollfd fds[2 * KV_MAX_POOL];
+    kvConn_t* mine[KV_MAX_POOL];
+    kvConn_t* other = NULL;
+    kvReq_t* done = NULL;
+    int n = 0;
+
+    // se toman las conexiones con pedidos en vuelo que no atiende otro hilo
+    for (int i = 0; i < client->poolSize; i++) {
+        kvConn_t* conn = &client->conns[i];
+        pthread_mutex_lock(&conn->lock);
+        if (conn->pending > 0) {
+            if (conn->busy) {
+                other = conn;
+            } else {
+                conn->busy = 1;
+                if (kvConnPrepare(conn, &fds[2 * n], &done)) {
+                    mine[n++] = conn;
+                } else {
+                    conn->busy = 0;
+                    pthread_cond_broadcast(&conn->cond);
+                }
+            }
+        }
+        pthread_mutex_unlock(&conn->lock);
+    }
+
+    if (n == 0) {
+        // todo lo que está en vuelo lo atiende otro hilo: se espera a que termine algo
+        if (done == NULL && other != NULL && timeoutMs != 0) {
+            pthread_mutex_lock(&other->lock);
+            if (other->busy && other->pending > 0) {
+                if (timeoutMs < 0) {
+                    pthread_cond_wait(&other->cond, &other->lock);
+                } else {
+                    struct timespec until;
+                    clock_gettime(CLOCK_REALTIME, &until);
+                    until.tv_sec += timeoutMs / 1000;
+                    until.tv_nsec += (long)(timeoutMs % 1000) * 1000000;
+                    if (until.tv_nsec >= 1000000000) {
+                        until.tv_sec++;
+                        until.tv_nsec -= 1000000000;
+                    }
+                    pthread_cond_timedwait(&other->cond, &other->lock, &until);
+                }
+            }
+            pthread_mutex_unlock(&other->lock);
+        }
+        return kvRunCallbacks(done);
+    }
+
+    if (poll(fds, 2 * n, done != NULL ? 0 : timeoutMs) < 0 && errno != EINTR) {
+        for (int i = 0; i < 2 * n; i++) fds[i].revents = 0;
+    }
+    for (int i = 0; i < n; i++) {
+        pthread_mutex_lock(&mine[i]->lock);
+        kvConnProcess(mine[i], &fds[2 * i], &done);
+        mine[i]->busy = 0;
+        pthread_cond_broadcast(&mine[i]->cond);
+        pthread_mutex_unlock(&mine[i]->lock);
+    }
+    return kvRunCallbacks(done);
+}
+
+size_t kvPending(kvClient_t* client) {
+    size_t total = 0;
+    for (int i = 0; i < client->poolSize; i++) {
+        total += __atomic_load_n(&client->conns[i].pending, __ATOMIC_RELAXED);
+    }
+    return total;
+}
+
+const char* kvStrError(int status) {
+    switch (status) {
+    case KV_OK: return "OK";
+    case KV_NOTFOUND: return "clave inexistente";
+    case KV_ESERVER: return "error informado por el servidor";
+    case KV_EIO: return "error de conexión";
+    case KV_EPROTO: return "respuesta inesperada del servidor";
+    case KV_EINVAL: return "clave o valor inválido";
+    case KV_ENOMEM: return "sin memoria";
+    case KV_EBUSY: return "servidor ocupado";
+    default: return "error desconocido";
+    }
+}
+
+int kvGet(kvClient_t* client, const char* key, char** val, size_t* len) {
+    kvReq_t* req = kvReqNew(REQ_GET, NULL, NULL);
+    if (req == NULL) return KV_ENOMEM;
+    int status = kvEncodeKey(req, "GETL", key, NULL);
+    if (status == KV_OK) status = kvExec(client, req);
+    if (status == KV_OK) {
+        *val = req->reply.val;
+        if (len != NULL) *len = req->reply.len;
+        req->reply.val = NULL;
+    }
+    kvReqFree(req);
+    return status;
+}
+
+int kvSet(kvClient_t* client, const char* key, const void* val, size_t len) {
+    kvReq_t* req = kvReqNew(REQ_SET, NULL, NULL);
+    if (req == NULL) return KV_ENOMEM;
+    int status = kvEncodeSet(req, key, val, len);
+    if (status == KV_OK) status = kvExec(client, req);
+    kvReqFree(req);
+    return status;
+}
+
+int kvDel(kvClient_t* client, const char* key) {
+    kvReq_t* req = kvReqNew(REQ_DEL, NULL, NULL);
+    if (req == NULL) return KV_ENOMEM;
+    int status = kvEncodeKey(req, "DEL", key, NULL);
+    if (status == KV_OK) status = kvExec(client, req);
+    kvReqFree(req);
+    return status;
+}
+
+int kvIncr(kvClient_t* client, const char* key, int64_t delta, int64_t* result) {
+    kvReq_t* req = kvReqNew(REQ_INCR, NULL, NULL);
+    if (req == NULL) return KV_ENOMEM;
+    int status = kvEncodeIncr(req, key, delta);
+    if (status == KV_OK) status = kvExec(client, req);
+    if (status == KV_OK && result != NULL) *result = req->reply.num;
+    kvReqFree(req);
+    return status;
+}
+
+int kvMget(kvClient_t* client, const char* const keys[], size_t n, kvValue_t values[]) {
+    kvReq_t* req = kvReqNew(REQ_MGET, NULL, NULL);
+    if (req == NULL) return KV_ENOMEM;
+    int status = kvEncodeMget(req, keys, n);
+    if (status == KV_OK) {
+        status = kvExec(client, req);
+        // los valores pasan a quien llama
+        memcpy(values, req->reply.values, n * sizeof(kvValue_t));
+        free(req->reply.values);
+        req->reply.values = NULL;
+    }
+    kvReqFree(req);
+    return status;
+}
+
+int kvMset(kvClient_t* client, const char* const keys[], const char* const vals[], size_t n) {
+    kvReq_t* req = kvReqNew(REQ_MSET, NULL, NULL);
+    if (req == NULL) return KV_ENOMEM;
+    int status = kvBatchEncode(req, "MSET", keys, vals, n);
+    if (status == KV_OK) status = kvExec(client, req);
+    kvReqFree(req);
+    return status;
+}
+
+int kvMdel(kvClient_t* client, const char* const keys[], size_t n, size_t* deleted) {
+    kvReq_t* req = kvReqNew(REQ_MDEL, NULL, NULL);
+    if (req == NULL) return KV_ENOMEM;
+    int status = kvBatchEncode(req, "MDEL", keys, NULL, n);
+    if (status == KV_OK) status = kvExec(client, req);
+    if (status == KV_OK && deleted != NULL) *deleted = req->reply.num;
+    kvReqFree(req);
+    return status;
+}
+
+void kvValuesFree(kvValue_t values[], size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        free(values[i].val);
+        values[i].val = NULL;
+    }
+}
+
+int kvGetAsync(kvClient_t* client, const char* key, kvCallback_t cb, void* arg) {
+    if (cb == NULL) return KV_EINVAL;
+    kvReq_t* req = kvReqNew(REQ_GET, cb, arg);
+    if (req == NULL) return KV_ENOMEM;
+    return kvSubmitNew(client, req, kvEncodeKey(req, "GETL", key, NULL));
+}
+
+int kvSetAsync(kvClient_t* client, const char* key, const void* val, size_t len, kvCallback_t cb, void* arg) {
+    if (cb == NULL) return KV_EINVAL;
+    kvReq_t* req = kvReqNew(REQ_SET, cb, arg);
+    if (req == NULL) return KV_ENOMEM;
+    return kvSubmitNew(client, req, kvEncodeSet(req, key, val, len));
+}
+
+int kvDelAsync(kvClient_t* client, const char* key, kvCallback_t cb, void* arg) {
+    if (cb == NULL) return KV_EINVAL;
+    kvReq_t* req = kvReqNew(REQ_DEL, cb, arg);
+    if (req == NULL) return KV_ENOMEM;
+    return kvSubmitNew(client, req, kvEncodeKey(req, "DEL", key, NULL));
+}
+
+int kvIncrAsync(kvClient_t* client, const char* key, int64_t delta, kvCallback_t cb, void* arg) {
+    if (cb == NULL) return KV_EINVAL;
+    kvReq_t* req = kvReqNew(REQ_INCR, cb, arg);
+    if (req == NULL) return KV_ENOMEM;
+    return kvSubmitNew(client, req, kvEncodeIncr(req, key, delta));
+}
+
+int kvMgetAsync(kvClient_t* client, const char* const keys[], size_t n, kvCallback_t cb, void* arg) {
+    if (cb == NULL) return KV_EINVAL;
+    kvReq_t* req = kvReqNew(REQ_MGET, cb, arg);
+    if (req == NULL) return KV_ENOMEM;
+    return kvSubmitNew(client, req, kvEncodeMget(req, keys, n));
+}
+
+int kvMsetAsync(kvClient_t* client, const char* const keys[], const char* const vals[], size_t n,
+                kvCallback_t cb, void* arg) {
+    if (cb == NULL) return KV_EINVAL;
+    kvReq_t* req = kvReqNew(REQ_MSET, cb, arg);
+    if (req == NULL) return KV_ENOMEM;
+    return kvSubmitNew(client, req, kvBatchEncode(req, "MSET", keys, vals, n));
+}
+
+int kvMdelAsync(kvClient_t* client, const char* const keys[], size_t n, kvCallback_t cb, void* arg) {
+    if (cb == NULL) return KV_EINVAL;
+    kvReq_t* req = kvReqNew(REQ_MDEL, cb, arg);
+    if (req == NULL) return KV_ENOMEM;
+    return kvSubmitNew(client, req, kvBatchEncode(req, "MDEL", keys, NULL, n));
+}
+
+/*********************** envío de pedidos ************************/
+static int kvSubmitNew(kvClient_t* client, kvReq_t* req, int status) {
+    if (status == KV_OK) status = kvSubmit(client, req);
+    if (status != KV_OK) kvReqFree(req);
+    return status;
+}
+
+static int kvEncodeKey(kvReq_t* req, const char* verb, const char* key, const char* arg) {
+    if (kvKeyCheck(key) == 0) return KV_EINVAL;
+    req->cmdLen = snprintf(req->line, sizeof(req->line), "%s %s%s%s\n", verb, key, arg ? " " : "", arg ? arg : "");
+    return KV_OK;
+}
+
+static int kvEncodeSet(kvReq_t* req, const char* key, const void* val, size_t len) {
+    if (len > KV_MAX_VALUE_LEN) return KV_EINVAL;
+    char arg[24];
+    snprintf(arg, sizeof(arg), "%zu", len);
+    req->val = val;
+    req->valLen = len;
+    return kvEncodeKey(req, "SETL", key, arg);
+}
+
+static int kvEncodeIncr(kvReq_t* req, const char* key, int64_t delta) {
+    char arg[24];
+    snprintf(arg, sizeof(arg), "%lld", (long long)delta);
+    return kvEncodeKey(req, "INCR", key, arg);
+}
+
+static int kvEncodeMget(kvReq_t* req, const char* const keys[], size_t n) {
+    int status = kvBatchEncode(req, "MGET", keys, NULL, n);
+    if (status != KV_OK) return status;
+
+    // se guardan las claves para pedir aparte las que respondan TOOBIG
+    size_t total = 0;
+    for (size_t i = 0; i < n; i++) total += strlen(keys[i]) + 1;
+    req->keys = malloc(n * sizeof(char*) + total);
+    req->reply.values = calloc(n, sizeof(kvValue_t));
+    if (req->keys == NULL || req->reply.values == NULL) return KV_ENOMEM;
+    char* blob = (char*)(req->keys + n);
+    for (size_t i = 0; i < n; i++) {
+        size_t len = strlen(keys[i]) + 1;
+        memcpy(blob, keys[i], len);
+        req->keys[i] = blob;
+        blob += len;
+        req->reply.values[i].status = KV_EIO; // hasta que llegue su respuesta
+    }
+    req->reply.count = n;
+    return KV_OK;
+}
+
+static kvReq_t* kvReqNew(kvReqType_t type, kvCallback_t cb, void* arg) {
+    kvReq_t* req = calloc(1, sizeof(*req));
+    if (req == NULL) return NULL;
+    req->type = type;
+    req->cb = cb;
+    req->arg = arg;
+    req->sync = cb == NULL;
+    req->cmd = req->line;
+    return req;
+}
+
+static void kvReqFree(kvReq_t* req) {
+    if (req == NULL) return;
+    if (req->cmd != req->line) free(req->cmd);
+    free(req->body);
+    free(req->single.val);
+    free(req->reply.val);
+    if (req->reply.values != NULL) {
+        kvValuesFree(req->reply.values, req->reply.count);
+        free(req->reply.values);
+    }
+    free(req->chunks);
+    free(req->keys);
+    free(req);
+}
+
+static int kvSubmit(kvClient_t* client, kvReq_t* req) {
+    // la conexión con menos pedidos en vuelo, empezando por una distinta cada vez
+    unsigned start = __atomic_fetch_add(&client->next, 1, __ATOMIC_RELAXED);
+    kvConn_t* conn = NULL;
+    size_t best = (size_t)-1;
+    for (int i = 0; i < client->poolSize; i++) {
+        kvConn_t* c = &client->conns[(start + i) % client->poolSize];
+        size_t pending = __atomic_load_n(&c->pending, __ATOMIC_RELAXED);
+        if (pending < best) {
+            conn = c;
+            best = pending;
+            if (pending == 0) break;
+        }
+    }
+
+    kvReq_t* done = NULL;
+    pthread_mutex_lock(&conn->lock);
+    if (conn->fd < 0 && kvConnOpen(conn) < 0) {
+        pthread_mutex_unlock(&conn->lock);
+        return KV_EIO;
+    }
+    size_t outLen = conn->outLen;
+    if (kvOutAppend(conn, req->cmd, req->cmdLen) < 0 || kvOutAppend(conn, req->val, req->valLen) < 0) {
+        conn->outLen = outLen;
+        pthread_mutex_unlock(&conn->lock);
+        return KV_ENOMEM;
+    }
+    req->val = NULL; // ya se copió, puede dejar de existir
+
+    req->conn = conn;
+    if (conn->tail != NULL) conn->tail->next = req;
+    else conn->head = req;
+    conn->tail = req;
+    __atomic_add_fetch(&conn->pending, 1, __ATOMIC_RELAXED);
+
+    // se envía ya; lo que no entra en el socket lo envía el hilo que la atiende
+    int rc = kvConnFlush(conn);
+    if (conn->busy && (rc < 0 || conn->outOff < conn->outLen)) {
+        kvConnWake(conn);
+    } else if (rc < 0) {
+        kvConnSendFailed(conn, &done);
+    }
+    pthread_mutex_unlock(&conn->lock);
+    kvRunCallbacks(done);
+    return KV_OK;
+}
+
+static int kvExec(kvClient_t* client, kvReq_t* req) {
+    int status = kvSubmit(client, req);
+    if (status != KV_OK) return status;
+
+    kvConn_t* conn = req->conn;
+    kvReq_t* done = NULL;
+    pthread_mutex_lock(&conn->lock);
+    while (!req->done) {
+        if (conn->busy) {
+            // la atiende otro hilo: avisa al soltarla
+            pthread_cond_wait(&conn->cond, &conn->lock);
+            continue;
+        }
+        conn->busy = 1;
+        struct pollfd fds[2];
+        if (kvConnPrepare(conn, fds, &done) && !req->done) {
+            pthread_mutex_unlock(&conn->lock);
+            if (poll(fds, 2, done != NULL ? 0 : -1) < 0) fds[0].revents = fds[1].revents = 0;
+            pthread_mutex_lock(&conn->lock);
+            kvConnProcess(conn, fds, &done);
+        }
+        conn->busy = 0;
+        pthread_cond_broadcast(&conn->cond);
+        if (done != NULL) {
+            // los callbacks de otros pedidos terminados, sin el lock
+            pthread_mutex_unlock(&conn->lock);
+            kvRunCallbacks(done);
+            done = NULL;
+            pthread_mutex_lock(&conn->lock);
+        }
+    }
+    pthread_mutex_unlock(&conn->lock);
+    return req->reply.status;
+}
+
+static int kvBatchEncode(kvReq_t* req, const char* verb, const char* const keys[], const char* const vals[],
+                         size_t n) {
+    if (n == 0) return KV_EINVAL;
+    size_t verbLen = strlen(verb);
+    size_t total = 0;
+    for (size_t i = 0; i < n; i++) {
+        size_t pair = kvKeyCheck(keys[i]);
+        if (pair == 0) return KV_EINVAL;
+        if (vals != NULL) {
+            // el valor de MSET es una palabra más de la línea
+            size_t valLen = strlen(vals[i]);
+            for (size_t j = 0; j < valLen; j++) {
+                if ((unsigned char)vals[i][j] <= ' ' || vals[i][j] == 0x7f) return KV_EINVAL;
+            }
+            if (valLen == 0) return KV_EINVAL;
+            pair += 1 + valLen;
+        }
+        if (verbLen + 1 + pair + 1 > KV_LINE_MAX) return KV_EINVAL;
+        total += 1 + pair;
+    }
+
+    // cada línea empieza con el comando y termina con '\n'
+    req->cmd = malloc(total + n * (verbLen + 1));
+    req->chunks = malloc(n * sizeof(size_t));
+    if (req->cmd == NULL || req->chunks == NULL) return KV_ENOMEM;
+    size_t len = 0;
+    size_t lineStart = 0;
+    size_t inLine = 0;
+    for (size_t i = 0; i < n; i++) {
+        size_t keyLen = strlen(keys[i]);
+        size_t valLen = vals != NULL ? strlen(vals[i]) : 0;
+        size_t pair = 1 + keyLen + (vals != NULL ? 1 + valLen : 0);
+        if (inLine > 0 && (inLine == KV_BATCH_MAX_KEYS || len - lineStart + pair + 1 > KV_LINE_MAX)) {
+            req->cmd[len++] = '\n';
+            req->chunks[req->chunkCount++] = inLine;
+            inLine = 0;
+        }
+        if (inLine == 0) {
+            lineStart = len;
+            memcpy(req->cmd + len, verb, verbLen);
+            len += verbLen;
+        }
+        req->cmd[len++] = ' ';
+        memcpy(req->cmd + len, keys[i], keyLen);
+        len += keyLen;
+        if (vals != NULL) {
+            req->cmd[len++] = ' ';
+            memcpy(req->cmd + len, vals[i], valLen);
+            len += valLen;
+        }
+        inLine++;
+    }
+    req->cmd[len++] = '\n';
+    req->chunks[req->chunkCount++] = inLine;
+    req->cmdLen = len;
+    return KV_OK;
+}
+
+static size_t kvKeyCheck(const char* key) {
+    // el servidor separa las palabras por espacios y las líneas por '\n' (y descarta un '\r' final)
+    size_t len = strcspn(key, " \r\n");
+    if (len == 0 || key[len] != '\0' || len > KV_MAX_KEY_LEN) return 0;
+    return len;
+}
+
+static int kvOutAppend(kvConn_t* conn, const void* data, size_t len) {
+    if (len == 0) return 0;
+    if (conn->outLen + len > conn->outCap && conn->outOff > 0) {
+        // se corre al inicio lo que falta enviar
+        memmove(conn->out, conn->out + conn->outOff, conn->outLen - conn->outOff);
+        conn->outLen -= conn->outOff;
+        conn->outOff = 0;
+    }
+    if (conn->outLen + len > conn->outCap) {
+        size_t cap = conn->outCap > 0 ? conn->outCap : KV_OUT_BUF_INIT_LEN;
+        while (cap < conn->outLen + len) cap *= 2;
+        char* out = realloc(conn->out, cap);
+        if (out == NULL) return -1;
+        conn->out = out;
+        conn->outCap = cap;
+    }
+    memcpy(conn->out + conn->outLen, data, len);
+    conn->outLen += len;
+    return 0;
+}
+
+/*********************** conexiones ************************/
+static int kvAddrParse(const char* addr, struct sockaddr_storage* ss, socklen_t* len) {
+    memset(ss, 0, sizeof(*ss));
+    if (strncmp(addr, "unix:", 5) == 0 || addr[0] == '@') {
+        struct sockaddr_un* un = (struct sockaddr_un*)ss;
+        int abstract = addr[0] == '@';
+        const char* path = abstract ? addr + 1 : addr + 5;
+        size_t pathLen = strlen(path);
+        if (pathLen == 0 || pathLen + 1 > sizeof(un->sun_path)) return -1;
+        un->sun_family = AF_UNIX;
+        // los abstractos empiezan con un '\0' y su largo no incluye un '\0' final
+        memcpy(un->sun_path + abstract, path, pathLen);
+        *len = offsetof(struct sockaddr_un, sun_path) + abstract + pathLen + !abstract;
+        return 0;
+    }
+
+    // "<host>:<puerto>" o "[<IPv6>]:<puerto>"
+    char host[256];
+    const char* colon = strrchr(addr, ':');
+    if (colon == NULL || colon[1] == '\0') return -1;
+    size_t hostLen = colon - addr;
+    const char* hostStart = addr;
+    if (addr[0] == '[') {
+        if (hostLen < 2 || addr[hostLen - 1] != ']') return -1;
+        hostStart++;
+        hostLen -= 2;
+    }
+    if (hostLen == 0 || hostLen >= sizeof(host)) return -1;
+    memcpy(host, hostStart, hostLen);
+    host[hostLen] = '\0';
+
+    struct addrinfo hints = {0};
+    struct addrinfo* res;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, colon + 1, &hints, &res) != 0) return -1;
+    memcpy(ss, res->ai_addr, res->ai_addrlen);
+    *len = res->ai_addrlen;
+    freeaddrinfo(res);
+    return 0;
+}
+
+static int kvConnOpen(kvConn_t* conn) {
+    kvClient_t* client = conn->client;
+    int fd = socket(client->addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (struct sockaddr*)&client->addr, client->addrLen) < 0) {
+        close(fd);
+        return -1;
+    }
+    if (client->addr.ss_family != AF_UNIX) {
+        // los pedidos chicos salen enseguida, sin esperar a juntar más
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    conn->fd = fd;
+    return 0;
+}
+
+static void kvConnFail(kvConn_t* conn, int status, kvReq_t** done) {
+    if (conn->fd >= 0) close(conn->fd);
+    conn->fd = -1;
+    conn->outLen = conn->outOff = 0;
+    conn->inLen = conn->inOff = 0;
+
+    // las respuestas que faltan ya no van a llegar
+    while (conn->head != NULL) {
+        kvReq_t* req = conn->head;
+        conn->head = req->next;
+        req->next = NULL;
+        free(req->body);
+        req->body = NULL;
+        req->reply.status = status;
+        __atomic_sub_fetch(&conn->pending, 1, __ATOMIC_RELAXED);
+        kvReqComplete(conn, req, done);
+    }
+    conn->tail = NULL;
+}
+
+static void kvConnSendFailed(kvConn_t* conn, kvReq_t** done) {
+    int status = kvConnRead(conn, done);
+    kvConnFail(conn, status < 0 ? status : KV_EIO, done);
+}
+
+static int kvConnFlush(kvConn_t* conn) {
+    while (conn->outOff < conn->outLen) {
+        ssize_t n = send(conn->fd, conn->out + conn->outOff, conn->outLen - conn->outOff,
+                         MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        conn->outOff += n;
+    }
+    conn->outOff = conn->outLen = 0;
+    return 0;
+}
+
+static void kvConnWake(kvConn_t* conn) {
+    uint64_t one = 1;
+    if (write(conn->wakeFd, &one, sizeof(one)) < 0) {
+        // el contador ya es distinto de cero: el hilo igual se va a despertar
+    }
+}
+
+static int kvConnPrepare(kvConn_t* conn, struct pollfd fds[2], kvReq_t** done) {
+    if (conn->fd < 0) return 0;
+    if (kvConnFlush(conn) < 0) {
+        kvConnSendFailed(conn, done);
+        return 0;
+    }
+    fds[0].fd = conn->fd;
+    fds[0].events = POLLIN | (conn->outOff < conn->outLen ? POLLOUT : 0);
+    fds[0].revents = 0;
+    fds[1].fd = conn->wakeFd;
+    fds[1].events = POLLIN;
+    fds[1].revents = 0;
+    return 1;
+}
+
+static void kvConnProcess(kvConn_t* conn, struct pollfd fds[2], kvReq_t** done) {
+    if (fds[1].revents & POLLIN) {
+        uint64_t count;
+        if (read(conn->wakeFd, &count, sizeof(count)) < 0) {
+            // otro hilo ya lo vació
+        }
+    }
+    if (conn->fd < 0) return;
+    if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+        int status = kvConnRead(conn, done);
+        if (status < 0) {
+            kvConnFail(conn, status, done);
+            return;
+        }
+    }
+    // lo que encolaron otros hilos mientras tanto, y los GETL de los TOOBIG
+    if (kvConnFlush(conn) < 0) kvConnSendFailed(conn, done);
+}
+
+/*********************** respuestas ************************/
+static int kvConnRead(kvConn_t* conn, kvReq_t** done) {
+    while (1) {
+        kvReq_t* head = conn->head;
+        ssize_t n;
+        if (head != NULL && head->body != NULL && conn->inOff == conn->inLen) {
+            // el resto de un valor va directo a su buffer, sin pasar por in
+            conn->inOff = conn->inLen = 0;
+            n = recv(conn->fd, head->body + head->bodyOff, head->bodyLen - head->bodyOff, MSG_DONTWAIT);
+            if (n > 0) head->bodyOff += n;
+        } else {
+            if (conn->inOff > 0) {
+                memmove(conn->in, conn->in + conn->inOff, conn->inLen - conn->inOff);
+                conn->inLen -= conn->inOff;
+                conn->inOff = 0;
+            }
+            if (conn->inLen == KV_IN_BUF_LEN) return KV_EPROTO; // una línea que no entra
+            n = recv(conn->fd, conn->in + conn->inLen, KV_IN_BUF_LEN - conn->inLen, MSG_DONTWAIT);
+            if (n > 0) conn->inLen += n;
+        }
+        if (n == 0) return KV_EIO;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return KV_EIO;
+        }
+
+        int status = kvConnParse(conn, done);
+        if (status < 0) return status;
+    }
+}
+
+static int kvConnParse(kvConn_t* conn, kvReq_t** done) {
+    while (conn->head != NULL) {
+        kvReq_t* req = conn->head;
+        int complete;
+        if (req->body != NULL) {
+            size_t n = conn->inLen - conn->inOff;
+            if (n > req->bodyLen - req->bodyOff) n = req->bodyLen - req->bodyOff;
+            memcpy(req->body + req->bodyOff, conn->in + conn->inOff, n);
+            conn->inOff += n;
+            req->bodyOff += n;
+            if (req->bodyOff < req->bodyLen) return 0;
+            complete = kvBodyDone(req);
+        } else {
+            char* nl = memchr(conn->in + conn->inOff, '\n', conn->inLen - conn->inOff);
+            if (nl == NULL) return 0;
+            const char* line = conn->in + conn->inOff;
+            conn->inOff = nl + 1 - conn->in;
+            complete = kvParseLine(conn, req, line, nl - line);
+            if (complete < 0) return complete;
+        }
+
+        if (complete) {
+            conn->head = req->next;
+            if (conn->head == NULL) conn->tail = NULL;
+            req->next = NULL;
+            __atomic_sub_fetch(&conn->pending, 1, __ATOMIC_RELAXED);
+            kvReqComplete(conn, req, done);
+        }
+    }
+    // bytes que no corresponden a ningún pedido
+    return conn->inOff < conn->inLen ? KV_EPROTO : 0;
+}
+
+static int kvParseLine(kvConn_t* conn, kvReq_t* req, const char* line, size_t len) {
+    int64_t num;
+    // el servidor rechazó la conexión al aceptarla: fallan todos sus pedidos
+    if (kvLineIs(line, len, "BUSY")) return KV_EBUSY;
+    if (len >= 5 && memcmp(line, "ERROR", 5) == 0) {
+        // solo llegan errores de una línea: los que traen la ayuda son de comandos mal armados
+        size_t n = len < KV_ERR_LEN - 1 ? len : KV_ERR_LEN - 1;
+        memcpy(req->err, line, n);
+        req->err[n] = '\0';
+        req->reply.err = req->err;
+        req->reply.status = KV_ESERVER;
+        if (req->type != REQ_MGET) {
+            if (req->type == REQ_MSET || req->type == REQ_MDEL) return ++req->chunk == req->chunkCount;
+            return 1;
+        }
+        // un MGET con error no responde nada más de esa línea
+        if (req->chunkLeft != 0) return KV_EPROTO;
+        size_t keys = req->chunks[req->chunk++];
+        for (size_t i = 0; i < keys; i++) req->reply.values[req->item++].status = KV_ESERVER;
+        return req->chunk == req->chunkCount;
+    }
+
+    switch (req->type) {
+    case REQ_GET:
+    case REQ_MGET: {
+        if (req->type == REQ_MGET && req->chunkLeft == 0) req->chunkLeft = req->chunks[req->chunk++];
+        kvValue_t* dst = req->type == REQ_GET ? &req->single : &req->reply.values[req->item];
+        if (kvLineIs(line, len, "NOTFOUND")) {
+            if (req->type == REQ_GET) {
+                req->reply.status = KV_NOTFOUND;
+                return 1;
+            }
+            dst->status = KV_NOTFOUND;
+            return kvBodyDone(req);
+        }
+        if (req->type == REQ_MGET && kvLineNum(line, len, "TOOBIG ", &num) == 0) {
+            int status = kvFetchTooBig(conn, req, req->item);
+            if (status < 0) return status;
+            return kvBodyDone(req);
+        }
+        if (kvLineNum(line, len, "OK ", &num) < 0 || num < 0 || (uint64_t)num > KV_MAX_VALUE_LEN) return KV_EPROTO;
+        req->body = malloc(num + 1);
+        if (req->body == NULL) return KV_ENOMEM;
+        req->bodyLen = num;
+        req->bodyOff = 0;
+        req->bodyDst = dst;
+        return 0;
+    }
+    case REQ_SET:
+        return kvLineIs(line, len, "OK") ? 1 : KV_EPROTO;
+    case REQ_DEL:
+        if (kvLineIs(line, len, "NOTFOUND")) req->reply.status = KV_NOTFOUND;
+        else if (!kvLineIs(line, len, "OK")) return KV_EPROTO;
+        return 1;
+    case REQ_INCR:
+        if (kvLineNum(line, len, "OK ", &req->reply.num) < 0) return KV_EPROTO;
+        return 1;
+    case REQ_MSET:
+        if (!kvLineIs(line, len, "OK")) return KV_EPROTO;
+        return ++req->chunk == req->chunkCount;
+    case REQ_MDEL:
+        if (kvLineNum(line, len, "OK ", &num) < 0) return KV_EPROTO;
+        req->reply.num += num;
+        return ++req->chunk == req->chunkCount;
+    }
+    return KV_EPROTO;
+}
+
+static int kvBodyDone(kvReq_t* req) {
+    if (req->body != NULL) {
+        req->body[req->bodyLen] = '\0';
+        req->bodyDst->val = req->body;
+        req->bodyDst->len = req->bodyLen;
+        req->bodyDst->status = KV_OK;
+        req->body = NULL;
+    }
+    if (req->type == REQ_GET) return 1;
+    // MGET: pasa a la clave siguiente
+    req->item++;
+    req->chunkLeft--;
+    return req->item == req->reply.count;
+}
+
+static int kvFetchTooBig(kvConn_t* conn, kvReq_t* req, size_t index) {
+    kvReq_t* sub = kvReqNew(REQ_GET, NULL, NULL);
+    if (sub == NULL) return KV_ENOMEM;
+    sub->sync = 0;
+    sub->parent = req;
+    sub->index = index;
+    sub->cmdLen = snprintf(sub->line, sizeof(sub->line), "GETL %s\n", req->keys[index]);
+    if (kvOutAppend(conn, sub->cmd, sub->cmdLen) < 0) {
+        kvReqFree(sub);
+        return KV_ENOMEM;
+    }
+    // va al final de la cola: el kvConnFlush() de kvConnProcess() lo envía
+    sub->conn = conn;
+    conn->tail->next = sub;
+    conn->tail = sub;
+    __atomic_add_fetch(&conn->pending, 1, __ATOMIC_RELAXED);
+    req->waiting++;
+    return 0;
+}
+
+static void kvReqComplete(kvConn_t* conn, kvReq_t* req, kvReq_t** done) {
+    if (req->parent != NULL) {
+        // GETL de un TOOBIG: el valor pasa a su lugar en el MGET
+        kvReq_t* parent = req->parent;
+        kvValue_t* dst = &parent->reply.values[req->index];
+        dst->status = req->reply.status;
+        dst->val = req->single.val;
+        dst->len = req->single.len;
+        req->single.val = NULL;
+        if (req->reply.status < 0 && parent->reply.status == KV_OK) {
+            parent->reply.status = req->reply.status;
+            memcpy(parent->err, req->err, sizeof(parent->err));
+            if (req->reply.err != NULL) parent->reply.err = parent->err;
+        }
+        kvReqFree(req);
+        if (--parent->waiting == 0 && parent->parsed) kvReqComplete(conn, parent, done);
+        return;
+    }
+    if (req->type == REQ_MGET) {
+        req->parsed = 1;
+        if (req->waiting > 0) return; // lo termina el último GETL
+    }
+    if (req->type == REQ_GET) {
+        req->reply.val = req->single.val;
+        req->reply.len = req->single.len;
+        req->single.val = NULL;
+    }
+    if (req->sync) {
+        req->done = 1;
+    } else {
+        req->next = *done;
+        *done = req;
+    }
+}
+
+static int kvRunCallbacks(kvReq_t* done) {
+    // la lista quedó al revés: se da vuelta para llamarlos en el orden en que terminaron
+    kvReq_t* ordered = NULL;
+    while (done != NULL) {
+        kvReq_t* next = done->next;
+        done->next = ordered;
+        ordered = done;
+        done = next;
+    }
+    int count = 0;
+    while (ordered != NULL) {
+        kvReq_t* next = ordered->next;
+        ordered->cb(&ordered->reply, ordered->arg);
+        kvReqFree(ordered);
+        ordered = next;
+        count++;
+    }
+    return count;
+}
+
+/*********************** funciones utilitarias ************************/
+static int kvLineIs(const char* line, size_t len, const char* text) {
+    return strlen(text) == len && memcmp(line, text, len) == 0;
+}
+
+static int kvLineNum(const char* line, size_t len, const char* prefix, int64_t* out) {
+    size_t prefixLen = strlen(prefix);
+    if (len <= prefixLen || memcmp(line, prefix, prefixLen) != 0) return -1;
+    size_t pos = prefixLen;
+    int negative = line[pos] == '-';
+    if (negative) pos++;
+    if (pos == len) return -1;
+    uint64_t value = 0;
+    for (; pos < len; pos++) {
+        if (line[pos] < '0' || line[pos] > '9') return -1;
+        uint64_t digit = line[pos] - '0';
+        if (value > (UINT64_MAX - digit) / 10) return -1;
+        value = value * 10 + digit;
+    }
+    if (value > (uint64_t)INT64_MAX + negative) return -1;
+    *out = negative ? (int64_t)(0 - value) : (int64_t)value;
+    return 0;
+}
+
+/*********************** end of file ************************/
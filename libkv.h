@@ -0,0 +1,198 @@
+/**
+ * @file libkv.h
+ * @brief Biblioteca cliente para el servidor clave-valor
+ *
+ * Reemplaza al connectToServer()/sendCommand() de test_client.c: en vez de
+ * una conexión por comando y un read() que se supone trae toda la
+ * respuesta, un kvClient_t mantiene un conjunto de conexiones abiertas que
+ * pueden usar varios hilos a la vez. Los pedidos de todos los hilos se
+ * envían por esas conexiones sin esperar las respuestas anteriores
+ * (pipelining) y las respuestas se interpretan a medida que llegan, en
+ * cualquier cantidad de pedazos.
+ *
+ * Cada operación tiene dos formas:
+ * - sincrónica (kvGet(), kvSet(), ...): espera la respuesta.
+ * - asincrónica (kvGetAsync(), ...): vuelve enseguida y la respuesta llega
+ *   a un callback. Los callbacks corren en el hilo que procesa la conexión:
+ *   el que llama a kvPoll() o uno que espera una operación sincrónica por
+ *   la misma conexión.
+ *
+ * Compilar junto con el programa: gcc -Wall -Wextra -O2 -pthread programa.c libkv.c
+ */
+
+#ifndef LIBKV_H
+#define LIBKV_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** Largo máximo de una clave (así cualquier comando entra en la línea de 128 bytes del servidor) */
+#define KV_MAX_KEY_LEN 100
+/** Largo máximo de un valor (el de SETL en el servidor) */
+#define KV_MAX_VALUE_LEN (1024UL * 1024 * 1024)
+/** Máximo de conexiones de un cliente */
+#define KV_MAX_POOL 64
+
+/**
+ * @brief Resultado de una operación
+ *
+ * Los valores no negativos son respuestas del servidor; los negativos,
+ * errores que no dejaron completar la operación.
+ */
+typedef enum {
+    KV_OK = 0,          /**< OK */
+    KV_NOTFOUND = 1,    /**< NOTFOUND: la clave no existe */
+    KV_ESERVER = -1,    /**< El servidor respondió ERROR (el mensaje va en kvReply_t.err) */
+    KV_EIO = -2,        /**< No se pudo conectar o se cortó la conexión */
+    KV_EPROTO = -3,     /**< Respuesta inesperada: se cerró la conexión */
+    KV_EINVAL = -4,     /**< Clave o valor que el protocolo no admite */
+    KV_ENOMEM = -5,     /**< Sin memoria */
+    KV_EBUSY = -6,      /**< El servidor está lleno (BUSY): se cerró la conexión, reintentar más tarde */
+} kvStatus_t;
+
+/**
+ * @brief Valor de una clave dentro de un lote
+ */
+typedef struct {
+    int status;         /**< KV_OK, KV_NOTFOUND o un error */
+    char* val;          /**< Valor (malloc, terminado en '\0' de más) o NULL */
+    size_t len;         /**< Largo del valor */
+} kvValue_t;
+
+/**
+ * @brief Respuesta entregada a un callback
+ *
+ * Vale solo durante el callback. Para quedarse con un valor, el callback
+ * copia el puntero y lo pone en NULL (después es suyo y lo libera con free()).
+ */
+typedef struct {
+    int status;         /**< kvStatus_t */
+    const char* err;    /**< Mensaje del servidor si status es KV_ESERVER */
+    char* val;          /**< GET: valor (malloc, terminado en '\0' de más) */
+    size_t len;         /**< GET: largo del valor */
+    int64_t num;        /**< INCR: valor nuevo; MDEL: claves eliminadas */
+    kvValue_t* values;  /**< MGET: un valor por clave, en el orden pedido */
+    size_t count;       /**< MGET: cantidad de valores */
+} kvReply_t;
+
+/**
+ * @brief Callback de una operación asincrónica
+ * @param reply Respuesta
+ * @param arg Argumento indicado al pedirla
+ */
+typedef void (*kvCallback_t)(kvReply_t* reply, void* arg);
+
+/**
+ * @brief Cliente: conjunto de conexiones a un servidor
+ */
+typedef struct kvClient kvClient_t;
+
+/**
+ * @brief Crea un cliente
+ *
+ * Las conexiones se abren recién con el primer pedido que va por cada una,
+ * y una que se cortó se vuelve a abrir con el siguiente.
+ * @param addr Dirección del servidor, como la de -L: "<host>:<puerto>",
+ *  "[<IPv6>]:<puerto>", "unix:<ruta>" o "@<nombre>"
+ * @param poolSize Cantidad de conexiones (1 a KV_MAX_POOL)
+ * @return Cliente, o NULL si la dirección es inválida o no hay memoria
+ */
+kvClient_t* kvClientNew(const char* addr, int poolSize);
+
+/**
+ * @brief Cierra las conexiones y libera el cliente
+ *
+ * No tiene que haber otro hilo usándolo. Los pedidos asincrónicos sin
+ * respuesta se descartan sin llamar a sus callbacks.
+ */
+void kvClientFree(kvClient_t* client);
+
+/**
+ * @brief Procesa las respuestas que llegaron y envía lo pendiente
+ *
+ * Motor de la interfaz asincrónica: corre los callbacks de las operaciones
+ * que terminaron. Se puede llamar desde varios hilos; cada conexión la
+ * atiende uno por vez.
+ * @param timeoutMs Máximo a esperar alguna respuesta (-1 = sin límite, 0 = no esperar)
+ * @return Cantidad de operaciones terminadas
+ */
+int kvPoll(kvClient_t* client, int timeoutMs);
+
+/**
+ * @brief Operaciones enviadas que todavía no terminaron
+ */
+size_t kvPending(kvClient_t* client);
+
+/**
+ * @brief Texto de un kvStatus_t
+ */
+const char* kvStrError(int status);
+
+/* Operaciones sincrónicas: devuelven un kvStatus_t */
+
+/**
+ * @brief Lee una clave (GETL)
+ * @param val Recibe el valor (malloc, terminado en '\0' de más; lo libera quien llama)
+ * @param len Recibe el largo (puede ser NULL)
+ */
+int kvGet(kvClient_t* client, const char* key, char** val, size_t* len);
+
+/**
+ * @brief Guarda un valor de cualquier contenido (SETL)
+ */
+int kvSet(kvClient_t* client, const char* key, const void* val, size_t len);
+
+/**
+ * @brief Elimina una clave (KV_NOTFOUND si no existía)
+ */
+int kvDel(kvClient_t* client, const char* key);
+
+/**
+ * @brief Suma delta al valor entero de una clave (INCR)
+ * @param result Recibe el valor nuevo (puede ser NULL)
+ */
+int kvIncr(kvClient_t* client, const char* key, int64_t delta, int64_t* result);
+
+/**
+ * @brief Lee varias claves (MGET)
+ *
+ * Se envían en lotes de hasta 256 claves; cada lote es atómico en el
+ * servidor. Los valores de más de 16 KB, que el servidor no incluye en un
+ * MGET, se piden solos con GETL.
+ * @param values Recibe un valor por clave (se liberan con kvValuesFree())
+ * @return KV_OK si todas tienen respuesta (encontradas o no) o el primer error
+ */
+int kvMget(kvClient_t* client, const char* const keys[], size_t n, kvValue_t values[]);
+
+/**
+ * @brief Guarda varias claves (MSET)
+ *
+ * Los valores viajan como palabras de la línea de comando: no pueden estar
+ * vacíos ni tener espacios ni caracteres de control (para otros, kvSet()).
+ */
+int kvMset(kvClient_t* client, const char* const keys[], const char* const vals[], size_t n);
+
+/**
+ * @brief Elimina varias claves (MDEL)
+ * @param deleted Recibe cuántas existían (puede ser NULL)
+ */
+int kvMdel(kvClient_t* client, const char* const keys[], size_t n, size_t* deleted);
+
+/**
+ * @brief Libera los valores de un kvMget()
+ */
+void kvValuesFree(kvValue_t values[], size_t n);
+
+/* Operaciones asincrónicas: devuelven KV_OK si el pedido quedó en curso (y
+ * su callback se va a llamar) o un error (y el callback no se llama) */
+
+int kvGetAsync(kvClient_t* client, const char* key, kvCallback_t cb, void* arg);
+int kvSetAsync(kvClient_t* client, const char* key, const void* val, size_t len, kvCallback_t cb, void* arg);
+int kvDelAsync(kvClient_t* client, const char* key, kvCallback_t cb, void* arg);
+int kvIncrAsync(kvClient_t* client, const char* key, int64_t delta, kvCallback_t cb, void* arg);
+int kvMgetAsync(kvClient_t* client, const char* const keys[], size_t n, kvCallback_t cb, void* arg);
+int kvMsetAsync(kvClient_t* client, const char* const keys[], const char* const vals[], size_t n,
+                kvCallback_t cb, void* arg);
+int kvMdelAsync(kvClient_t* client, const char* const keys[], size_t n, kvCallback_t cb, void* arg);
+
+#endif /* LIBKV_H */
@@ -0,0 +1,500 @@
+/**
+ * @file libkv_test.c
+ * @brief Pruebas de libkv contra un servidor arrancado por la prueba
+ *
+ * Arranca el servidor en una carpeta temporal, escuchando en un socket Unix
+ * y en un puerto TCP, corre las pruebas y lo detiene. Termina con código de
+ * error si alguna falla.
+ *
+ * Compilar: gcc -Wall -Wextra -O2 -pthread -o libkv_test libkv_test.c libkv.c
+ * Ejecutar: ./libkv_test [<ruta del servidor>]   (por defecto ./server)
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include "libkv.h"
+
+#include <ftw.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TEST_THREADS 8
+#define TEST_THREAD_OPS 2000
+#define TEST_ASYNC_OPS 2000
+#define TEST_BATCH_KEYS 600
+#define TEST_MAX_CONNS 32
+
+#define CHECK(cond)                                                            \
+    do {                                                                       \
+        if (!(cond)) {                                                         \
+            fprintf(stderr, "%s:%d: falla: %s\n", __FILE__, __LINE__, #cond);  \
+            failures++;                                                        \
+        }                                                                      \
+    } while (0)
+
+/**
+ * @brief Estado de las pruebas asincrónicas
+ */
+typedef struct {
+    int completed;      /**< Callbacks llamados (se cuentan con atómicos) */
+    int wrong;          /**< Respuestas distintas de la esperada */
+} testAsync_t;
+
+/**
+ * @brief Argumento de cada hilo de la prueba concurrente
+ */
+typedef struct {
+    kvClient_t* client; /**< Cliente compartido */
+    int id;             /**< Número de hilo */
+    int errors;         /**< Operaciones que fallaron */
+} testThread_t;
+
+static int failures;
+static char unixAddr[PATH_MAX];
+static char tcpAddr[64];
+
+/**
+ * @brief Arranca el servidor en una carpeta temporal
+ * @param restore Volcado a cargar con -r (NULL = ninguno)
+ * @return PID del servidor
+ */
+static pid_t testServerStart(const char* serverPath, char* dir, const char* restore);
+
+/**
+ * @brief Envía un comando de texto por el socket Unix y lee la primera línea de la respuesta
+ * @return 0 si respondió, -1 si no
+ */
+static int testCommand(const char* cmd, char* reply, size_t cap);
+
+/**
+ * @brief Borra la carpeta temporal del servidor
+ */
+static void testRemoveDir(const char* dir);
+
+static void testSync(kvClient_t* client);
+static void testBatch(kvClient_t* client);
+static void testAsync(kvClient_t* client);
+static void testConcurrent(kvClient_t* client);
+static void testErrors(kvClient_t* client);
+static void testTcp(void);
+static void testBusy(void);
+static pid_t testSnapshot(const char* serverPath, pid_t pid, const char* dir, char* restoreDir);
+
+int main(int argc, char* argv[]) {
+    char serverPath[PATH_MAX];
+    if (realpath(argc > 1 ? argv[1] : "./server", serverPath) == NULL) {
+        perror("realpath");
+        return EXIT_FAILURE;
+    }
+
+    char dir[] = "/tmp/libkv_test.XXXXXX";
+    pid_t pid = testServerStart(serverPath, dir, NULL);
+
+    kvClient_t* client = kvClientNew(unixAddr, 4);
+    CHECK(client != NULL);
+    if (client != NULL) {
+        testSync(client);
+        testBatch(client);
+        testAsync(client);
+        testConcurrent(client);
+        testErrors(client);
+        kvClientFree(client);
+    }
+    testTcp();
+    testBusy();
+    char restoreDir[] = "/tmp/libkv_test.XXXXXX";
+    pid = testSnapshot(serverPath, pid, dir, restoreDir);
+
+    kill(pid, SIGINT);
+    waitpid(pid, NULL, 0);
+    testRemoveDir(dir);
+    testRemoveDir(restoreDir);
+
+    printf("libkv_test: %s (%d fallas)\n", failures == 0 ? "ok" : "FALLA", failures);
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static pid_t testServerStart(const char* serverPath, char* dir, const char* restore) {
+    if (mkdtemp(dir) == NULL) {
+        perror("mkdtemp");
+        exit(EXIT_FAILURE);
+    }
+    snprintf(unixAddr, sizeof(unixAddr), "unix:%s/kv.sock", dir);
+    int port = 20000 + getpid() % 20000;
+    snprintf(tcpAddr, sizeof(tcpAddr), "127.0.0.1:%d", port);
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(EXIT_FAILURE);
+    }
+    if (pid == 0) {
+        if (chdir(dir) < 0) {
+            perror("chdir");
+            _exit(EXIT_FAILURE);
+        }
+        char maxConns[16];
+        snprintf(maxConns, sizeof(maxConns), "%d", TEST_MAX_CONNS);
+        if (restore != NULL) {
+            execl(serverPath, serverPath, "-t", "2", "-l", "warn", "-C", maxConns, "-L", unixAddr, "-L", tcpAddr,
+                  "-r", restore, (char*)NULL);
+        } else {
+            execl(serverPath, serverPath, "-t", "2", "-l", "warn", "-C", maxConns, "-L", unixAddr, "-L", tcpAddr,
+                  (char*)NULL);
+        }
+        perror("execl");
+        _exit(EXIT_FAILURE);
+    }
+
+    // se espera a que acepte conexiones
+    for (int i = 0; i < 100; i++) {
+        kvClient_t* probe = kvClientNew(unixAddr, 1);
+        int status = probe != NULL ? kvDel(probe, "arranque") : KV_EIO;
+        kvClientFree(probe);
+        if (status >= 0) return pid;
+        nanosleep(&(struct timespec){.tv_nsec = 50 * 1000 * 1000}, NULL);
+    }
+    fprintf(stderr, "libkv_test: el servidor no arrancó\n");
+    kill(pid, SIGKILL);
+    exit(EXIT_FAILURE);
+}
+
+static int testCommand(const char* cmd, char* reply, size_t cap) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%.*s", (int)sizeof(addr.sun_path) - 1, unixAddr + strlen("unix:"));
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    size_t len = 0, cmdLen = strlen(cmd);
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0 && write(fd, cmd, cmdLen) == (ssize_t)cmdLen) {
+        while (len < cap - 1 && memchr(reply, '\n', len) == NULL) {
+            ssize_t n = read(fd, reply + len, cap - 1 - len);
+            if (n <= 0) break;
+            len += n;
+        }
+    }
+    close(fd);
+    reply[len] = '\0';
+    char* end = strchr(reply, '\n');
+    if (end == NULL) return -1;
+    *end = '\0';
+    return 0;
+}
+
+static int testRemoveEntry(const char* path, const struct stat* st, int flag, struct FTW* ftw) {
+    (void)st;
+    (void)flag;
+    (void)ftw;
+    return remove(path);
+}
+
+static void testRemoveDir(const char* dir) {
+    nftw(dir, testRemoveEntry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+static void testSync(kvClient_t* client) {
+    char* val;
+    size_t len;
+
+    CHECK(kvSet(client, "manzana", "apple", 5) == KV_OK);
+    CHECK(kvGet(client, "manzana", &val, &len) == KV_OK);
+    CHECK(len == 5 && strcmp(val, "apple") == 0);
+    free(val);
+
+    CHECK(kvGet(client, "casa", &val, &len) == KV_NOTFOUND);
+    CHECK(kvDel(client, "manzana") == KV_OK);
+    CHECK(kvDel(client, "manzana") == KV_NOTFOUND);
+    CHECK(kvGet(client, "manzana", &val, &len) == KV_NOTFOUND);
+
+    // cualquier contenido, incluido vacío
+    const char bin[] = "a b\nc\0d\r\n";
+    CHECK(kvSet(client, "binario", bin, sizeof(bin)) == KV_OK);
+    CHECK(kvGet(client, "binario", &val, &len) == KV_OK);
+    CHECK(len == sizeof(bin) && memcmp(val, bin, len) == 0);
+    free(val);
+    CHECK(kvSet(client, "vacio", "", 0) == KV_OK);
+    CHECK(kvGet(client, "vacio", &val, &len) == KV_OK);
+    CHECK(len == 0 && val[0] == '\0');
+    free(val);
+
+    // un valor que no entra en un solo read() ni en los buffers de los sockets
+    size_t bigLen = 3 * 1024 * 1024 + 7;
+    char* big = malloc(bigLen);
+    for (size_t i = 0; i < bigLen; i++) big[i] = (char)(i * 31 + i / 4096);
+    CHECK(kvSet(client, "grande", big, bigLen) == KV_OK);
+    CHECK(kvGet(client, "grande", &val, &len) == KV_OK);
+    CHECK(len == bigLen && memcmp(val, big, bigLen) == 0);
+    free(val);
+    free(big);
+
+    int64_t n = 0;
+    CHECK(kvIncr(client, "contador", 5, &n) == KV_OK && n == 5);
+    CHECK(kvIncr(client, "contador", -7, &n) == KV_OK && n == -2);
+    CHECK(kvDel(client, "contador") == KV_OK);
+    printf("libkv_test: operaciones sincrónicas\n");
+}
+
+static void testBatch(kvClient_t* client) {
+    // más claves de las que entran en un lote del servidor: se parte en varias líneas
+    static char keyBuf[TEST_BATCH_KEYS][16];
+    static char valBuf[TEST_BATCH_KEYS][16];
+    const char* keys[TEST_BATCH_KEYS];
+    const char* vals[TEST_BATCH_KEYS];
+    kvValue_t values[TEST_BATCH_KEYS];
+    for (int i = 0; i < TEST_BATCH_KEYS; i++) {
+        snprintf(keyBuf[i], sizeof(keyBuf[i]), "lote:%d", i);
+        snprintf(valBuf[i], sizeof(valBuf[i]), "v%d", i * 3);
+        keys[i] = keyBuf[i];
+        vals[i] = valBuf[i];
+    }
+    CHECK(kvMset(client, keys, vals, TEST_BATCH_KEYS) == KV_OK);
+    CHECK(kvMget(client, keys, TEST_BATCH_KEYS, values) == KV_OK);
+    int wrong = 0;
+    for (int i = 0; i < TEST_BATCH_KEYS; i++) {
+        wrong += values[i].status != KV_OK || strcmp(values[i].val, vals[i]) != 0;
+    }
+    CHECK(wrong == 0);
+    kvValuesFree(values, TEST_BATCH_KEYS);
+
+    // un valor de más de 16 KB llega como TOOBIG y se pide aparte con GETL
+    size_t bigLen = 100 * 1000;
+    char* big = malloc(bigLen);
+    memset(big, 'x', bigLen);
+    big[0] = '\n';
+    CHECK(kvSet(client, "lote:grande", big, bigLen) == KV_OK);
+    const char* mixed[] = {"lote:1", "lote:grande", "lote:no", "lote:2", "lote:grande"};
+    CHECK(kvMget(client, mixed, 5, values) == KV_OK);
+    CHECK(values[0].status == KV_OK && strcmp(values[0].val, "v3") == 0);
+    CHECK(values[1].status == KV_OK && values[1].len == bigLen && memcmp(values[1].val, big, bigLen) == 0);
+    CHECK(values[2].status == KV_NOTFOUND && values[2].val == NULL);
+    CHECK(values[3].status == KV_OK && strcmp(values[3].val, "v6") == 0);
+    CHECK(values[4].status == KV_OK && values[4].len == bigLen);
+    kvValuesFree(values, 5);
+    free(big);
+
+    size_t deleted = 0;
+    CHECK(kvMdel(client, keys, TEST_BATCH_KEYS, &deleted) == KV_OK && deleted == TEST_BATCH_KEYS);
+    CHECK(kvMget(client, keys, 3, values) == KV_OK);
+    CHECK(values[0].status == KV_NOTFOUND && values[2].status == KV_NOTFOUND);
+    kvValuesFree(values, 3);
+    printf("libkv_test: operaciones de varias claves\n");
+}
+
+static void testAsyncSetDone(kvReply_t* reply, void* arg) {
+    testAsync_t* state = arg;
+    if (reply->status != KV_OK) __atomic_add_fetch(&state->wrong, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&state->completed, 1, __ATOMIC_RELAXED);
+}
+
+static testAsync_t asyncGets;
+
+static void testAsyncGetDone(kvReply_t* reply, void* arg) {
+    // arg es el número de clave: el valor tiene que ser "valor:<número>"
+    char expected[32];
+    snprintf(expected, sizeof(expected), "valor:%d", (int)(intptr_t)arg);
+    if (reply->status != KV_OK || strcmp(reply->val, expected) != 0) {
+        __atomic_add_fetch(&asyncGets.wrong, 1, __ATOMIC_RELAXED);
+    }
+    __atomic_add_fetch(&asyncGets.completed, 1, __ATOMIC_RELAXED);
+}
+
+static void testAsyncMgetDone(kvReply_t* reply, void* arg) {
+    testAsync_t* state = arg;
+    if (reply->status != KV_OK || reply->count != 2 || reply->values[0].status != KV_OK ||
+        strcmp(reply->values[0].val, "valor:0") != 0 || reply->values[1].status != KV_NOTFOUND) {
+        state->wrong++;
+    }
+    // el callback puede quedarse con el valor
+    free(reply->values[0].val);
+    reply->values[0].val = NULL;
+    state->completed++;
+}
+
+static void testAsync(kvClient_t* client) {
+    testAsync_t sets = {0};
+    char key[32];
+    char val[32];
+    for (int i = 0; i < TEST_ASYNC_OPS; i++) {
+        snprintf(key, sizeof(key), "async:%d", i);
+        int len = snprintf(val, sizeof(val), "valor:%d", i);
+        CHECK(kvSetAsync(client, key, val, len, testAsyncSetDone, &sets) == KV_OK);
+    }
+    while (kvPending(client) > 0) kvPoll(client, 1000);
+    CHECK(sets.completed == TEST_ASYNC_OPS && sets.wrong == 0);
+
+    for (int i = 0; i < TEST_ASYNC_OPS; i++) {
+        snprintf(key, sizeof(key), "async:%d", i);
+        CHECK(kvGetAsync(client, key, testAsyncGetDone, (void*)(intptr_t)i) == KV_OK);
+    }
+    while (kvPending(client) > 0) kvPoll(client, 1000);
+    CHECK(asyncGets.completed == TEST_ASYNC_OPS && asyncGets.wrong == 0);
+
+    testAsync_t mget = {0};
+    const char* keys[] = {"async:0", "async:no"};
+    CHECK(kvMgetAsync(client, keys, 2, testAsyncMgetDone, &mget) == KV_OK);
+    while (mget.completed == 0) kvPoll(client, 1000);
+    CHECK(mget.wrong == 0);
+
+    // sin nada en vuelo, kvPoll() vuelve enseguida
+    CHECK(kvPoll(client, 0) == 0);
+    printf("libkv_test: operaciones asincrónicas\n");
+}
+
+static void* testThreadRun(void* arg) {
+    testThread_t* th = arg;
+    char key[32];
+    char val[32];
+    for (int i = 0; i < TEST_THREAD_OPS; i++) {
+        snprintf(key, sizeof(key), "hilo:%d:%d", th->id, i % 50);
+        int len = snprintf(val, sizeof(val), "%d-%d", th->id, i);
+        char* got;
+        size_t gotLen;
+        th->errors += kvIncr(th->client, "compartido", 1, NULL) != KV_OK;
+        th->errors += kvSet(th->client, key, val, len) != KV_OK;
+        if (kvGet(th->client, key, &got, &gotLen) == KV_OK) {
+            th->errors += gotLen != (size_t)len || memcmp(got, val, len) != 0;
+            free(got);
+        } else {
+            th->errors++;
+        }
+    }
+    return NULL;
+}
+
+static void testConcurrent(kvClient_t* client) {
+    // varios hilos por las mismas 4 conexiones, y uno más con pedidos asincrónicos
+    pthread_t threads[TEST_THREADS];
+    testThread_t args[TEST_THREADS];
+    for (int i = 0; i < TEST_THREADS; i++) {
+        args[i] = (testThread_t){.client = client, .id = i};
+        pthread_create(&threads[i], NULL, testThreadRun, &args[i]);
+    }
+    testAsync_t incrs = {0};
+    for (int i = 0; i < TEST_THREAD_OPS; i++) {
+        CHECK(kvIncrAsync(client, "compartido", 1, testAsyncSetDone, &incrs) == KV_OK);
+        if (i % 100 == 99) kvPoll(client, 0);
+    }
+    while (__atomic_load_n(&incrs.completed, __ATOMIC_RELAXED) < TEST_THREAD_OPS) kvPoll(client, 100);
+    CHECK(incrs.wrong == 0);
+
+    int errors = 0;
+    for (int i = 0; i < TEST_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+        errors += args[i].errors;
+    }
+    CHECK(errors == 0);
+    int64_t total = 0;
+    CHECK(kvIncr(client, "compartido", 0, &total) == KV_OK);
+    CHECK(total == (TEST_THREADS + 1) * TEST_THREAD_OPS);
+    printf("libkv_test: %d hilos concurrentes\n", TEST_THREADS + 1);
+}
+
+static void testErrors(kvClient_t* client) {
+    // un ERROR del servidor no desarma la conexión
+    int64_t n;
+    CHECK(kvSet(client, "texto", "abc", 3) == KV_OK);
+    CHECK(kvIncr(client, "texto", 1, &n) == KV_ESERVER);
+    char* val;
+    size_t len;
+    CHECK(kvGet(client, "texto", &val, &len) == KV_OK && len == 3);
+    free(val);
+
+    // lo que el protocolo no admite se rechaza sin enviarlo
+    char longKey[KV_MAX_KEY_LEN + 2];
+    memset(longKey, 'k', sizeof(longKey) - 1);
+    longKey[sizeof(longKey) - 1] = '\0';
+    CHECK(kvSet(client, "con espacio", "x", 1) == KV_EINVAL);
+    CHECK(kvSet(client, "", "x", 1) == KV_EINVAL);
+    CHECK(kvSet(client, longKey, "x", 1) == KV_EINVAL);
+    const char* keys[] = {"a"};
+    const char* vals[] = {"con espacio"};
+    CHECK(kvMset(client, keys, vals, 1) == KV_EINVAL);
+    CHECK(kvMget(client, keys, 0, NULL) == KV_EINVAL);
+
+    // un servidor que no existe
+    char missing[PATH_MAX + 16];
+    snprintf(missing, sizeof(missing), "%s.no", unixAddr);
+    kvClient_t* none = kvClientNew(missing, 1);
+    CHECK(none != NULL && kvDel(none, "a") == KV_EIO);
+    kvClientFree(none);
+    CHECK(kvClientNew("sin-puerto", 1) == NULL);
+    printf("libkv_test: errores\n");
+}
+
+static void testTcp(void) {
+    kvClient_t* client = kvClientNew(tcpAddr, 2);
+    CHECK(client != NULL);
+    if (client == NULL) return;
+    char* val;
+    size_t len;
+    CHECK(kvSet(client, "tcp", "por tcp", 7) == KV_OK);
+    CHECK(kvGet(client, "tcp", &val, &len) == KV_OK && len == 7 && memcmp(val, "por tcp", 7) == 0);
+    free(val);
+    kvClientFree(client);
+    printf("libkv_test: TCP\n");
+}
+
+static void testBusy(void) {
+    // más clientes que el máximo del servidor: los que sobran reciben BUSY
+    kvClient_t* clients[TEST_MAX_CONNS + 8];
+    int ok = 0, busy = 0;
+    for (int i = 0; i < TEST_MAX_CONNS + 8; i++) {
+        clients[i] = kvClientNew(unixAddr, 1);
+        CHECK(clients[i] != NULL);
+        int status = clients[i] != NULL ? kvDel(clients[i], "lleno") : KV_EIO;
+        if (status == KV_NOTFOUND) ok++;
+        if (status == KV_EBUSY) busy++;
+    }
+    CHECK(ok + busy == TEST_MAX_CONNS + 8);
+    CHECK(ok <= TEST_MAX_CONNS && busy >= 8);
+    for (int i = 0; i < TEST_MAX_CONNS + 8; i++) kvClientFree(clients[i]);
+
+    // al liberarse lugar se vuelve a atender
+    kvClient_t* client = kvClientNew(unixAddr, 1);
+    int status = KV_EBUSY;
+    for (int i = 0; i < 100 && status == KV_EBUSY; i++) {
+        status = kvDel(client, "lleno");
+        if (status == KV_EBUSY) nanosleep(&(struct timespec){.tv_nsec = 10 * 1000 * 1000}, NULL);
+    }
+    CHECK(status == KV_NOTFOUND);
+    kvClientFree(client);
+    printf("libkv_test: servidor lleno\n");
+}
+
+static pid_t testSnapshot(const char* serverPath, pid_t pid, const char* dir, char* restoreDir) {
+    char reply[64];
+    CHECK(testCommand("SET vence valor EX 1000\n", reply, sizeof(reply)) == 0 && strcmp(reply, "OK") == 0);
+    CHECK(testCommand("SET no-vence valor\n", reply, sizeof(reply)) == 0 && strcmp(reply, "OK") == 0);
+    CHECK(testCommand("SNAPSHOT\n", reply, sizeof(reply)) == 0 && strcmp(reply, "OK") == 0);
+
+    // el volcado aparece con su nombre final recién cuando está completo
+    char snapshot[PATH_MAX];
+    snprintf(snapshot, sizeof(snapshot), "%s/db_snapshot", dir);
+    struct stat st;
+    for (int i = 0; i < 100 && stat(snapshot, &st) != 0; i++) {
+        nanosleep(&(struct timespec){.tv_nsec = 50 * 1000 * 1000}, NULL);
+    }
+    kill(pid, SIGINT);
+    waitpid(pid, NULL, 0);
+
+    // otro servidor, sobre una base vacía, arranca con el volcado: los vencimientos siguen
+    pid = testServerStart(serverPath, restoreDir, snapshot);
+    CHECK(testCommand("GETL vence\n", reply, sizeof(reply)) == 0 && strcmp(reply, "OK 5") == 0);
+    long ttl = 0;
+    CHECK(testCommand("TTL vence\n", reply, sizeof(reply)) == 0 && sscanf(reply, "OK %ld", &ttl) == 1);
+    CHECK(ttl > 900 && ttl <= 1000);
+    CHECK(testCommand("TTL no-vence\n", reply, sizeof(reply)) == 0 && strcmp(reply, "OK -1") == 0);
+    printf("libkv_test: SNAPSHOT y -r con vencimientos\n");
+    return pid;
+}
+
+/*********************** end of file ************************/
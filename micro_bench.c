@@ -0,0 +1,453 @@
+/**
+ * @file micro_bench.c
+ * @brief Microbenchmarks de las funciones del camino de un pedido en el servidor
+ *
+ * Mide por separado, sin red ni hilos de atención:
+ * - utilsStringTokenize() con un GET, un SET y un MSET de 64 claves.
+ * - dbFilePathOf(), la ruta de una clave en el motor file (lo que antes era
+ *   utilsGenerateFilePath()), con 0, 1 y 2 niveles de subcarpetas.
+ * - dbCreateKey() (clave nueva y clave existente), dbGetValue() y
+ *   dbDeleteValue() con cada motor, para cada cantidad de claves y largo de
+ *   valor pedidos.
+ *
+ * De cada uno informa ns, llamadas al sistema y reservas de memoria por
+ * operación, en CSV por stdout (o -o): una línea por caso, así dos corridas
+ * se comparan con diff o una planilla.
+ *
+ * Incluye server_tcp.c (con su main() renombrado) para llegar a sus
+ * funciones static. Las llamadas al sistema se cuentan con macros que
+ * envuelven las funciones de la libc que usa el servidor; las reservas,
+ * reemplazando malloc(), calloc() y realloc(). Se cuentan solo las del hilo
+ * que mide: las del hilo de compactación del motor log no entran.
+ *
+ * Cada motor corre en un proceso aparte, en una carpeta temporal que se
+ * borra al terminar.
+ *
+ * Compilar: make micro_bench (o gcc -Wall -Wextra -O2 -pthread -o micro_bench micro_bench.c)
+ * Ejecutar: ./micro_bench [-e file,log] [-k 1000,10000] [-v 16,1024,16384] [-n <repeticiones>] [-d <carpeta>] [-o <archivo>]
+ */
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <linux/io_uring.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MB_MAX_LIST 16
+#define MB_DEFAULT_REPS 1000000
+#define MB_PATH_KEYS 1024
+#define MB_MSET_KEYS 64
+
+/** Llamadas al sistema del hilo que mide */
+static __thread uint64_t mbSyscalls;
+/** Reservas de memoria del hilo que mide */
+static __thread uint64_t mbAllocs;
+
+/*
+ * Los encabezados ya se incluyeron: desde acá cada llamada a una de estas
+ * funciones dentro de server_tcp.c suma una llamada al sistema. Dentro de la
+ * macro el nombre ya no se vuelve a expandir y llama a la función de la libc.
+ */
+#define MB_SYSCALL(call) (mbSyscalls++, call)
+#define open(...) MB_SYSCALL(open(__VA_ARGS__))
+#define openat(...) MB_SYSCALL(openat(__VA_ARGS__))
+#define close(...) MB_SYSCALL(close(__VA_ARGS__))
+#define read(...) MB_SYSCALL(read(__VA_ARGS__))
+#define pread(...) MB_SYSCALL(pread(__VA_ARGS__))
+#define write(...) MB_SYSCALL(write(__VA_ARGS__))
+#define pwrite(...) MB_SYSCALL(pwrite(__VA_ARGS__))
+#define writev(...) MB_SYSCALL(writev(__VA_ARGS__))
+#define pwritev(...) MB_SYSCALL(pwritev(__VA_ARGS__))
+#define rename(...) MB_SYSCALL(rename(__VA_ARGS__))
+#define renameat(...) MB_SYSCALL(renameat(__VA_ARGS__))
+#define unlink(...) MB_SYSCALL(unlink(__VA_ARGS__))
+#define unlinkat(...) MB_SYSCALL(unlinkat(__VA_ARGS__))
+#define access(...) MB_SYSCALL(access(__VA_ARGS__))
+#define faccessat(...) MB_SYSCALL(faccessat(__VA_ARGS__))
+#define fstat(...) MB_SYSCALL(fstat(__VA_ARGS__))
+#define fstatat(...) MB_SYSCALL(fstatat(__VA_ARGS__))
+#define lstat(...) MB_SYSCALL(lstat(__VA_ARGS__))
+#define fsync(...) MB_SYSCALL(fsync(__VA_ARGS__))
+#define fdatasync(...) MB_SYSCALL(fdatasync(__VA_ARGS__))
+#define syncfs(...) MB_SYSCALL(syncfs(__VA_ARGS__))
+#define mkdir(...) MB_SYSCALL(mkdir(__VA_ARGS__))
+#define mkdirat(...) MB_SYSCALL(mkdirat(__VA_ARGS__))
+#define sendfile(...) MB_SYSCALL(sendfile(__VA_ARGS__))
+#define copy_file_range(...) MB_SYSCALL(copy_file_range(__VA_ARGS__))
+#define fcntl(...) MB_SYSCALL(fcntl(__VA_ARGS__))
+#define mmap(...) MB_SYSCALL(mmap(__VA_ARGS__))
+
+#define main serverMain
+#include "server_tcp.c"
+#undef main
+
+/*
+ * malloc() y compañía de la libc son reemplazables: estas versiones las usan
+ * el servidor y también la libc por dentro (strdup(), fopen(), ...).
+ */
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t n, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+
+void* malloc(size_t size) {
+    mbAllocs++;
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t n, size_t size) {
+    mbAllocs++;
+    return __libc_calloc(n, size);
+}
+
+void* realloc(void* ptr, size_t size) {
+    mbAllocs++;
+    return __libc_realloc(ptr, size);
+}
+
+/**
+ * @brief Configuración obtenida de la línea de comandos
+ */
+typedef struct {
+    const char* engines[MB_MAX_LIST];   /**< Motores a medir */
+    int engineCount;
+    size_t keys[MB_MAX_LIST];           /**< Cantidades de claves */
+    int keyCount;
+    size_t valLens[MB_MAX_LIST];        /**< Largos de valor */
+    int valLenCount;
+    uint64_t reps;                      /**< Repeticiones de las mediciones sin disco */
+    const char* dir;                    /**< Carpeta donde crear las temporales */
+    const char* outPath;                /**< Archivo del CSV (NULL = stdout) */
+} mbConfig_t;
+
+/**
+ * @brief Contadores al empezar una medición
+ */
+typedef struct {
+    uint64_t ns;
+    uint64_t syscalls;
+    uint64_t allocs;
+} mbMark_t;
+
+static mbConfig_t mbConfig = {
+    .engines = { "file", "log" },
+    .engineCount = 2,
+    .keys = { 1000, 10000 },
+    .keyCount = 2,
+    .valLens = { 16, 1024, 16384 },
+    .valLenCount = 3,
+    .reps = MB_DEFAULT_REPS,
+    .dir = "/tmp",
+};
+
+/**
+ * @brief Interpreta las opciones; una lista inválida termina el programa
+ */
+static void mbParseArgs(int argc, char* argv[], mbConfig_t* cfg);
+
+/**
+ * @brief Mide utilsStringTokenize()
+ */
+static void mbTokenize(FILE* out);
+
+/**
+ * @brief Mide dbFilePathOf() con 0, 1 y 2 niveles de subcarpetas
+ */
+static void mbFilePath(FILE* out);
+
+/**
+ * @brief Mide los caminos de la base con un motor, en un proceso aparte
+ */
+static void mbEngine(FILE* out, const char* engine);
+
+static mbMark_t mbStart(void) {
+    return (mbMark_t){ .ns = utilsNowNs(), .syscalls = mbSyscalls, .allocs = mbAllocs };
+}
+
+/**
+ * @brief Escribe la línea de un caso con lo que pasó desde start
+ */
+static void mbReport(FILE* out, mbMark_t start, const char* name, const char* engine, size_t keys, size_t valLen,
+                     uint64_t ops) {
+    mbMark_t end = mbStart();
+    fprintf(out, "%s,%s,%zu,%zu,%lu,%.1f,%.3f,%.3f\n", name, engine, keys, valLen, ops,
+            (double)(end.ns - start.ns) / ops, (double)(end.syscalls - start.syscalls) / ops,
+            (double)(end.allocs - start.allocs) / ops);
+    fflush(out);
+}
+
+int main(int argc, char* argv[]) {
+    mbParseArgs(argc, argv, &mbConfig);
+    config.traceLevel = TRACE_LEVEL_OFF; // sin hilo de registro ni mensajes en la medición
+
+    FILE* out = stdout;
+    if (mbConfig.outPath != NULL && (out = fopen(mbConfig.outPath, "w")) == NULL) {
+        perror("Error in fopen");
+        exit(EXIT_FAILURE);
+    }
+
+    fprintf(out, "benchmark,engine,keys,value_bytes,ops,ns_per_op,syscalls_per_op,allocs_per_op\n");
+    mbTokenize(out);
+    mbFilePath(out);
+    for (int i = 0; i < mbConfig.engineCount; i++) mbEngine(out, mbConfig.engines[i]);
+    if (out != stdout) fclose(out);
+    return EXIT_SUCCESS;
+}
+
+static void mbTokenize(FILE* out) {
+    char set[MAX_MSG_LENGTH];
+    snprintf(set, sizeof(set), "SET clave:00000042 %0100d", 7);
+    char mset[CONN_IN_BUF_LEN];
+    size_t msetLen = snprintf(mset, sizeof(mset), "MSET");
+    for (int i = 0; i < MB_MSET_KEYS; i++) {
+        msetLen += snprintf(mset + msetLen, sizeof(mset) - msetLen, " clave:%08d valor:%08d", i, i);
+    }
+    struct {
+        const char* name;
+        const char* line;
+        size_t keys;
+        size_t valLen;
+    } cases[] = {
+        { "tokenize_get", "GET clave:00000042", 1, 0 },
+        { "tokenize_set", set, 1, 100 },
+        { "tokenize_mset", mset, MB_MSET_KEYS, 14 },
+    };
+
+    utilsSlice_t words[MAX_BATCH_WORDS];
+    for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+        size_t len = strlen(cases[c].line);
+        int tokens = 0;
+        mbMark_t start = mbStart();
+        for (uint64_t i = 0; i < mbConfig.reps; i++) {
+            tokens += utilsStringTokenize(cases[c].line, len, MAX_BATCH_WORDS, words);
+            __asm__ volatile("" : : "r"(words) : "memory"); // que el compilador no descarte los tokens
+        }
+        mbReport(out, start, cases[c].name, "-", cases[c].keys, cases[c].valLen, mbConfig.reps);
+        if (tokens == 0) fprintf(stderr, "micro_bench: %s sin tokens\n", cases[c].name);
+    }
+}
+
+static void mbFilePath(FILE* out) {
+    static char keys[MB_PATH_KEYS][MAX_MSG_LENGTH];
+    for (int i = 0; i < MB_PATH_KEYS; i++) snprintf(keys[i], sizeof(keys[i]), "usuario:%d:sesion", i * 7919);
+
+    for (int fanout = 0; fanout <= DB_FANOUT_MAX; fanout++) {
+        // la ruta solo depende de config.fanout: no hace falta abrir las carpetas
+        config.fanout = fanout;
+        char name[32];
+        snprintf(name, sizeof(name), "filepath_f%d", fanout);
+        dbFilePath_t path;
+        mbMark_t start = mbStart();
+        for (uint64_t i = 0; i < mbConfig.reps; i++) {
+            dbFilePathOf(keys[i % MB_PATH_KEYS], &path);
+            __asm__ volatile("" : : "r"(&path) : "memory");
+        }
+        mbReport(out, start, name, "file", MB_PATH_KEYS, 0, mbConfig.reps);
+    }
+    config.fanout = 0;
+}
+
+static int mbRemoveEntry(const char* path, const struct stat* st, int flag, struct FTW* ftw) {
+    (void)st;
+    (void)flag;
+    (void)ftw;
+    return remove(path);
+}
+
+/**
+ * @brief Crea, reescribe, lee y borra n claves con valores de valLen bytes
+ */
+static void mbEngineRound(FILE* out, const char* engine, char (*keys)[MAX_MSG_LENGTH], size_t n, size_t valLen) {
+    char* value = malloc(valLen + 1);
+    if (value == NULL) {
+        perror("Error in malloc");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < valLen; i++) value[i] = 'a' + i % 26;
+
+    mbMark_t start = mbStart();
+    for (size_t i = 0; i < n; i++) dbCreateKey(keys[i], value, valLen, 0);
+    mbReport(out, start, "create", engine, n, valLen, n);
+
+    start = mbStart();
+    for (size_t i = 0; i < n; i++) dbCreateKey(keys[i], value, valLen, 0);
+    mbReport(out, start, "update", engine, n, valLen, n);
+
+    size_t wrong = 0;
+    start = mbStart();
+    for (size_t i = 0; i < n; i++) wrong += dbGetValue(keys[i], value, valLen + 1) != (ssize_t)valLen;
+    mbReport(out, start, "get", engine, n, valLen, n);
+
+    start = mbStart();
+    for (size_t i = 0; i < n; i++) wrong += !dbDeleteValue(keys[i]);
+    mbReport(out, start, "delete", engine, n, valLen, n);
+
+    if (wrong > 0) fprintf(stderr, "micro_bench: %s: %zu operaciones con resultado inesperado\n", engine, wrong);
+    free(value);
+}
+
+static void mbEngine(FILE* out, const char* engine) {
+    char dir[MAX_PATH_LEN];
+    snprintf(dir, sizeof(dir), "%s/micro_bench.XXXXXX", mbConfig.dir);
+    if (mkdtemp(dir) == NULL) {
+        perror("Error in mkdtemp");
+        exit(EXIT_FAILURE);
+    }
+
+    // cada motor en su proceso: los dos usan variables globales y carpetas relativas
+    fflush(out);
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("Error in fork");
+        exit(EXIT_FAILURE);
+    }
+    if (pid == 0) {
+        if (chdir(dir) == -1) {
+            perror("Error in chdir");
+            _exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < KEY_LOCK_STRIPES; i++) pthread_rwlock_init(&keyLocks[i], NULL);
+        config.storage = engine;
+        dbInit(engine);
+        idxInit();
+
+        size_t maxKeys = 0;
+        for (int k = 0; k < mbConfig.keyCount; k++) {
+            if (mbConfig.keys[k] > maxKeys) maxKeys = mbConfig.keys[k];
+        }
+        char (*keys)[MAX_MSG_LENGTH] = malloc(maxKeys * MAX_MSG_LENGTH);
+        if (keys == NULL) {
+            perror("Error in malloc");
+            _exit(EXIT_FAILURE);
+        }
+        for (size_t i = 0; i < maxKeys; i++) snprintf(keys[i], MAX_MSG_LENGTH, "usuario:%zu:sesion", i * 7919);
+
+        for (int k = 0; k < mbConfig.keyCount; k++) {
+            for (int v = 0; v < mbConfig.valLenCount; v++) {
+                mbEngineRound(out, engine, keys, mbConfig.keys[k], mbConfig.valLens[v]);
+            }
+        }
+        fflush(out);
+        _exit(EXIT_SUCCESS);
+    }
+
+    int status;
+    waitpid(pid, &status, 0);
+    nftw(dir, mbRemoveEntry, 16, FTW_DEPTH | FTW_PHYS);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+        fprintf(stderr, "micro_bench: falló la medición del motor %s\n", engine);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * @brief Interpreta una lista de números separados por coma
+ * @return Cantidad de números, -1 si la lista es inválida
+ */
+static int mbParseList(const char* arg, size_t values[]) {
+    int n = 0;
+    const char* p = arg;
+    while (*p != '\0') {
+        char* end;
+        unsigned long long v = strtoull(p, &end, 10);
+        if (end == p || v == 0 || n == MB_MAX_LIST) return -1;
+        values[n++] = v;
+        if (*end == ',') end++;
+        else if (*end != '\0') return -1;
+        p = end;
+    }
+    return n > 0 ? n : -1;
+}
+
+static void mbUsage(const char* prog) {
+    printf("Uso: %s [opciones]\n", prog);
+    printf("  -e <motores>     motores a medir, separados por coma (por defecto file,log)\n");
+    printf("  -k <claves>      cantidades de claves, separadas por coma (por defecto 1000,10000)\n");
+    printf("  -v <bytes>       largos de valor, separados por coma (por defecto 16,1024,16384)\n");
+    printf("  -n <veces>       repeticiones de las mediciones sin disco (por defecto %d)\n", MB_DEFAULT_REPS);
+    printf("  -d <carpeta>     donde crear las carpetas temporales de los motores (por defecto /tmp)\n");
+    printf("  -o <archivo>     escribe el CSV en el archivo en lugar de stdout\n");
+}
+
+static void mbParseArgs(int argc, char* argv[], mbConfig_t* cfg) {
+    int opt;
+    while ((opt = getopt(argc, argv, "e:k:v:n:d:o:h")) != -1) {
+        switch (opt) {
+        case 'e': {
+            cfg->engineCount = 0;
+            for (char* name = strtok(optarg, ","); name != NULL; name = strtok(NULL, ",")) {
+                if (cfg->engineCount == MB_MAX_LIST || (strcmp(name, "file") != 0 && strcmp(name, "log") != 0)) {
+                    fprintf(stderr, "ERROR motor inválido: %s (file o log)\n", name);
+                    exit(EXIT_FAILURE);
+                }
+                cfg->engines[cfg->engineCount++] = name;
+            }
+            break;
+        }
+        case 'k':
+            if ((cfg->keyCount = mbParseList(optarg, cfg->keys)) == -1) {
+                fprintf(stderr, "ERROR cantidades de claves inválidas: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'v':
+            if ((cfg->valLenCount = mbParseList(optarg, cfg->valLens)) == -1) {
+                fprintf(stderr, "ERROR largos de valor inválidos: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'n':
+            cfg->reps = strtoull(optarg, NULL, 10);
+            if (cfg->reps == 0) {
+                fprintf(stderr, "ERROR repeticiones inválidas: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'd':
+            cfg->dir = optarg;
+            break;
+        case 'o':
+            cfg->outPath = optarg;
+            break;
+        case 'h':
+            mbUsage(argv[0]);
+            exit(EXIT_SUCCESS);
+        default:
+            mbUsage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (cfg->engineCount == 0) {
+        mbUsage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*********************** end of file ************************/
@@ -5,525 +5,9375 @@
  * @date 27 July 2025
  */
 
+#define _GNU_SOURCE // Para accept4()
+
 #include <arpa/inet.h>
+#include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <linux/io_uring.h>
+#include <netdb.h> // Para getaddrinfo()
 #include <netinet/in.h>
+#include <netinet/tcp.h> // Para TCP_INFO
+#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stdarg.h>
+#include <stddef.h> // Para offsetof()
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/stat.h> // Para mkdir()
+#include <sys/syscall.h> // io_uring no tiene envoltorio en la libc
+#include <sys/uio.h>  // Para writev()
+#include <sys/un.h>   // Para sockaddr_un
+#include <time.h>
 #include <unistd.h>
 
 #define SERVER_PORT 5000
+#define SERVER_BACKLOG 1024
+#define SERVER_MAX_CONNS 10000
+#define SERVER_MAX_LISTENERS 8
+#define MAX_WORKERS 256
 #define MAX_MSG_LENGTH 128
-#define MAX_VAL_READ_LEN 100
-#define MAX_WORDS 3
+#define MAX_VAL_READ_LEN (16 * 1024)
+#define MAX_VALUE_LEN (1024UL * 1024 * 1024)
+#define MAX_WORDS 5
+#define MAX_BATCH_KEYS 256
+#define MAX_BATCH_WORDS (2 * MAX_BATCH_KEYS + 1)
 #define MAX_PATH_LEN 128
+#define MAX_EVENTS 64
+#define CONN_IN_BUF_LEN (16 * 1024)
+#define CONN_OUT_BUF_INIT_LEN 256
+#define CONN_OUT_HIGH_WATER (64 * 1024)
+#define CONN_OUT_LIMIT_MB 16
+#define CONN_IDLE_TIMEOUT_S 300
+#define CONN_READ_TIMEOUT_S 10
+#define CONN_TIMER_TICK_MS 100
+#define STREAM_CHUNK_LEN (64 * 1024)
 #define DB_FOLDER_PERM 0755
 #define FILES_PERM 0644
+#define KEY_LOCK_STRIPES 1024
+#define CACHE_SHARDS 64
+#define CACHE_DEFAULT_MB 64
+#define CACHE_AVG_ENTRY_LEN 64
+#define CACHE_MIN_SLOTS 64
+#define KEYSET_SHARDS 64
+#define KEYSET_MIN_SLOTS 1024
+#define DB_SCAN_BUF_LEN (1024 * 1024)
+#define DB_FANOUT_MAX 2
+#define DB_FANOUT_DIRS 256
+#define DB_NAME_LEN 256
+#define SNAPSHOT_BUF_LEN (1024 * 1024)
+#define REPL_BUF_LEN (64 * 1024 * 1024)
+#define REPL_INLINE_MAX (64 * 1024)
+#define REPL_CHUNK_LEN (256 * 1024)
+#define REPL_PING_MS 100
+#define REPL_RETRY_MS 1000
+#define REPL_MAX_FOLLOWERS 16
+#define TTL_SHARDS 64
+#define TTL_MIN_SLOTS 256
+#define TTL_TICK_MS 100
+#define TTL_WHEEL_BITS 6
+#define TTL_WHEEL_SLOTS (1 << TTL_WHEEL_BITS)
+#define TTL_WHEEL_LEVELS 4
+#define TTL_JOURNAL_MIN_REWRITE (16 * 1024 * 1024)
+#define IDX_MAX_LEVEL 24
+#define SCAN_DEFAULT_COUNT 100
+#define SCAN_MAX_COUNT 1000
+#define HOT_DEFAULT_TOP 32
+#define HOT_MAX_TOP 128
+#define HOT_INDEX_LEN (2 * HOT_MAX_TOP)
+#define HOT_DEPTH 4
+#define HOT_WIDTH 1024
+#define HOT_PERIOD_NS (5ULL * 1000000000ULL)
+#define HOT_SAMPLE 8
+#define HOTKEYS_DEFAULT_COUNT 10
+#define LOG_INDEX_SHARDS 256
+#define LOG_INDEX_MIN_SLOTS 1024
+#define LOG_MAX_SEGMENTS 1024
+#define LOG_SCAN_BUF_LEN (1024 * 1024)
+#define LOG_TOMBSTONE UINT32_MAX
+#define SYNC_REPORT_INTERVAL 10
+#define STATS_HIST_BUCKETS 160
+#define STATS_PROM_MIN_OCTAVE 10
+#define STATS_PROM_MAX_OCTAVE 33
+#define CONN_SEND_TRACK 32
+#define URING_ENTRIES 1024
+#define URING_SLOTS 1024
+#define URING_OP_MASK 7
+#define BIN_MAGIC_REQUEST 0x80
+#define BIN_MAGIC_RESPONSE 0x81
+#define TRACE_RING_SLOTS 1024
+#define TRACE_MSG_LEN 240
+#define TRACE_FLUSH_MS 10
+#define TRACE_BATCH_LEN (64 * 1024)
+// nivel mínimo que se compila: con -DTRACE_MIN_LEVEL=1 los mensajes de
+// depuración desaparecen del binario (ver traceLevel_t)
+#ifndef TRACE_MIN_LEVEL
+#define TRACE_MIN_LEVEL 0
+#endif
+#ifndef LOG_SEGMENT_MAX
+#define LOG_SEGMENT_MAX (64 * 1024 * 1024)
+#endif
+#ifndef LOG_MERGE_INTERVAL
+#define LOG_MERGE_INTERVAL 30
+#endif
+#ifndef LOG_MERGE_MIN_DEAD
+#define LOG_MERGE_MIN_DEAD (16 * 1024 * 1024)
+#endif
+
+/***************************** macros *********************************/
+/**
+ * @brief Registra un mensaje si su nivel alcanza el umbral
+ *
+ * Por debajo de TRACE_MIN_LEVEL la condición es constante y el compilador
+ * elimina la llamada entera (argumentos incluidos); por debajo del nivel de
+ * -l el costo es una comparación.
+ */
+#define TRACE(level, ...)                                                   \
+    do {                                                                    \
+        if ((level) >= TRACE_MIN_LEVEL && (level) >= config.traceLevel)    \
+            traceWrite((level), __VA_ARGS__);                               \
+    } while (0)
+#define TRACE_DEBUG(...) TRACE(TRACE_LEVEL_DEBUG, __VA_ARGS__)
+#define TRACE_INFO(...) TRACE(TRACE_LEVEL_INFO, __VA_ARGS__)
+#define TRACE_WARN(...) TRACE(TRACE_LEVEL_WARN, __VA_ARGS__)
+#define TRACE_ERROR(...) TRACE(TRACE_LEVEL_ERROR, __VA_ARGS__)
+
+/***************************** tipos *********************************/
+/**
+ * @brief Niveles de los mensajes del servidor (-l)
+ *
+ * Los valores son los de TRACE_MIN_LEVEL.
+ */
+typedef enum {
+    TRACE_LEVEL_DEBUG = 0,  /**< Cada conexión, pedido y envío */
+    TRACE_LEVEL_INFO = 1,   /**< Arranque, compactaciones e informes periódicos */
+    TRACE_LEVEL_WARN = 2,   /**< Problemas de los que el servidor se recupera (van a stderr) */
+    TRACE_LEVEL_ERROR = 3,  /**< Errores (van a stderr) */
+    TRACE_LEVEL_OFF = 4,    /**< Sin mensajes */
+} traceLevel_t;
+
+/**
+ * @brief Mensaje ya formateado, esperando que lo escriba el hilo de registro
+ */
+typedef struct {
+    uint8_t level;              /**< traceLevel_t del mensaje */
+    uint8_t len;                /**< Largo del texto */
+    char text[TRACE_MSG_LEN];   /**< Texto, con el salto de línea */
+} traceRecord_t;
+
+/**
+ * @brief Cola de mensajes de un hilo
+ *
+ * Un solo productor (el hilo dueño) y un solo consumidor (quien tenga
+ * traceFlushLock): tail lo avanza el productor y head el consumidor, sin
+ * locks. Si se llena, el mensaje se descarta y se cuenta en dropped: el
+ * registro nunca frena la atención de clientes.
+ */
+typedef struct traceRing {
+    traceRecord_t slots[TRACE_RING_SLOTS]; /**< Mensajes (posición % TRACE_RING_SLOTS) */
+    size_t head;                /**< Próximo mensaje a escribir */
+    size_t tail;                /**< Próxima posición libre */
+    uint64_t dropped;           /**< Mensajes descartados por cola llena */
+    struct traceRing* next;     /**< Siguiente cola registrada */
+} traceRing_t;
+
+/**
+ * @brief Modo de durabilidad de las escrituras (-d)
+ */
+typedef enum {
+    DURABILITY_NONE,        /**< Sin fsync: lo decide el sistema operativo */
+    DURABILITY_EVERYSEC,    /**< Un fsync por segundo en segundo plano */
+    DURABILITY_ALWAYS,      /**< Se responde OK recién cuando la escritura es durable */
+} dbDurability_t;
+
+/**
+ * @brief Mecanismo de E/S de los hilos de atención (-e)
+ */
+typedef enum {
+    ENGINE_EPOLL,   /**< Aviso de disponibilidad con epoll y llamadas no bloqueantes */
+    ENGINE_URING,   /**< Lecturas, envíos y accept() enviados por lotes con io_uring */
+} serverEngine_t;
+
+/**
+ * @brief Operación de io_uring en vuelo, va en los bits bajos de user_data
+ *
+ * El resto de user_data es el puntero a la conexión (o al socket de
+ * escucha para URING_OP_ACCEPT, o al hilo para URING_OP_SYNC).
+ */
+typedef enum {
+    URING_OP_RECV,      /**< Lectura del socket en el buffer de entrada */
+    URING_OP_SEND,      /**< Envío de una porción del buffer de salida */
+    URING_OP_POLLOUT,   /**< Espera lugar en el socket para seguir con sendfile() */
+    URING_OP_ACCEPT,    /**< accept() de un socket de escucha del hilo */
+    URING_OP_SYNC,      /**< Lectura del eventfd del hilo de fsync */
+    URING_OP_TIMER,     /**< Espera para revisar los plazos de las conexiones */
+} serverUringOp_t;
+
+/**
+ * @brief Anillos de io_uring de un hilo de atención
+ *
+ * Los anillos se comparten con el kernel por mmap(): el hilo agrega pedidos
+ * al final de la cola de envío (SQ) y consume terminaciones del principio
+ * de la de terminación (CQ).
+ */
+typedef struct {
+    int fd;                     /**< Descriptor de io_uring (0 = no se usa) */
+    unsigned* sqHead;           /**< Principio de la SQ (lo avanza el kernel) */
+    unsigned* sqTail;           /**< Final de la SQ publicado al kernel */
+    unsigned sqMask;            /**< Máscara de posiciones de la SQ */
+    unsigned sqEntries;         /**< Lugares de la SQ */
+    unsigned* sqArray;          /**< Índices de los SQE en la SQ */
+    struct io_uring_sqe* sqes;  /**< Pedidos */
+    unsigned sqLocalTail;       /**< Final de la SQ con los pedidos todavía no publicados */
+    unsigned* cqHead;           /**< Principio de la CQ (lo avanza el hilo) */
+    unsigned* cqTail;           /**< Final de la CQ (lo avanza el kernel) */
+    unsigned cqMask;            /**< Máscara de posiciones de la CQ */
+    struct io_uring_cqe* cqes;  /**< Terminaciones */
+    int fixedFiles;             /**< Hay tabla registrada de sockets */
+    int fixedBuffers;           /**< Hay tabla registrada de buffers de entrada */
+    int freeSlots[URING_SLOTS]; /**< Lugares libres de las tablas registradas */
+    int freeCount;              /**< Cantidad de lugares libres */
+    int acceptMultishot;        /**< Un solo pedido de accept() da todas las conexiones */
+    uint64_t syncCount;         /**< Destino de la lectura del eventfd del hilo de fsync */
+    struct __kernel_timespec timerTs; /**< Espera del pedido URING_OP_TIMER */
+    int timerArmed;             /**< Hay un pedido URING_OP_TIMER en vuelo */
+} serverUring_t;
+
+/**
+ * @brief Protocolo de una conexión, se decide con el primer byte recibido
+ */
+typedef enum {
+    PROTO_UNKNOWN,      /**< Todavía no llegó nada */
+    PROTO_TEXT,         /**< Comandos ASCII terminados en '\n' */
+    PROTO_BINARY,       /**< Tramas con encabezado fijo (primer byte BIN_MAGIC_REQUEST) */
+} serverProto_t;
+
+/**
+ * @brief Operaciones del protocolo binario
+ */
+typedef enum {
+    BIN_OP_GET = 0x00,
+    BIN_OP_SET = 0x01,
+    BIN_OP_DEL = 0x04,
+} serverBinOpcode_t;
+
+/**
+ * @brief Estado de una respuesta del protocolo binario
+ */
+typedef enum {
+    BIN_STATUS_OK = 0,
+    BIN_STATUS_NOTFOUND = 1,
+    BIN_STATUS_ERROR = 2,      /**< El valor de la respuesta es el mensaje de error */
+} serverBinStatus_t;
+
+/**
+ * @brief Encabezado de una trama del protocolo binario (campos en orden de red)
+ *
+ * Un pedido es: encabezado + clave + valor. La respuesta lleva el mismo
+ * opcode y opaque que el pedido, el estado en lugar del largo de clave, y
+ * el valor a continuación. Como el cliente identifica cada respuesta por
+ * su opaque, no tienen por qué llegar en el orden de los pedidos.
+ */
+typedef struct __attribute__((packed)) {
+    uint8_t magic;      /**< BIN_MAGIC_REQUEST o BIN_MAGIC_RESPONSE */
+    uint8_t opcode;     /**< Operación (serverBinOpcode_t) */
+    uint16_t keyLen;    /**< Pedido: largo de la clave. Respuesta: estado (serverBinStatus_t) */
+    uint32_t valLen;    /**< Largo del valor que sigue */
+    uint32_t opaque;    /**< Identificador del pedido, se devuelve tal cual */
+} serverBinHeader_t;
+
+/**
+ * @brief Respuesta binaria que espera a que su escritura sea durable
+ */
+typedef struct {
+    uint64_t ticket;        /**< Escritura a esperar (ver dbSyncTicket()) */
+    serverBinHeader_t h;    /**< Respuesta a enviar entonces */
+} serverBinAck_t;
+
+/**
+ * @brief Tipos de comando que se cuentan por separado en las estadísticas
+ */
+typedef enum {
+    STAT_GET,       /**< GET, GETL y GET binario */
+    STAT_SET,       /**< SET y SET binario */
+    STAT_SETL,      /**< SETL y SET binario recibido por partes */
+    STAT_DEL,
+    STAT_MGET,
+    STAT_MSET,
+    STAT_MDEL,
+    STAT_STATS,
+    STAT_SNAPSHOT,
+    STAT_TTL,
+    STAT_PERSIST,
+    STAT_SCAN,
+    STAT_RANGE,
+    STAT_INCR,
+    STAT_APPEND,
+    STAT_CAS,
+    STAT_HOTKEYS,
+    STAT_INVALID,   /**< Comandos que no se pudieron interpretar */
+    STAT_CMDS,
+} serverStatCmd_t;
+
+/**
+ * @brief Fases en las que se mide la latencia de un pedido
+ */
+typedef enum {
+    PHASE_PARSE,    /**< Desde que el comando está completo hasta elegir el manejador */
+    PHASE_STORAGE,  /**< Ejecución del manejador (para SETL incluye recibir el cuerpo) */
+    PHASE_SEND,     /**< Desde que la respuesta está lista hasta que sale su último byte */
+    PHASES,
+} serverStatPhase_t;
+
+/**
+ * @brief Histograma de latencias
+ *
+ * Log-lineal: cada potencia de 2 de nanosegundos se divide en 4 partes,
+ * así un percentil tiene como mucho un 25% de error sin importar la escala.
+ */
+typedef struct {
+    uint64_t count;     /**< Muestras */
+    uint64_t sumNs;     /**< Suma de las muestras */
+    uint64_t buckets[STATS_HIST_BUCKETS]; /**< Muestras por intervalo (ver serverHistIndex()) */
+} serverHist_t;
+
+/**
+ * @brief Contadores de un tipo de comando
+ */
+typedef struct {
+    uint64_t requests;  /**< Pedidos atendidos */
+    uint64_t hits;      /**< Claves encontradas (GET, MGET, DEL) */
+    uint64_t misses;    /**< Claves no encontradas (NOTFOUND) */
+    uint64_t bytesIn;   /**< Bytes recibidos (comando y valor) */
+    uint64_t bytesOut;  /**< Bytes de respuesta */
+    serverHist_t lat[PHASES]; /**< Latencia por fase */
+} serverCmdStats_t;
+
+/**
+ * @brief Estadísticas de un hilo de atención
+ *
+ * Las escribe solo su hilo, sin locks ni atómicos; STATS y /metrics suman
+ * las de todos los hilos al leerlas.
+ */
+typedef struct {
+    serverCmdStats_t cmd[STAT_CMDS]; /**< Por tipo de comando */
+    uint64_t connsOpened;   /**< Conexiones aceptadas */
+    uint64_t connsClosed;   /**< Conexiones cerradas */
+    uint64_t connsRejected; /**< Conexiones rechazadas con BUSY (límite o sin descriptores) */
+    uint64_t connsTimedOut; /**< Conexiones cerradas por vencer un plazo */
+    uint64_t connsDropped;  /**< Conexiones cerradas por pasarse del límite de salida o quedarse sin memoria */
+} serverStats_t;
+
+/**
+ * @brief Respuesta cuya salida se está midiendo (fase de envío)
+ */
+typedef struct {
+    size_t end;         /**< Posición de out donde termina la respuesta */
+    uint64_t t;         /**< Momento en que quedó lista (ns) */
+    serverStatCmd_t cmd; /**< Comando al que corresponde */
+} serverSendTrack_t;
+
+/**
+ * @brief Porción de un buffer: puntero y largo, sin terminador
+ *
+ * Los tokens de un comando se devuelven así, apuntando al buffer de
+ * entrada de la conexión, sin copiarlos ni escribir '\0' en él.
+ */
+typedef struct {
+    const char* ptr;    /**< Comienzo */
+    size_t len;         /**< Largo */
+} utilsSlice_t;
+
+/**
+ * @brief Valor que se está recibiendo por partes (SETL)
+ *
+ * El cuerpo se escribe en un archivo temporal a medida que llega; recién
+ * cuando está completo se le pasa al motor con dbStreamCommit().
+ */
+typedef struct {
+    int fd;                     /**< Archivo temporal (-1 = ninguno) */
+    char path[MAX_PATH_LEN];    /**< Ruta del temporal */
+    size_t len;                 /**< Largo total del valor */
+    uint32_t crc;               /**< CRC32 de lo recibido (si el motor lo pide) */
+} dbStream_t;
+
+/**
+ * @brief Ubicación de un valor en disco, para enviarlo sin copiarlo
+ */
+typedef struct {
+    int fd;             /**< Descriptor propio (lo cierra quien lo pidió) */
+    off_t off;          /**< Posición del valor dentro del archivo */
+    size_t len;         /**< Largo del valor */
+} dbValueRef_t;
+
+/**
+ * @brief Plazo que está corriendo para una conexión
+ *
+ * Cada tipo tiene un único plazo para todas las conexiones, así que cada
+ * hilo las mantiene en una lista por tipo ordenada por el momento en que
+ * empezó a correr: agregar, mover y vencer son O(1) mirando solo la cabeza.
+ */
+typedef enum {
+    CONN_TIMER_NONE,    /**< Sin plazo (esperando un fsync del servidor) */
+    CONN_TIMER_IDLE,    /**< Sin nada en curso: plazo de inactividad (-I) */
+    CONN_TIMER_READ,    /**< Pedido a medias o respuesta sin leer: plazo de lectura (-T) */
+    CONN_TIMERS,
+} serverConnTimer_t;
+
+/**
+ * @brief Estado de una conexión de cliente
+ *
+ * Cada conexión mantiene su propio buffer de entrada (para comandos que
+ * llegan partidos o varios juntos) y de salida (para respuestas que no
+ * se pudieron escribir enteras porque el socket es no bloqueante).
+ */
+typedef struct serverConn {
+    int fd;                     /**< Socket del cliente */
+    struct serverWorker* worker; /**< Hilo que atiende la conexión */
+    char in[CONN_IN_BUF_LEN];   /**< Bytes recibidos pendientes de procesar */
+    size_t inOff;               /**< Comienzo de lo que falta procesar en in */
+    size_t inScan;              /**< Hasta dónde ya se buscó el '\n' del comando pendiente */
+    size_t inLen;               /**< Bytes válidos en in */
+    char* out;                  /**< Respuestas pendientes de enviar */
+    size_t outLen;              /**< Bytes válidos en out */
+    size_t outOff;              /**< Bytes de out ya enviados */
+    size_t outCap;              /**< Capacidad reservada de out */
+    int readReady;              /**< Puede quedar algo por leer (epoll no vuelve a avisar) */
+    int peerClosed;             /**< El cliente cerró su extremo de escritura */
+    int closeAfterFlush;        /**< Cerrar en cuanto se vacíe out (modo one-shot) */
+    uint64_t syncTicket;        /**< Escritura que tiene que ser durable antes de seguir enviando (0 = ninguna) */
+    size_t syncOff;             /**< Hasta dónde de out se puede enviar mientras tanto */
+    struct serverConn* waitPrev; /**< Lista de conexiones esperando un fsync */
+    struct serverConn* waitNext;
+    int waiting;                /**< Está en la lista de espera de su hilo */
+    int sendFd;                 /**< Valor a enviar con sendfile() al llegar a out[sendAt] (-1 = ninguno) */
+    size_t sendAt;              /**< Posición de out donde va el valor */
+    off_t sendOff;              /**< Próximo byte del valor a enviar */
+    size_t sendLeft;            /**< Bytes del valor que faltan enviar */
+    size_t bodyLeft;            /**< Bytes del cuerpo del SETL en curso que faltan recibir */
+    int bodyDiscard;            /**< El cuerpo se descarta (SETL rechazado) */
+    char bodyKey[MAX_MSG_LENGTH]; /**< Clave del SETL en curso */
+    dbStream_t body;            /**< Destino del cuerpo del SETL en curso */
+    serverProto_t proto;        /**< Protocolo de la conexión */
+    uint8_t binOpcode;          /**< Opcode del pedido binario en curso */
+    uint32_t binOpaque;         /**< Opaque del pedido binario en curso (orden de red) */
+    uint64_t binTicket;         /**< Escritura no durable del pedido binario en curso (0 = ninguna) */
+    serverBinAck_t* acks;       /**< Respuestas binarias esperando un fsync, en orden de ticket */
+    size_t ackHead;             /**< Primera respuesta pendiente en acks */
+    size_t ackCount;            /**< Respuestas pendientes */
+    size_t ackCap;              /**< Capacidad reservada de acks */
+    uint64_t bytesOut;          /**< Bytes de respuesta encolados o enviados en total */
+    serverStatCmd_t statCmd;    /**< Comando en curso, para las estadísticas */
+    int statPending;            /**< Hay un comando en curso sin anotar */
+    uint64_t statStart;         /**< Momento en que empezó a procesarse (ns) */
+    uint64_t statParsed;        /**< Momento en que se eligió el manejador (ns, 0 = todavía no) */
+    size_t statIn;              /**< Bytes recibidos del comando en curso */
+    uint64_t statOut;           /**< bytesOut al empezar el comando en curso */
+    serverSendTrack_t track[CONN_SEND_TRACK]; /**< Respuestas esperando salir, para medir el envío */
+    size_t trackHead;           /**< Primera respuesta en track */
+    size_t trackCount;          /**< Respuestas en track */
+    int closing;                /**< Cerrada, esperando que terminen sus operaciones de io_uring */
+    int uringRecv;              /**< Hay una lectura de io_uring en vuelo (escribe en in + inLen) */
+    int uringSend;              /**< Hay un envío (o espera de lugar) de io_uring en vuelo */
+    char* uringSendBuf;         /**< Buffer de salida del envío en vuelo (no se puede mover ni liberar) */
+    int uringSlot;              /**< Lugar en las tablas registradas de io_uring (-1 = ninguno) */
+    int uringFixedFile;         /**< El socket está en la tabla de archivos registrados */
+    int uringFixedBuffer;       /**< in está en la tabla de buffers registrados */
+    int broken;                 /**< Se pasó del límite de salida o faltó memoria: se cierra sin responder más */
+    serverConnTimer_t timer;    /**< Lista de plazos en la que está */
+    uint64_t timerAt;           /**< Momento en que empezó a correr su plazo (ns) */
+    int timerProgress;          /**< Completó un pedido, recibió cuerpo o envió algo desde la última revisión */
+    struct serverConn* timerPrev; /**< Lista de plazos de su hilo */
+    struct serverConn* timerNext;
+} serverConn_t;
+
+/**
+ * @brief Tipo de dirección en la que escucha el servidor
+ */
+typedef enum {
+    LISTEN_TCP,         /**< host:puerto, un socket por hilo con SO_REUSEPORT */
+    LISTEN_UNIX,        /**< Socket Unix con ruta en el sistema de archivos */
+    LISTEN_ABSTRACT,    /**< Socket Unix en el espacio de nombres abstracto de Linux (sin archivo) */
+} serverListenKind_t;
+
+/**
+ * @brief Dirección en la que escucha el servidor (-L)
+ */
+typedef struct {
+    serverListenKind_t kind;    /**< Tipo de dirección */
+    char addr[sizeof(((struct sockaddr_un*)0)->sun_path)]; /**< Host (TCP), ruta (unix) o nombre (abstracto) */
+    int port;                   /**< Puerto (solo TCP) */
+    int fd;                     /**< Socket compartido por todos los hilos (unix y abstracto) */
+} serverListener_t;
+
+/**
+ * @brief Configuración del servidor obtenida de la línea de comandos
+ */
+typedef struct {
+    int port;       /**< Puerto TCP de escucha si no se indica ninguna dirección con -L */
+    int oneShot;    /**< 1: cerrar la conexión tras cada respuesta (comportamiento original) */
+    int workers;    /**< Cantidad de hilos, cada uno con su socket de escucha y su epoll */
+    int backlog;    /**< Largo de la cola de conexiones pendientes de listen() */
+    size_t cacheMB; /**< Memoria para la cache de valores en MB (0 la desactiva) */
+    const char* storage; /**< Motor de almacenamiento: "file" o "log" */
+    dbDurability_t durability; /**< Cuándo se hace fsync de las escrituras */
+    int metricsPort;    /**< Puerto del endpoint de métricas para Prometheus (0 = desactivado) */
+    traceLevel_t traceLevel; /**< Nivel mínimo de los mensajes que se registran */
+    serverEngine_t engine; /**< Mecanismo de E/S de los hilos de atención */
+    int fanout;         /**< Niveles de subcarpetas del motor "file" (0 = carpeta plana) */
+    const char* restore; /**< Volcado de SNAPSHOT a cargar al arrancar (NULL = ninguno) */
+    int replPort;       /**< Puerto para las réplicas (0 = no acepta réplicas) */
+    const char* replLeader; /**< Líder a replicar, "host:puerto" (NULL = no es réplica) */
+    serverListener_t listeners[SERVER_MAX_LISTENERS]; /**< Direcciones de escucha de los clientes */
+    int listenerCount;  /**< Direcciones en listeners */
+    int hotTop;         /**< Claves por lista de HOTKEYS que sigue cada hilo (0 = sin seguimiento) */
+    int maxConns;       /**< Conexiones abiertas como máximo entre todos los hilos (0 = sin límite) */
+    int idleTimeout;    /**< Segundos sin actividad antes de cerrar una conexión (0 = sin plazo) */
+    int readTimeout;    /**< Segundos para completar un pedido o leer la respuesta (0 = sin plazo) */
+    size_t outLimitMB;  /**< Respuestas pendientes de enviar por conexión, en MB (0 = sin límite) */
+} serverConfig_t;
+
+/**
+ * @brief Socket de escucha de un hilo, el que aparece en los eventos de accept()
+ */
+typedef struct {
+    struct serverWorker* worker; /**< Hilo que lo atiende */
+    int fd;                      /**< Socket (propio en TCP, compartido en unix y abstracto) */
+} serverListenSoc_t;
+
+/**
+ * @brief Hilo de atención
+ *
+ * Cada hilo tiene su propio socket de escucha TCP por dirección
+ * (SO_REUSEPORT, el kernel reparte las conexiones entre ellos) y su propio
+ * bucle de eventos, así que no comparten nada en el camino de red. Los
+ * sockets Unix no admiten SO_REUSEPORT: todos los hilos esperan en el
+ * mismo y el kernel despierta a uno solo por conexión (EPOLLEXCLUSIVE).
+ */
+typedef struct serverWorker {
+    int id;             /**< Número de hilo */
+    pthread_t thread;   /**< Identificador del hilo */
+    serverListenSoc_t listen[SERVER_MAX_LISTENERS]; /**< Sockets de escucha, uno por dirección de config */
+    int epollFd;        /**< Descriptor de epoll propio */
+    int syncFd;         /**< eventfd por el que el hilo de fsync avisa que avanzó */
+    serverConn_t* waitList; /**< Conexiones con respuestas esperando un fsync */
+    char* scratch;      /**< Memoria de trabajo para armar las respuestas de MGET */
+    size_t scratchCap;  /**< Capacidad reservada de scratch */
+    serverStats_t* stats; /**< Estadísticas del hilo */
+    struct hotTracker* hot; /**< Claves más pedidas por el hilo, para HOTKEYS */
+    serverUring_t uring; /**< Anillos de io_uring (con -e uring) */
+    int spareFd;        /**< Descriptor de reserva para rechazar conexiones sin descriptores libres */
+    uint64_t now;       /**< Momento de la última vuelta del bucle de eventos (ns) */
+    serverConn_t* timerHead[CONN_TIMERS]; /**< Listas de plazos, la cabeza es la que vence primero */
+    serverConn_t* timerTail[CONN_TIMERS];
+} serverWorker_t;
+
+/**
+ * @brief Entrada de la cache de valores
+ */
+typedef struct {
+    uint64_t hash;      /**< Hash de la clave (0 = slot libre) */
+    char* key;          /**< Clave (memoria propia) */
+    char* value;        /**< Valor (memoria propia) */
+    size_t valLen;      /**< Largo del valor */
+    int ref;            /**< Bit de referencia del algoritmo CLOCK */
+} cacheEntry_t;
+
+/**
+ * @brief Porción de la cache con su propio lock
+ *
+ * Tabla hash de direccionamiento abierto (sondeo lineal) con borrado por
+ * corrimiento hacia atrás, así no quedan lápidas. Cuando se pasa del
+ * presupuesto de memoria o de la carga máxima se desaloja con CLOCK.
+ */
+typedef struct {
+    pthread_mutex_t lock;   /**< Protege toda la porción */
+    cacheEntry_t* slots;    /**< Tabla de entradas */
+    size_t mask;            /**< Cantidad de slots - 1 (potencia de 2) */
+    size_t used;            /**< Slots ocupados */
+    size_t bytes;           /**< Memoria usada por claves y valores */
+    size_t budget;          /**< Memoria máxima para claves y valores */
+    size_t hand;            /**< Aguja del CLOCK */
+} cacheShard_t;
+
+/**
+ * @brief Función llamada por cada clave al recorrer el motor de almacenamiento
+ */
+typedef void (*dbKeyFn)(const char* key, void* arg);
+
+/**
+ * @brief Motor de almacenamiento detrás de las funciones db*
+ *
+ * Las funciones db* delegan en el motor elegido al arrancar. Se llaman
+ * siempre con el lock de la clave tomado (ver dbLockKey()).
+ */
+typedef struct {
+    const char* name;   /**< Nombre para -s */
+    void (*init)(void); /**< Prepara el almacenamiento al arrancar */
+    int (*createKey)(const char* key, const char* value, size_t valLen);   /**< Ver dbCreateKey() */
+    int (*openValue)(const char* key, dbValueRef_t* ref);                   /**< Ver dbOpenValue() */
+    int (*deleteValue)(const char* key);                                    /**< Ver dbDeleteValue() */
+    int (*commitStream)(const char* key, dbStream_t* stream);               /**< Ver dbStreamCommit() */
+    void (*sync)(void); /**< Hace durables todas las escrituras terminadas */
+    void (*forEachKey)(dbKeyFn fn, void* arg); /**< Llama a fn por cada clave existente, sin locks de claves */
+    void (*restore)(int fd, uint64_t size);    /**< Carga un volcado de SNAPSHOT en la base vacía */
+    int streamCrc;      /**< 1 si el motor necesita el CRC32 de los valores recibidos por partes */
+} dbBackend_t;
+
+/**
+ * @brief Estadísticas de los fsync agrupados
+ */
+typedef struct {
+    uint64_t batches;   /**< Cantidad de fsync hechos */
+    uint64_t writes;    /**< Escrituras cubiertas por esos fsync */
+    uint64_t maxBatch;  /**< Mayor cantidad de escrituras cubiertas por un fsync */
+    uint64_t totalNs;   /**< Tiempo total en fsync */
+    uint64_t maxNs;     /**< fsync más lento */
+} dbSyncStats_t;
+
+/**
+ * @brief Encabezado de un registro del log
+ *
+ * En disco cada registro es: encabezado + clave + valor. Un DEL se guarda
+ * como lápida (valLen == LOG_TOMBSTONE, sin valor). El número de secuencia
+ * ordena los registros aunque estén en segmentos distintos.
+ */
+typedef struct __attribute__((packed)) {
+    uint32_t crc;       /**< CRC32 del resto del encabezado, la clave y el valor */
+    uint64_t seq;       /**< Número de secuencia global */
+    uint32_t keyLen;    /**< Largo de la clave */
+    uint32_t valLen;    /**< Largo del valor, LOG_TOMBSTONE si es un borrado */
+} logRecordHeader_t;
+
+/**
+ * @brief Entrada de un archivo de pistas (hint)
+ *
+ * Resume un segmento compactado: con la posición de cada valor alcanza para
+ * reconstruir el índice sin leer los valores. Va seguida de la clave.
+ */
+typedef struct __attribute__((packed)) {
+    uint64_t seq;       /**< Número de secuencia del registro */
+    uint64_t valOff;    /**< Posición del valor dentro del segmento */
+    uint32_t keyLen;    /**< Largo de la clave */
+    uint32_t valLen;    /**< Largo del valor */
+} logHintHeader_t;
+
+/**
+ * @brief Entrada del conjunto de claves del motor "file"
+ *
+ * Guarda solo el hash: dos claves con el mismo hash comparten la entrada
+ * y se cuentan, así borrar una no hace desaparecer a la otra.
+ */
+typedef struct {
+    uint64_t hash;      /**< Hash de la clave (0 = slot libre) */
+    uint32_t count;     /**< Claves existentes con este hash */
+} dbKeySetEntry_t;
+
+/**
+ * @brief Porción del conjunto de claves con su propio lock
+ */
+typedef struct {
+    pthread_mutex_t lock;   /**< Protege toda la porción */
+    dbKeySetEntry_t* slots; /**< Tabla de entradas (sondeo lineal) */
+    size_t mask;            /**< Cantidad de slots - 1 (potencia de 2) */
+    size_t used;            /**< Slots ocupados */
+} dbKeySetShard_t;
+
+/**
+ * @brief Ubicación del archivo de una clave en el motor "file"
+ */
+typedef struct {
+    int dirFd;              /**< Carpeta abierta a la que es relativo name */
+    char name[DB_NAME_LEN]; /**< Ruta relativa: subcarpetas que falten y nombre codificado */
+} dbFilePath_t;
+
+/**
+ * @brief Estado del SNAPSHOT en curso
+ *
+ * El volcado tiene el formato de un segmento del motor "log": registros
+ * logRecordHeader_t + clave + valor, uno por clave. Detrás del de una clave
+ * con vencimiento va uno como los del diario de vencimientos (seq 0 y el
+ * vencimiento como valor), que los motores no cargan como valor.
+ */
+typedef struct {
+    int running;            /**< 1 desde el inicio hasta que el volcado queda en dest */
+    int active;             /**< 1 mientras las escrituras tienen que guardar el valor anterior */
+    dbKeySetShard_t touched[KEYSET_SHARDS]; /**< Claves ya volcadas o escritas desde el inicio */
+    pthread_mutex_t lock;   /**< Protege el archivo de salida */
+    int fd;                 /**< Temporal del volcado */
+    char path[MAX_PATH_LEN]; /**< Ruta del temporal */
+    char dest[MAX_PATH_LEN]; /**< Ruta final del volcado */
+    uint64_t replOffset;    /**< Posición del flujo de replicación en el momento del volcado */
+    char* buf;              /**< Registros todavía sin escribir */
+    size_t len;             /**< Bytes ocupados de buf */
+    uint64_t off;           /**< Bytes ya escritos en el archivo */
+    uint64_t keys;          /**< Registros volcados */
+    uint64_t start;         /**< Inicio, para el informe */
+} dbSnapshot_t;
+
+/**
+ * @brief Tipos de registro del flujo de replicación
+ */
+typedef enum {
+    REPL_SET,       /**< Clave y valor */
+    REPL_DEL,       /**< Solo la clave */
+    REPL_REF,       /**< Solo en el anillo: valor grande, se lee de la base al enviarlo (sale como SET o DEL) */
+    REPL_PING,      /**< Sin clave: fin actual del flujo en el líder */
+    REPL_FULLSYNC,  /**< Clave = id de la corrida del líder; le sigue un volcado de valLen bytes */
+    REPL_CONTINUE,  /**< Clave = id de la corrida del líder; el flujo sigue desde offset */
+    REPL_EXPIRE,    /**< Solo la clave; valLen = vencimiento (ms desde 1970), 0 si se quitó */
+} replType_t;
+
+/**
+ * @brief Encabezado de un registro del flujo de replicación
+ *
+ * En el anillo del líder y en el socket cada registro es: encabezado +
+ * clave + valor. Los números van en el orden del host (líder y réplica
+ * corren en la misma máquina).
+ */
+typedef struct __attribute__((packed)) {
+    uint8_t type;       /**< replType_t */
+    uint32_t keyLen;    /**< Largo de la clave */
+    uint64_t valLen;    /**< Largo del valor (del volcado en REPL_FULLSYNC, vencimiento en REPL_EXPIRE) */
+    uint64_t offset;    /**< Posición del flujo al final del registro (en bytes del anillo) */
+    uint64_t timeNs;    /**< Momento de la escritura en el líder (CLOCK_REALTIME) */
+} replHeader_t;
+
+/**
+ * @brief Réplica conectada al líder
+ */
+typedef struct {
+    int used;           /**< Slot ocupado */
+    int fd;             /**< Socket de la réplica */
+    char addr[32];      /**< Dirección, para las estadísticas */
+    uint64_t sent;      /**< Posición del flujo hasta donde se envió */
+    uint64_t acked;     /**< Posición del flujo que la réplica confirmó aplicada */
+    uint64_t behindNs;  /**< Desde cuándo la réplica no está al día (0 = al día) */
+} replFollower_t;
+
+/**
+ * @brief Estado del líder: anillo con las últimas escrituras y réplicas conectadas
+ *
+ * Las posiciones del flujo crecen siempre; la posición p está en
+ * buf[p % REPL_BUF_LEN] mientras end - p <= REPL_BUF_LEN.
+ */
+typedef struct {
+    char* buf;              /**< Anillo de registros (NULL = no acepta réplicas) */
+    uint64_t end;           /**< Posición del flujo después del último registro */
+    char runId[17];         /**< Id de esta corrida en hexadecimal: las posiciones valen solo dentro de ella */
+    pthread_mutex_t lock;   /**< Protege el anillo y las réplicas */
+    pthread_cond_t cond;    /**< Avisa que hay registros nuevos */
+    replFollower_t followers[REPL_MAX_FOLLOWERS]; /**< Réplicas conectadas */
+} replLog_t;
+
+/**
+ * @brief Estado de la réplica (con -F)
+ */
+typedef struct {
+    int fd;                 /**< Socket al líder (-1 = desconectada) */
+    char runId[17];         /**< Corrida del líder de la que viene lo aplicado ("-" = ninguna) */
+    uint64_t applied;       /**< Posición del flujo aplicada */
+    uint64_t acked;         /**< Última posición confirmada al líder */
+    uint64_t leaderEnd;     /**< Fin del flujo en el líder, según el último registro recibido */
+    uint64_t nextTimeNs;    /**< Momento en el líder del último registro recibido */
+    uint64_t fullSyncs;     /**< Sincronizaciones completas hechas */
+    char host[MAX_PATH_LEN]; /**< Host del líder */
+    char port[8];           /**< Puerto del líder */
+    char* buf;              /**< Lo recibido del líder sin procesar */
+    size_t len;             /**< Bytes válidos en buf */
+    size_t off;             /**< Bytes de buf ya procesados */
+    char* value;            /**< Valor en curso (o bloque de uno grande) */
+    dbKeySetShard_t dumpKeys[KEYSET_SHARDS]; /**< Claves del volcado de una sincronización completa */
+} replReplica_t;
+
+/**
+ * @brief Vencimiento de una clave
+ *
+ * Está a la vez en la tabla de su porción (para buscarla por clave) y en
+ * una lista de la rueda de tiempos (para encontrarla cuando vence).
+ */
+typedef struct ttlEntry {
+    uint64_t hash;              /**< Hash de la clave */
+    char* key;                  /**< Clave (memoria propia) */
+    uint64_t expireMs;          /**< Momento en que vence (ms desde 1970) */
+    struct ttlEntry* prev;      /**< Lista de su casillero de la rueda */
+    struct ttlEntry* next;
+    struct ttlEntry** head;     /**< Casillero de la rueda donde está (NULL = ninguno) */
+} ttlEntry_t;
+
+/**
+ * @brief Porción de los vencimientos con su propio lock
+ *
+ * La rueda es jerárquica: TTL_WHEEL_LEVELS niveles de TTL_WHEEL_SLOTS
+ * casilleros; un casillero del nivel n abarca TTL_WHEEL_SLOTS^n ticks de
+ * TTL_TICK_MS. Cada tick se vencen las entradas de un casillero del nivel
+ * 0 y, cada TTL_WHEEL_SLOTS^n ticks, las de un casillero del nivel n se
+ * reparten en los niveles de abajo: el costo por tick no depende de
+ * cuántas claves tienen vencimiento.
+ */
+typedef struct {
+    pthread_mutex_t lock;   /**< Protege toda la porción */
+    ttlEntry_t** slots;     /**< Tabla de entradas por clave (sondeo lineal, NULL = libre) */
+    size_t mask;            /**< Cantidad de slots - 1 (potencia de 2) */
+    size_t used;            /**< Slots ocupados */
+    uint64_t tick;          /**< Último tick procesado de la rueda */
+    ttlEntry_t* wheel[TTL_WHEEL_LEVELS][TTL_WHEEL_SLOTS]; /**< Casilleros de la rueda */
+} ttlShard_t;
+
+/**
+ * @brief Nodo de la lista con saltos del índice ordenado
+ *
+ * La clave va en la misma reserva, a continuación de los punteros.
+ */
+typedef struct idxNode {
+    const char* key;            /**< Clave */
+    int height;                 /**< Cantidad de niveles del nodo */
+    struct idxNode* next[];     /**< Siguiente nodo en cada nivel */
+} idxNode_t;
+
+/**
+ * @brief Índice ordenado de todas las claves (lista con saltos)
+ *
+ * Solo cambia cuando se crea o se borra una clave: sobrescribir un valor
+ * no lo toca.
+ */
+typedef struct {
+    pthread_rwlock_t lock;  /**< Escritura para agregar y quitar, lectura para recorrer */
+    idxNode_t* head;        /**< Nodo inicial sin clave, de IDX_MAX_LEVEL niveles */
+    int height;             /**< Niveles en uso */
+    uint64_t count;         /**< Claves en el índice */
+    uint64_t rng;           /**< Estado del generador de alturas (con el lock de escritura) */
+} idxIndex_t;
+
+/**
+ * @brief Función a la que se le pasa cada clave recorrida del índice
+ */
+typedef void (*idxKeyFn)(const char* key, void* arg);
+
+/**
+ * @brief Listas de claves que sigue cada hilo para HOTKEYS
+ */
+typedef enum {
+    HOT_REQUESTS,       /**< Más pedidas */
+    HOT_BYTES,          /**< Más bytes movidos (clave y valor) */
+    HOT_SIZE,           /**< Valores más grandes */
+    HOT_LISTS,
+} hotList_t;
+
+/**
+ * @brief Clave de una lista de HOTKEYS
+ */
+typedef struct {
+    uint64_t hash;              /**< Hash de la clave */
+    uint64_t count;             /**< Estimación al último acceso (pedidos o bytes), o mayor largo visto */
+    uint64_t epoch;             /**< Período del último acceso */
+    char key[MAX_MSG_LENGTH];   /**< Clave */
+} hotSlot_t;
+
+/**
+ * @brief Las claves de mayor cuenta: montículo de mínimo sobre lugares fijos
+ *
+ * Las claves no se mueven de su lugar mientras están en la lista: el
+ * montículo ordena solo los índices, así reordenarlo no toca lo que copia
+ * HOTKEYS desde otro hilo.
+ */
+typedef struct {
+    uint64_t hashes[HOT_MAX_TOP];   /**< Copia de slots[i].hash, juntas para buscar sin tocar las claves */
+    uint8_t index[HOT_INDEX_LEN];   /**< Tabla abierta por hash: slot + 1 (0 = libre) */
+    hotSlot_t slots[HOT_MAX_TOP];   /**< Claves */
+    uint8_t heap[HOT_MAX_TOP];      /**< Índices de slots, con la menor cuenta en heap[0] */
+    uint8_t pos[HOT_MAX_TOP];       /**< Posición de cada slot en heap */
+    int used;                       /**< Slots ocupados */
+} hotTop_t;
+
+/**
+ * @brief Celda del sketch: los contadores de las dos métricas en los dos períodos
+ *
+ * Juntos en 32 bytes alineados: cada fila que toca un pedido es una sola
+ * línea de cache.
+ */
+typedef struct {
+    uint64_t n[2][2];   /**< [período & 1][HOT_REQUESTS o HOT_BYTES] */
+} __attribute__((aligned(32))) hotCell_t;
+
+/**
+ * @brief Seguimiento de claves de un hilo de atención
+ *
+ * Un sketch Count-Min estima cuántos pedidos y bytes tuvo cada clave sin
+ * guardar las claves; la ventana son los dos últimos períodos de
+ * HOT_PERIOD_NS, cada uno con su mitad de cada celda. Lo escribe solo su
+ * hilo; el lock es para cambiar una clave de lugar mientras HOTKEYS las
+ * copia.
+ */
+typedef struct hotTracker {
+    hotCell_t sketch[HOT_DEPTH][HOT_WIDTH]; /**< [fila][columna] */
+    uint64_t epoch;                     /**< Período actual */
+    uint64_t rng;                       /**< Estado del xorshift que elige los pedidos muestreados */
+    pthread_mutex_t lock;               /**< Protege hash y key de los slots */
+    hotTop_t top[HOT_LISTS];            /**< Listas de claves */
+} hotTracker_t;
+
+/**
+ * @brief Entrada del índice en memoria clave -> posición en el log
+ */
+typedef struct {
+    uint64_t hash;      /**< Hash de la clave (0 = slot libre) */
+    char* key;          /**< Clave (memoria propia) */
+    uint32_t segId;     /**< Segmento donde está el valor */
+    uint32_t valLen;    /**< Largo del valor (LOG_TOMBSTONE solo durante la reconstrucción) */
+    uint64_t valOff;    /**< Posición del valor dentro del segmento */
+    uint64_t seq;       /**< Número de secuencia del registro */
+} logIndexEntry_t;
+
+/**
+ * @brief Porción del índice con su propio lock
+ */
+typedef struct {
+    pthread_mutex_t lock;   /**< Protege toda la porción */
+    logIndexEntry_t* slots; /**< Tabla de entradas (sondeo lineal) */
+    size_t mask;            /**< Cantidad de slots - 1 (potencia de 2) */
+    size_t used;            /**< Slots ocupados */
+} logIndexShard_t;
+
+/**
+ * @brief Segmento del log abierto
+ */
+typedef struct {
+    int fd;             /**< Descriptor abierto (-1 = slot libre) */
+    uint32_t id;        /**< Número de segmento (nombre del archivo) */
+    uint64_t size;      /**< Bytes válidos */
+    uint64_t dead;      /**< Bytes de registros pisados o borrados */
+} logSegment_t;
+
+/**
+ * @brief Estado de una compactación en curso
+ */
+typedef struct {
+    logSegment_t* out;  /**< Segmento de salida actual (NULL si no hay) */
+    FILE* hint;         /**< Archivo de pistas del segmento de salida */
+    uint64_t copied;    /**< Registros vivos copiados */
+} logMergeState_t;
+
+/**
+ * @brief Función llamada por cada registro al recorrer un segmento
+ * @return 0 para seguir, -1 para cortar el recorrido
+ */
+typedef int (*logScanFn)(uint32_t segId, const logRecordHeader_t* h, const char* key,
+                         const char* value, uint64_t recOff, void* arg);
 
 /****************** prototipos funciones auxiliares ******************/
 /**
- * @brief Configura y pone en escucha el socket del servidor
+ * @brief Configura y pone en escucha el socket del servidor en 127.0.0.1
  * @param port Puerto en el que escuchar
- * @return Descriptor del socket del servidor
+ * @param backlog Largo de la cola de conexiones pendientes
+ * @return Descriptor del socket del servidor (no bloqueante, con SO_REUSEPORT)
+ */
+int serverSocketSet(int port, int backlog);
+
+/**
+ * @brief Configura y pone en escucha un socket en una dirección de -L
+ *
+ * Un socket Unix viejo en la misma ruta (de una corrida anterior) se borra antes.
+ * @param l Dirección
+ * @param backlog Largo de la cola de conexiones pendientes
+ * @return Descriptor del socket (no bloqueante; con SO_REUSEPORT si es TCP)
+ */
+static int serverListenerOpen(const serverListener_t* l, int backlog);
+
+/**
+ * @brief Interpreta una dirección de -L: "host:puerto", "[ipv6]:puerto", "unix:<ruta>" o "@<nombre>"
+ * @return 0 si es válida, -1 si no
  */
-int serverSocketSet(int port);
+static int serverListenerParse(const char* spec, serverListener_t* l);
+
+/**
+ * @brief Describe una dirección de escucha como se escribe en -L
+ */
+static void serverListenerName(const serverListener_t* l, char* buf, size_t len);
 
 /**
  * @brief Acepta una conexión entrante
+ *
+ * Si el proceso se quedó sin descriptores rechaza las pendientes con BUSY
+ * usando el descriptor de reserva del hilo, en lugar de dejarlas en la cola.
+ * @param worker Hilo que acepta
  * @param serverSoc Socket del servidor
- * @return Descriptor del socket del cliente
+ * @return Descriptor del socket del cliente (no bloqueante), -1 si no hay más pendientes
  */
-int serverSocketAccept(int serverSoc);
+int serverSocketAccept(serverWorker_t* worker, int serverSoc);
 
 /**
- * @brief Lee un mensaje del cliente
- * @param s Socket del cliente
- * @param buffer Buffer donde almacenar el mensaje
- * @return Número de bytes leídos
+ * @brief Rechaza con BUSY una conexión pendiente cuando no hay descriptores libres
+ *
+ * Cierra el descriptor de reserva del hilo para poder aceptarla y lo vuelve
+ * a abrir; sin esto la conexión quedaría en la cola y el aviso se repetiría.
+ * @param worker Hilo que acepta
+ * @param serverSoc Socket del servidor
+ * @return 1 si rechazó una, 0 si no pudo (con errno del accept())
  */
-int serverReadMessage(int s, char* buffer);
+static int serverSocketShed(serverWorker_t* worker, int serverSoc);
 
 /**
- * @brief Envía un mensaje al cliente
- * @param s Socket del cliente
- * @param buffer Buffer con el mensaje a enviar
- * @return Número de bytes enviados
+ * @brief Rechaza una conexión recién aceptada: le envía BUSY sin esperar (la cierra quien llama)
+ * @param worker Hilo que la aceptó
+ * @param fd Socket del cliente
  */
-int serverSendMessage(int s, char* buffer);
+static void serverConnReject(serverWorker_t* worker, int fd);
 
 /**
- * @brief Envía mensaje de uso al cliente
- * @param s Socket del cliente
+ * @brief Punto de entrada de un hilo de atención
+ * @param arg Puntero al serverWorker_t del hilo
+ * @return NULL
  */
-void serverSendUsageMsg(int s);
+static void* serverWorkerRun(void* arg);
 
 /**
- * @brief Envía mensaje de error y uso al cliente
- * @param s Socket del cliente
- * @param errorMsg Mensaje de error a enviar
+ * @brief Bucle de eventos: atiende conexiones y comandos con epoll
+ * @param worker Hilo dueño del bucle (socket de escucha y epoll)
  */
-static void serverSendError(int s, const char * errorMsg, int sendUsage);
+static void serverEventLoop(serverWorker_t* worker);
 
 /**
- * @brief Maneja el comando SET
- * @param clientSoc Socket del cliente
- * @param key Clave a establecer
- * @param value Valor a almacenar
+ * @brief Bucle de eventos con io_uring: atiende conexiones y comandos por terminaciones
+ *
+ * Las lecturas y envíos de todas las conexiones del hilo se preparan en la
+ * cola de envío y salen juntos, con un solo io_uring_enter() por vuelta que
+ * además espera las terminaciones. Los comandos se ejecutan con los mismos
+ * manejadores que en el bucle de epoll.
+ * @param worker Hilo dueño del bucle
  */
-static void serverHandleSetCmd(int clientSoc, const char * key, const char * value);
+static void serverUringLoop(serverWorker_t* worker);
 
 /**
- * @brief Maneja el comando GET
- * @param clientSoc Socket del cliente
- * @param key Clave a obtener
+ * @brief Instala el socket y el buffer de entrada de una conexión en las tablas registradas de io_uring
+ * @param conn Conexión recién aceptada
  */
-static void serverHandleGetCmd(int clientSoc, const char * key);
+static void serverUringConnSetup(serverConn_t* conn);
 
 /**
- * @brief Maneja el comando DEL
- * @param clientSoc Socket del cliente
- * @param key Clave a eliminar
+ * @brief Quita una conexión de las tablas registradas de io_uring
+ * @param conn Conexión a liberar, sin operaciones en vuelo
  */
-static void serverHandleDelCmd(int clientSoc, const char * key);
+static void serverUringConnRelease(serverConn_t* conn);
 
 /**
- * @brief Crea una nueva clave en la base de datos
- * @param pathKey Ruta del archivo de la clave
- * @param value Valor a almacenar
+ * @brief Verifica que el kernel permita crear anillos de io_uring
+ * @return 1 si se puede usar io_uring, 0 si no
  */
-void dbCreateKey(const char* pathKey, const char* value);
+static int serverUringProbe(void);
 
 /**
- * @brief Obtiene el valor de una clave
- * @param pathKey Ruta del archivo de la clave
- * @param value Buffer donde almacenar el valor
+ * @brief Crea el estado de una conexión nueva y la registra en epoll (o en io_uring)
+ * @param worker Hilo que va a atender la conexión
+ * @param fd Socket del cliente
+ * @return Conexión creada, NULL si falló
+ */
+static serverConn_t* serverConnOpen(serverWorker_t* worker, int fd);
+
+/**
+ * @brief Cierra una conexión y libera sus recursos
+ * @param conn Conexión a cerrar
+ */
+static void serverConnClose(serverConn_t* conn);
+
+/**
+ * @brief Pasa la conexión a la lista de plazos que le corresponde según lo que tiene en curso
+ *
+ * El plazo vuelve a empezar al cambiar de lista o si hubo progreso (un
+ * pedido completo, cuerpo recibido o bytes enviados); los bytes sueltos
+ * de un comando que no termina de llegar no lo extienden.
+ * @param conn Conexión
+ */
+static void serverConnTimerUpdate(serverConn_t* conn);
+
+/**
+ * @brief Cierra las conexiones del hilo cuyo plazo venció
+ * @param worker Hilo
+ * @return Milisegundos hasta el próximo vencimiento, -1 si no hay plazos corriendo
+ */
+static int serverConnTimerExpire(serverWorker_t* worker);
+
+/**
+ * @brief Atiende un evento de epoll sobre una conexión
+ * @param conn Conexión
+ * @param events Eventos reportados por epoll
+ * @return 0 si la conexión sigue abierta, -1 si hay que cerrarla
+ */
+static int serverConnHandleEvent(serverConn_t* conn, uint32_t events);
+
+/**
+ * @brief Envía, procesa y lee todo lo que se pueda, y decide si la conexión sigue abierta
+ *
+ * Mientras haya un valor esperando salir por sendfile() o demasiadas
+ * respuestas sin enviar no se procesan más comandos ni se lee el socket:
+ * un cliente que no lee frena al que escribe (control de flujo de TCP).
+ * Si quedan respuestas retenidas esperando un fsync, anota la conexión en
+ * la lista de espera de su hilo.
+ * @param conn Conexión
+ * @return 0 si la conexión sigue abierta, -1 si hay que cerrarla
  */
-void dbGetValue(const char* pathKey, char* value);
+static int serverConnPump(serverConn_t* conn);
+
+/**
+ * @brief Versión de serverConnPump() para io_uring
+ *
+ * En lugar de leer y enviar hasta EAGAIN deja en vuelo, como mucho, una
+ * lectura y un envío por conexión; al terminar cada uno se vuelve a llamar.
+ * @param conn Conexión
+ * @return 0 si la conexión sigue abierta, -1 si hay que cerrarla
+ */
+static int serverUringPump(serverConn_t* conn);
+
+/**
+ * @brief Vacía el aviso del hilo de fsync y retoma las conexiones que esperaban
+ * @param worker Hilo que recibió el aviso del hilo de fsync
+ */
+static void serverSyncWake(serverWorker_t* worker);
+
+/**
+ * @brief Retoma las conexiones cuyas escrituras ya son durables
+ * @param worker Hilo que recibió el aviso del hilo de fsync
+ */
+static void serverSyncResume(serverWorker_t* worker);
+
+/**
+ * @brief Registra una escritura recién hecha para la durabilidad
+ *
+ * Se llama antes de encolar la respuesta: en modo "always" lo que se
+ * encole desde acá queda retenido hasta que la escritura sea durable.
+ * @param conn Conexión que hizo la escritura
+ */
+static void serverSyncAfterWrite(serverConn_t* conn);
+
+/**
+ * @brief Lee del cliente todo lo disponible (hasta EAGAIN o buffer lleno)
+ *
+ * Si hay un SETL en curso y el buffer de comandos está vacío, el cuerpo se
+ * lee en bloques grandes y va directo al archivo temporal.
+ * @param conn Conexión del cliente
+ * @return Número de bytes leídos, -1 si hubo error
+ */
+int serverReadMessage(serverConn_t* conn);
+
+/**
+ * @brief Procesa todos los comandos completos (terminados en '\n') del buffer de entrada
+ *
+ * Es reanudable: un comando partido entre varias lecturas queda en el buffer
+ * y la búsqueda del '\n' sigue desde donde había quedado.
+ * @param conn Conexión del cliente
+ * @return 0 si todo bien, -1 si hay que cerrar la conexión
+ */
+static int serverProcessInput(serverConn_t* conn);
+
+/**
+ * @brief Interpreta y ejecuta un comando
+ * @param conn Conexión del cliente
+ * @param msg Comando (sin el '\n', no terminado en null)
+ * @param len Longitud del comando
+ */
+static void serverProcessCommand(serverConn_t* conn, const char* msg, size_t len);
+
+/**
+ * @brief Interpreta y ejecuta una trama del protocolo binario
+ *
+ * Usa los mismos manejadores que los comandos de texto; solo cambia cómo
+ * se arma la respuesta (ver serverReplyOk() y compañía).
+ * @param conn Conexión del cliente
+ * @return 1 si consumió una trama, 0 si todavía no llegó completa
+ */
+static int serverProcessFrame(serverConn_t* conn);
+
+/**
+ * @brief Bytes que tienen que estar en el buffer para procesar una trama
+ *
+ * Un SET cuyo valor entra en el buffer de entrada se procesa entero en el
+ * lugar; uno más grande (o una trama inválida) solo necesita el encabezado
+ * y la clave, el resto se recibe como el cuerpo de un SETL.
+ * @param buf Comienzo de la trama
+ * @param avail Bytes disponibles desde buf
+ * @return Bytes necesarios (si es más que avail, hay que esperar)
+ */
+static size_t serverFrameLen(const char* buf, size_t avail);
+
+/**
+ * @brief Pasa al buffer de salida las respuestas binarias cuyo fsync ya terminó
+ * @param conn Conexión del cliente
+ */
+static void serverBinReleaseAcks(serverConn_t* conn);
+
+/**
+ * @brief Responde OK en el protocolo de la conexión
+ *
+ * En binario, si el pedido hizo una escritura que todavía no es durable,
+ * la respuesta espera al fsync sin frenar las que vienen detrás.
+ * @param conn Conexión del cliente
+ */
+static void serverReplyOk(serverConn_t* conn);
+
+/**
+ * @brief Responde que la clave no existe, en el protocolo de la conexión
+ * @param conn Conexión del cliente
+ */
+static void serverReplyNotFound(serverConn_t* conn);
+
+/**
+ * @brief Responde un valor en el protocolo de la conexión
+ * @param conn Conexión del cliente
+ * @param value Valor en memoria (si ref es NULL)
+ * @param len Largo del valor
+ * @param ref Valor a enviar con sendfile() (NULL si está en memoria)
+ * @param withLen Texto: 1 para "OK <largo>\n<valor>" (GETL), 0 para "OK\n<valor>\n" (GET)
+ */
+static void serverReplyValue(serverConn_t* conn, const char* value, size_t len,
+                             const dbValueRef_t* ref, int withLen);
+
+/**
+ * @brief Encola un mensaje para el cliente
+ * @param conn Conexión del cliente
+ * @param buffer Buffer con el mensaje a enviar
+ * @return Número de bytes encolados
+ */
+int serverSendMessage(serverConn_t* conn, const char* buffer);
+
+/**
+ * @brief Encola bytes arbitrarios para el cliente
+ * @param conn Conexión del cliente
+ * @param data Datos a enviar
+ * @param len Largo de los datos
+ */
+static void serverSendBytes(serverConn_t* conn, const void* data, size_t len);
+
+/**
+ * @brief Envía una respuesta armada en partes con una sola llamada a writev()
+ *
+ * Si no hay nada encolado antes, las partes van directo al socket sin
+ * copiarlas al buffer de salida; lo que no entra se encola.
+ * @param conn Conexión del cliente
+ * @param iov Partes de la respuesta
+ * @param iovCnt Cantidad de partes
+ */
+static void serverSendVector(serverConn_t* conn, const struct iovec* iov, int iovCnt);
+
+/**
+ * @brief Encola un valor que se envía directo del archivo al socket (sendfile)
+ *
+ * Va detrás de lo ya encolado; lo que se encole después sale a continuación.
+ * @param conn Conexión del cliente
+ * @param ref Valor a enviar (la conexión se queda con el descriptor)
+ */
+static void serverSendFile(serverConn_t* conn, const dbValueRef_t* ref);
+
+/**
+ * @brief Envía al cliente lo pendiente del buffer de salida (hasta EAGAIN)
+ * @param conn Conexión del cliente
+ * @return 0 si se pudo escribir (todo o parte), -1 si hubo error
+ */
+static int serverFlush(serverConn_t* conn);
+
+/**
+ * @brief Envía mensaje de uso al cliente
+ * @param conn Conexión del cliente
+ */
+void serverSendUsageMsg(serverConn_t* conn);
+
+/**
+ * @brief Envía mensaje de error y uso al cliente
+ * @param conn Conexión del cliente
+ * @param errorMsg Mensaje de error a enviar
+ */
+static void serverSendError(serverConn_t* conn, const char * errorMsg, int sendUsage);
+
+/**
+ * @brief Maneja el comando SET
+ * @param conn Conexión del cliente
+ * @param key Clave a establecer
+ * @param value Valor a almacenar
+ * @param expireMs Momento en que vence (ms desde 1970), 0 si no vence
+ */
+static void serverHandleSetCmd(serverConn_t* conn, const char * key, utilsSlice_t value, uint64_t expireMs);
+
+/**
+ * @brief Maneja el comando SETL: SET con el largo del valor por delante
+ *
+ * Después de la línea "SETL <clave> <largo>" (o de una trama SET binaria
+ * que no entra en el buffer de entrada) llegan exactamente <largo> bytes
+ * de valor, que pueden contener cualquier cosa (incluso '\n').
+ * @param conn Conexión del cliente
+ * @param key Clave a establecer
+ * @param len Largo del valor
+ */
+static void serverHandleSetlCmd(serverConn_t* conn, const char * key, size_t len);
+
+/**
+ * @brief Pasa bytes del cuerpo de un SETL al archivo temporal
+ *
+ * Al completarse el cuerpo guarda la clave y responde.
+ * @param conn Conexión del cliente
+ * @param data Bytes recibidos
+ * @param len Cantidad de bytes (como mucho conn->bodyLeft)
+ */
+static void serverStreamFeed(serverConn_t* conn, const char* data, size_t len);
+
+/**
+ * @brief Maneja los comandos GET y GETL
+ * @param conn Conexión del cliente
+ * @param key Clave a obtener
+ * @param withLen 1 para GETL: responde "OK <largo>\n" y el valor sin '\n' final
+ */
+static void serverHandleGetCmd(serverConn_t* conn, const char * key, int withLen);
+
+/**
+ * @brief Maneja el comando DEL
+ * @param conn Conexión del cliente
+ * @param key Clave a eliminar
+ */
+static void serverHandleDelCmd(serverConn_t* conn, const char * key);
+
+/**
+ * @brief Maneja el comando TTL: responde "OK <segundos>" hasta que vence, "OK -1" si no vence
+ * @param conn Conexión del cliente
+ * @param key Clave a consultar
+ */
+static void serverHandleTtlCmd(serverConn_t* conn, const char * key);
+
+/**
+ * @brief Maneja el comando PERSIST: quita el vencimiento, responde "OK 1" si tenía o "OK 0"
+ * @param conn Conexión del cliente
+ * @param key Clave
+ */
+static void serverHandlePersistCmd(serverConn_t* conn, const char * key);
+
+/**
+ * @brief Maneja INCR y DECR: suma delta al valor, que tiene que ser un entero de 64 bits
+ *
+ * Una clave que no existe cuenta como 0. Responde "OK <valor nuevo>".
+ * @param conn Conexión del cliente
+ * @param key Clave
+ * @param delta Cantidad a sumar (negativa para DECR)
+ */
+static void serverHandleIncrCmd(serverConn_t* conn, const char * key, int64_t delta);
+
+/**
+ * @brief Maneja el comando APPEND: agrega bytes al final del valor, responde "OK <largo nuevo>"
+ *
+ * Una clave que no existe se crea con lo agregado.
+ * @param conn Conexión del cliente
+ * @param key Clave
+ * @param value Bytes a agregar
+ */
+static void serverHandleAppendCmd(serverConn_t* conn, const char * key, utilsSlice_t value);
+
+/**
+ * @brief Maneja el comando CAS: reemplaza el valor solo si es igual al esperado
+ *
+ * Responde "OK" si lo reemplazó, "MISMATCH" si el valor era otro o
+ * "NOTFOUND" si la clave no existe.
+ * @param conn Conexión del cliente
+ * @param key Clave
+ * @param expected Valor esperado
+ * @param value Valor nuevo
+ */
+static void serverHandleCasCmd(serverConn_t* conn, const char * key, utilsSlice_t expected, utilsSlice_t value);
+
+/**
+ * @brief Maneja SCAN y RANGE: responde una página de claves del índice ordenado
+ *
+ * Responde "OK <cursor> <cantidad>\n" y una clave por línea. El cursor es
+ * la última clave de la página en base64url (con '~' adelante, como en
+ * utilsKeyEncodeBase64()), o "0" si no quedan más.
+ * @param conn Conexión del cliente
+ * @param from Desde dónde empezar (la primera clave del rango o la del cursor)
+ * @param after 1 si from viene del cursor y ya se respondió
+ * @param prefix Prefijo de SCAN (NULL: todas las claves)
+ * @param end Fin del rango de RANGE, sin incluir (NULL: sin fin)
+ * @param count Cantidad máxima de claves en la página
+ */
+static void serverHandleScanCmd(serverConn_t* conn, const char* from, int after, const char* prefix,
+                                const char* end, size_t count);
+
+/**
+ * @brief Maneja el comando MGET: varios GETL en un solo pedido
+ *
+ * Responde por cada clave, en orden, "OK <largo>\n<valor>" o "NOTFOUND\n"
+ * (o "TOOBIG <largo>\n" si el valor es de los que se piden con GETL).
+ * @param conn Conexión del cliente
+ * @param keys Claves a obtener
+ * @param n Cantidad de claves
+ */
+static void serverHandleMgetCmd(serverConn_t* conn, const char* keys[], int n);
+
+/**
+ * @brief Maneja el comando MSET: guarda varios pares clave-valor juntos
+ * @param conn Conexión del cliente
+ * @param keys Claves a establecer
+ * @param values Valores de cada clave
+ * @param n Cantidad de pares
+ */
+static void serverHandleMsetCmd(serverConn_t* conn, const char* keys[], const utilsSlice_t values[], int n);
+
+/**
+ * @brief Maneja el comando MDEL: elimina varias claves, responde cuántas existían
+ * @param conn Conexión del cliente
+ * @param keys Claves a eliminar
+ * @param n Cantidad de claves
+ */
+static void serverHandleMdelCmd(serverConn_t* conn, const char* keys[], int n);
+
+/**
+ * @brief Maneja el comando STATS: contadores y latencias de todos los hilos
+ *
+ * Responde "OK <largo>\n" seguido del informe, como GETL.
+ * @param conn Conexión del cliente
+ */
+static void serverHandleStatsCmd(serverConn_t* conn);
+
+/**
+ * @brief Maneja el comando HOTKEYS: claves más pedidas, con más bytes y valores más grandes
+ * @param conn Conexión del cliente
+ * @param count Claves por lista
+ */
+static void serverHandleHotkeysCmd(serverConn_t* conn, size_t count);
+
+/**
+ * @brief Maneja el comando SNAPSHOT: empieza un volcado en segundo plano
+ *
+ * Responde OK apenas queda fijado el momento del volcado, sin esperar a
+ * que se escriba.
+ * @param conn Conexión del cliente
+ */
+static void serverHandleSnapshotCmd(serverConn_t* conn);
+
+/**
+ * @brief Empieza a medir un comando recién completo
+ * @param conn Conexión del cliente
+ * @param bytesIn Bytes recibidos del comando
+ */
+static void serverStatsBegin(serverConn_t* conn, size_t bytesIn);
+
+/**
+ * @brief Anota que ya se interpretó el comando y cuál es
+ * @param conn Conexión del cliente
+ * @param cmd Tipo de comando
+ */
+static void serverStatsParsed(serverConn_t* conn, serverStatCmd_t cmd);
+
+/**
+ * @brief Anota el comando en curso en las estadísticas del hilo
+ *
+ * Se llama cuando el comando terminó (un SETL, cuando llegó todo el cuerpo).
+ * Deja anotada la respuesta para medir su envío en serverStatsSent().
+ * @param conn Conexión del cliente
+ */
+static void serverStatsEnd(serverConn_t* conn);
+
+/**
+ * @brief Anota una clave encontrada o no encontrada del comando en curso
+ * @param conn Conexión del cliente
+ * @param found 1 si la clave existía
+ */
+static void serverStatsHit(serverConn_t* conn, int found);
+
+/**
+ * @brief Mide el envío de las respuestas que ya salieron enteras
+ * @param conn Conexión del cliente
+ */
+static void serverStatsSent(serverConn_t* conn);
+
+/**
+ * @brief Escribe el informe de estadísticas
+ * @param out Destino
+ * @param prometheus 1 para el formato de texto de Prometheus, 0 para STATS
+ */
+static void serverStatsWrite(FILE* out, int prometheus);
+
+/**
+ * @brief Abre el endpoint de métricas en config.metricsPort y lo atiende en un hilo propio
+ */
+static void serverMetricsInit(void);
+
+/**
+ * @brief Toma el lock de la clave (bloqueo por franjas)
+ *
+ * Serializa las operaciones sobre una misma clave entre hilos: varias
+ * lecturas pueden ir en paralelo, una escritura o borrado va sola.
+ * @param key Clave a bloquear
+ * @param write 1 para escritura (SET/DEL), 0 para lectura (GET)
+ */
+static void dbLockKey(const char* key, int write);
+
+/**
+ * @brief Libera el lock tomado con dbLockKey()
+ * @param key Clave a liberar
+ */
+static void dbUnlockKey(const char* key);
+
+/**
+ * @brief Toma los locks de varias claves a la vez
+ *
+ * Las franjas se toman una sola vez cada una y en orden creciente, así dos
+ * pedidos con claves en común no se pueden trabar entre sí.
+ * @param keys Claves a bloquear
+ * @param n Cantidad de claves
+ * @param write 1 para escritura, 0 para lectura
+ * @param stripes Recibe las franjas tomadas (lugar para n)
+ * @return Cantidad de franjas tomadas, para dbUnlockStripes()
+ */
+static int dbLockKeys(const char* keys[], int n, int write, uint32_t stripes[]);
+
+/**
+ * @brief Libera las franjas tomadas con dbLockKeys()
+ */
+static void dbUnlockStripes(const uint32_t stripes[], int n);
+
+/**
+ * @brief Elige e inicializa el motor de almacenamiento
+ * @param name Nombre del motor ("file" o "log")
+ */
+static void dbInit(const char* name);
+
+/**
+ * @brief Crea una nueva clave en la base de datos
+ * @param key Clave
+ * @param value Valor a almacenar
+ * @param valLen Largo del valor
+ * @param keepTtl 1 si conserva el vencimiento (INCR, APPEND), 0 si se lo quita como un SET
+ * @return 1 si la clave ya existía (se actualizó), 0 si es nueva
+ */
+int dbCreateKey(const char* key, const char* value, size_t valLen, int keepTtl);
+
+/**
+ * @brief Obtiene el valor de una clave
+ * @param key Clave
+ * @param value Buffer donde almacenar el valor (terminado en null, se corta si no entra)
+ * @param maxLen Tamaño del buffer
+ * @return Largo completo del valor, -1 si la clave no existe
+ */
+ssize_t dbGetValue(const char* key, char* value, size_t maxLen);
+
+/**
+ * @brief Ubica el valor de una clave en disco, para leerlo o enviarlo sin copiarlo
+ *
+ * El descriptor devuelto sigue viendo este valor aunque después se pise o
+ * se borre la clave.
+ * @param key Clave
+ * @param ref Recibe descriptor propio, posición y largo del valor
+ * @return 1 si la clave existe, 0 si no
+ */
+int dbOpenValue(const char* key, dbValueRef_t* ref);
+
+/**
+ * @brief Empieza a recibir un valor por partes en un archivo temporal
+ * @param stream Estado a inicializar
+ * @param len Largo total del valor
+ */
+static void dbStreamOpen(dbStream_t* stream, size_t len);
+
+/**
+ * @brief Agrega una parte del valor al archivo temporal
+ * @param stream Valor en curso
+ * @param data Bytes recibidos
+ * @param len Cantidad de bytes
+ */
+static void dbStreamWrite(dbStream_t* stream, const char* data, size_t len);
+
+/**
+ * @brief Guarda como valor de la clave lo recibido por partes
+ *
+ * Se llama con el lock de la clave tomado. Libera el estado del valor.
+ * @param key Clave
+ * @param stream Valor completo
+ * @param keepTtl 1 si conserva el vencimiento, 0 si se lo quita (ver dbCreateKey())
+ * @return 1 si la clave ya existía (se actualizó), 0 si es nueva
+ */
+static int dbStreamCommit(const char* key, dbStream_t* stream, int keepTtl);
+
+/**
+ * @brief Descarta un valor a medio recibir
+ * @param stream Valor en curso
+ */
+static void dbStreamAbort(dbStream_t* stream);
+
+/**
+ * @brief Elimina una clave de la base de datos
+ * @param key Clave
+ * @return 1 si la clave existía, 0 si no
+ */
+int dbDeleteValue(const char* key);
+
+/**
+ * @brief Empieza un SNAPSHOT: fija el momento del volcado y lo escribe en un hilo aparte
+ *
+ * Espera solo a las escrituras en curso (toma un momento todos los locks
+ * de claves). Desde ahí, la primera escritura de cada clave que todavía
+ * no se volcó agrega primero su valor anterior al volcado.
+ * @return 0 si empezó, -1 si ya hay uno en curso, -2 si no se puede ahora
+ */
+static int dbSnapshotStart(void);
+
+/**
+ * @brief Fija el momento de un volcado, como dbSnapshotStart(), sin lanzar el hilo
+ * @param dest Ruta final del volcado
+ * @return 0 si empezó, -1 si ya hay uno en curso, -2 si no se puede ahora
+ */
+static int dbSnapshotBegin(const char* dest);
+
+/**
+ * @brief Escribe el volcado empezado con dbSnapshotBegin() y lo deja en su ruta final
+ */
+static void dbSnapshotFinish(void);
+
+/**
+ * @brief Guarda en el volcado el valor anterior de una clave por escribirse
+ *
+ * Se llama con el lock de escritura de la clave tomado, antes de modificarla.
+ */
+static void dbSnapshotPreserve(const char* key);
+
+/**
+ * @brief Carga el volcado de -r en la base, que tiene que estar vacía
+ */
+static void dbRestore(const char* path);
+
+/**
+ * @brief Pasa al diario de vencimientos un registro de vencimiento del volcado de -r
+ *
+ * Lo llaman los motores al cargar el volcado. Lo que venció desde el
+ * SNAPSHOT también pasa: se borra en el primer tick, como al reiniciar.
+ */
+static void dbRestoreExpiry(const logRecordHeader_t* h, const char* key, const char* value);
+
+/**
+ * @brief Agrega una escritura al flujo de replicación
+ *
+ * Se llama con el lock de escritura de la clave tomado, así dos escrituras
+ * de una misma clave entran al flujo en el orden en que se hicieron. No
+ * hace nada si el servidor no acepta réplicas.
+ * @param type REPL_SET, REPL_DEL o REPL_EXPIRE
+ * @param key Clave
+ * @param value Valor (NULL si es un DEL o un EXPIRE, o si es grande y se lee de la base al enviarlo)
+ * @param valLen Largo del valor, o el vencimiento en un REPL_EXPIRE
+ */
+static void replAppend(replType_t type, const char* key, const char* value, size_t valLen);
+
+/**
+ * @brief Abre el puerto para réplicas (-R) o se conecta al líder (-F)
+ */
+static void replInit(void);
+
+/**
+ * @brief Indica si el servidor es una réplica (de solo lectura)
+ */
+static int replIsReplica(void);
+
+/**
+ * @brief Escribe el estado de la replicación para STATS o Prometheus
+ */
+static void replStatsWrite(FILE* out, int prometheus);
+
+/**
+ * @brief Inicia el hilo de fsync según el modo de durabilidad
+ */
+static void dbSyncInit(void);
+
+/**
+ * @brief Anota una escritura terminada que todavía no es durable
+ * @return Número de escritura (ticket) a esperar con dbSyncIsDurable()
+ */
+static uint64_t dbSyncTicket(void);
+
+/**
+ * @brief Indica si una escritura ya es durable
+ * @param ticket Número devuelto por dbSyncTicket()
+ * @return 1 si ya se hizo fsync, 0 si no
+ */
+static int dbSyncIsDurable(uint64_t ticket);
+
+/**
+ * @brief Imprime cuántas escrituras cubrió cada fsync y cuánto tardaron
+ */
+static void dbSyncReport(void);
+
+/**
+ * @brief Motor "file": un archivo por clave en PATH_DB_FOLDER
+ */
+static void dbFileInit(void);
+static int dbFileCreateKey(const char* key, const char* value, size_t valLen);
+static int dbFileOpenValue(const char* key, dbValueRef_t* ref);
+static int dbFileDeleteValue(const char* key);
+static int dbFileCommitStream(const char* key, dbStream_t* stream);
+static void dbFileSync(void);
+static void dbFileForEachKey(dbKeyFn fn, void* arg);
+static void dbFileRestore(int fd, uint64_t size);
+
+/**
+ * @brief Calcula dónde va el archivo de una clave según -f
+ *
+ * Con -f 1 es "<xx>/<nombre>" y con -f 2 "<xx>/<yy>/<nombre>", donde xx e
+ * yy son los dos primeros bytes del hash de la clave en hexadecimal. La
+ * carpeta del primer nivel sale de dbFileDirFds[], ya abierta.
+ */
+static void dbFilePathOf(const char* key, dbFilePath_t* path);
+
+/**
+ * @brief Mueve a su subcarpeta los archivos que quedaron en la carpeta plana
+ *
+ * Corre en su propio hilo con el servidor ya atendiendo: cada archivo se
+ * mueve con el lock de su clave tomado, y mientras tanto las operaciones
+ * también buscan en la carpeta plana (ver dbFileMigrating).
+ */
+static void* dbFileMigrateThread(void* arg);
+
+/**
+ * @brief Motor "log": segmentos de solo-agregado en PATH_LOG_FOLDER (estilo Bitcask)
+ *
+ * SET y DEL agregan un registro al segmento activo; un índice en memoria
+ * guarda dónde está el último valor de cada clave, así un GET es un solo
+ * pread(). Un hilo de fondo compacta los segmentos viejos.
+ */
+static void logInit(void);
+static int logCreateKey(const char* key, const char* value, size_t valLen);
+static int logOpenValue(const char* key, dbValueRef_t* ref);
+static int logDeleteValue(const char* key);
+static int logCommitStream(const char* key, dbStream_t* stream);
+static void logSync(void);
+static void logForEachKey(dbKeyFn fn, void* arg);
+static void logRestore(int fd, uint64_t size);
+
+/**
+ * @brief Recorre los registros válidos de un segmento
+ * @param fd Descriptor del segmento
+ * @param segId Número de segmento
+ * @param fn Función a llamar por cada registro
+ * @param arg Argumento para fn
+ * @return Bytes válidos del segmento (hasta el primer registro roto)
+ */
+static uint64_t logScanSegment(int fd, uint32_t segId, logScanFn fn, void* arg);
+
+/**
+ * @brief Compacta los segmentos que ya no reciben escrituras
+ *
+ * Copia los registros vivos a segmentos nuevos (con su archivo de pistas),
+ * repunta el índice y borra los segmentos viejos.
+ * @param force 1 para compactar aunque haya poca basura
+ */
+static void logMerge(int force);
+
+/**
+ * @brief Vencimientos: carga el diario de PATH_TTL_JOURNAL y lanza el hilo de la rueda
+ *
+ * Los vencimientos de todas las claves, con cualquier motor, se guardan en
+ * un único diario de registros con el formato de un segmento del motor
+ * "log" (clave y momento de vencimiento, o sin valor si se quitó); al
+ * arrancar se carga y se reescribe con solo lo vigente.
+ */
+static void ttlInit(void);
+
+/**
+ * @brief Le pone vencimiento a una clave (con el lock de escritura de la clave tomado)
+ * @param key Clave
+ * @param expireMs Momento en que vence (ms desde 1970)
+ */
+static void ttlSet(const char* key, uint64_t expireMs);
+
+/**
+ * @brief Quita el vencimiento de una clave (con el lock de escritura de la clave tomado)
+ * @return 1 si tenía vencimiento, 0 si no
+ */
+static int ttlClear(const char* key);
+
+/**
+ * @brief Momento en que vence una clave
+ * @return ms desde 1970, 0 si no vence
+ */
+static uint64_t ttlGet(const char* key);
+
+/**
+ * @brief Arma el registro del diario de vencimientos para una clave
+ *
+ * Los volcados de SNAPSHOT llevan los vencimientos con este mismo registro.
+ * @param key Clave
+ * @param expireMs Vencimiento, 0 si se quitó
+ * @param rec Destino, de al menos sizeof(logRecordHeader_t) + MAX_MSG_LENGTH + 8 bytes
+ * @return Largo del registro
+ */
+static size_t ttlJournalEncode(const char* key, uint64_t expireMs, char* rec);
+
+/**
+ * @brief Borra la clave si ya venció (vencimiento perezoso, al accederla)
+ *
+ * Se llama sin locks de claves tomados, antes de leerla.
+ */
+static void ttlExpireIfDue(const char* key);
+
+/**
+ * @brief Hace durable el diario de vencimientos (lo llama el hilo de fsync)
+ */
+static void ttlSync(void);
+
+/**
+ * @brief Escribe las estadísticas de vencimientos para STATS o Prometheus
+ */
+static void ttlStatsWrite(FILE* out, int prometheus);
+
+/**
+ * @brief Índice ordenado: lo arma con todas las claves de la base al arrancar
+ */
+static void idxInit(void);
+
+/**
+ * @brief Agrega al índice una clave recién creada (con su lock de escritura tomado)
+ */
+static void idxAdd(const char* key);
+
+/**
+ * @brief Quita del índice una clave recién borrada (con su lock de escritura tomado)
+ */
+static void idxRemove(const char* key);
+
+/**
+ * @brief Recorre en orden una página de claves del índice
+ *
+ * Sostiene el lock de lectura del índice solo durante la página.
+ * @param from Primera clave a considerar (o la siguiente, si after es 1)
+ * @param after 1 para empezar después de from (cursor)
+ * @param prefix Solo claves con este prefijo (NULL: sin restricción)
+ * @param end Solo claves menores a esta (NULL: sin restricción)
+ * @param max Cantidad máxima de claves a recorrer
+ * @param fn Función a llamar por cada clave, con el lock del índice tomado
+ * @param arg Argumento para fn
+ * @return 1 si quedan claves después de la última recorrida, 0 si no
+ */
+static int idxScan(const char* from, int after, const char* prefix, const char* end, size_t max,
+                   idxKeyFn fn, void* arg);
+
+/**
+ * @brief Escribe las estadísticas del índice ordenado para STATS o Prometheus
+ */
+static void idxStatsWrite(FILE* out, int prometheus);
+
+/**
+ * @brief Crea el seguimiento de claves de un hilo
+ */
+static hotTracker_t* hotNew(void);
+
+/**
+ * @brief Anota un acceso a una clave en el seguimiento del hilo de la conexión
+ * @param conn Conexión del cliente (da el hilo y el momento del pedido)
+ * @param key Clave
+ * @param valLen Largo del valor leído o escrito, -1 si no hay (DEL, clave inexistente)
+ */
+static void hotRecord(serverConn_t* conn, const char* key, ssize_t valLen);
+
+/**
+ * @brief Junta las listas de todos los hilos y escribe las count claves de mayor cuenta de cada una
+ */
+static void hotWrite(FILE* out, size_t count);
+
+/**
+ * @brief Inicializa la cache de valores
+ * @param budgetMB Memoria total en MB para claves y valores (0 la desactiva)
+ */
+static void cacheInit(size_t budgetMB);
+
+/**
+ * @brief Busca una clave en la cache
+ * @param key Clave a buscar
+ * @param value Buffer donde copiar el valor (terminado en null)
+ * @param maxLen Tamaño del buffer
+ * @return Largo del valor, -1 si no está en cache
+ */
+static ssize_t cacheGet(const char* key, char* value, size_t maxLen);
+
+/**
+ * @brief Guarda o actualiza una clave en la cache, desalojando si hace falta
+ * @param key Clave
+ * @param value Valor
+ * @param valLen Largo del valor
+ */
+static void cachePut(const char* key, const char* value, size_t valLen);
+
+/**
+ * @brief Quita una clave de la cache
+ * @param key Clave a quitar
+ */
+static void cacheInvalidate(const char* key);
+
+/**
+ * @brief Separa una línea en tokens por espacios, sin modificarla
+ * @param string Línea a tokenizar (no hace falta que termine en null)
+ * @param len Largo de la línea
+ * @param maxTokens Número máximo de tokens
+ * @param array Array donde almacenar los tokens
+ * @return Número de tokens encontrados, -1 si hay más de maxTokens
+ */
+static int utilsStringTokenize(const char* string, size_t len, int maxTokens, utilsSlice_t array[]);
+
+/**
+ * @brief Compara un token con una cadena
+ * @return 1 si son iguales, 0 si no
+ */
+static int utilsSliceEquals(utilsSlice_t slice, const char* string);
+
+/**
+ * @brief Interpreta un token como número entero sin signo
+ * @param slice Token
+ * @param out Recibe el número
+ * @return 0 si es un número válido, -1 si no
+ */
+static int utilsSliceToSize(utilsSlice_t slice, size_t* out);
+
+/**
+ * @brief Interpreta un token como número entero de 64 bits con signo ('-' opcional)
+ * @param slice Token
+ * @param out Recibe el número
+ * @return 0 si es un número válido, -1 si no
+ */
+static int utilsSliceToInt64(utilsSlice_t slice, int64_t* out);
+
+/**
+ * @brief CRC32 (polinomio IEEE 802.3)
+ * @param crc Valor previo (0 para empezar)
+ * @param data Datos
+ * @param len Largo de los datos
+ * @return CRC acumulado
+ */
+static uint32_t utilsCrc32(uint32_t crc, const void* data, size_t len);
+
+/**
+ * @brief CRC32 de dos bloques seguidos a partir del CRC de cada uno
+ * @param crc1 CRC32 del primer bloque
+ * @param crc2 CRC32 del segundo bloque
+ * @param len2 Largo del segundo bloque
+ * @return CRC32 del primer bloque seguido del segundo
+ */
+static uint32_t utilsCrc32Combine(uint32_t crc1, uint32_t crc2, size_t len2);
+
+/**
+ * @brief Copia bytes entre archivos dentro del kernel (copy_file_range)
+ * @param in Archivo de origen
+ * @param inOff Posición en el origen
+ * @param out Archivo de destino
+ * @param outOff Posición en el destino
+ * @param len Bytes a copiar
+ */
+static void utilsCopyFile(int in, off_t inOff, int out, off_t outOff, size_t len);
+
+/**
+ * @brief Hash FNV-1a de una cadena
+ * @param string Cadena terminada en null
+ * @return Hash de 64 bits
+ */
+static uint64_t utilsHashString(const char* string);
+
+/**
+ * @brief Arma el nombre de archivo de una clave
+ *
+ * Las claves que no sirven como nombre ("." y "..", con '/' o caracteres
+ * de control, o que empiezan con '~') se guardan como '~' seguido de la
+ * clave en base64url; las demás quedan tal cual.
+ * @param key Clave terminada en null
+ * @param name Destino, de al menos DB_NAME_LEN bytes
+ */
+static void utilsKeyEncode(const char* key, char* name);
+
+/**
+ * @brief Arma el nombre de archivo '~' + base64url de una clave, sea o no válida tal cual
+ */
+static void utilsKeyEncodeBase64(const char* key, char* name);
+
+/**
+ * @brief Recupera la clave de un nombre de archivo armado con utilsKeyEncode()
+ * @param name Nombre del archivo
+ * @param key Destino, de MAX_MSG_LENGTH bytes
+ * @return 0 si es una clave válida, -1 si no
+ */
+static int utilsKeyDecode(const char* name, char* key);
+
+/**
+ * @brief Asegura que un directorio existe, lo crea si no existe
+ * @param path Ruta del directorio
+ */
+static void utilsEnsureDirectoryExists(const char* path);
+
+/**
+ * @brief Encola un mensaje en la cola del hilo actual
+ *
+ * Se usa a través de TRACE_DEBUG() y demás, que descartan los mensajes de
+ * nivel menor al configurado sin formatearlos. El texto se formatea en el
+ * hilo que llama (hasta TRACE_MSG_LEN bytes) y se escribe después, por
+ * lotes, desde el hilo de registro.
+ * @param level Nivel del mensaje
+ * @param fmt Formato de printf(), sin el salto de línea final
+ */
+static void traceWrite(traceLevel_t level, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+
+/**
+ * @brief Escribe todos los mensajes encolados
+ *
+ * Los de nivel WARN o más van a stderr y el resto a stdout, con un write()
+ * por lote.
+ */
+static void traceFlush(void);
+
+/**
+ * @brief Lanza el hilo que escribe los mensajes encolados cada TRACE_FLUSH_MS
+ */
+static void traceInit(void);
+
+/**
+ * @brief Momento actual en ns (reloj monotónico)
+ */
+static uint64_t utilsNowNs(void);
+
+/**
+ * @brief Momento actual en ns desde 1970 (reloj de pared, comparable entre procesos y corridas)
+ */
+static uint64_t utilsWallNs(void);
+
+/**
+ * @brief Verifica si un archivo existe dentro de una carpeta abierta
+ * @param dirFd Descriptor de la carpeta
+ * @param name Nombre del archivo
+ * @return 1 si existe, 0 si no existe
+ */
+static int utilsFileExistsAt(int dirFd, const char* name);
+
+/**
+ * @brief Interpreta los argumentos de la línea de comandos
+ * @param argc Cantidad de argumentos
+ * @param argv Argumentos
+ * @param cfg Configuración a completar
+ */
+static void utilsParseArgs(int argc, char* argv[], serverConfig_t* cfg);
+
+/**
+ * @brief Limpia recursos y termina el programa
+ * @param code Código de salida
+ */
+static void utilsCleanupAndExit(int code);
+
+/**
+ * @brief Hilo que espera SIGINT con sigwait() y cierra el servidor
+ *
+ * La señal está bloqueada en todos los hilos: el cierre (informe, vaciado
+ * del registro y exit()) corre fuera de un manejador, sin cortar a ningún
+ * hilo a mitad de un pedido.
+ * @param arg Conjunto de señales bloqueadas (sigset_t*)
+ */
+static void* utilsSignalThread(void* arg);
+
+/**
+ * @brief Agrega múltiples señales al manejador
+ * @param sa Estructura sigaction
+ * @param array Array de señales
+ * @param len Longitud del array
+ */
+static void utilsAddSignalsToHandler(struct sigaction* sa, int array[], int len);
+
+/************************ variables globales *************************/
+/** @brief Ruta de la carpeta de base de datos */
+const char* PATH_DB_FOLDER = "./db";
+
+/** @brief Ruta de la carpeta de segmentos del motor "log" */
+const char* PATH_LOG_FOLDER = "./db_log";
+
+/** @brief Ruta del último volcado de SNAPSHOT */
+const char* PATH_SNAPSHOT = "./db_snapshot";
+
+/** @brief Ruta del diario de vencimientos (TTL) de las claves */
+const char* PATH_TTL_JOURNAL = "./db_ttl";
+
+/** @brief Ruta de la carpeta de temporales (mismo sistema de archivos que ./db) */
+const char* PATH_TMP_FOLDER = "./db_tmp";
+
+/** @brief Hilos de atención (uno por cada -t) */
+serverWorker_t workers[MAX_WORKERS];
+
+/** @brief Conexiones abiertas entre todos los hilos, para el límite de -C */
+int serverConnCount;
+
+/** @brief Colas de mensajes de todos los hilos que registraron algo (se agregan al frente, sin lock) */
+traceRing_t* traceRings;
+
+/** @brief Cola de mensajes del hilo actual (NULL hasta su primer mensaje) */
+__thread traceRing_t* traceMyRing;
+
+/** @brief Serializa a los consumidores de las colas (hilo de registro y cierre) */
+pthread_mutex_t traceFlushLock = PTHREAD_MUTEX_INITIALIZER;
+
+/** @brief Nombres de los niveles para -l, en el orden de traceLevel_t */
+const char* traceLevelNames[] = { "debug", "info", "warn", "error", "off" };
+
+/** @brief Momento de arranque, para el tiempo en marcha de STATS */
+uint64_t serverStartNs;
+
+/** @brief Nombres de los comandos en las estadísticas, en el orden de serverStatCmd_t */
+const char* serverStatCmdNames[] = { "get", "set", "setl", "del", "mget", "mset", "mdel", "stats", "snapshot", "ttl", "persist",
+                                     "scan", "range", "incr", "append",
+                                     "cas", "hotkeys", "invalid" };
+
+/** @brief Nombres de las fases en las estadísticas, en el orden de serverStatPhase_t */
+const char* serverStatPhaseNames[] = { "parse", "storage", "send" };
+
+/** @brief Configuración del servidor */
+serverConfig_t config = { .port = SERVER_PORT, .oneShot = 0, .workers = 1, .backlog = SERVER_BACKLOG,
+                          .cacheMB = CACHE_DEFAULT_MB, .storage = "file", .durability = DURABILITY_NONE,
+                          .traceLevel = TRACE_LEVEL_INFO, .engine = ENGINE_EPOLL, .hotTop = HOT_DEFAULT_TOP,
+                          .maxConns = SERVER_MAX_CONNS, .idleTimeout = CONN_IDLE_TIMEOUT_S,
+                          .readTimeout = CONN_READ_TIMEOUT_S, .outLimitMB = CONN_OUT_LIMIT_MB };
+
+/** @brief Nombres de los mecanismos de E/S para -e, en el orden de serverEngine_t */
+const char* serverEngineNames[] = { "epoll", "uring" };
+
+/** @brief Locks por franjas de claves, ver dbLockKey() */
+pthread_rwlock_t keyLocks[KEY_LOCK_STRIPES];
+
+/** @brief Cache de valores, NULL si está desactivada */
+cacheShard_t* cacheShards;
+
+/** @brief Motores de almacenamiento disponibles */
+const dbBackend_t dbBackends[] = {
+    { "file", dbFileInit, dbFileCreateKey, dbFileOpenValue, dbFileDeleteValue, dbFileCommitStream, dbFileSync,
+      dbFileForEachKey, dbFileRestore, 0 },
+    { "log", logInit, logCreateKey, logOpenValue, logDeleteValue, logCommitStream, logSync,
+      logForEachKey, logRestore, 1 },
+};
+
+/** @brief Motor de almacenamiento en uso */
+const dbBackend_t* db;
+
+/** @brief Nombres de los modos de durabilidad, en el orden de dbDurability_t */
+const char* dbDurabilityNames[] = { "none", "everysec", "always" };
+
+/** @brief Escrituras terminadas y escrituras ya durables (tickets) */
+uint64_t dbSyncWritten, dbSyncDurable;
+
+/** @brief Protegen el despertar del hilo de fsync */
+pthread_mutex_t dbSyncLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t dbSyncCond = PTHREAD_COND_INITIALIZER;
+
+/** @brief Estadísticas de fsync, escritas sólo por el hilo de fsync */
+dbSyncStats_t dbSyncStats;
+
+/** @brief Carpeta del motor "file" abierta, para syncfs() */
+int dbFileFolderFd = -1;
+
+/** @brief Carpetas del primer nivel de subcarpetas abiertas (con -f), ver dbFilePathOf() */
+int dbFileDirFds[DB_FANOUT_DIRS];
+
+/** @brief 1 mientras quedan archivos en la carpeta plana por mover a subcarpetas */
+int dbFileMigrating;
+
+/** @brief Hashes de las claves que existen en el motor "file", ver dbFileKeyMayExist() */
+dbKeySetShard_t dbKeySet[KEYSET_SHARDS];
+
+/** @brief SNAPSHOT en curso */
+dbSnapshot_t dbSnap = { .lock = PTHREAD_MUTEX_INITIALIZER, .fd = -1 };
+
+/** @brief Diario de vencimientos que arma la carga de -r y vencimientos cargados */
+FILE* dbRestoreTtl;
+uint64_t dbRestoreTtlKeys;
+
+/** @brief Flujo de replicación del líder */
+replLog_t replLog = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+/** @brief Estado de la réplica */
+replReplica_t replReplica = { .fd = -1, .runId = "-" };
+
+/** @brief Vencimientos de las claves, ver ttlSet() */
+ttlShard_t ttlShards[TTL_SHARDS];
+
+/** @brief Claves con vencimiento y claves vencidas desde el arranque */
+uint64_t ttlCount, ttlExpired;
+
+/** @brief Diario de vencimientos abierto, sus bytes y los de sus registros vigentes */
+int ttlJournalFd = -1;
+uint64_t ttlJournalBytes, ttlJournalLive;
+
+/** @brief Hay registros del diario sin fsync */
+int ttlJournalDirty;
+
+/** @brief Los agregados al diario lo toman para leer; la reescritura, para escribir */
+pthread_rwlock_t ttlJournalLock = PTHREAD_RWLOCK_INITIALIZER;
+
+/** @brief Índice ordenado de las claves (SCAN y RANGE) */
+idxIndex_t idx = { .lock = PTHREAD_RWLOCK_INITIALIZER };
+
+/** @brief Contador para nombres únicos de temporales */
+uint64_t dbTmpCounter;
+
+/** @brief Índice del motor "log" */
+logIndexShard_t logIndex[LOG_INDEX_SHARDS];
+
+/** @brief Segmentos abiertos del motor "log", por id % LOG_MAX_SEGMENTS */
+logSegment_t logSegments[LOG_MAX_SEGMENTS];
+
+/** @brief Protege el cierre de segmentos mientras un GET lee de ellos */
+pthread_rwlock_t logSegmentsLock = PTHREAD_RWLOCK_INITIALIZER;
+
+/** @brief Serializa los agregados al segmento activo y la contabilidad */
+pthread_mutex_t logWriteLock = PTHREAD_MUTEX_INITIALIZER;
+
+/** @brief Segmento activo (0 = ninguno), próximo id libre y último número de secuencia */
+uint32_t logActiveId, logNextId = 1;
+uint64_t logSeq;
+
+/*************************** main function ***************************/
+/**
+ * @brief Función principal del servidor TCP
+ *
+ * Configura el manejo de señales, crea el socket del servidor y entra en un
+ * bucle de eventos (epoll, edge-triggered) que atiende muchos clientes a la
+ * vez. Las conexiones quedan abiertas y aceptan cualquier cantidad de
+ * comandos SET, GET y DEL (y SETL/GETL para valores grandes). Con la opción -1 se vuelve al comportamiento
+ * original: se cierra la conexión tras responder el primer comando.
+ *
+ * Con -t N se lanzan N hilos, cada uno con su propio socket de escucha
+ * (SO_REUSEPORT) y su propio bucle de eventos.
+ *
+ * Si recibe Ctrl+C termina controladamente cerrando los sockets.
+ *
+ * @return EXIT_SUCCESS en caso de terminación controlada.
+ */
+int main(int argc, char* argv[]) {
+
+    utilsParseArgs(argc, argv, &config);
+    // antes de lanzar cualquier hilo, así todos lo heredan bloqueado
+    static sigset_t stopSignals;
+    sigemptyset(&stopSignals);
+    sigaddset(&stopSignals, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &stopSignals, NULL);
+    traceInit();
+    pthread_t signalThread;
+    if (pthread_create(&signalThread, NULL, utilsSignalThread, &stopSignals) != 0) {
+        fprintf(stderr, "ERROR creando el hilo de señales\n");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+    pthread_detach(signalThread);
+    if (config.engine == ENGINE_URING && !serverUringProbe()) {
+        TRACE_WARN("server: io_uring no disponible (%s), se usa epoll", strerror(errno));
+        config.engine = ENGINE_EPOLL;
+    }
+
+    struct sigaction sa = { 0 };
+    sa.sa_flags = 0;
+    sigemptyset(&sa.sa_mask);
+
+    // SIGPIPE se ignora: los envíos usan MSG_NOSIGNAL y un cliente que corta
+    // la conexión se detecta por EPIPE/ECONNRESET, cerrando solo ese socket
+    sa.sa_handler = SIG_IGN;
+    int ignored[] = { SIGPIPE };
+    utilsAddSignalsToHandler(&sa, ignored, sizeof(ignored) / sizeof(ignored[0]));
+
+    for (int i = 0; i < KEY_LOCK_STRIPES; i++) {
+        pthread_rwlock_init(&keyLocks[i], NULL);
+    }
+    cacheInit(config.cacheMB);
+    dbInit(config.storage);
+    idxInit();
+    ttlInit();
+    dbSyncInit();
+    replInit();
+
+    // sin -L se escucha como siempre en 127.0.0.1:<-p>
+    if (config.listenerCount == 0) {
+        serverListener_t* l = &config.listeners[config.listenerCount++];
+        l->kind = LISTEN_TCP;
+        strcpy(l->addr, "127.0.0.1");
+        l->port = config.port;
+    }
+
+    // Seteamos los sockets del server antes de lanzar los hilos, así un
+    // error de bind() se informa enseguida; los Unix se comparten entre hilos
+    for (int j = 0; j < config.listenerCount; j++) {
+        serverListener_t* l = &config.listeners[j];
+        l->fd = l->kind == LISTEN_TCP ? -1 : serverListenerOpen(l, config.backlog);
+        char name[MAX_PATH_LEN];
+        serverListenerName(l, name, sizeof(name));
+        TRACE_INFO("server: escuchando en %s", name);
+    }
+    serverStartNs = utilsNowNs();
+    for (int i = 0; i < config.workers; i++) {
+        workers[i].id = i;
+        workers[i].stats = calloc(1, sizeof(serverStats_t));
+        if (workers[i].stats == NULL) {
+            perror("Error in calloc");
+            utilsCleanupAndExit(EXIT_FAILURE);
+        }
+        if (config.hotTop > 0) workers[i].hot = hotNew();
+        // reserva para aceptar y rechazar con BUSY cuando se agoten los descriptores
+        workers[i].spareFd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        for (int j = 0; j < config.listenerCount; j++) {
+            const serverListener_t* l = &config.listeners[j];
+            workers[i].listen[j].worker = &workers[i];
+            workers[i].listen[j].fd = l->kind == LISTEN_TCP ? serverListenerOpen(l, config.backlog) : l->fd;
+        }
+        // el hilo de fsync puede avisar a cualquier hilo apenas arranca
+        if ((workers[i].syncFd = eventfd(0, EFD_NONBLOCK)) == -1) {
+            perror("Error in eventfd");
+            utilsCleanupAndExit(EXIT_FAILURE);
+        }
+    }
+
+    if (config.metricsPort) serverMetricsInit();
+
+    // el hilo principal atiende como worker 0
+    for (int i = 1; i < config.workers; i++) {
+        if (pthread_create(&workers[i].thread, NULL, serverWorkerRun, &workers[i]) != 0) {
+            fprintf(stderr, "ERROR creando el hilo %d\n", i);
+            utilsCleanupAndExit(EXIT_FAILURE);
+        }
+    }
+    serverWorkerRun(&workers[0]);
+
+    // para consistencia
+    utilsCleanupAndExit(EXIT_SUCCESS);
+    return EXIT_SUCCESS;
+}
+
+/*********************** funciones del servidor ************************/
+int serverSocketSet(int port, int backlog) {
+    serverListener_t l = { .kind = LISTEN_TCP, .addr = "127.0.0.1", .port = port };
+    return serverListenerOpen(&l, backlog);
+}
+
+static int serverListenerOpen(const serverListener_t* l, int backlog) {
+    // Cargamos la dirección: IPv4, IPv6 o Unix (la abstracta empieza con un byte 0)
+    struct sockaddr_storage addr = { 0 };
+    socklen_t addrLen;
+    if (l->kind == LISTEN_TCP) {
+        struct sockaddr_in* in4 = (struct sockaddr_in*)&addr;
+        struct sockaddr_in6* in6 = (struct sockaddr_in6*)&addr;
+        if (inet_pton(AF_INET, l->addr, &in4->sin_addr) == 1) {
+            in4->sin_family = AF_INET;
+            in4->sin_port = htons(l->port);
+            addrLen = sizeof(*in4);
+        } else if (inet_pton(AF_INET6, l->addr, &in6->sin6_addr) == 1) {
+            in6->sin6_family = AF_INET6;
+            in6->sin6_port = htons(l->port);
+            addrLen = sizeof(*in6);
+        } else {
+            fprintf(stderr, "ERROR invalid server IP: %s\n", l->addr);
+            utilsCleanupAndExit(EXIT_FAILURE);
+        }
+    } else {
+        struct sockaddr_un* un = (struct sockaddr_un*)&addr;
+        un->sun_family = AF_UNIX;
+        size_t len = strlen(l->addr);
+        if (l->kind == LISTEN_ABSTRACT) {
+            memcpy(un->sun_path + 1, l->addr, len);
+            len++; // el nombre abstracto no termina en null: cuenta el largo
+        } else {
+            memcpy(un->sun_path, l->addr, len);
+            // un socket que quedó de una corrida anterior no deja hacer bind()
+            struct stat st;
+            if (lstat(l->addr, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(l->addr);
+        }
+        addrLen = offsetof(struct sockaddr_un, sun_path) + len;
+    }
+
+    // se crea el socket (no bloqueante, para el bucle de eventos)
+    int s = socket(addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (s == -1) {
+        perror("Error in socket");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+
+    if (l->kind == LISTEN_TCP) {
+        // permite reiniciar el server sin esperar el TIME_WAIT del puerto
+        int opt = 1;
+        if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) == -1) {
+            perror("Error in setsockopt");
+            utilsCleanupAndExit(EXIT_FAILURE);
+        }
+
+        // varios sockets (uno por hilo) escuchando en el mismo puerto
+        if (setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) == -1) {
+            perror("Error in setsockopt");
+            utilsCleanupAndExit(EXIT_FAILURE);
+        }
+    }
+
+    // Abrimos puerto
+    if (bind(s, (struct sockaddr*)&addr, addrLen) == -1) {
+        perror("Error in bind");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+
+    // Seteamos socket en modo Listening
+    if (listen(s, backlog) == -1) {
+        perror("Error in listen");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+
+    return s;
+}
+
+static int serverListenerParse(const char* spec, serverListener_t* l) {
+    memset(l, 0, sizeof(*l));
+    const char* addr = spec;
+    if (strncmp(spec, "unix:", 5) == 0) {
+        l->kind = LISTEN_UNIX;
+        addr = spec + 5;
+    } else if (spec[0] == '@') {
+        l->kind = LISTEN_ABSTRACT;
+        addr = spec + 1;
+    }
+    if (l->kind != LISTEN_TCP) {
+        // sun_path tiene lugar para la ruta con su null, o para el 0 inicial y el nombre
+        if (addr[0] == '\0' || strlen(addr) >= sizeof(l->addr)) return -1;
+        strcpy(l->addr, addr);
+        return 0;
+    }
+
+    const char* colon = strrchr(spec, ':');
+    if (colon == NULL || colon == spec) return -1;
+    l->port = atoi(colon + 1);
+    if (l->port <= 0 || l->port > 65535) return -1;
+    size_t len = colon - spec;
+    if (spec[0] == '[' && spec[len - 1] == ']') { // IPv6 entre corchetes
+        spec++;
+        len -= 2;
+    }
+    if (len == 0 || len >= sizeof(l->addr)) return -1;
+    memcpy(l->addr, spec, len);
+    l->addr[len] = '\0';
+    unsigned char probe[sizeof(struct in6_addr)];
+    if (inet_pton(AF_INET, l->addr, probe) != 1 && inet_pton(AF_INET6, l->addr, probe) != 1) return -1;
+    return 0;
+}
+
+static void serverListenerName(const serverListener_t* l, char* buf, size_t len) {
+    if (l->kind == LISTEN_UNIX) {
+        snprintf(buf, len, "unix:%s", l->addr);
+    } else if (l->kind == LISTEN_ABSTRACT) {
+        snprintf(buf, len, "@%s", l->addr);
+    } else if (strchr(l->addr, ':') != NULL) {
+        snprintf(buf, len, "[%s]:%d", l->addr, l->port);
+    } else {
+        snprintf(buf, len, "%s:%d", l->addr, l->port);
+    }
+}
+
+int serverSocketAccept(serverWorker_t* worker, int serverSoc) {
+    // Ejecutamos accept4() para recibir conexiones entrantes ya no bloqueantes
+    struct sockaddr_storage clientaddr;
+    socklen_t addr_len = sizeof(clientaddr);
+    int clientSoc;
+    while ((clientSoc = accept4(serverSoc, (struct sockaddr*)&clientaddr, &addr_len, SOCK_NONBLOCK)) == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return -1; // no hay más conexiones pendientes
+        }
+        if (errno == ECONNABORTED || errno == EINTR) {
+            continue; // el cliente se fue antes del accept, no es fatal
+        }
+        // el kernel informa EMFILE antes de mirar la cola: puede que no haya ninguna
+        if ((errno == EMFILE || errno == ENFILE) && serverSocketShed(worker, serverSoc)) {
+            continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return -1;
+        }
+        if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+            // quedan en la cola hasta que se libere algo (o las tire el kernel)
+            TRACE_WARN("server: no se pueden aceptar conexiones: %s", strerror(errno));
+            return -1;
+        }
+        perror("Error in accept");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+
+    char ipClient[INET6_ADDRSTRLEN] = "local"; // por un socket Unix no hay dirección
+    if (clientaddr.ss_family == AF_INET) {
+        inet_ntop(AF_INET, &((struct sockaddr_in*)&clientaddr)->sin_addr, ipClient, sizeof(ipClient));
+    } else if (clientaddr.ss_family == AF_INET6) {
+        inet_ntop(AF_INET6, &((struct sockaddr_in6*)&clientaddr)->sin6_addr, ipClient, sizeof(ipClient));
+    }
+    TRACE_DEBUG("server: conexión desde:  %s", ipClient);
+
+    return clientSoc;
+}
+
+static int serverSocketShed(serverWorker_t* worker, int serverSoc) {
+    // se libera el descriptor de reserva para poder aceptarla, y se recupera
+    if (worker->spareFd == -1) return 0;
+    close(worker->spareFd);
+    int fd = accept4(serverSoc, NULL, NULL, SOCK_NONBLOCK);
+    int err = errno;
+    if (fd != -1) {
+        serverConnReject(worker, fd);
+        close(fd);
+    }
+    worker->spareFd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    errno = err; // si no rechazó ninguna, el motivo es el del accept()
+    return fd != -1;
+}
+
+static void serverConnReject(serverWorker_t* worker, int fd) {
+    // el socket recién aceptado tiene lugar: el BUSY entra sin bloquear
+    if (send(fd, "BUSY\n", 5, MSG_NOSIGNAL | MSG_DONTWAIT) == -1) {
+        TRACE_DEBUG("server: no se pudo enviar BUSY: %s", strerror(errno));
+    }
+    // se descarta lo que el cliente ya mandó: cerrar con datos sin leer
+    // envía un RST y el cliente podría perder el BUSY
+    char discard[512];
+    for (int i = 0; i < 4 && recv(fd, discard, sizeof(discard), MSG_DONTWAIT) > 0; i++) {}
+    worker->stats->connsRejected++;
+    TRACE_DEBUG("server: conexión rechazada, servidor ocupado");
+}
+
+static void* serverWorkerRun(void* arg) {
+    serverWorker_t* worker = arg;
+    if (config.engine == ENGINE_URING) {
+        serverUringLoop(worker);
+    } else {
+        serverEventLoop(worker);
+    }
+    return NULL;
+}
+
+static void serverEventLoop(serverWorker_t* worker) {
+    int epollFd;
+    if ((epollFd = worker->epollFd = epoll_create1(0)) == -1) {
+        perror("Error in epoll_create1");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+
+    // los sockets de escucha se identifican con data.ptr dentro de worker->listen
+    struct epoll_event ev = { 0 };
+    for (int i = 0; i < config.listenerCount; i++) {
+        // uno Unix lo esperan todos los hilos: que el kernel despierte a uno solo
+        ev.events = EPOLLIN | EPOLLET | (config.listeners[i].kind != LISTEN_TCP ? EPOLLEXCLUSIVE : 0);
+        ev.data.ptr = &worker->listen[i];
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, worker->listen[i].fd, &ev) == -1) {
+            perror("Error in epoll_ctl");
+            utilsCleanupAndExit(EXIT_FAILURE);
+        }
+    }
+    ev.events = EPOLLIN | EPOLLET;
+
+    // y el aviso del hilo de fsync con data.ptr == &worker->syncFd
+    ev.data.ptr = &worker->syncFd;
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, worker->syncFd, &ev) == -1) {
+        perror("Error in epoll_ctl");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+
+    TRACE_INFO("server: hilo %d esperando conexiones...", worker->id);
+    struct epoll_event events[MAX_EVENTS];
+    while (1) {
+        // se despierta a tiempo para el primer plazo que vence
+        int n = epoll_wait(epollFd, events, MAX_EVENTS, serverConnTimerExpire(worker));
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            perror("Error in epoll_wait");
+            utilsCleanupAndExit(EXIT_FAILURE);
+        }
+        worker->now = utilsNowNs();
+
+        for (int i = 0; i < n; i++) {
+            serverConn_t* conn = events[i].data.ptr;
+            uintptr_t slot = (uintptr_t)conn - (uintptr_t)worker->listen;
+            if (slot < config.listenerCount * sizeof(serverListenSoc_t)) {
+                // edge-triggered: hay que aceptar hasta vaciar la cola
+                int fd;
+                while ((fd = serverSocketAccept(worker, ((serverListenSoc_t*)conn)->fd)) != -1) {
+                    if (serverConnOpen(worker, fd) == NULL) close(fd);
+                }
+            } else if (events[i].data.ptr == &worker->syncFd) {
+                serverSyncWake(worker);
+            } else if (serverConnHandleEvent(conn, events[i].events) == -1) {
+                serverConnClose(conn);
+            }
+        }
+    }
+}
+
+static serverConn_t* serverConnOpen(serverWorker_t* worker, int fd) {
+    // lleno: se avisa enseguida en lugar de hacer esperar al cliente
+    if (__atomic_add_fetch(&serverConnCount, 1, __ATOMIC_RELAXED) > config.maxConns && config.maxConns > 0) {
+        __atomic_sub_fetch(&serverConnCount, 1, __ATOMIC_RELAXED);
+        serverConnReject(worker, fd);
+        return NULL;
+    }
+    serverConn_t* conn = calloc(1, sizeof(serverConn_t));
+    if (conn == NULL) {
+        perror("Error in calloc");
+        __atomic_sub_fetch(&serverConnCount, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    conn->fd = fd;
+    conn->worker = worker;
+    conn->readReady = 1;
+    conn->sendFd = -1;
+    conn->body.fd = -1;
+    conn->uringSlot = -1;
+
+    if (config.engine == ENGINE_URING) {
+        serverUringConnSetup(conn);
+        worker->stats->connsOpened++;
+        return conn;
+    }
+
+    // se registra lectura y escritura una sola vez: en modo edge-triggered
+    // EPOLLOUT solo avisa cuando el socket vuelve a tener lugar
+    struct epoll_event ev = { 0 };
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = conn;
+    if (epoll_ctl(worker->epollFd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        perror("Error in epoll_ctl");
+        __atomic_sub_fetch(&serverConnCount, 1, __ATOMIC_RELAXED);
+        free(conn);
+        return NULL;
+    }
+    worker->stats->connsOpened++;
+    return conn;
+}
+
+/**
+ * @brief Saca una conexión de la lista de espera de fsync de su hilo
+ */
+static void serverConnUnwait(serverConn_t* conn) {
+    if (!conn->waiting) return;
+    if (conn->waitPrev) conn->waitPrev->waitNext = conn->waitNext;
+    else conn->worker->waitList = conn->waitNext;
+    if (conn->waitNext) conn->waitNext->waitPrev = conn->waitPrev;
+    conn->waitPrev = conn->waitNext = NULL;
+    conn->waiting = 0;
+}
+
+/**
+ * @brief Saca una conexión de su lista de plazos
+ */
+static void serverConnTimerUnlink(serverConn_t* conn) {
+    if (conn->timer == CONN_TIMER_NONE) return;
+    serverWorker_t* worker = conn->worker;
+    if (conn->timerPrev) conn->timerPrev->timerNext = conn->timerNext;
+    else worker->timerHead[conn->timer] = conn->timerNext;
+    if (conn->timerNext) conn->timerNext->timerPrev = conn->timerPrev;
+    else worker->timerTail[conn->timer] = conn->timerPrev;
+    conn->timerPrev = conn->timerNext = NULL;
+    conn->timer = CONN_TIMER_NONE;
+}
+
+static void serverConnClose(serverConn_t* conn) {
+    if (!conn->closing) {
+        TRACE_DEBUG("server: cerrando conexión %d", conn->fd);
+        conn->worker->stats->connsClosed++;
+        serverConnUnwait(conn);
+        serverConnTimerUnlink(conn);
+        if (conn->sendFd != -1) close(conn->sendFd);
+        conn->sendFd = -1;
+        if (conn->body.fd != -1) dbStreamAbort(&conn->body);
+        conn->closing = 1;
+    }
+    // con io_uring el kernel puede estar usando los buffers de la conexión:
+    // shutdown() hace terminar lo que está en vuelo y al llegar la última
+    // terminación se vuelve a llamar para liberar
+    if (conn->uringRecv || conn->uringSend) {
+        shutdown(conn->fd, SHUT_RDWR);
+        return;
+    }
+    if (conn->uringSlot != -1) serverUringConnRelease(conn);
+    // close() también lo quita del conjunto de epoll
+    close(conn->fd);
+    __atomic_sub_fetch(&serverConnCount, 1, __ATOMIC_RELAXED);
+    free(conn->out);
+    free(conn->acks);
+    free(conn);
+}
+
+/**
+ * @brief Plazo de cada lista en ns (0 = sin plazo)
+ */
+static inline uint64_t serverConnTimeoutNs(serverConnTimer_t timer) {
+    int s = timer == CONN_TIMER_IDLE ? config.idleTimeout : timer == CONN_TIMER_READ ? config.readTimeout : 0;
+    return s * 1000000000ULL;
+}
+
+static void serverConnTimerUpdate(serverConn_t* conn) {
+    serverConnTimer_t timer = CONN_TIMER_IDLE;
+    if (conn->waiting) {
+        timer = CONN_TIMER_NONE; // la demora es del servidor, no del cliente
+    } else if (conn->inOff < conn->inLen || conn->bodyLeft > 0 || conn->outOff < conn->outLen ||
+               conn->sendFd != -1 || conn->uringSend) {
+        timer = CONN_TIMER_READ;
+    }
+    if (serverConnTimeoutNs(timer) == 0) timer = CONN_TIMER_NONE;
+
+    int progress = conn->timerProgress;
+    conn->timerProgress = 0;
+    if (timer == conn->timer && !progress) return;
+
+    // se pasa al final de la lista: las listas quedan ordenadas por timerAt
+    serverConnTimerUnlink(conn);
+    if (timer == CONN_TIMER_NONE) return;
+    serverWorker_t* worker = conn->worker;
+    conn->timer = timer;
+    conn->timerAt = worker->now;
+    conn->timerPrev = worker->timerTail[timer];
+    if (conn->timerPrev) conn->timerPrev->timerNext = conn;
+    else worker->timerHead[timer] = conn;
+    worker->timerTail[timer] = conn;
+}
+
+static int serverConnTimerExpire(serverWorker_t* worker) {
+    if (worker->timerHead[CONN_TIMER_IDLE] == NULL && worker->timerHead[CONN_TIMER_READ] == NULL) return -1;
+
+    worker->now = utilsNowNs();
+    uint64_t next = UINT64_MAX;
+    for (int t = CONN_TIMER_IDLE; t < CONN_TIMERS; t++) {
+        uint64_t timeout = serverConnTimeoutNs(t);
+        serverConn_t* conn;
+        while ((conn = worker->timerHead[t]) != NULL && conn->timerAt + timeout <= worker->now) {
+            TRACE_DEBUG("server: conexión %d %s", conn->fd,
+                        t == CONN_TIMER_IDLE ? "inactiva, se cierra" : "sin completar el pedido ni leer, se cierra");
+            worker->stats->connsTimedOut++;
+            serverConnClose(conn);
+        }
+        if (conn != NULL && conn->timerAt + timeout - worker->now < next) next = conn->timerAt + timeout - worker->now;
+    }
+    if (next == UINT64_MAX) return -1;
+    return (next + 999999) / 1000000; // redondeado hacia arriba, para no despertar antes de tiempo
+}
+
+static int serverConnHandleEvent(serverConn_t* conn, uint32_t events) {
+    if (events & EPOLLERR) return -1;
+
+    // edge-triggered: queda anotado hasta que read() devuelva EAGAIN
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) conn->readReady = 1;
+
+    // se intenta enviar siempre: tanto si hay respuestas nuevas como si
+    // el socket avisó que volvió a tener lugar (EPOLLOUT)
+    return serverConnPump(conn);
+}
+
+/**
+ * @brief Escritura cuyo fsync está esperando la conexión para seguir enviando
+ * @return Ticket a esperar, 0 si no espera ninguno
+ */
+static inline uint64_t serverConnSyncWait(const serverConn_t* conn) {
+    if (conn->syncTicket) return conn->syncTicket;
+    if (conn->ackCount) return conn->acks[conn->ackHead].ticket;
+    return 0;
+}
+
+/**
+ * @brief Indica si la conexión tiene que esperar a que el cliente lea
+ */
+static inline int serverConnPaused(const serverConn_t* conn) {
+    return conn->sendFd != -1 || conn->outLen - conn->outOff > CONN_OUT_HIGH_WATER;
+}
+
+/**
+ * @brief Indica si en el buffer de entrada hay algo completo para procesar
+ */
+static int serverInputComplete(const serverConn_t* conn) {
+    size_t avail = conn->inLen - conn->inOff;
+    if (avail == 0) return 0;
+    if (conn->bodyLeft > 0 || conn->proto == PROTO_UNKNOWN) return 1;
+    if (conn->proto == PROTO_BINARY) return serverFrameLen(conn->in + conn->inOff, avail) <= avail;
+    return memchr(conn->in + conn->inScan, '\n', conn->inLen - conn->inScan) != NULL;
+}
+
+/**
+ * @brief Anota la conexión en la lista de espera de su hilo si tiene respuestas retenidas por un fsync
+ */
+static void serverConnWaitSync(serverConn_t* conn) {
+    // el hilo de fsync avisa por el eventfd del hilo, ver serverSyncResume()
+    if (serverConnSyncWait(conn) && !conn->waiting) {
+        conn->waitPrev = NULL;
+        conn->waitNext = conn->worker->waitList;
+        if (conn->waitNext) conn->waitNext->waitPrev = conn;
+        conn->worker->waitList = conn;
+        conn->waiting = 1;
+    }
+}
+
+static int serverConnPump(serverConn_t* conn) {
+    if (config.engine == ENGINE_URING) {
+        if (serverUringPump(conn) == -1) return -1;
+        serverConnTimerUpdate(conn);
+        return 0;
+    }
+
+    while (1) {
+        // primero los comandos que ya están en el buffer, después se lee más
+        if (serverProcessInput(conn) == -1) return -1;
+        if (serverFlush(conn) == -1) return -1;
+        if (conn->closeAfterFlush || serverConnPaused(conn)) break; // sigue con EPOLLOUT
+
+        // si se había frenado por el cliente y ya se destrabó, quedan comandos completos
+        if (serverInputComplete(conn)) continue;
+        if (!conn->readReady || conn->peerClosed) break;
+        if (serverReadMessage(conn) == -1) return -1;
+    }
+
+    serverConnWaitSync(conn);
+
+    int pending = conn->outOff < conn->outLen || conn->sendFd != -1 || conn->ackCount > 0;
+    if (!pending && (conn->closeAfterFlush || conn->peerClosed)) return -1;
+    serverConnTimerUpdate(conn);
+    return 0;
+}
+
+static void serverSyncWake(serverWorker_t* worker) {
+    uint64_t count;
+    // se vacía el contador del eventfd (el aviso es edge-triggered)
+    while (read(worker->syncFd, &count, sizeof(count)) > 0) {}
+    serverSyncResume(worker);
+}
+
+static void serverSyncResume(serverWorker_t* worker) {
+    serverConn_t* conn = worker->waitList;
+    while (conn != NULL) {
+        serverConn_t* next = conn->waitNext;
+        if (dbSyncIsDurable(serverConnSyncWait(conn))) {
+            serverConnUnwait(conn);
+            if (serverConnPump(conn) == -1) serverConnClose(conn);
+        }
+        conn = next;
+    }
+}
+
+static void serverSyncAfterWrite(serverConn_t* conn) {
+    if (config.durability == DURABILITY_NONE) return;
+
+    uint64_t ticket = dbSyncTicket();
+    if (config.durability == DURABILITY_ALWAYS && conn->proto == PROTO_BINARY) {
+        // binario: solo se demora la respuesta de este pedido (ver serverReplyOk())
+        conn->binTicket = ticket;
+    } else if (config.durability == DURABILITY_ALWAYS) {
+        // lo encolado hasta ahora se puede enviar; lo que sigue espera al fsync
+        if (conn->syncTicket == 0) conn->syncOff = conn->outLen;
+        conn->syncTicket = ticket;
+    }
+}
+
+int serverReadMessage(serverConn_t* conn) {
+    int total = 0;
+    while (!conn->peerClosed && !conn->closeAfterFlush && conn->inLen < CONN_IN_BUF_LEN) {
+        ssize_t n;
+        if (conn->bodyLeft > 0 && conn->inLen == 0) {
+            // cuerpo de un SETL: en bloques grandes, sin pasar por el buffer de comandos
+            char chunk[STREAM_CHUNK_LEN];
+            n = read(conn->fd, chunk, conn->bodyLeft < sizeof(chunk) ? conn->bodyLeft : sizeof(chunk));
+            if (n > 0) {
+                serverStreamFeed(conn, chunk, n);
+                conn->timerProgress = 1;
+            }
+        } else {
+            n = read(conn->fd, conn->in + conn->inLen, CONN_IN_BUF_LEN - conn->inLen);
+            if (n > 0) conn->inLen += n;
+        }
+        if (n == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                conn->readReady = 0;
+                break;
+            }
+            if (errno == EINTR) continue;
+            perror("Error in read");
+            return -1;
+        }
+        if (n == 0) {
+            conn->peerClosed = 1; // EOF, se procesa lo que quedó y se cierra
+            break;
+        }
+        total += n;
+    }
+    TRACE_DEBUG("server: recibidos %d bytes", total);
+    return total;
+}
+
+/**
+ * @brief Procesa una línea completa (sin el '\n')
+ */
+static void serverProcessLine(serverConn_t* conn, const char* line, size_t len) {
+    serverStatsBegin(conn, len + 1);
+
+    // se tolera el "\r\n" de clientes tipo telnet
+    if (len > 0 && line[len - 1] == '\r') len--;
+
+    // el largo máximo depende del comando, lo controla serverProcessCommand()
+    serverProcessCommand(conn, line, len);
+    if (conn->bodyLeft == 0) serverStatsEnd(conn); // un SETL termina con el cuerpo
+
+    // modo compatibilidad: una respuesta por conexión (la de un SETL llega con el cuerpo)
+    if (config.oneShot && conn->bodyLeft == 0) conn->closeAfterFlush = 1;
+}
+
+static int serverProcessInput(serverConn_t* conn) {
+    while (conn->inOff < conn->inLen && !conn->closeAfterFlush && !conn->broken && !serverConnPaused(conn)) {
+        // cuerpo de un SETL: va tal cual al archivo temporal
+        if (conn->bodyLeft > 0) {
+            size_t n = conn->inLen - conn->inOff;
+            if (n > conn->bodyLeft) n = conn->bodyLeft;
+            serverStreamFeed(conn, conn->in + conn->inOff, n);
+            conn->inOff += n;
+            conn->inScan = conn->inOff;
+            conn->timerProgress = 1;
+            continue;
+        }
+
+        // los comandos de texto empiezan con una letra: un primer byte
+        // BIN_MAGIC_REQUEST no puede ser otra cosa que una trama binaria
+        if (conn->proto == PROTO_UNKNOWN) {
+            conn->proto = ((uint8_t)conn->in[conn->inOff] == BIN_MAGIC_REQUEST) ? PROTO_BINARY : PROTO_TEXT;
+            TRACE_DEBUG("server: protocolo %s", conn->proto == PROTO_BINARY ? "binario" : "texto");
+        }
+        if (conn->proto == PROTO_BINARY) {
+            if (!serverProcessFrame(conn)) break;
+            conn->inScan = conn->inOff;
+            conn->timerProgress = 1;
+            if (config.oneShot && conn->bodyLeft == 0) conn->closeAfterFlush = 1;
+            continue;
+        }
+
+        // el '\n' se busca solo en lo que llegó desde la última vez
+        char* nl = memchr(conn->in + conn->inScan, '\n', conn->inLen - conn->inScan);
+        if (nl == NULL) {
+            conn->inScan = conn->inLen;
+            break;
+        }
+
+        const char* line = conn->in + conn->inOff;
+        conn->inOff = conn->inScan = nl + 1 - conn->in;
+        conn->timerProgress = 1;
+        serverProcessLine(conn, line, nl - line);
+    }
+
+    if (conn->inOff == conn->inLen) {
+        conn->inOff = conn->inScan = conn->inLen = 0;
+    } else if (conn->inLen == CONN_IN_BUF_LEN && conn->inOff > 0) {
+        // se corre al inicio lo que quedó sin procesar, para hacer lugar a más
+        memmove(conn->in, conn->in + conn->inOff, conn->inLen - conn->inOff);
+        conn->inLen -= conn->inOff;
+        conn->inScan -= conn->inOff;
+        conn->inOff = 0;
+    }
+
+    if (conn->bodyLeft > 0 || serverConnPaused(conn)) {
+        // falta el resto del cuerpo, o se sigue cuando el cliente lea
+        if (conn->peerClosed && conn->bodyLeft > 0 && conn->inLen == 0) return -1; // SETL cortado
+    } else if (conn->proto == PROTO_BINARY) {
+        // una trama cortada por el cierre del cliente no se puede ejecutar
+        if (conn->peerClosed) conn->inOff = conn->inScan = conn->inLen = 0;
+    } else if (conn->inLen == CONN_IN_BUF_LEN && conn->inScan == conn->inLen) {
+        // buffer lleno y sin '\n': el comando no entra nunca
+        serverSendError(conn, "ERROR: comando muy largo.\n", 0);
+        conn->inOff = conn->inScan = conn->inLen = 0;
+        conn->closeAfterFlush = 1;
+    } else if (conn->peerClosed && conn->inLen > conn->inOff && !conn->closeAfterFlush) {
+        // el cliente cerró sin mandar '\n': se toma lo recibido como comando
+        serverProcessLine(conn, conn->in + conn->inOff, conn->inLen - conn->inOff);
+        conn->inOff = conn->inScan = conn->inLen = 0;
+    }
+    return conn->broken ? -1 : 0;
+}
+
+/**
+ * @brief Interpreta y ejecuta MGET, MSET o MDEL
+ * @param words Tokens del comando
+ * @param params Cantidad de tokens
+ */
+static void serverProcessBatch(serverConn_t* conn, const utilsSlice_t words[], int params) {
+    // MSET lleva clave y valor por cada par, los otros solo claves
+    int stride = utilsSliceEquals(words[0], "MSET") ? 2 : 1;
+    int n = (params - 1) / stride;
+    if ((params - 1) % stride != 0) {
+        serverSendError(conn, "ERROR: el comando MSET requiere pares de clave y valor.\n", 1);
+        return;
+    }
+    if (n > MAX_BATCH_KEYS) {
+        serverSendError(conn, "ERROR: demasiadas claves.\n", 1);
+        return;
+    }
+
+    // las claves se terminan en null en un buffer aparte; los valores quedan en la línea
+    char keyBuf[CONN_IN_BUF_LEN + MAX_BATCH_KEYS];
+    const char* keys[MAX_BATCH_KEYS];
+    utilsSlice_t values[MAX_BATCH_KEYS];
+    size_t used = 0;
+    for (int i = 0; i < n; i++) {
+        utilsSlice_t key = words[1 + i * stride];
+        if (key.len >= MAX_MSG_LENGTH) {
+            serverSendError(conn, "ERROR: clave muy larga.\n", 1);
+            return;
+        }
+        memcpy(keyBuf + used, key.ptr, key.len);
+        keyBuf[used + key.len] = '\0';
+        keys[i] = keyBuf + used;
+        used += key.len + 1;
+        if (stride == 2) values[i] = words[2 + i * stride];
+    }
+
+    if (utilsSliceEquals(words[0], "MGET")) {
+        serverStatsParsed(conn, STAT_MGET);
+        serverHandleMgetCmd(conn, keys, n);
+    } else if (stride == 2) {
+        serverStatsParsed(conn, STAT_MSET);
+        serverHandleMsetCmd(conn, keys, values, n);
+    } else {
+        serverStatsParsed(conn, STAT_MDEL);
+        serverHandleMdelCmd(conn, keys, n);
+    }
+}
+
+/**
+ * @brief Interpreta y ejecuta SCAN o RANGE
+ *
+ * Van aparte del resto porque con el cursor la línea puede pasar de
+ * MAX_MSG_LENGTH.
+ * @param words Tokens del comando
+ * @param params Cantidad de tokens
+ */
+static void serverProcessScan(serverConn_t* conn, const utilsSlice_t words[], int params) {
+    int range = utilsSliceEquals(words[0], "RANGE");
+    serverStatsParsed(conn, range ? STAT_RANGE : STAT_SCAN);
+
+    // SCAN <prefijo> o RANGE <desde> <hasta>, y después [COUNT <n>] [<cursor>]
+    int fixed = range ? 3 : 2;
+    int extra = params - fixed;
+    size_t count = SCAN_DEFAULT_COUNT;
+    int valid = extra >= 0 && extra <= 3;
+    if (valid && extra >= 2) {
+        valid = utilsSliceEquals(words[fixed], "COUNT") && utilsSliceToSize(words[fixed + 1], &count) == 0 &&
+                count > 0 && count <= SCAN_MAX_COUNT;
+    }
+    if (!valid) {
+        serverSendError(conn, range ? "ERROR: el comando RANGE requiere <desde> <hasta> [COUNT <n>] [<cursor>].\n"
+                                    : "ERROR: el comando SCAN requiere <prefijo> [COUNT <n>] [<cursor>].\n", 1);
+        return;
+    }
+
+    char keys[2][MAX_MSG_LENGTH];
+    for (int i = 1; i < fixed; i++) {
+        if (words[i].len >= MAX_MSG_LENGTH) {
+            serverSendError(conn, "ERROR: clave muy larga.\n", 1);
+            return;
+        }
+        memcpy(keys[i - 1], words[i].ptr, words[i].len);
+        keys[i - 1][words[i].len] = '\0';
+    }
+
+    char from[MAX_MSG_LENGTH];
+    int after = 0;
+    if (extra % 2 == 1 && !utilsSliceEquals(words[params - 1], "0")) {
+        char name[DB_NAME_LEN];
+        utilsSlice_t cursor = words[params - 1];
+        if (cursor.len >= DB_NAME_LEN || cursor.ptr[0] != '~') {
+            serverSendError(conn, "ERROR: cursor inválido.\n", 0);
+            return;
+        }
+        memcpy(name, cursor.ptr, cursor.len);
+        name[cursor.len] = '\0';
+        if (utilsKeyDecode(name, from) == -1) {
+            serverSendError(conn, "ERROR: cursor inválido.\n", 0);
+            return;
+        }
+        after = 1;
+    } else {
+        strcpy(from, range ? keys[0] : "");
+    }
+
+    if (range) {
+        serverHandleScanCmd(conn, from, after, NULL, keys[1], count);
+    } else {
+        // "tenant:42:*" es lo mismo que "tenant:42:", y "*" son todas las claves
+        size_t prefixLen = strlen(keys[0]);
+        if (keys[0][prefixLen - 1] == '*') keys[0][--prefixLen] = '\0';
+        serverHandleScanCmd(conn, from, after, prefixLen > 0 ? keys[0] : NULL, NULL, count);
+    }
+}
+
+static void serverProcessCommand(serverConn_t* conn, const char* msg, size_t len) {
+    TRACE_DEBUG("server: comando recibido (%zu bytes)", len);
+
+    // Procesamiento del mensaje: los tokens apuntan a la línea, no se copian
+    utilsSlice_t words[MAX_BATCH_WORDS];
+    int params = utilsStringTokenize(msg, len, MAX_BATCH_WORDS, words);
+    TRACE_DEBUG("server: parámetros recibidos %d", params);
+    if (params == -1) {
+        serverSendError(conn, "ERROR: demasiados parámetros.\n", 1);
+        return;
+    }
+    if (params == 1 && utilsSliceEquals(words[0], "STATS")) {
+        serverStatsParsed(conn, STAT_STATS);
+        serverHandleStatsCmd(conn);
+        return;
+    }
+    if (params == 1 && utilsSliceEquals(words[0], "SNAPSHOT")) {
+        serverStatsParsed(conn, STAT_SNAPSHOT);
+        serverHandleSnapshotCmd(conn);
+        return;
+    }
+    if (utilsSliceEquals(words[0], "HOTKEYS")) {
+        serverStatsParsed(conn, STAT_HOTKEYS);
+        size_t count = HOTKEYS_DEFAULT_COUNT;
+        if (params != 1 && (params != 3 || !utilsSliceEquals(words[1], "COUNT") ||
+                            utilsSliceToSize(words[2], &count) == -1 || count == 0 || count > HOT_MAX_TOP)) {
+            serverSendError(conn, "ERROR: el comando HOTKEYS acepta solo [COUNT <n>].\n", 1);
+            return;
+        }
+        serverHandleHotkeysCmd(conn, count);
+        return;
+    }
+    if (params < 2) { // ademas del comando tiene que haber algo mas
+        serverSendError(conn, "ERROR: comando muy corto.\n", 1);
+        return;
+    }
+
+    // los comandos de varias claves pueden ocupar todo el buffer de entrada
+    int batch = utilsSliceEquals(words[0], "MGET") || utilsSliceEquals(words[0], "MSET") ||
+                utilsSliceEquals(words[0], "MDEL");
+    if (batch) {
+        serverProcessBatch(conn, words, params);
+        return;
+    }
+    if (utilsSliceEquals(words[0], "SCAN") || utilsSliceEquals(words[0], "RANGE")) {
+        serverProcessScan(conn, words, params);
+        return;
+    }
+    if (len >= MAX_MSG_LENGTH) {
+        serverSendError(conn, "ERROR: comando muy largo.\n", 1);
+        return;
+    }
+    if (params > MAX_WORDS) {
+        serverSendError(conn, "ERROR: demasiados parámetros.\n", 1);
+        return;
+    }
+
+    // la clave sí se termina en null: la usan las rutas y los índices del almacenamiento
+    char key[MAX_MSG_LENGTH];
+    memcpy(key, words[1].ptr, words[1].len);
+    key[words[1].len] = '\0';
+
+    serverStatCmd_t cmd = STAT_INVALID;
+    if (utilsSliceEquals(words[0], "SET")) cmd = STAT_SET;
+    else if (utilsSliceEquals(words[0], "SETL")) cmd = STAT_SETL;
+    else if (utilsSliceEquals(words[0], "GET") || utilsSliceEquals(words[0], "GETL")) cmd = STAT_GET;
+    else if (utilsSliceEquals(words[0], "DEL")) cmd = STAT_DEL;
+    else if (utilsSliceEquals(words[0], "TTL")) cmd = STAT_TTL;
+    else if (utilsSliceEquals(words[0], "PERSIST")) cmd = STAT_PERSIST;
+    else if (utilsSliceEquals(words[0], "INCR") || utilsSliceEquals(words[0], "DECR")) cmd = STAT_INCR;
+    else if (utilsSliceEquals(words[0], "APPEND")) cmd = STAT_APPEND;
+    else if (utilsSliceEquals(words[0], "CAS")) cmd = STAT_CAS;
+    serverStatsParsed(conn, cmd);
+
+    if (utilsSliceEquals(words[0], "SET")) {
+        size_t secs;
+        if (params == 3) {
+            serverHandleSetCmd(conn, key, words[2], 0);
+        } else if (params == 5 && utilsSliceEquals(words[3], "EX")) {
+            if (utilsSliceToSize(words[4], &secs) == -1 || secs == 0 || secs > UINT32_MAX) {
+                serverSendError(conn, "ERROR: tiempo de vida inválido.\n", 0);
+            } else {
+                serverHandleSetCmd(conn, key, words[2], utilsWallNs() / 1000000 + secs * 1000);
+            }
+        } else {
+            serverSendError(conn, "ERROR: el comando SET requiere clave y valor.\n", 1);
+        }
+    } else if (utilsSliceEquals(words[0], "SETL")) {
+        if (params == 3) {
+            size_t valLen;
+            if (utilsSliceToSize(words[2], &valLen) == -1) {
+                // sin un largo válido no se sabe qué sigue: no se espera cuerpo
+                serverSendError(conn, "ERROR: largo de valor inválido.\n", 1);
+            } else {
+                serverHandleSetlCmd(conn, key, valLen);
+            }
+        } else {
+            serverSendError(conn, "ERROR: el comando SETL requiere clave y largo.\n", 1);
+        }
+    } else if (utilsSliceEquals(words[0], "GET") || utilsSliceEquals(words[0], "GETL")) {
+        if (params == 2) {
+            serverHandleGetCmd(conn, key, words[0].len == 4);
+        } else {
+            serverSendError(conn, "ERROR: el comando GET solo requiere clave.\n", 1);
+        }
+    } else if (utilsSliceEquals(words[0], "DEL")) {
+        if (params == 2) {
+            serverHandleDelCmd(conn, key);
+        } else {
+            serverSendError(conn, "ERROR: el comando DEL solo requiere clave.\n", 1);
+        }
+    } else if (utilsSliceEquals(words[0], "TTL")) {
+        if (params == 2) {
+            serverHandleTtlCmd(conn, key);
+        } else {
+            serverSendError(conn, "ERROR: el comando TTL solo requiere clave.\n", 1);
+        }
+    } else if (utilsSliceEquals(words[0], "PERSIST")) {
+        if (params == 2) {
+            serverHandlePersistCmd(conn, key);
+        } else {
+            serverSendError(conn, "ERROR: el comando PERSIST solo requiere clave.\n", 1);
+        }
+    } else if (cmd == STAT_INCR) {
+        int64_t delta = 1;
+        if (params > 3 || (params == 3 && utilsSliceToInt64(words[2], &delta) == -1)) {
+            serverSendError(conn, "ERROR: el comando INCR/DECR requiere clave y, opcional, un entero.\n", 1);
+        } else if (words[0].ptr[0] == 'D' && delta == INT64_MIN) {
+            serverSendError(conn, "ERROR: el resultado se sale de rango.\n", 0);
+        } else {
+            serverHandleIncrCmd(conn, key, words[0].ptr[0] == 'D' ? -delta : delta);
+        }
+    } else if (cmd == STAT_APPEND) {
+        if (params == 3) {
+            serverHandleAppendCmd(conn, key, words[2]);
+        } else {
+            serverSendError(conn, "ERROR: el comando APPEND requiere clave y valor.\n", 1);
+        }
+    } else if (cmd == STAT_CAS) {
+        if (params == 4) {
+            serverHandleCasCmd(conn, key, words[2], words[3]);
+        } else {
+            serverSendError(conn, "ERROR: el comando CAS requiere clave, valor esperado y valor nuevo.\n", 1);
+        }
+    } else {
+        serverSendError(conn, "ERROR: ningún comando válido detectado.\n", 1);
+    }
+}
+
+static size_t serverFrameLen(const char* buf, size_t avail) {
+    serverBinHeader_t h;
+    if (avail < sizeof(h)) return sizeof(h);
+    memcpy(&h, buf, sizeof(h));
+    size_t keyLen = ntohs(h.keyLen);
+    if (keyLen == 0 || keyLen >= MAX_MSG_LENGTH) return sizeof(h);
+    size_t len = sizeof(h) + keyLen;
+    if (h.opcode == BIN_OP_SET && len + ntohl(h.valLen) <= CONN_IN_BUF_LEN) len += ntohl(h.valLen);
+    return len;
+}
+
+static int serverProcessFrame(serverConn_t* conn) {
+    const char* frame = conn->in + conn->inOff;
+    size_t frameLen = serverFrameLen(frame, conn->inLen - conn->inOff);
+    if (frameLen > conn->inLen - conn->inOff) return 0;
+    conn->inOff += frameLen;
+    serverStatsBegin(conn, frameLen);
+
+    serverBinHeader_t h;
+    memcpy(&h, frame, sizeof(h));
+    size_t keyLen = ntohs(h.keyLen);
+    size_t valLen = ntohl(h.valLen);
+    conn->binOpcode = h.opcode;
+    conn->binOpaque = h.opaque;
+    TRACE_DEBUG("server: trama recibida: opcode %u, clave %zu bytes, valor %zu bytes", h.opcode, keyLen, valLen);
+
+    if (h.magic != BIN_MAGIC_REQUEST) {
+        // se perdió el encuadre: no se puede saber dónde empieza la próxima trama
+        serverSendError(conn, "ERROR: trama inválida.\n", 0);
+        conn->closeAfterFlush = 1;
+        serverStatsEnd(conn);
+        return 1;
+    }
+
+    // lo que no se usa de la trama se descarta como el cuerpo de un SETL rechazado
+    size_t rest = sizeof(h) + keyLen + valLen - frameLen;
+    if (keyLen == 0 || keyLen >= MAX_MSG_LENGTH) {
+        serverSendError(conn, "ERROR: largo de clave inválido.\n", 0);
+    } else if (h.opcode != BIN_OP_GET && h.opcode != BIN_OP_SET && h.opcode != BIN_OP_DEL) {
+        serverSendError(conn, "ERROR: operación desconocida.\n", 0);
+    } else if (h.opcode != BIN_OP_SET && valLen != 0) {
+        serverSendError(conn, "ERROR: la operación no lleva valor.\n", 0);
+    } else {
+        char key[MAX_MSG_LENGTH];
+        memcpy(key, frame + sizeof(h), keyLen);
+        key[keyLen] = '\0';
+
+        switch (h.opcode) {
+        case BIN_OP_GET:
+            serverStatsParsed(conn, STAT_GET);
+            serverHandleGetCmd(conn, key, 1);
+            break;
+        case BIN_OP_SET:
+            if (rest == 0) {
+                serverStatsParsed(conn, STAT_SET);
+                utilsSlice_t value = { frame + sizeof(h) + keyLen, valLen };
+                serverHandleSetCmd(conn, key, value, 0);
+            } else {
+                serverStatsParsed(conn, STAT_SETL);
+                serverHandleSetlCmd(conn, key, valLen);
+            }
+            rest = 0;
+            break;
+        case BIN_OP_DEL:
+            serverStatsParsed(conn, STAT_DEL);
+            serverHandleDelCmd(conn, key);
+            break;
+        }
+    }
+    if (rest > 0) {
+        conn->bodyLeft = rest;
+        conn->bodyDiscard = 1;
+    }
+    if (conn->bodyLeft == 0) serverStatsEnd(conn);
+    return 1;
+}
+
+/**
+ * @brief Marca la conexión para cerrarla: lo que sigue no se responde
+ *
+ * Solo afecta a esta conexión; serverProcessInput() o el envío devuelven -1
+ * y el bucle de eventos la cierra.
+ */
+static void serverConnBreak(serverConn_t* conn) {
+    if (!conn->broken) conn->worker->stats->connsDropped++;
+    conn->broken = 1;
+}
+
+int serverSendMessage(serverConn_t* conn, const char* buffer) {
+    size_t len = strlen(buffer);
+    serverSendBytes(conn, buffer, len);
+    return len;
+}
+
+static void serverSendBytes(serverConn_t* conn, const void* data, size_t len) {
+    if (conn->broken) return;
+    // un cliente que pide sin leer no puede acumular respuestas sin límite
+    if (config.outLimitMB > 0 && conn->outLen - conn->outOff + len > config.outLimitMB * 1024 * 1024) {
+        TRACE_WARN("server: conexión %d supera el límite de salida, se cierra", conn->fd);
+        serverConnBreak(conn);
+        return;
+    }
+    // se agranda el buffer de salida si hace falta
+    if (conn->outLen + len > conn->outCap) {
+        size_t cap = conn->outCap ? conn->outCap : CONN_OUT_BUF_INIT_LEN;
+        while (cap < conn->outLen + len) cap *= 2;
+        char* out;
+        if (conn->uringSend && conn->uringSendBuf == conn->out) {
+            // io_uring está enviando desde este buffer: se copia a uno nuevo
+            // y el viejo se libera cuando termine el envío
+            out = malloc(cap);
+            if (out != NULL) memcpy(out, conn->out, conn->outLen);
+        } else {
+            out = realloc(conn->out, cap);
+        }
+        if (out == NULL) {
+            perror("Error in realloc");
+            serverConnBreak(conn);
+            return;
+        }
+        conn->out = out;
+        conn->outCap = cap;
+    }
+    memcpy(conn->out + conn->outLen, data, len);
+    conn->outLen += len;
+    conn->bytesOut += len;
+}
+
+static void serverSendVector(serverConn_t* conn, const struct iovec* iov, int iovCnt) {
+    if (conn->broken) return;
+    // si hay algo encolado (o retenido por un fsync) la respuesta va detrás
+    size_t sent = 0;
+    if (conn->outOff == conn->outLen && conn->sendFd == -1) {
+        ssize_t n;
+        do {
+            n = writev(conn->fd, iov, iovCnt);
+        } while (n == -1 && errno == EINTR);
+        // con error se encola todo: serverFlush() lo vuelve a ver y cierra la conexión
+        if (n > 0) {
+            TRACE_DEBUG("server: enviados %zd bytes con writev", n);
+            sent = n;
+            conn->bytesOut += n;
+        }
+    }
+
+    // lo que no salió se encola, en orden
+    for (int i = 0; i < iovCnt; i++) {
+        if (sent >= iov[i].iov_len) {
+            sent -= iov[i].iov_len;
+            continue;
+        }
+        serverSendBytes(conn, (const char*)iov[i].iov_base + sent, iov[i].iov_len - sent);
+        sent = 0;
+    }
+}
+
+static void serverSendFile(serverConn_t* conn, const dbValueRef_t* ref) {
+    if (ref->len == 0) {
+        close(ref->fd);
+        return;
+    }
+    conn->bytesOut += ref->len;
+    conn->sendFd = ref->fd;
+    conn->sendAt = conn->outLen;
+    conn->sendOff = ref->off;
+    conn->sendLeft = ref->len;
+}
+
+/**
+ * @brief Hasta dónde de out se puede enviar
+ *
+ * Con durabilidad "always" lo que sigue a una escritura no durable se retiene.
+ */
+static size_t serverFlushLimit(serverConn_t* conn) {
+    if (conn->syncTicket) {
+        if (!dbSyncIsDurable(conn->syncTicket)) return conn->syncOff;
+        conn->syncTicket = 0;
+    }
+    return conn->outLen;
+}
+
+/**
+ * @brief Envía con sendfile() lo que entre del valor pendiente
+ * @return 1 si avanzó, 0 si el socket está lleno, -1 si hubo error
+ */
+static int serverFlushFile(serverConn_t* conn) {
+    // el valor va del archivo al socket dentro del kernel, sin copiarlo al proceso
+    ssize_t n;
+    do {
+        n = sendfile(conn->fd, conn->sendFd, &conn->sendOff, conn->sendLeft);
+    } while (n == -1 && errno == EINTR);
+    if (n == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) return 0; // cliente lento
+        if (errno != EPIPE && errno != ECONNRESET) perror("Error in sendfile");
+        return -1;
+    }
+    if (n == 0) {
+        fprintf(stderr, "ERROR el valor terminó antes de lo esperado\n");
+        return -1;
+    }
+    TRACE_DEBUG("server: enviados %zd bytes con sendfile", n);
+    conn->sendLeft -= n;
+    conn->timerProgress = 1;
+    if (conn->sendLeft == 0) {
+        close(conn->sendFd);
+        conn->sendFd = -1;
+    }
+    return 1;
+}
+
+static int serverFlush(serverConn_t* conn) {
+    if (conn->ackCount > 0) serverBinReleaseAcks(conn);
+    if (conn->broken) return -1;
+    size_t limit = serverFlushLimit(conn);
+
+    while (1) {
+        // lo que va antes del valor pendiente (si hay) sale del buffer
+        int fileNext = (conn->sendFd != -1 && conn->sendAt <= limit);
+        size_t end = fileNext ? conn->sendAt : limit;
+        if (conn->outOff < end) {
+            // MSG_NOSIGNAL: si el cliente se fue devuelve EPIPE en vez de SIGPIPE
+            // MSG_MORE: el encabezado sale junto con el comienzo del valor
+            ssize_t n = send(conn->fd, conn->out + conn->outOff, end - conn->outOff,
+                             MSG_NOSIGNAL | (fileNext ? MSG_MORE : 0));
+            if (n == -1) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) { // espera EPOLLOUT
+                    serverStatsSent(conn);
+                    return 0;
+                }
+                if (errno == EINTR) continue;
+                if (errno != EPIPE && errno != ECONNRESET) perror("Error in write");
+                return -1;
+            }
+            TRACE_DEBUG("server: enviados %zd bytes", n);
+            conn->outOff += n;
+            conn->timerProgress = 1;
+            continue;
+        }
+        if (!fileNext) break;
+
+        int r = serverFlushFile(conn);
+        if (r == -1) return -1;
+        if (r == 0) { // espera EPOLLOUT
+            serverStatsSent(conn);
+            return 0;
+        }
+    }
+    serverStatsSent(conn);
+    if (conn->outOff == conn->outLen && conn->sendFd == -1) conn->outOff = conn->outLen = 0;
+    return 0;
+}
+
+/**
+ * @brief Encola el encabezado de una respuesta binaria al pedido en curso
+ */
+static void serverBinReply(serverConn_t* conn, serverBinStatus_t status, size_t valLen) {
+    serverBinHeader_t h = { 0 };
+    h.magic = BIN_MAGIC_RESPONSE;
+    h.opcode = conn->binOpcode;
+    h.keyLen = htons(status);
+    h.valLen = htonl(valLen);
+    h.opaque = conn->binOpaque;
+    serverSendBytes(conn, &h, sizeof(h));
+}
+
+static void serverBinReleaseAcks(serverConn_t* conn) {
+    while (conn->ackCount > 0 && dbSyncIsDurable(conn->acks[conn->ackHead].ticket)) {
+        serverSendBytes(conn, &conn->acks[conn->ackHead].h, sizeof(serverBinHeader_t));
+        conn->ackHead++;
+        conn->ackCount--;
+    }
+    if (conn->ackCount == 0) conn->ackHead = 0;
+}
+
+static void serverReplyOk(serverConn_t* conn) {
+    if (conn->proto != PROTO_BINARY) {
+        serverSendMessage(conn, "OK\n");
+        return;
+    }
+    if (conn->binTicket == 0) {
+        serverBinReply(conn, BIN_STATUS_OK, 0);
+        return;
+    }
+
+    // la escritura todavía no es durable: el OK espera, los pedidos que siguen no
+    if (conn->ackHead + conn->ackCount == conn->ackCap) {
+        if (conn->ackHead > 0) {
+            memmove(conn->acks, conn->acks + conn->ackHead, conn->ackCount * sizeof(serverBinAck_t));
+            conn->ackHead = 0;
+        } else {
+            size_t cap = conn->ackCap ? conn->ackCap * 2 : 16;
+            serverBinAck_t* acks = realloc(conn->acks, cap * sizeof(serverBinAck_t));
+            if (acks == NULL) {
+                perror("Error in realloc");
+                serverConnBreak(conn);
+                return;
+            }
+            conn->acks = acks;
+            conn->ackCap = cap;
+        }
+    }
+    serverBinAck_t* ack = &conn->acks[conn->ackHead + conn->ackCount++];
+    ack->ticket = conn->binTicket;
+    ack->h.magic = BIN_MAGIC_RESPONSE;
+    ack->h.opcode = conn->binOpcode;
+    ack->h.keyLen = htons(BIN_STATUS_OK);
+    ack->h.valLen = 0;
+    ack->h.opaque = conn->binOpaque;
+    conn->binTicket = 0;
+}
+
+static void serverReplyNotFound(serverConn_t* conn) {
+    if (conn->proto == PROTO_BINARY) {
+        serverBinReply(conn, BIN_STATUS_NOTFOUND, 0);
+    } else {
+        serverSendMessage(conn, "NOTFOUND\n");
+    }
+}
+
+static void serverReplyValue(serverConn_t* conn, const char* value, size_t len,
+                             const dbValueRef_t* ref, int withLen) {
+    if (conn->proto == PROTO_BINARY) {
+        serverBinReply(conn, BIN_STATUS_OK, len);
+    } else {
+        char header[32];
+        snprintf(header, sizeof(header), withLen ? "OK %zu\n" : "OK\n", len);
+        serverSendMessage(conn, header);
+    }
+    if (ref == NULL) {
+        serverSendBytes(conn, value, len);
+    } else {
+        serverSendFile(conn, ref);
+    }
+    if (conn->proto != PROTO_BINARY && !withLen) serverSendMessage(conn, "\n");
+}
+
+void serverSendUsageMsg(serverConn_t* conn) {
+    serverSendMessage(conn, "Usage:\n<CMD> <key> [<value>]\nComandos:\n\tSET\tSetea un registro clave-valor nuevo.\n");
+    serverSendMessage(conn, "\t\tSET <key> <value> EX <segundos> además le pone vencimiento.\n");
+    serverSendMessage(conn, "\tGET\tObtiene el valor de una clave.\n\tDEL\tElimina un registro a partir de su clave.\n");
+    serverSendMessage(conn, "\tSETL\tSETL <key> <largo>, seguido de <largo> bytes de valor.\n");
+    serverSendMessage(conn, "\tGETL\tComo GET, responde OK <largo> y el valor sin salto de línea final.\n");
+    serverSendMessage(conn, "\tMGET\tMGET <key> [<key> ...], responde cada una como GETL (NOTFOUND si no existe).\n");
+    serverSendMessage(conn, "\tMSET\tMSET <key> <value> [<key> <value> ...]\n\tMDEL\tMDEL <key> [<key> ...], responde OK <borradas>.\n");
+    serverSendMessage(conn, "\tTTL\tSegundos hasta que vence la clave, responde OK <segundos> (OK -1 si no vence).\n");
+    serverSendMessage(conn, "\tPERSIST\tQuita el vencimiento, responde OK 1 si tenía (OK 0 si no).\n");
+    serverSendMessage(conn, "\tINCR\tINCR <key> [<n>], suma n (1 si no se indica) a un entero, responde OK <valor>.\n");
+    serverSendMessage(conn, "\tDECR\tDECR <key> [<n>], como INCR pero resta.\n");
+    serverSendMessage(conn, "\tAPPEND\tAPPEND <key> <value>, agrega al final, responde OK <largo>.\n");
+    serverSendMessage(conn, "\tCAS\tCAS <key> <esperado> <nuevo>, reemplaza solo si vale <esperado> (si no, MISMATCH).\n");
+    serverSendMessage(conn, "\tSCAN\tSCAN <prefijo> [COUNT <n>] [<cursor>], responde OK <cursor> <n> y una clave por línea.\n");
+    serverSendMessage(conn, "\tRANGE\tRANGE <desde> <hasta> [COUNT <n>] [<cursor>], claves desde <desde> hasta antes de <hasta>.\n");
+    serverSendMessage(conn, "\tHOTKEYS\tHOTKEYS [COUNT <n>], claves más pedidas, de más bytes y valores más grandes.\n");
+}
+
+static void serverHandleSetCmd(serverConn_t* conn, const char * key, utilsSlice_t value, uint64_t expireMs) {
+    TRACE_DEBUG("server: comando SET detectado - SET %s (%zu bytes)", key, value.len);
+
+    if (replIsReplica()) {
+        serverSendError(conn, "ERROR: réplica de solo lectura.\n", 0);
+        return;
+    }
+    // crear/actualizar el registro (y la cache, bajo el mismo lock)
+    dbLockKey(key, 1);
+    int keyExists = dbCreateKey(key, value.ptr, value.len, 0);
+    if (expireMs) ttlSet(key, expireMs);
+    cachePut(key, value.ptr, value.len);
+    dbUnlockKey(key);
+    hotRecord(conn, key, value.len);
+    serverSyncAfterWrite(conn);
+    if (keyExists) {
+        TRACE_DEBUG("server: clave actualizada: %s, %zu bytes", key, value.len);
+    } else {
+        TRACE_DEBUG("server: clave creada: %s, %zu bytes", key, value.len);
+    }
+    serverReplyOk(conn);
+}
+
+static void serverHandleSetlCmd(serverConn_t* conn, const char * key, size_t len) {
+    TRACE_DEBUG("server: comando SETL detectado - SETL %s %zu", key, len);
+
+    conn->bodyLeft = len;
+    if (replIsReplica()) {
+        serverSendError(conn, "ERROR: réplica de solo lectura.\n", 0);
+        conn->bodyDiscard = len > 0;
+        return;
+    }
+    if (len > MAX_VALUE_LEN) {
+        // se responde ya, pero el cuerpo hay que consumirlo igual
+        serverSendError(conn, "ERROR: valor muy largo.\n", 0);
+        conn->bodyDiscard = 1;
+        return;
+    }
+    strcpy(conn->bodyKey, key);
+    dbStreamOpen(&conn->body, len);
+    serverStreamFeed(conn, NULL, 0); // un valor vacío se guarda enseguida
+}
+
+static void serverStreamFeed(serverConn_t* conn, const char* data, size_t len) {
+    if (!conn->bodyDiscard && len > 0) dbStreamWrite(&conn->body, data, len);
+    conn->bodyLeft -= len;
+    conn->statIn += len;
+    if (conn->bodyLeft > 0) return;
+
+    if (conn->bodyDiscard) {
+        conn->bodyDiscard = 0;
+    } else {
+        // el valor completo reemplaza al anterior de una vez, bajo el lock de la clave
+        const char* key = conn->bodyKey;
+        dbLockKey(key, 1);
+        cacheInvalidate(key);
+        int keyExists = dbStreamCommit(key, &conn->body, 0);
+        dbUnlockKey(key);
+        hotRecord(conn, key, conn->body.len);
+        serverSyncAfterWrite(conn);
+        TRACE_DEBUG("server: clave %s: %s, %zu bytes", keyExists ? "actualizada" : "creada", key,
+                    (size_t)conn->body.len);
+        serverReplyOk(conn);
+    }
+    serverStatsEnd(conn);
+    if (config.oneShot) conn->closeAfterFlush = 1;
+}
+
+static void serverHandleGetCmd(serverConn_t* conn, const char * key, int withLen) {
+    TRACE_DEBUG("server: comando GET detectado - GET %s", key);
+
+    char value[MAX_VAL_READ_LEN + 1];
+    dbValueRef_t ref = { .fd = -1 };
+    ttlExpireIfDue(key);
+    dbLockKey(key, 0);
+    // primero la cache: si está no se toca el disco
+    ssize_t valLen = cacheGet(key, value, sizeof(value));
+    // bajo lock: un SET o DEL concurrente no puede cambiar la clave a mitad de la lectura
+    if (valLen == -1 && dbOpenValue(key, &ref)) {
+        valLen = ref.len;
+        if (ref.len <= MAX_VAL_READ_LEN) {
+            // chico: se lee y se deja en cache para la próxima
+            if (pread(ref.fd, value, ref.len, ref.off) != (ssize_t)ref.len) {
+                perror("Error in pread");
+                utilsCleanupAndExit(EXIT_FAILURE);
+            }
+            close(ref.fd);
+            ref.fd = -1;
+            cachePut(key, value, valLen);
+        }
+        // grande: sale directo del archivo, el descriptor lo sigue viendo aunque lo pisen
+    }
+    dbUnlockKey(key);
+    hotRecord(conn, key, valLen);
+
+    serverStatsHit(conn, valLen != -1);
+    if (valLen == -1) {
+        TRACE_DEBUG("server: clave solicitada no existe: %s", key);
+        serverReplyNotFound(conn);
+        return;
+    }
+
+    TRACE_DEBUG("server: valor a devolver: %zd bytes", valLen);
+    serverReplyValue(conn, value, valLen, ref.fd == -1 ? NULL : &ref, withLen);
+}
+
+static void serverHandleDelCmd(serverConn_t* conn, const char * key) {
+    TRACE_DEBUG("server: comando DEL detectado - DEL %s", key);
+
+    if (replIsReplica()) {
+        serverSendError(conn, "ERROR: réplica de solo lectura.\n", 0);
+        return;
+    }
+    // eliminar el registro, si existe
+    dbLockKey(key, 1);
+    cacheInvalidate(key);
+    int keyExists = dbDeleteValue(key);
+    dbUnlockKey(key);
+    hotRecord(conn, key, -1);
+    if (keyExists) serverSyncAfterWrite(conn);
+    serverStatsHit(conn, keyExists);
+
+    if (keyExists) {
+        TRACE_DEBUG("server: clave eliminada %s", key);
+        serverReplyOk(conn);
+    } else {
+        TRACE_DEBUG("server: clave solicitada no existe: %s", key);
+        serverReplyNotFound(conn);
+    }
+}
+
+static void serverHandleTtlCmd(serverConn_t* conn, const char * key) {
+    TRACE_DEBUG("server: comando TTL detectado - TTL %s", key);
+
+    ttlExpireIfDue(key);
+    dbValueRef_t ref;
+    dbLockKey(key, 0);
+    int keyExists = dbOpenValue(key, &ref);
+    uint64_t expireMs = keyExists ? ttlGet(key) : 0;
+    dbUnlockKey(key);
+    if (keyExists) close(ref.fd);
+    serverStatsHit(conn, keyExists);
+
+    if (!keyExists) {
+        serverReplyNotFound(conn);
+        return;
+    }
+    char reply[32];
+    if (expireMs == 0) {
+        snprintf(reply, sizeof(reply), "OK -1\n");
+    } else {
+        // redondeado hacia arriba: mientras la clave existe nunca responde 0
+        uint64_t nowMs = utilsWallNs() / 1000000;
+        uint64_t leftMs = expireMs > nowMs ? expireMs - nowMs : 0;
+        snprintf(reply, sizeof(reply), "OK %lu\n", (leftMs + 999) / 1000);
+    }
+    serverSendMessage(conn, reply);
+}
+
+static void serverHandlePersistCmd(serverConn_t* conn, const char * key) {
+    TRACE_DEBUG("server: comando PERSIST detectado - PERSIST %s", key);
+
+    if (replIsReplica()) {
+        serverSendError(conn, "ERROR: réplica de solo lectura.\n", 0);
+        return;
+    }
+    ttlExpireIfDue(key);
+    dbValueRef_t ref;
+    dbLockKey(key, 1);
+    int keyExists = dbOpenValue(key, &ref);
+    int cleared = keyExists && ttlClear(key);
+    dbUnlockKey(key);
+    if (keyExists) close(ref.fd);
+    if (cleared) serverSyncAfterWrite(conn);
+    serverStatsHit(conn, keyExists);
+
+    if (!keyExists) {
+        serverReplyNotFound(conn);
+    } else {
+        serverSendMessage(conn, cleared ? "OK 1\n" : "OK 0\n");
+    }
+}
+
+/**
+ * @brief Página de SCAN o RANGE que se arma en la memoria de trabajo del hilo
+ */
+typedef struct {
+    serverWorker_t* worker; /**< Hilo dueño de la memoria de trabajo */
+    size_t used;            /**< Bytes usados: las claves, cada una con su '\n' */
+    size_t last;            /**< Posición de la última clave */
+    size_t n;               /**< Claves en la página */
+} serverScanPage_t;
+
+/**
+ * @brief Asegura lugar en la memoria de trabajo del hilo
+ * @param worker Hilo
+ * @param len Bytes necesarios
+ */
+static void serverScratchReserve(serverWorker_t* worker, size_t len) {
+    if (len <= worker->scratchCap) return;
+    size_t cap = worker->scratchCap ? worker->scratchCap : MAX_VAL_READ_LEN;
+    while (cap < len) cap *= 2;
+    char* scratch = realloc(worker->scratch, cap);
+    if (scratch == NULL) {
+        perror("Error in realloc");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+    worker->scratch = scratch;
+    worker->scratchCap = cap;
+}
+
+/**
+ * @brief Agrega una clave a la página (ver idxKeyFn)
+ */
+static void serverScanAddKey(const char* key, void* arg) {
+    serverScanPage_t* page = arg;
+    size_t len = strlen(key);
+    serverScratchReserve(page->worker, page->used + len + 1);
+    memcpy(page->worker->scratch + page->used, key, len);
+    page->worker->scratch[page->used + len] = '\n';
+    page->last = page->used;
+    page->used += len + 1;
+    page->n++;
+}
+
+static void serverHandleScanCmd(serverConn_t* conn, const char* from, int after, const char* prefix,
+                                const char* end, size_t count) {
+    TRACE_DEBUG("server: comando %s detectado - desde %s, %zu claves", end != NULL ? "RANGE" : "SCAN", from, count);
+
+    // las claves se copian con el lock del índice y se envían sin él
+    serverScanPage_t page = { .worker = conn->worker };
+    int more = idxScan(from, after, prefix, end, count, serverScanAddKey, &page);
+
+    char cursor[DB_NAME_LEN] = "0";
+    if (more) {
+        char last[MAX_MSG_LENGTH];
+        size_t lastLen = page.used - 1 - page.last;
+        memcpy(last, page.worker->scratch + page.last, lastLen);
+        last[lastLen] = '\0';
+        utilsKeyEncodeBase64(last, cursor);
+    }
+    char header[DB_NAME_LEN + 32];
+    snprintf(header, sizeof(header), "OK %s %zu\n", cursor, page.n);
+    serverStatsHit(conn, page.n > 0);
+    serverSendMessage(conn, header);
+    serverSendBytes(conn, page.worker->scratch, page.used);
+}
+
+/**
+ * @brief Lee un valor chico de una clave (con su lock tomado), primero de la cache
+ * @param key Clave
+ * @param value Buffer donde copiar el valor (terminado en null, se corta si no entra)
+ * @param maxLen Tamaño del buffer
+ * @return Largo completo del valor, -1 si la clave no existe
+ */
+static ssize_t serverReadValue(const char* key, char* value, size_t maxLen) {
+    ssize_t len = cacheGet(key, value, maxLen);
+    if (len == -1) len = dbGetValue(key, value, maxLen);
+    return len;
+}
+
+static void serverHandleIncrCmd(serverConn_t* conn, const char * key, int64_t delta) {
+    TRACE_DEBUG("server: comando INCR detectado - INCR %s %ld", key, delta);
+
+    if (replIsReplica()) {
+        serverSendError(conn, "ERROR: réplica de solo lectura.\n", 0);
+        return;
+    }
+    ttlExpireIfDue(key);
+    // leer, sumar y escribir bajo el mismo lock: dos INCR a la vez no pierden ninguno
+    char value[32];
+    int64_t n = 0;
+    dbLockKey(key, 1);
+    ssize_t len = serverReadValue(key, value, sizeof(value));
+    int keyExists = len != -1;
+    int valid = len == -1 ||
+                ((size_t)len < sizeof(value) && utilsSliceToInt64((utilsSlice_t){ value, len }, &n) == 0);
+    int overflow = valid && __builtin_add_overflow(n, delta, &n);
+    if (valid && !overflow) {
+        len = snprintf(value, sizeof(value), "%ld", n);
+        dbCreateKey(key, value, len, 1); // cambia el valor, no el vencimiento
+        cachePut(key, value, len);
+    }
+    dbUnlockKey(key);
+    hotRecord(conn, key, valid && !overflow ? len : -1);
+    serverStatsHit(conn, keyExists);
+
+    if (!valid) {
+        serverSendError(conn, "ERROR: el valor no es un entero.\n", 0);
+    } else if (overflow) {
+        serverSendError(conn, "ERROR: el resultado se sale de rango.\n", 0);
+    } else {
+        serverSyncAfterWrite(conn);
+        char reply[32];
+        snprintf(reply, sizeof(reply), "OK %ld\n", n);
+        serverSendMessage(conn, reply);
+    }
+}
+
+static void serverHandleAppendCmd(serverConn_t* conn, const char * key, utilsSlice_t value) {
+    TRACE_DEBUG("server: comando APPEND detectado - APPEND %s (%zu bytes)", key, value.len);
+
+    if (replIsReplica()) {
+        serverSendError(conn, "ERROR: réplica de solo lectura.\n", 0);
+        return;
+    }
+    ttlExpireIfDue(key);
+    serverWorker_t* worker = conn->worker;
+    serverScratchReserve(worker, MAX_VAL_READ_LEN + 1 + value.len);
+    dbValueRef_t ref = { .fd = -1 };
+
+    dbLockKey(key, 1);
+    ssize_t oldLen = cacheGet(key, worker->scratch, MAX_VAL_READ_LEN + 1);
+    if (oldLen == -1 && dbOpenValue(key, &ref)) oldLen = ref.len;
+    int keyExists = oldLen != -1;
+    size_t total = (keyExists ? oldLen : 0) + value.len;
+    int tooBig = total > MAX_VALUE_LEN;
+
+    if (!tooBig && (ref.fd == -1 || ref.len <= MAX_VAL_READ_LEN)) {
+        // chico: el valor nuevo se arma en la memoria de trabajo
+        if (ref.fd != -1 && pread(ref.fd, worker->scratch, ref.len, ref.off) != (ssize_t)ref.len) {
+            perror("Error in pread");
+            utilsCleanupAndExit(EXIT_FAILURE);
+        }
+        memcpy(worker->scratch + total - value.len, value.ptr, value.len);
+        dbCreateKey(key, worker->scratch, total, 1); // como INCR, conserva el vencimiento
+        cachePut(key, worker->scratch, total);
+    } else if (!tooBig) {
+        // grande: se copia por partes a un temporal y se publica de una vez, como un SETL
+        dbStream_t stream;
+        dbStreamOpen(&stream, total);
+        for (size_t off = 0; off < ref.len;) {
+            size_t chunk = ref.len - off < MAX_VAL_READ_LEN ? ref.len - off : MAX_VAL_READ_LEN;
+            ssize_t n = pread(ref.fd, worker->scratch, chunk, ref.off + off);
+            if (n <= 0) {
+                perror("Error in pread");
+                utilsCleanupAndExit(EXIT_FAILURE);
+            }
+            dbStreamWrite(&stream, worker->scratch, n);
+            off += n;
+        }
+        dbStreamWrite(&stream, value.ptr, value.len);
+        cacheInvalidate(key);
+        dbStreamCommit(key, &stream, 1);
+    }
+    dbUnlockKey(key);
+    if (ref.fd != -1) close(ref.fd);
+    hotRecord(conn, key, tooBig ? -1 : (ssize_t)total);
+    serverStatsHit(conn, keyExists);
+
+    if (tooBig) {
+        serverSendError(conn, "ERROR: valor muy largo.\n", 0);
+        return;
+    }
+    serverSyncAfterWrite(conn);
+    char reply[32];
+    snprintf(reply, sizeof(reply), "OK %zu\n", total);
+    serverSendMessage(conn, reply);
+}
+
+static void serverHandleCasCmd(serverConn_t* conn, const char * key, utilsSlice_t expected, utilsSlice_t value) {
+    TRACE_DEBUG("server: comando CAS detectado - CAS %s (%zu bytes)", key, value.len);
+
+    if (replIsReplica()) {
+        serverSendError(conn, "ERROR: réplica de solo lectura.\n", 0);
+        return;
+    }
+    ttlExpireIfDue(key);
+    // el esperado viene en la línea: un valor más largo ya no puede ser igual
+    char current[MAX_MSG_LENGTH + 1];
+    dbLockKey(key, 1);
+    ssize_t len = serverReadValue(key, current, sizeof(current));
+    int match = len != -1 && (size_t)len == expected.len && memcmp(current, expected.ptr, len) == 0;
+    if (match) {
+        dbCreateKey(key, value.ptr, value.len, 0);
+        cachePut(key, value.ptr, value.len);
+    }
+    dbUnlockKey(key);
+    hotRecord(conn, key, match ? (ssize_t)value.len : len);
+    serverStatsHit(conn, len != -1);
+
+    if (len == -1) {
+        serverReplyNotFound(conn);
+    } else if (!match) {
+        serverSendMessage(conn, "MISMATCH\n");
+    } else {
+        serverSyncAfterWrite(conn);
+        serverReplyOk(conn);
+    }
+}
+
+static void serverHandleMgetCmd(serverConn_t* conn, const char* keys[], int n) {
+    TRACE_DEBUG("server: comando MGET detectado - %d claves", n);
+
+    serverWorker_t* worker = conn->worker;
+    ssize_t lens[MAX_BATCH_KEYS];       // -1: no existe
+    size_t offs[MAX_BATCH_KEYS];        // posición del valor en scratch
+    dbValueRef_t refs[MAX_BATCH_KEYS];
+    uint32_t stripes[MAX_BATCH_KEYS];
+    size_t used = 0;
+
+    for (int i = 0; i < n; i++) ttlExpireIfDue(keys[i]);
+    // todas las claves bajo lock a la vez: la respuesta es una foto consistente
+    int locked = dbLockKeys(keys, n, 0, stripes);
+
+    // 1) lo que está en cache se copia directo a la memoria de trabajo
+    for (int i = 0; i < n; i++) {
+        refs[i].fd = -1;
+        serverScratchReserve(worker, used + MAX_VAL_READ_LEN + 1);
+        offs[i] = used;
+        lens[i] = cacheGet(keys[i], worker->scratch + used, MAX_VAL_READ_LEN + 1);
+        if (lens[i] != -1) used += lens[i];
+    }
+    // 2) las que faltan se abren todas juntas (motor file: openat() sobre la carpeta)...
+    for (int i = 0; i < n; i++) {
+        if (lens[i] == -1 && dbOpenValue(keys[i], &refs[i])) lens[i] = refs[i].len;
+    }
+    // 3) ...y recién después se leen
+    for (int i = 0; i < n; i++) {
+        if (refs[i].fd == -1) continue;
+        if (refs[i].len <= MAX_VAL_READ_LEN) {
+            serverScratchReserve(worker, used + refs[i].len);
+            offs[i] = used;
+            if (pread(refs[i].fd, worker->scratch + used, refs[i].len, refs[i].off) != (ssize_t)refs[i].len) {
+                perror("Error in pread");
+                utilsCleanupAndExit(EXIT_FAILURE);
+            }
+            cachePut(keys[i], worker->scratch + used, refs[i].len);
+            used += refs[i].len;
+        }
+        close(refs[i].fd);
+    }
+    dbUnlockStripes(stripes, locked);
+
+    // encabezado y valor de cada clave, todo en un solo writev()
+    char headers[MAX_BATCH_KEYS][32];
+    struct iovec iov[2 * MAX_BATCH_KEYS];
+    int iovCnt = 0;
+    for (int i = 0; i < n; i++) {
+        serverStatsHit(conn, lens[i] != -1);
+        hotRecord(conn, keys[i], lens[i]);
+        if (lens[i] == -1) {
+            strcpy(headers[i], "NOTFOUND\n");
+        } else if (lens[i] > MAX_VAL_READ_LEN) {
+            // los valores grandes no se arman en memoria: se piden de a uno con GETL
+            snprintf(headers[i], sizeof(headers[i]), "TOOBIG %zd\n", lens[i]);
+        } else {
+            snprintf(headers[i], sizeof(headers[i]), "OK %zd\n", lens[i]);
+        }
+        iov[iovCnt].iov_base = headers[i];
+        iov[iovCnt++].iov_len = strlen(headers[i]);
+        if (lens[i] > 0 && lens[i] <= MAX_VAL_READ_LEN) {
+            iov[iovCnt].iov_base = worker->scratch + offs[i];
+            iov[iovCnt++].iov_len = lens[i];
+        }
+    }
+    serverSendVector(conn, iov, iovCnt);
+}
+
+static void serverHandleMsetCmd(serverConn_t* conn, const char* keys[], const utilsSlice_t values[], int n) {
+    TRACE_DEBUG("server: comando MSET detectado - %d claves", n);
+
+    if (replIsReplica()) {
+        serverSendError(conn, "ERROR: réplica de solo lectura.\n", 0);
+        return;
+    }
+    // todas las claves bajo lock a la vez: nadie ve el lote a medio escribir
+    uint32_t stripes[MAX_BATCH_KEYS];
+    int locked = dbLockKeys(keys, n, 1, stripes);
+    for (int i = 0; i < n; i++) {
+        dbCreateKey(keys[i], values[i].ptr, values[i].len, 0);
+        cachePut(keys[i], values[i].ptr, values[i].len);
+    }
+    dbUnlockStripes(stripes, locked);
+    for (int i = 0; i < n; i++) hotRecord(conn, keys[i], values[i].len);
+    // un solo ticket: el OK espera al fsync que cubre a la última
+    serverSyncAfterWrite(conn);
+    serverSendMessage(conn, "OK\n");
+}
+
+static void serverHandleMdelCmd(serverConn_t* conn, const char* keys[], int n) {
+    TRACE_DEBUG("server: comando MDEL detectado - %d claves", n);
+
+    if (replIsReplica()) {
+        serverSendError(conn, "ERROR: réplica de solo lectura.\n", 0);
+        return;
+    }
+    uint32_t stripes[MAX_BATCH_KEYS];
+    int deleted = 0;
+    int locked = dbLockKeys(keys, n, 1, stripes);
+    for (int i = 0; i < n; i++) {
+        cacheInvalidate(keys[i]);
+        int found = dbDeleteValue(keys[i]);
+        serverStatsHit(conn, found);
+        deleted += found;
+    }
+    dbUnlockStripes(stripes, locked);
+    for (int i = 0; i < n; i++) hotRecord(conn, keys[i], -1);
+    if (deleted > 0) serverSyncAfterWrite(conn);
+
+    char reply[32];
+    snprintf(reply, sizeof(reply), "OK %d\n", deleted);
+    serverSendMessage(conn, reply);
+}
+
+static void serverSendError(serverConn_t* conn, const char * errorMsg, int sendUsage) {
+    TRACE_DEBUG("server: %s", errorMsg);
+    if (conn->proto == PROTO_BINARY) {
+        // el mensaje va como valor de la respuesta; el uso es solo para humanos
+        serverBinReply(conn, BIN_STATUS_ERROR, strlen(errorMsg));
+        serverSendBytes(conn, errorMsg, strlen(errorMsg));
+        return;
+    }
+    serverSendMessage(conn, errorMsg);
+    if(sendUsage) serverSendUsageMsg(conn);
+}
+
+/*********************** io_uring ************************/
+static inline int serverUringEnter(serverUring_t* ring, unsigned submit, unsigned wait) {
+    return syscall(__NR_io_uring_enter, ring->fd, submit, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+static inline int serverUringRegister(serverUring_t* ring, unsigned op, void* arg, unsigned nr) {
+    return syscall(__NR_io_uring_register, ring->fd, op, arg, nr);
+}
+
+/**
+ * @brief Publica al kernel los pedidos preparados
+ */
+static inline unsigned serverUringPublish(serverUring_t* ring) {
+    unsigned pending = ring->sqLocalTail - *ring->sqTail;
+    __atomic_store_n(ring->sqTail, ring->sqLocalTail, __ATOMIC_RELEASE);
+    return pending;
+}
+
+/**
+ * @brief Prepara un pedido en la cola de envío (sale con el próximo io_uring_enter())
+ * @param conn Conexión a la que va el pedido (NULL para el socket de escucha y el eventfd)
+ * @return Pedido en blanco con el descriptor, la operación y user_data completos
+ */
+static struct io_uring_sqe* serverUringPrep(serverWorker_t* worker, serverConn_t* conn, uint8_t opcode, int fd,
+                                            serverUringOp_t op) {
+    serverUring_t* ring = &worker->uring;
+    if (ring->sqLocalTail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) == ring->sqEntries) {
+        // cola llena: se envía lo que hay sin esperar terminaciones
+        unsigned pending = serverUringPublish(ring);
+        while (serverUringEnter(ring, pending, 0) == -1) {
+            if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                perror("Error in io_uring_enter");
+                utilsCleanupAndExit(EXIT_FAILURE);
+            }
+        }
+    }
+
+    unsigned idx = ring->sqLocalTail & ring->sqMask;
+    struct io_uring_sqe* sqe = &ring->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sqArray[idx] = idx;
+    ring->sqLocalTail++;
+
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    if (conn != NULL && conn->uringFixedFile) {
+        // socket registrado: el kernel no busca el descriptor en cada operación
+        sqe->fd = conn->uringSlot;
+        sqe->flags |= IOSQE_FIXED_FILE;
+    }
+    sqe->user_data = (uint64_t)(uintptr_t)(conn ? (void*)conn : (void*)worker) | op;
+    return sqe;
+}
+
+static void serverUringArmAccept(serverListenSoc_t* ls) {
+    serverWorker_t* worker = ls->worker;
+    struct io_uring_sqe* sqe = serverUringPrep(worker, NULL, IORING_OP_ACCEPT, ls->fd, URING_OP_ACCEPT);
+    sqe->user_data = (uint64_t)(uintptr_t)ls | URING_OP_ACCEPT; // para saber a cuál volver a pedirle
+    sqe->accept_flags = SOCK_NONBLOCK; // sendfile() se hace directo, sin bloquear el hilo
+    if (worker->uring.acceptMultishot) sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+}
+
+/**
+ * @brief Pide que io_uring_enter() vuelva a lo sumo en ms milisegundos, para revisar los plazos
+ */
+static void serverUringArmTimer(serverWorker_t* worker, int ms) {
+    serverUring_t* ring = &worker->uring;
+    ring->timerTs.tv_sec = ms / 1000;
+    ring->timerTs.tv_nsec = (ms % 1000) * 1000000L;
+    struct io_uring_sqe* sqe = serverUringPrep(worker, NULL, IORING_OP_TIMEOUT, -1, URING_OP_TIMER);
+    sqe->addr = (uintptr_t)&ring->timerTs;
+    sqe->len = 1;
+    ring->timerArmed = 1;
+}
+
+static void serverUringArmSync(serverWorker_t* worker) {
+    struct io_uring_sqe* sqe = serverUringPrep(worker, NULL, IORING_OP_READ, worker->syncFd, URING_OP_SYNC);
+    sqe->addr = (uintptr_t)&worker->uring.syncCount;
+    sqe->len = sizeof(worker->uring.syncCount);
+}
+
+/**
+ * @brief Pide la lectura del socket en lo que queda libre del buffer de entrada
+ */
+static void serverUringPostRecv(serverConn_t* conn) {
+    struct io_uring_sqe* sqe;
+    if (conn->uringFixedBuffer) {
+        // buffer registrado: el kernel no tiene que fijar sus páginas en cada lectura
+        sqe = serverUringPrep(conn->worker, conn, IORING_OP_READ_FIXED, conn->fd, URING_OP_RECV);
+        sqe->buf_index = conn->uringSlot;
+        sqe->off = -1;
+    } else {
+        sqe = serverUringPrep(conn->worker, conn, IORING_OP_RECV, conn->fd, URING_OP_RECV);
+    }
+    sqe->addr = (uintptr_t)(conn->in + conn->inLen);
+    sqe->len = CONN_IN_BUF_LEN - conn->inLen;
+    conn->uringRecv = 1;
+}
+
+/**
+ * @brief Envía lo que se pueda de out: pide el envío a io_uring o hace el sendfile() pendiente
+ * @return 0 si se pudo (o quedó pedido), -1 si hubo error
+ */
+static int serverUringFlush(serverConn_t* conn) {
+    if (conn->ackCount > 0) serverBinReleaseAcks(conn);
+    if (conn->broken) return -1;
+    size_t limit = serverFlushLimit(conn);
+
+    while (1) {
+        int fileNext = (conn->sendFd != -1 && conn->sendAt <= limit);
+        size_t end = fileNext ? conn->sendAt : limit;
+        if (conn->outOff < end) {
+            // outOff avanza recién con la terminación, ver serverUringComplete()
+            struct io_uring_sqe* sqe = serverUringPrep(conn->worker, conn, IORING_OP_SEND, conn->fd, URING_OP_SEND);
+            sqe->addr = (uintptr_t)(conn->out + conn->outOff);
+            sqe->len = end - conn->outOff;
+            sqe->msg_flags = MSG_NOSIGNAL | (fileNext ? MSG_MORE : 0);
+            conn->uringSend = 1;
+            conn->uringSendBuf = conn->out;
+            break;
+        }
+        if (!fileNext) break;
+
+        // sendfile() no pasa por io_uring: se hace directo y, si el socket
+        // se llena, se pide aviso cuando vuelva a tener lugar
+        int r = serverFlushFile(conn);
+        if (r == -1) return -1;
+        if (r == 0) {
+            struct io_uring_sqe* sqe = serverUringPrep(conn->worker, conn, IORING_OP_POLL_ADD, conn->fd,
+                                                       URING_OP_POLLOUT);
+            sqe->poll32_events = POLLOUT;
+            conn->uringSend = 1;
+            break;
+        }
+    }
+    serverStatsSent(conn);
+    if (!conn->uringSend && conn->outOff == conn->outLen && conn->sendFd == -1) conn->outOff = conn->outLen = 0;
+    return 0;
+}
+
+static int serverUringPump(serverConn_t* conn) {
+    while (1) {
+        // con una lectura en vuelo el kernel escribe en in + inLen: no se toca
+        // el buffer (lo completo ya se procesó antes de pedirla)
+        if (!conn->uringRecv && serverProcessInput(conn) == -1) return -1;
+        if (!conn->uringSend && serverUringFlush(conn) == -1) return -1;
+        if (conn->uringRecv || conn->closeAfterFlush || serverConnPaused(conn)) break;
+
+        // si se había frenado por el cliente y el envío lo destrabó, quedan comandos completos
+        if (!serverInputComplete(conn)) break;
+    }
+
+    // se lee más con las mismas condiciones que en serverConnPump()
+    if (!conn->uringRecv && !conn->peerClosed && !conn->closeAfterFlush && !serverConnPaused(conn) &&
+        conn->inLen < CONN_IN_BUF_LEN) {
+        serverUringPostRecv(conn);
+    }
+    serverConnWaitSync(conn);
+
+    int pending = conn->outOff < conn->outLen || conn->sendFd != -1 || conn->ackCount > 0 || conn->uringSend;
+    if (!pending && (conn->closeAfterFlush || conn->peerClosed)) return -1;
+    return 0;
+}
+
+/**
+ * @brief Instala el socket y el buffer de entrada de una conexión en las tablas registradas
+ *
+ * Si no hay lugar, o el kernel no lo permite (por ejemplo, por el límite
+ * de memoria fijada), la conexión usa las operaciones comunes.
+ */
+static void serverUringConnSetup(serverConn_t* conn) {
+    serverUring_t* ring = &conn->worker->uring;
+    if ((!ring->fixedFiles && !ring->fixedBuffers) || ring->freeCount == 0) return;
+    conn->uringSlot = ring->freeSlots[--ring->freeCount];
+
+    if (ring->fixedFiles) {
+        struct io_uring_files_update up = { .offset = conn->uringSlot, .fds = (uintptr_t)&conn->fd };
+        conn->uringFixedFile = (serverUringRegister(ring, IORING_REGISTER_FILES_UPDATE, &up, 1) == 1);
+    }
+    if (ring->fixedBuffers) {
+        struct iovec iov = { conn->in, CONN_IN_BUF_LEN };
+        struct io_uring_rsrc_update2 up = { .offset = conn->uringSlot, .data = (uintptr_t)&iov, .nr = 1 };
+        conn->uringFixedBuffer = (serverUringRegister(ring, IORING_REGISTER_BUFFERS_UPDATE, &up, sizeof(up)) == 1);
+    }
+}
+
+/**
+ * @brief Quita la conexión de las tablas registradas (sin operaciones en vuelo)
+ */
+static void serverUringConnRelease(serverConn_t* conn) {
+    serverUring_t* ring = &conn->worker->uring;
+    if (conn->uringFixedFile) {
+        int none = -1;
+        struct io_uring_files_update up = { .offset = conn->uringSlot, .fds = (uintptr_t)&none };
+        serverUringRegister(ring, IORING_REGISTER_FILES_UPDATE, &up, 1);
+    }
+    if (conn->uringFixedBuffer) {
+        struct iovec iov = { NULL, 0 };
+        struct io_uring_rsrc_update2 up = { .offset = conn->uringSlot, .data = (uintptr_t)&iov, .nr = 1 };
+        serverUringRegister(ring, IORING_REGISTER_BUFFERS_UPDATE, &up, sizeof(up));
+    }
+    ring->freeSlots[ring->freeCount++] = conn->uringSlot;
+    conn->uringSlot = -1;
+}
+
+/**
+ * @brief Atiende una terminación de io_uring
+ */
+static void serverUringComplete(serverWorker_t* worker, const struct io_uring_cqe* cqe) {
+    serverUringOp_t op = cqe->user_data & URING_OP_MASK;
+    int res = cqe->res;
+
+    if (op == URING_OP_ACCEPT) {
+        if (res >= 0) {
+            TRACE_DEBUG("server: conexión aceptada: %d", res);
+            serverConn_t* conn = serverConnOpen(worker, res);
+            if (conn == NULL) {
+                close(res);
+            } else if (serverConnPump(conn) == -1) {
+                serverConnClose(conn);
+            }
+        } else if (res == -EINVAL && worker->uring.acceptMultishot) {
+            worker->uring.acceptMultishot = 0; // kernel anterior a 5.19: un accept() por pedido
+        } else if (res == -EMFILE || res == -ENFILE) {
+            // sin descriptores: se rechazan las pendientes en lugar de reintentar en vacío
+            serverListenSoc_t* ls = (serverListenSoc_t*)(uintptr_t)(cqe->user_data & ~(uint64_t)URING_OP_MASK);
+            while (serverSocketShed(worker, ls->fd)) {}
+        } else if (res != -EAGAIN && res != -EINTR && res != -ECONNABORTED && res != -ENOBUFS && res != -ENOMEM) {
+            errno = -res;
+            perror("Error in accept");
+            utilsCleanupAndExit(EXIT_FAILURE);
+        }
+        // el pedido multishot sigue activo mientras el kernel marque IORING_CQE_F_MORE
+        if (!(cqe->flags & IORING_CQE_F_MORE)) {
+            serverUringArmAccept((serverListenSoc_t*)(uintptr_t)(cqe->user_data & ~(uint64_t)URING_OP_MASK));
+        }
+        return;
+    }
+    if (op == URING_OP_TIMER) {
+        worker->uring.timerArmed = 0; // termina con -ETIME, los plazos se revisan en la vuelta
+        return;
+    }
+    if (op == URING_OP_SYNC) {
+        if (res < 0 && res != -EAGAIN && res != -EINTR) {
+            errno = -res;
+            perror("Error in read");
+            utilsCleanupAndExit(EXIT_FAILURE);
+        }
+        serverSyncResume(worker);
+        serverUringArmSync(worker);
+        return;
+    }
+
+    serverConn_t* conn = (serverConn_t*)(uintptr_t)(cqe->user_data & ~(uint64_t)URING_OP_MASK);
+    if (op == URING_OP_RECV) {
+        conn->uringRecv = 0;
+    } else {
+        conn->uringSend = 0;
+        if (conn->uringSendBuf != NULL && conn->uringSendBuf != conn->out) free(conn->uringSendBuf);
+        conn->uringSendBuf = NULL;
+    }
+    if (conn->closing) {
+        if (!conn->uringRecv && !conn->uringSend) serverConnClose(conn);
+        return;
+    }
+
+    if (op == URING_OP_RECV) {
+        if (res > 0) {
+            TRACE_DEBUG("server: recibidos %d bytes", res);
+            conn->inLen += res;
+        } else if (res == 0) {
+            conn->peerClosed = 1; // EOF, se procesa lo que quedó y se cierra
+        } else if (res != -EAGAIN && res != -EINTR) {
+            if (res != -ECONNRESET) {
+                errno = -res;
+                perror("Error in read");
+            }
+            serverConnClose(conn);
+            return;
+        }
+    } else if (op == URING_OP_SEND) {
+        if (res >= 0) {
+            TRACE_DEBUG("server: enviados %d bytes", res);
+            conn->outOff += res;
+            conn->timerProgress = 1;
+        } else if (res != -EAGAIN && res != -EINTR) {
+            if (res != -EPIPE && res != -ECONNRESET) {
+                errno = -res;
+                perror("Error in write");
+            }
+            serverConnClose(conn);
+            return;
+        }
+    }
+    // URING_OP_POLLOUT: el socket volvió a tener lugar, serverUringFlush() sigue con sendfile()
+    if (serverConnPump(conn) == -1) serverConnClose(conn);
+}
+
+/**
+ * @brief Crea los anillos de io_uring del hilo y registra sus tablas
+ */
+static void serverUringInit(serverWorker_t* worker) {
+    serverUring_t* ring = &worker->uring;
+    struct io_uring_params params = { 0 };
+    // un solo hilo usa el anillo y siempre espera terminaciones al entrar:
+    // el kernel puede dejar el trabajo pendiente para ese momento (6.1+)
+    params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    int fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (fd == -1 && errno == EINVAL) {
+        memset(&params, 0, sizeof(params));
+        fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    }
+    if (fd == -1) {
+        perror("Error in io_uring_setup");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+    ring->fd = fd;
+
+    size_t sqLen = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cqLen = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) sqLen = cqLen = (sqLen > cqLen ? sqLen : cqLen);
+    char* sq = mmap(NULL, sqLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    char* cq = sq;
+    if (sq != MAP_FAILED && !(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        cq = mmap(NULL, cqLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    }
+    ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        perror("Error in mmap");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+    ring->sqHead = (unsigned*)(sq + params.sq_off.head);
+    ring->sqTail = (unsigned*)(sq + params.sq_off.tail);
+    ring->sqMask = *(unsigned*)(sq + params.sq_off.ring_mask);
+    ring->sqEntries = params.sq_entries;
+    ring->sqArray = (unsigned*)(sq + params.sq_off.array);
+    ring->sqLocalTail = *ring->sqTail;
+    ring->cqHead = (unsigned*)(cq + params.cq_off.head);
+    ring->cqTail = (unsigned*)(cq + params.cq_off.tail);
+    ring->cqMask = *(unsigned*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    // tablas vacías de sockets y buffers: cada conexión ocupa un lugar
+    // mientras está abierta (kernel 5.19+; si no, se usan operaciones comunes)
+    struct io_uring_rsrc_register reg = { .nr = URING_SLOTS, .flags = IORING_RSRC_REGISTER_SPARSE };
+    ring->fixedFiles = (serverUringRegister(ring, IORING_REGISTER_FILES2, &reg, sizeof(reg)) == 0);
+    ring->fixedBuffers = (serverUringRegister(ring, IORING_REGISTER_BUFFERS2, &reg, sizeof(reg)) == 0);
+    for (int i = 0; i < URING_SLOTS; i++) ring->freeSlots[i] = URING_SLOTS - 1 - i;
+    ring->freeCount = URING_SLOTS;
+    ring->acceptMultishot = 1;
+}
+
+static int serverUringProbe(void) {
+    struct io_uring_params params = { 0 };
+    int fd = syscall(__NR_io_uring_setup, 1, &params);
+    if (fd == -1) return 0;
+    close(fd);
+    return 1;
+}
+
+static void serverUringLoop(serverWorker_t* worker) {
+    serverUringInit(worker);
+    serverUring_t* ring = &worker->uring;
+    for (int i = 0; i < config.listenerCount; i++) serverUringArmAccept(&worker->listen[i]);
+    serverUringArmSync(worker);
+
+    TRACE_INFO("server: hilo %d esperando conexiones (io_uring%s%s)...", worker->id,
+               ring->fixedFiles ? ", sockets registrados" : "", ring->fixedBuffers ? ", buffers registrados" : "");
+    while (1) {
+        // los plazos no se mueven con un pedido ya en vuelo: se revisan cada
+        // CONN_TIMER_TICK_MS como mucho, mientras haya alguno corriendo
+        int ms = serverConnTimerExpire(worker);
+        if (ms >= 0 && !ring->timerArmed) serverUringArmTimer(worker, ms < CONN_TIMER_TICK_MS ? ms : CONN_TIMER_TICK_MS);
+
+        // una sola llamada envía todo lo preparado en la vuelta anterior y
+        // espera al menos una terminación
+        if (serverUringEnter(ring, serverUringPublish(ring), 1) == -1) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) continue;
+            perror("Error in io_uring_enter");
+            utilsCleanupAndExit(EXIT_FAILURE);
+        }
+        worker->now = utilsNowNs();
+
+        unsigned head = *ring->cqHead;
+        while (head != __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)) {
+            // se copia antes de liberar el lugar: atenderla puede agregar pedidos
+            struct io_uring_cqe cqe = ring->cqes[head & ring->cqMask];
+            __atomic_store_n(ring->cqHead, ++head, __ATOMIC_RELEASE);
+            serverUringComplete(worker, &cqe);
+        }
+    }
+}
+
+/*********************** registro de mensajes ************************/
+/**
+ * @brief Crea y registra la cola de mensajes del hilo actual
+ */
+static traceRing_t* traceRingCreate(void) {
+    traceRing_t* ring = calloc(1, sizeof(traceRing_t));
+    if (ring == NULL) return NULL; // sin memoria el mensaje se pierde
+    ring->next = __atomic_load_n(&traceRings, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&traceRings, &ring->next, ring, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+    traceMyRing = ring;
+    return ring;
+}
+
+static void traceWrite(traceLevel_t level, const char* fmt, ...) {
+    traceRing_t* ring = traceMyRing ? traceMyRing : traceRingCreate();
+    if (ring == NULL) return;
+
+    size_t tail = ring->tail;
+    if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == TRACE_RING_SLOTS) {
+        __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    traceRecord_t* rec = &ring->slots[tail % TRACE_RING_SLOTS];
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(rec->text, TRACE_MSG_LEN - 1, fmt, args);
+    va_end(args);
+    if (n < 0) return;
+    if (n > TRACE_MSG_LEN - 2) n = TRACE_MSG_LEN - 2; // recortado
+    rec->text[n++] = '\n';
+    rec->len = n;
+    rec->level = level;
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Escribe un lote entero, reintentando si write() escribe de a partes
+ */
+static void traceWriteAll(int fd, const char* buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return; // no hay dónde avisar: se pierde el lote
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+static void traceFlush(void) {
+    static char batch[2][TRACE_BATCH_LEN];
+    size_t batchLen[2] = { 0, 0 };
+    const int fds[2] = { STDOUT_FILENO, STDERR_FILENO };
+
+    pthread_mutex_lock(&traceFlushLock);
+    for (traceRing_t* ring = __atomic_load_n(&traceRings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+        size_t head = ring->head;
+        size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            const traceRecord_t* rec = &ring->slots[head % TRACE_RING_SLOTS];
+            int b = rec->level >= TRACE_LEVEL_WARN;
+            if (batchLen[b] + rec->len > TRACE_BATCH_LEN) {
+                traceWriteAll(fds[b], batch[b], batchLen[b]);
+                batchLen[b] = 0;
+            }
+            memcpy(batch[b] + batchLen[b], rec->text, rec->len);
+            batchLen[b] += rec->len;
+        }
+        // recién ahora se liberan los lugares: los textos ya están copiados
+        __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+
+        uint64_t dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+        if (dropped > 0 && batchLen[1] + 64 <= TRACE_BATCH_LEN) {
+            batchLen[1] += snprintf(batch[1] + batchLen[1], 64, "trace: %lu mensajes descartados\n", dropped);
+        }
+    }
+    for (int b = 0; b < 2; b++) {
+        if (batchLen[b] > 0) traceWriteAll(fds[b], batch[b], batchLen[b]);
+    }
+    pthread_mutex_unlock(&traceFlushLock);
+}
+
+/**
+ * @brief Hilo de registro: escribe los mensajes encolados cada TRACE_FLUSH_MS
+ */
+static void* traceThread(void* arg) {
+    (void)arg;
+    struct timespec interval = { 0, TRACE_FLUSH_MS * 1000000L };
+    while (1) {
+        nanosleep(&interval, NULL);
+        traceFlush();
+    }
+    return NULL;
+}
+
+static void traceInit(void) {
+    if (config.traceLevel == TRACE_LEVEL_OFF) return;
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, traceThread, NULL) != 0) {
+        fprintf(stderr, "ERROR creando el hilo de registro\n");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+}
+
+/*********************** estadísticas ************************/
+/**
+ * @brief Intervalo del histograma en el que cae una latencia
+ */
+static inline int serverHistIndex(uint64_t ns) {
+    if (ns < 4) return ns;
+    int e = 63 - __builtin_clzll(ns); // ns está en [2^e, 2^(e+1))
+    int idx = 4 * (e - 1) + ((ns >> (e - 2)) & 3);
+    return idx < STATS_HIST_BUCKETS ? idx : STATS_HIST_BUCKETS - 1;
+}
+
+/**
+ * @brief Mayor latencia que cae en un intervalo del histograma
+ */
+static uint64_t serverHistUpper(int idx) {
+    if (idx < 4) return idx;
+    int e = idx / 4 + 1;
+    return ((uint64_t)(4 + idx % 4 + 1) << (e - 2)) - 1;
+}
+
+static inline void serverHistRecord(serverHist_t* hist, uint64_t ns) {
+    hist->count++;
+    hist->sumNs += ns;
+    hist->buckets[serverHistIndex(ns)]++;
+}
+
+/**
+ * @brief Percentil de un histograma, en ns (cota superior de su intervalo)
+ */
+static uint64_t serverHistPercentile(const serverHist_t* hist, double pct) {
+    if (hist->count == 0) return 0;
+    uint64_t rank = (uint64_t)(pct / 100 * hist->count + 0.5);
+    if (rank == 0) rank = 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < STATS_HIST_BUCKETS; i++) {
+        seen += hist->buckets[i];
+        if (seen >= rank) return serverHistUpper(i);
+    }
+    return serverHistUpper(STATS_HIST_BUCKETS - 1);
+}
+
+static void serverStatsBegin(serverConn_t* conn, size_t bytesIn) {
+    conn->statPending = 1;
+    conn->statCmd = STAT_INVALID;
+    conn->statStart = utilsNowNs();
+    conn->statParsed = 0;
+    conn->statIn = bytesIn;
+    conn->statOut = conn->bytesOut;
+}
+
+static void serverStatsParsed(serverConn_t* conn, serverStatCmd_t cmd) {
+    conn->statCmd = cmd;
+    conn->statParsed = utilsNowNs();
+}
+
+static void serverStatsEnd(serverConn_t* conn) {
+    if (!conn->statPending) return;
+    conn->statPending = 0;
+
+    uint64_t now = utilsNowNs();
+    if (conn->statParsed == 0) conn->statParsed = now; // no se pudo interpretar: todo fue parseo
+    serverCmdStats_t* cs = &conn->worker->stats->cmd[conn->statCmd];
+    cs->requests++;
+    cs->bytesIn += conn->statIn;
+    cs->bytesOut += conn->bytesOut - conn->statOut;
+    serverHistRecord(&cs->lat[PHASE_PARSE], conn->statParsed - conn->statStart);
+    serverHistRecord(&cs->lat[PHASE_STORAGE], now - conn->statParsed);
+
+    // el envío se mide cuando sale el último byte de la respuesta; con
+    // muchos pedidos en vuelo se mide una muestra (los que entran en track)
+    if (conn->trackCount < CONN_SEND_TRACK) {
+        serverSendTrack_t* t = &conn->track[(conn->trackHead + conn->trackCount++) % CONN_SEND_TRACK];
+        t->end = conn->outLen;
+        t->t = now;
+        t->cmd = conn->statCmd;
+    }
+}
+
+static void serverStatsHit(serverConn_t* conn, int found) {
+    serverCmdStats_t* cs = &conn->worker->stats->cmd[conn->statCmd];
+    if (found) {
+        cs->hits++;
+    } else {
+        cs->misses++;
+    }
+}
+
+static void serverStatsSent(serverConn_t* conn) {
+    uint64_t now = 0;
+    while (conn->trackCount > 0) {
+        serverSendTrack_t* t = &conn->track[conn->trackHead];
+        // falta enviar parte del buffer, o el valor que va justo al final (sendfile)
+        if (conn->outOff < t->end || (conn->sendFd != -1 && conn->sendAt <= t->end)) break;
+        if (now == 0) now = utilsNowNs();
+        serverHistRecord(&conn->worker->stats->cmd[t->cmd].lat[PHASE_SEND], now - t->t);
+        conn->trackHead = (conn->trackHead + 1) % CONN_SEND_TRACK;
+        conn->trackCount--;
+    }
+}
+
+/**
+ * @brief Suma las estadísticas de todos los hilos
+ *
+ * Se leen sin lock mientras los hilos las siguen escribiendo: cada contador
+ * es una palabra alineada, así que a lo sumo el total queda un poco
+ * desfasado entre un contador y otro.
+ */
+static void serverStatsCollect(serverStats_t* total) {
+    memset(total, 0, sizeof(*total));
+    for (int w = 0; w < config.workers; w++) {
+        const serverStats_t* st = workers[w].stats;
+        total->connsOpened += st->connsOpened;
+        total->connsClosed += st->connsClosed;
+        total->connsRejected += st->connsRejected;
+        total->connsTimedOut += st->connsTimedOut;
+        total->connsDropped += st->connsDropped;
+        for (int c = 0; c < STAT_CMDS; c++) {
+            const serverCmdStats_t* src = &st->cmd[c];
+            serverCmdStats_t* dst = &total->cmd[c];
+            dst->requests += src->requests;
+            dst->hits += src->hits;
+            dst->misses += src->misses;
+            dst->bytesIn += src->bytesIn;
+            dst->bytesOut += src->bytesOut;
+            for (int p = 0; p < PHASES; p++) {
+                dst->lat[p].count += src->lat[p].count;
+                dst->lat[p].sumNs += src->lat[p].sumNs;
+                for (int b = 0; b < STATS_HIST_BUCKETS; b++) dst->lat[p].buckets[b] += src->lat[p].buckets[b];
+            }
+        }
+    }
+}
+
+/**
+ * @brief Largo actual y máximo de la cola de conexiones sin aceptar, sumando todos los hilos
+ */
+static void serverStatsAcceptQueue(uint64_t* len, uint64_t* max) {
+    *len = *max = 0;
+    for (int w = 0; w < config.workers; w++) {
+        for (int j = 0; j < config.listenerCount; j++) {
+            // en un socket en escucha TCP_INFO informa la cola de accept():
+            // tcpi_unacked es su largo actual y tcpi_sacked el máximo (backlog);
+            // los sockets Unix no lo informan
+            struct tcp_info info;
+            socklen_t infoLen = sizeof(info);
+            if (config.listeners[j].kind != LISTEN_TCP) continue;
+            if (getsockopt(workers[w].listen[j].fd, IPPROTO_TCP, TCP_INFO, &info, &infoLen) == -1) continue;
+            *len += info.tcpi_unacked;
+            *max += info.tcpi_sacked;
+        }
+    }
+}
+
+static void serverStatsWrite(FILE* out, int prometheus) {
+    serverStats_t* st = malloc(sizeof(serverStats_t));
+    if (st == NULL) {
+        perror("Error in malloc");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+    serverStatsCollect(st);
+    uint64_t queueLen, queueMax;
+    serverStatsAcceptQueue(&queueLen, &queueMax);
+    double uptime = (utilsNowNs() - serverStartNs) / 1e9;
+
+    if (!prometheus) {
+        fprintf(out, "uptime_s %.0f\nconnections_current %lu\nconnections_total %lu\n", uptime,
+                st->connsOpened - st->connsClosed, st->connsOpened);
+        fprintf(out, "accept_queue %lu\naccept_queue_max %lu\n", queueLen, queueMax);
+        fprintf(out, "connections_rejected %lu\nconnections_timed_out %lu\nconnections_dropped %lu\n",
+                st->connsRejected, st->connsTimedOut, st->connsDropped);
+        for (int c = 0; c < STAT_CMDS; c++) {
+            const serverCmdStats_t* cs = &st->cmd[c];
+            if (cs->requests == 0) continue;
+            fprintf(out, "cmd %s requests=%lu hits=%lu misses=%lu bytes_in=%lu bytes_out=%lu",
+                    serverStatCmdNames[c], cs->requests, cs->hits, cs->misses, cs->bytesIn, cs->bytesOut);
+            for (int p = 0; p < PHASES; p++) {
+                fprintf(out, " %s_us=%.1f/%.1f/%.1f", serverStatPhaseNames[p],
+                        serverHistPercentile(&cs->lat[p], 50) / 1e3, serverHistPercentile(&cs->lat[p], 99) / 1e3,
+                        serverHistPercentile(&cs->lat[p], 99.9) / 1e3);
+            }
+            fprintf(out, "\n");
+        }
+        replStatsWrite(out, 0);
+        ttlStatsWrite(out, 0);
+        idxStatsWrite(out, 0);
+        free(st);
+        return;
+    }
+
+    // formato de texto de Prometheus (version 0.0.4)
+    fprintf(out, "# HELP kv_uptime_seconds Tiempo en marcha.\n# TYPE kv_uptime_seconds gauge\n");
+    fprintf(out, "kv_uptime_seconds %.3f\n", uptime);
+    fprintf(out, "# HELP kv_connections Conexiones abiertas.\n# TYPE kv_connections gauge\n");
+    fprintf(out, "kv_connections %lu\n", st->connsOpened - st->connsClosed);
+    fprintf(out, "# HELP kv_connections_accepted_total Conexiones aceptadas.\n");
+    fprintf(out, "# TYPE kv_connections_accepted_total counter\n");
+    fprintf(out, "kv_connections_accepted_total %lu\n", st->connsOpened);
+    fprintf(out, "# HELP kv_connections_rejected_total Conexiones rechazadas con BUSY.\n");
+    fprintf(out, "# TYPE kv_connections_rejected_total counter\n");
+    fprintf(out, "kv_connections_rejected_total %lu\n", st->connsRejected);
+    fprintf(out, "# HELP kv_connections_timed_out_total Conexiones cerradas por vencer un plazo.\n");
+    fprintf(out, "# TYPE kv_connections_timed_out_total counter\n");
+    fprintf(out, "kv_connections_timed_out_total %lu\n", st->connsTimedOut);
+    fprintf(out, "# HELP kv_connections_dropped_total Conexiones cerradas por el límite de salida o falta de memoria.\n");
+    fprintf(out, "# TYPE kv_connections_dropped_total counter\n");
+    fprintf(out, "kv_connections_dropped_total %lu\n", st->connsDropped);
+    fprintf(out, "# HELP kv_accept_queue Conexiones esperando accept().\n# TYPE kv_accept_queue gauge\n");
+    fprintf(out, "kv_accept_queue %lu\n", queueLen);
+    fprintf(out, "# HELP kv_accept_queue_max Largo máximo de la cola de accept().\n");
+    fprintf(out, "# TYPE kv_accept_queue_max gauge\nkv_accept_queue_max %lu\n", queueMax);
+
+    const char* counters[] = { "requests", "hits", "misses", "bytes_in", "bytes_out" };
+    const char* help[] = { "Pedidos atendidos", "Claves encontradas", "Claves no encontradas",
+                           "Bytes recibidos", "Bytes de respuesta" };
+    for (int k = 0; k < 5; k++) {
+        fprintf(out, "# HELP kv_%s_total %s, por comando.\n# TYPE kv_%s_total counter\n", counters[k], help[k], counters[k]);
+        for (int c = 0; c < STAT_CMDS; c++) {
+            const serverCmdStats_t* cs = &st->cmd[c];
+            uint64_t v[] = { cs->requests, cs->hits, cs->misses, cs->bytesIn, cs->bytesOut };
+            fprintf(out, "kv_%s_total{cmd=\"%s\"} %lu\n", counters[k], serverStatCmdNames[c], v[k]);
+        }
+    }
+
+    fprintf(out, "# HELP kv_request_duration_seconds Latencia por comando y fase.\n");
+    fprintf(out, "# TYPE kv_request_duration_seconds histogram\n");
+    for (int c = 0; c < STAT_CMDS; c++) {
+        for (int p = 0; p < PHASES; p++) {
+            const serverHist_t* h = &st->cmd[c].lat[p];
+            // los límites de Prometheus van en potencias de 2: todos los
+            // intervalos por debajo de 2^e ns caen en el bucket le=2^e
+            uint64_t cumulative = 0;
+            int b = 0;
+            for (int e = STATS_PROM_MIN_OCTAVE; e <= STATS_PROM_MAX_OCTAVE; e++) {
+                for (; b < 4 * (e - 1) && b < STATS_HIST_BUCKETS; b++) cumulative += h->buckets[b];
+                fprintf(out, "kv_request_duration_seconds_bucket{cmd=\"%s\",phase=\"%s\",le=\"%.9g\"} %lu\n",
+                        serverStatCmdNames[c], serverStatPhaseNames[p], (double)(1ULL << e) / 1e9, cumulative);
+            }
+            fprintf(out, "kv_request_duration_seconds_bucket{cmd=\"%s\",phase=\"%s\",le=\"+Inf\"} %lu\n",
+                    serverStatCmdNames[c], serverStatPhaseNames[p], h->count);
+            fprintf(out, "kv_request_duration_seconds_sum{cmd=\"%s\",phase=\"%s\"} %.9f\n",
+                    serverStatCmdNames[c], serverStatPhaseNames[p], h->sumNs / 1e9);
+            fprintf(out, "kv_request_duration_seconds_count{cmd=\"%s\",phase=\"%s\"} %lu\n",
+                    serverStatCmdNames[c], serverStatPhaseNames[p], h->count);
+        }
+    }
+    replStatsWrite(out, 1);
+    ttlStatsWrite(out, 1);
+    idxStatsWrite(out, 1);
+    free(st);
+}
+
+static void serverHandleStatsCmd(serverConn_t* conn) {
+    TRACE_DEBUG("server: comando STATS detectado");
+
+    // open_memstream() arma el informe en memoria con fprintf()
+    char* report = NULL;
+    size_t reportLen = 0;
+    FILE* out = open_memstream(&report, &reportLen);
+    if (out == NULL) {
+        perror("Error in open_memstream");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+    serverStatsWrite(out, 0);
+    fclose(out);
+
+    char header[32];
+    snprintf(header, sizeof(header), "OK %zu\n", reportLen);
+    serverSendMessage(conn, header);
+    serverSendBytes(conn, report, reportLen);
+    free(report);
+}
+
+static void serverHandleHotkeysCmd(serverConn_t* conn, size_t count) {
+    TRACE_DEBUG("server: comando HOTKEYS detectado - COUNT %zu", count);
+    if (config.hotTop == 0) {
+        serverSendError(conn, "ERROR: seguimiento de claves desactivado (-K 0).\n", 0);
+        return;
+    }
+
+    char* report = NULL;
+    size_t reportLen = 0;
+    FILE* out = open_memstream(&report, &reportLen);
+    if (out == NULL) {
+        perror("Error in open_memstream");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+    hotWrite(out, count);
+    fclose(out);
+
+    char header[32];
+    snprintf(header, sizeof(header), "OK %zu\n", reportLen);
+    serverSendMessage(conn, header);
+    serverSendBytes(conn, report, reportLen);
+    free(report);
+}
+
+static void serverHandleSnapshotCmd(serverConn_t* conn) {
+    TRACE_DEBUG("server: comando SNAPSHOT detectado");
+    int ret = dbSnapshotStart();
+    if (ret == -1) {
+        serverSendError(conn, "ERROR: ya hay un snapshot en curso.\n", 0);
+    } else if (ret == -2) {
+        serverSendError(conn, "ERROR: la base se está migrando a subcarpetas.\n", 0);
+    } else {
+        serverSendMessage(conn, "OK\n");
+    }
+}
+
+/**
+ * @brief Hilo del endpoint de métricas: atiende de a un pedido HTTP por vez
+ *
+ * Va aparte de los hilos de atención: un scrape (que recorre todos los
+ * histogramas) no demora a ningún cliente.
+ */
+static void* serverMetricsThread(void* arg) {
+    int soc = *(int*)arg;
+    while (1) {
+        int fd = accept(soc, NULL, NULL);
+        if (fd == -1) {
+            if (errno != EINTR && errno != ECONNABORTED) perror("Error in accept");
+            continue;
+        }
+        // un cliente que no manda el pedido no puede trabar el hilo
+        struct timeval tv = { 1, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        char request[1024];
+        if (read(fd, request, sizeof(request)) <= 0) {
+            close(fd);
+            continue;
+        }
+
+        // cualquier ruta devuelve las métricas (Prometheus pide /metrics)
+        char* body = NULL;
+        size_t bodyLen = 0;
+        FILE* out = open_memstream(&body, &bodyLen);
+        if (out == NULL) {
+            perror("Error in open_memstream");
+            close(fd);
+            continue;
+        }
+        serverStatsWrite(out, 1);
+        fclose(out);
+
+        char header[128];
+        int headerLen = snprintf(header, sizeof(header),
+                                 "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                                 "Content-Length: %zu\r\nConnection: close\r\n\r\n", bodyLen);
+        struct iovec iov[2] = { { header, headerLen }, { body, bodyLen } };
+        if (writev(fd, iov, 2) == -1 && errno != EPIPE) perror("Error in writev");
+        free(body);
+        close(fd);
+    }
+    return NULL;
+}
+
+static void serverMetricsInit(void) {
+    // mismo armado que el socket de comandos, pero bloqueante y con un solo hilo
+    static int soc;
+    soc = serverSocketSet(config.metricsPort, SERVER_BACKLOG);
+    int flags = fcntl(soc, F_GETFL);
+    if (flags == -1 || fcntl(soc, F_SETFL, flags & ~O_NONBLOCK) == -1) {
+        perror("Error in fcntl");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, serverMetricsThread, &soc) != 0) {
+        fprintf(stderr, "ERROR creando el hilo de métricas\n");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+    TRACE_INFO("server: métricas en http://127.0.0.1:%d/metrics", config.metricsPort);
+}
+
+/*********************** funciones de base de datos ************************/
+static void dbLockKey(const char* key, int write) {
+    pthread_rwlock_t* lock = &keyLocks[utilsHashString(key) % KEY_LOCK_STRIPES];
+    if (write) {
+        pthread_rwlock_wrlock(lock);
+    } else {
+        pthread_rwlock_rdlock(lock);
+    }
+}
+
+static void dbUnlockKey(const char* key) {
+    pthread_rwlock_unlock(&keyLocks[utilsHashString(key) % KEY_LOCK_STRIPES]);
+}
+
+/**
+ * @brief Compara números de franja para qsort()
+ */
+static int dbCompareStripes(const void* a, const void* b) {
+    uint32_t x = *(const uint32_t*)a;
+    uint32_t y = *(const uint32_t*)b;
+    return (x > y) - (x < y);
+}
+
+static int dbLockKeys(const char* keys[], int n, int write, uint32_t stripes[]) {
+    for (int i = 0; i < n; i++) {
+        stripes[i] = utilsHashString(keys[i]) % KEY_LOCK_STRIPES;
+    }
+    qsort(stripes, n, sizeof(stripes[0]), dbCompareStripes);
+
+    // sin repetidos: un rwlock no se puede tomar dos veces en el mismo hilo
+    int count = 0;
+    for (int i = 0; i < n; i++) {
+        if (count > 0 && stripes[count - 1] == stripes[i]) continue;
+        stripes[count++] = stripes[i];
+    }
+    for (int i = 0; i < count; i++) {
+        if (write) {
+            pthread_rwlock_wrlock(&keyLocks[stripes[i]]);
+        } else {
+            pthread_rwlock_rdlock(&keyLocks[stripes[i]]);
+        }
+    }
+    return count;
+}
+
+static void dbUnlockStripes(const uint32_t stripes[], int n) {
+    for (int i = 0; i < n; i++) {
+        pthread_rwlock_unlock(&keyLocks[stripes[i]]);
+    }
+}
+
+static void dbInit(const char* name) {
+    // los temporales que quedaron de una corrida anterior son valores a medio recibir
+    utilsEnsureDirectoryExists(PATH_TMP_FOLDER);
+    DIR* dir = opendir(PATH_TMP_FOLDER);
+    if (dir == NULL) {
+        perror("Error in opendir");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+    struct dirent* d;
+    while ((d = readdir(dir)) != NULL) {
+        if (d->d_name[0] != '.') unlinkat(dirfd(dir), d->d_name, 0);
+    }
+    closedir(dir);
+
+    for (size_t i = 0; i < sizeof(dbBackends) / sizeof(dbBackends[0]); i++) {
+        if (strcmp(dbBackends[i].name, name) == 0) {
+            db = &dbBackends[i];
+            TRACE_INFO("db: motor de almacenamiento \"%s\"", db->name);
+            db->init();
+            if (config.restore != NULL) dbRestore(config.restore);
+            return;
+        }
+    }
+    fprintf(stderr, "ERROR motor de almacenamiento desconocido: %s\n", name);
+    utilsCleanupAndExit(EXIT_FAILURE);
+}
+
+int dbCreateKey(const char* key, const char* value, size_t valLen, int keepTtl) {
+    dbSnapshotPreserve(key);
+    if (!keepTtl) ttlClear(key); // un valor nuevo no hereda el vencimiento del anterior
+    replAppend(REPL_SET, key, value, valLen);
+    int keyExists = db->createKey(key, value, valLen);
+    if (!keyExists) idxAdd(key);
+    return keyExists;
+}
+
+ssize_t dbGetValue(const char* key, char* value, size_t maxLen) {
+    dbValueRef_t ref;
+    if (!dbOpenValue(key, &ref)) return -1;
+
+    size_t len = ref.len < maxLen - 1 ? ref.len : maxLen - 1;
+    ssize_t n = pread(ref.fd, value, len, ref.off);
+    if (n == -1) {
+        perror("Error in pread");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+    value[n] = '\0'; // me aseguro que tenga caracter null al final
+    close(ref.fd);
+    return ref.len;
+}
+
+int dbOpenValue(const char* key, dbValueRef_t* ref) {
+    return db->openValue(key, ref);
+}
+
+int dbDeleteValue(const char* key) {
+    dbSnapshotPreserve(key);
+    ttlClear(key);
+    int found = db->deleteValue(key);
+    if (found) {
+        idxRemove(key);
+        replAppend(REPL_DEL, key, NULL, 0);
+    }
+    return found;
+}
+
+/**
+ * @brief Crea un archivo temporal con nombre único en PATH_TMP_FOLDER
+ * @param path Recibe la ruta del temporal
+ * @return Descriptor abierto para lectura y escritura
+ */
+static int dbTmpOpen(char* path) {
+    uint64_t id = __atomic_fetch_add(&dbTmpCounter, 1, __ATOMIC_RELAXED);
+    snprintf(path, MAX_PATH_LEN, "%s/%lu", PATH_TMP_FOLDER, id);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, FILES_PERM);
+    if (fd == -1) {
+        perror("Error in open");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+    return fd;
+}
+
+static void dbStreamOpen(dbStream_t* stream, size_t len) {
+    stream->fd = dbTmpOpen(stream->path);
+    stream->len = len;
+    stream->crc = 0;
+}
+
+static void dbStreamWrite(dbStream_t* stream, const char* data, size_t len) {
+    if (db->streamCrc) stream->crc = utilsCrc32(stream->crc, data, len);
+    while (len > 0) {
+        ssize_t n = write(stream->fd, data, len);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            perror("Error in write");
+            utilsCleanupAndExit(EXIT_FAILURE);
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+static int dbStreamCommit(const char* key, dbStream_t* stream, int keepTtl) {
+    dbSnapshotPreserve(key);
+    if (!keepTtl) ttlClear(key);
+    int keyExists = db->commitStream(key, stream);
+    if (!keyExists) idxAdd(key);
+    if (replLog.buf != NULL && stream->len <= REPL_INLINE_MAX) {
+        // el temporal sigue abierto: un valor chico va entero al flujo
+        char value[REPL_INLINE_MAX];
+        if (pread(stream->fd, value, stream->len, 0) != (ssize_t)stream->len) {
+            perror("Error in pread");
+            utilsCleanupAndExit(EXIT_FAILURE);
+        }
+        replAppend(REPL_SET, key, value, stream->len);
+    } else {
+        replAppend(REPL_SET, key, NULL, stream->len);
+    }
+    close(stream->fd);
+    stream->fd = -1;
+    return keyExists;
+}
+
+static void dbStreamAbort(dbStream_t* stream) {
+    close(stream->fd);
+    unlink(stream->path);
+    stream->fd = -1;
+}
+
+/*********************** durabilidad: fsync agrupado ************************/
+static void dbSyncReport(void) {
+    // sólo las escribe el hilo de fsync; para un informe alcanza con una copia
+    dbSyncStats_t st = dbSyncStats;
+    if (st.batches == 0) return;
+    TRACE_INFO("db: fsync: %lu lotes, %lu escrituras (promedio %.1f por lote, máximo %lu), "
+               "latencia promedio %.1f us, máxima %.1f us",
+               st.batches, st.writes, (double)st.writes / st.batches, st.maxBatch,
+               st.totalNs / 1e3 / st.batches, st.maxNs / 1e3);
+}
+
+/**
+ * @brief Hilo de fsync
+ *
+ * En modo "always" duerme hasta que haya escrituras sin confirmar y hace
+ * un solo fsync para todas las que se juntaron mientras tanto (group
+ * commit): cuanto más carga, más escrituras cubre cada fsync. En modo
+ * "everysec" hace un fsync por segundo si hubo escrituras.
+ */
+static void* dbSyncThread(void* arg) {
+    (void)arg;
+    time_t lastReport = time(NULL);
+    while (1) {
+        if (config.durability == DURABILITY_ALWAYS) {
+            pthread_mutex_lock(&dbSyncLock);
+            while (__atomic_load_n(&dbSyncWritten, __ATOMIC_ACQUIRE) ==
+                   __atomic_load_n(&dbSyncDurable, __ATOMIC_ACQUIRE)) {
+                pthread_cond_wait(&dbSyncCond, &dbSyncLock);
+            }
+            pthread_mutex_unlock(&dbSyncLock);
+        } else {
+            sleep(1);
+        }
+
+        // todo lo anotado hasta acá ya está escrito: un fsync lo cubre
+        uint64_t target = __atomic_load_n(&dbSyncWritten, __ATOMIC_ACQUIRE);
+        uint64_t durable = __atomic_load_n(&dbSyncDurable, __ATOMIC_ACQUIRE);
+        if (target != durable) {
+            struct timespec t0, t1;
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+            db->sync();
+            ttlSync();
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+            __atomic_store_n(&dbSyncDurable, target, __ATOMIC_RELEASE);
+
+            uint64_t ns = (t1.tv_sec - t0.tv_sec) * 1000000000ULL + (t1.tv_nsec - t0.tv_nsec);
+            uint64_t batch = target - durable;
+            dbSyncStats.batches++;
+            dbSyncStats.writes += batch;
+            dbSyncStats.totalNs += ns;
+            if (batch > dbSyncStats.maxBatch) dbSyncStats.maxBatch = batch;
+            if (ns > dbSyncStats.maxNs) dbSyncStats.maxNs = ns;
+
+            // se avisa a los hilos de atención para que envíen lo retenido
+            if (config.durability == DURABILITY_ALWAYS) {
+                uint64_t one = 1;
+                for (int i = 0; i < config.workers; i++) {
+                    if (write(workers[i].syncFd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+                        perror("Error in write");
+                    }
+                }
+            }
+        }
+
+        if (time(NULL) - lastReport >= SYNC_REPORT_INTERVAL) {
+            dbSyncReport();
+            lastReport = time(NULL);
+        }
+    }
+    return NULL;
+}
+
+static void dbSyncInit(void) {
+    TRACE_INFO("db: durabilidad \"%s\"", dbDurabilityNames[config.durability]);
+    if (config.durability == DURABILITY_NONE) return;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, dbSyncThread, NULL) != 0) {
+        fprintf(stderr, "ERROR creando el hilo de fsync\n");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+    pthread_detach(thread);
+}
+
+static uint64_t dbSyncTicket(void) {
+    pthread_mutex_lock(&dbSyncLock);
+    // el hilo de fsync también lo lee sin el lock
+    uint64_t ticket = __atomic_add_fetch(&dbSyncWritten, 1, __ATOMIC_RELEASE);
+    pthread_cond_signal(&dbSyncCond);
+    pthread_mutex_unlock(&dbSyncLock);
+    return ticket;
+}
+
+static int dbSyncIsDurable(uint64_t ticket) {
+    return __atomic_load_n(&dbSyncDurable, __ATOMIC_ACQUIRE) >= ticket;
+}
+
+/*********************** motor "file": un archivo por clave ************************/
+/**
+ * @brief Busca el slot de un hash en una porción del conjunto de claves
+ * @return Índice del slot, o del primer slot libre donde iría si no está
+ */
+static size_t dbKeySetFindSlot(const dbKeySetShard_t* shard, uint64_t hash) {
+    size_t i = hash & shard->mask;
+    while (shard->slots[i].hash != 0 && shard->slots[i].hash != hash) i = (i + 1) & shard->mask;
+    return i;
+}
+
+static inline dbKeySetShard_t* dbKeySetShardOf(dbKeySetShard_t* set, uint64_t hash) {
+    return &set[(hash >> 58) % KEYSET_SHARDS];
+}
+
+/**
+ * @brief Prepara un conjunto de claves vacío
+ */
+static void dbKeySetInit(dbKeySetShard_t* set) {
+    for (int i = 0; i < KEYSET_SHARDS; i++) {
+        pthread_mutex_init(&set[i].lock, NULL);
+        set[i].mask = KEYSET_MIN_SLOTS - 1;
+        set[i].used = 0;
+        set[i].slots = calloc(KEYSET_MIN_SLOTS, sizeof(dbKeySetEntry_t));
+        if (set[i].slots == NULL) {
+            perror("Error in calloc");
+            utilsCleanupAndExit(EXIT_FAILURE);
+        }
+    }
+}
+
+/**
+ * @brief Libera la memoria de un conjunto de claves
+ */
+static void dbKeySetFree(dbKeySetShard_t* set) {
+    for (int i = 0; i < KEYSET_SHARDS; i++) {
+        free(set[i].slots);
+        set[i].slots = NULL;
+        pthread_mutex_destroy(&set[i].lock);
+    }
+}
+
+/**
+ * @brief Cuenta una clave más con un hash en un conjunto
+ * @param set Conjunto de claves
+ * @param hash Hash de la clave, distinto de 0
+ * @return Claves con ese hash que había antes (0 si es nuevo)
+ */
+static uint32_t dbKeySetAdd(dbKeySetShard_t* set, uint64_t hash) {
+    dbKeySetShard_t* shard = dbKeySetShardOf(set, hash);
+    pthread_mutex_lock(&shard->lock);
+    size_t i = dbKeySetFindSlot(shard, hash);
+    if (shard->slots[i].hash == 0) {
+        // se agranda con la tabla a la mitad, para que los sondeos sigan cortos
+        if ((shard->used + 1) * 2 > shard->mask + 1) {
+            size_t oldCap = shard->mask + 1;
+            dbKeySetEntry_t* old = shard->slots;
+            shard->slots = calloc(oldCap * 2, sizeof(dbKeySetEntry_t));
+            if (shard->slots == NULL) {
+                perror("Error in calloc");
+                utilsCleanupAndExit(EXIT_FAILURE);
+            }
+            shard->mask = oldCap * 2 - 1;
+            for (size_t j = 0; j < oldCap; j++) {
+                if (old[j].hash != 0) shard->slots[dbKeySetFindSlot(shard, old[j].hash)] = old[j];
+            }
+            free(old);
+            i = dbKeySetFindSlot(shard, hash);
+        }
+        shard->slots[i].hash = hash;
+        shard->used++;
+    }
+    uint32_t before = shard->slots[i].count++;
+    pthread_mutex_unlock(&shard->lock);
+    return before;
+}
+
+/**
+ * @brief Indica si una clave puede existir en la carpeta
+ *
+ * Un 0 es seguro: la clave no existe y no hace falta preguntarle al
+ * sistema de archivos. Un 1 puede ser otra clave con el mismo hash.
+ */
+static int dbFileKeyMayExist(const char* key) {
+    uint64_t hash = utilsHashString(key) | 1; // 0 marca slot libre
+    dbKeySetShard_t* shard = dbKeySetShardOf(dbKeySet, hash);
+    pthread_mutex_lock(&shard->lock);
+    int found = shard->slots[dbKeySetFindSlot(shard, hash)].hash != 0;
+    pthread_mutex_unlock(&shard->lock);
+    return found;
+}
+
+/**
+ * @brief Anota una clave recién creada en el conjunto de claves
+ */
+static void dbFileKeyAdd(const char* key) {
+    dbKeySetAdd(dbKeySet, utilsHashString(key) | 1); // 0 marca slot libre
+}
+
+/**
+ * @brief Quita una clave recién borrada del conjunto de claves
+ */
+static void dbFileKeyRemove(const char* key) {
+    uint64_t hash = utilsHashString(key) | 1;
+    dbKeySetShard_t* shard = dbKeySetShardOf(dbKeySet, hash);
+    pthread_mutex_lock(&shard->lock);
+    size_t i = dbKeySetFindSlot(shard, hash);
+    if (shard->slots[i].hash != 0 && --shard->slots[i].count == 0) {
+        // borrado con corrimiento hacia atrás, como logIndexRemoveSlot()
+        shard->slots[i].hash = 0;
+        shard->used--;
+        size_t j = i;
+        while (1) {
+            j = (j + 1) & shard->mask;
+            if (shard->slots[j].hash == 0) break;
+            size_t home = shard->slots[j].hash & shard->mask;
+            int movable = (i <= j) ? (home <= i || home > j) : (home <= i && home > j);
+            if (movable) {
+                shard->slots[i] = shard->slots[j];
+                shard->slots[j].hash = 0;
+                i = j;
+            }
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+/**
+ * @brief Indica si una entrada de getdents64() es un archivo común
+ */
+static int dbFileIsRegular(int dirFd, const struct dirent64* d) {
+    if (d->d_type != DT_UNKNOWN) return d->d_type == DT_REG;
+    // algunos sistemas de archivos no informan el tipo
+    struct stat st;
+    return fstatat(dirFd, d->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISREG(st.st_mode);
+}
+
+/**
+ * @brief Recorre las claves de los archivos de una carpeta
+ * @param parentFd Carpeta abierta que la contiene
+ * @param name Nombre de la carpeta relativo a parentFd
+ * @param buf Buffer de DB_SCAN_BUF_LEN bytes para getdents64()
+ * @param fn Función a llamar por cada clave
+ * @param arg Argumento para fn
+ * @return Cantidad de claves encontradas
+ */
+static size_t dbFileWalkDir(int parentFd, const char* name, char* buf, dbKeyFn fn, void* arg) {
+    int fd = openat(parentFd, name, O_RDONLY | O_DIRECTORY);
+    if (fd == -1 && errno == ENOENT) return 0; // subcarpeta todavía sin claves
+    if (fd == -1) {
+        perror("Error in openat");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+    // getdents64() con un buffer grande: pocas llamadas aunque la carpeta
+    // tenga millones de archivos (readdir() lee de a 32 KB)
+    size_t keys = 0;
+    ssize_t n;
+    while ((n = getdents64(fd, buf, DB_SCAN_BUF_LEN)) > 0) {
+        for (ssize_t pos = 0; pos < n;) {
+            const struct dirent64* d = (const struct dirent64*)(buf + pos);
+            pos += d->d_reclen;
+            if (!dbFileIsRegular(fd, d)) continue; // ".", ".." y carpetas
+            char key[MAX_MSG_LENGTH];
+            if (utilsKeyDecode(d->d_name, key) == -1) {
+                TRACE_WARN("db: se ignora el archivo \"%s\", no es una clave", d->d_name);
+                continue;
+            }
+            fn(key, arg);
+            keys++;
+        }
+    }
+    if (n == -1) {
+        perror("Error in getdents64");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+    close(fd);
+    return keys;
+}
+
+/**
+ * @brief Recorre las claves de la carpeta plana y de todas las subcarpetas
+ * @param fn Función a llamar por cada clave
+ * @param arg Argumento para fn
+ * @param flat Recibe cuántas había en la carpeta plana (con -f, las que falta migrar)
+ * @return Cantidad de claves encontradas
+ */
+static size_t dbFileWalk(dbKeyFn fn, void* arg, size_t* flat) {
+    char* buf = malloc(DB_SCAN_BUF_LEN);
+    if (buf == NULL) {
+        perror("Error in malloc");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+    *flat = dbFileWalkDir(dbFileFolderFd, ".", buf, fn, arg);
+    size_t keys = *flat;
+    for (int i = 0; config.fanout > 0 && i < DB_FANOUT_DIRS; i++) {
+        if (config.fanout == 1) {
+            keys += dbFileWalkDir(dbFileDirFds[i], ".", buf, fn, arg);
+            continue;
+        }
+        for (int j = 0; j < DB_FANOUT_DIRS; j++) {
+            char sub[3];
+            snprintf(sub, sizeof(sub), "%02x", j);
+            keys += dbFileWalkDir(dbFileDirFds[i], sub, buf, fn, arg);
+        }
+    }
+    free(buf);
+    return keys;
+}
+
+static void dbFileScanKey(const char* key, void* arg) {
+    (void)arg;
+    dbFileKeyAdd(key);
+}
+
+/**
+ * @brief Carga en el conjunto de claves todos los archivos de la base
+ * @return Cantidad de claves en la carpeta plana (con -f, las que falta migrar)
+ */
+static size_t dbFileScan(void) {
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    size_t flat;
+    size_t keys = dbFileWalk(dbFileScanKey, NULL, &flat);
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    TRACE_INFO("db: %zu claves en %s, escaneadas en %.1f ms", keys, PATH_DB_FOLDER,
+               (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6);
+    return flat;
+}
+
+static void dbFileForEachKey(dbKeyFn fn, void* arg) {
+    size_t flat;
+    dbFileWalk(fn, arg, &flat);
+}
+
+/**
+ * @brief Indica si una entrada de una carpeta abierta es una carpeta
+ */
+static int dbFileIsDirAt(int dirFd, const char* name) {
+    struct stat st;
+    return fstatat(dirFd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+}
+
+/**
+ * @brief Crea una carpeta dentro de una carpeta abierta si no existe
+ */
+static void dbFileMkdirAt(int dirFd, const char* name) {
+    if (mkdirat(dirFd, name, DB_FOLDER_PERM) == -1 && errno != EEXIST) {
+        perror("Error in mkdirat");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * @brief Renombra un archivo a la ubicación de una clave
+ *
+ * Con -f 2 crea la subcarpeta del segundo nivel si todavía no existe.
+ * @return Lo mismo que renameat()
+ */
+static int dbFileRenameTo(int fromFd, const char* from, const dbFilePath_t* path) {
+    int ret = renameat(fromFd, from, path->dirFd, path->name);
+    if (ret == -1 && errno == ENOENT && config.fanout == 2) {
+        char sub[3] = { path->name[0], path->name[1], '\0' };
+        dbFileMkdirAt(path->dirFd, sub);
+        ret = renameat(fromFd, from, path->dirFd, path->name);
+    }
+    return ret;
+}
+
+/**
+ * @brief Mueve un archivo de la carpeta plana a su subcarpeta
+ * @param name Nombre del archivo en la carpeta plana
+ * @return 1 si lo movió (o lo borró por haber uno más nuevo), 0 si no
+ */
+static int dbFileMigrateOne(const char* name) {
+    char key[MAX_MSG_LENGTH];
+    if (utilsKeyDecode(name, key) == -1) return 0;
+    dbFilePath_t path;
+    dbFilePathOf(key, &path);
+
+    dbLockKey(key, 1);
+    int moved = 1;
+    if (utilsFileExistsAt(path.dirFd, path.name)) {
+        // las dos copias estaban al arrancar y la plana es la vieja; las dos
+        // se anotaron en el conjunto de claves
+        if (unlinkat(dbFileFolderFd, name, 0) == 0) {
+            dbFileKeyRemove(key);
+        } else if (errno == ENOENT) {
+            moved = 0;
+        } else {
+            perror("Error in unlinkat");
+            utilsCleanupAndExit(EXIT_FAILURE);
+        }
+    } else if (dbFileRenameTo(dbFileFolderFd, name, &path) == -1) {
+        if (errno != ENOENT) { // un DEL o SET lo borró recién
+            perror("Error in renameat");
+            utilsCleanupAndExit(EXIT_FAILURE);
+        }
+        moved = 0;
+    }
+    dbUnlockKey(key);
+    return moved;
+}
+
+static void* dbFileMigrateThread(void* arg) {
+    (void)arg;
+    uint64_t start = utilsNowNs();
+    char* buf = malloc(DB_SCAN_BUF_LEN);
+    if (buf == NULL) {
+        perror("Error in malloc");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+    int fd = openat(dbFileFolderFd, ".", O_RDONLY | O_DIRECTORY);
+    if (fd == -1) {
+        perror("Error in openat");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+    // a la carpeta plana ya no se agregan archivos, así que una pasada alcanza
+    size_t moved = 0;
+    ssize_t n;
+    while ((n = getdents64(fd, buf, DB_SCAN_BUF_LEN)) > 0) {
+        for (ssize_t pos = 0; pos < n;) {
+            const struct dirent64* d = (const struct dirent64*)(buf + pos);
+            pos += d->d_reclen;
+            if (dbFileIsRegular(fd, d)) moved += dbFileMigrateOne(d->d_name);
+        }
+    }
+    if (n == -1) {
+        perror("Error in getdents64");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+    close(fd);
+    free(buf);
+
+    __atomic_store_n(&dbFileMigrating, 0, __ATOMIC_RELEASE);
+    TRACE_INFO("db: migración a %d niveles de subcarpetas terminada, %zu claves movidas en %.1f s",
+               config.fanout, moved, (utilsNowNs() - start) / 1e9);
+    return NULL;
+}
+
+/**
+ * @brief Crea y abre las subcarpetas del primer nivel de -f
+ *
+ * Las 256 del primer nivel se crean al arrancar; las del segundo, con la
+ * primera clave que cae en cada una (ver dbFileRenameTo()). La cantidad
+ * de niveles se reconoce en el arranque siguiente por "00" y "00/00".
+ */
+static void dbFileFanoutInit(void) {
+    int found = dbFileIsDirAt(dbFileFolderFd, "00") ? (dbFileIsDirAt(dbFileFolderFd, "00/00") ? 2 : 1) : 0;
+    if (found != 0 && found != config.fanout) {
+        fprintf(stderr, "ERROR %s tiene %d niveles de subcarpetas, usar -f %d\n", PATH_DB_FOLDER, found, found);
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+    if (config.fanout == 0) return;
+
+    uint64_t start = utilsNowNs();
+    char aside[DB_FANOUT_DIRS][DB_NAME_LEN];
+    int asideCount = 0;
+    for (int i = 0; i < DB_FANOUT_DIRS; i++) {
+        char name[3];
+        snprintf(name, sizeof(name), "%02x", i);
+        if (found == 0 && utilsFileExistsAt(dbFileFolderFd, name)) {
+            // una clave de la carpeta plana con el nombre de una subcarpeta: se
+            // aparta con su otro nombre válido ('~' y base64) y se migra abajo
+            utilsKeyEncodeBase64(name, aside[asideCount]);
+            if (renameat(dbFileFolderFd, name, dbFileFolderFd, aside[asideCount]) == -1) {
+                perror("Error in renameat");
+                utilsCleanupAndExit(EXIT_FAILURE);
+            }
+            asideCount++;
+        }
+        dbFileMkdirAt(dbFileFolderFd, name);
+        if ((dbFileDirFds[i] = openat(dbFileFolderFd, name, O_RDONLY | O_DIRECTORY)) == -1) {
+            perror("Error in openat");
+            utilsCleanupAndExit(EXIT_FAILURE);
+        }
+    }
+    if (config.fanout == 2) dbFileMkdirAt(dbFileDirFds[0], "00"); // marca los dos niveles
+    for (int i = 0; i < asideCount; i++) dbFileMigrateOne(aside[i]);
+    if (found == 0) {
+        TRACE_INFO("db: subcarpetas de %d niveles creadas en %.1f ms", config.fanout, (utilsNowNs() - start) / 1e6);
+    }
+}
+
+static void dbFileInit(void) {
+    /*
+     * La carpeta se verifica y se abre una sola vez al arrancar. Después todo
+     *  se hace relativo a su descriptor con las llamadas *at() (openat(),
+     *  renameat(), unlinkat(), faccessat()): el kernel no vuelve a recorrer
+     *  "./db" en cada operación, y las de un MGET/MSET/MDEL salen seguidas
+     *  sobre el mismo directorio ya resuelto.
+     */
+    utilsEnsureDirectoryExists(PATH_DB_FOLDER);
+
+    if ((dbFileFolderFd = open(PATH_DB_FOLDER, O_RDONLY | O_DIRECTORY)) == -1) {
+        perror("Error in open");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+    // la carpeta es solo del servidor: con las claves en memoria, los GET y
+    // DEL de claves que no existen se responden sin ninguna llamada al sistema
+    dbKeySetInit(dbKeySet);
+    dbFileFanoutInit();
+    if (dbFileScan() > 0 && config.fanout > 0) {
+        TRACE_INFO("db: migrando %s a %d niveles de subcarpetas", PATH_DB_FOLDER, config.fanout);
+        dbFileMigrating = 1;
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, dbFileMigrateThread, NULL) != 0) {
+            fprintf(stderr, "ERROR creando el hilo de migración\n");
+            utilsCleanupAndExit(EXIT_FAILURE);
+        }
+        pthread_detach(thread);
+    }
+}
+
+static void dbFileSync(void) {
+    /*
+     * syncfs() baja a disco todo el sistema de archivos de la carpeta: en una
+     *  sola llamada cubre el contenido de todos los archivos escritos y las
+     *  altas y bajas de la carpeta, que con fsync() serían un fsync por
+     *  archivo más uno de la carpeta.
+     */
+    if (syncfs(dbFileFolderFd) == -1) {
+        perror("Error in syncfs");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+}
+
+static void dbFilePathOf(const char* key, dbFilePath_t* path) {
+    if (config.fanout == 0) {
+        path->dirFd = dbFileFolderFd;
+        utilsKeyEncode(key, path->name);
+        return;
+    }
+    uint64_t hash = utilsHashString(key);
+    path->dirFd = dbFileDirFds[hash >> 56];
+    if (config.fanout == 1) {
+        utilsKeyEncode(key, path->name);
+        return;
+    }
+    snprintf(path->name, 4, "%02x/", (unsigned)(hash >> 48) & 0xff);
+    utilsKeyEncode(key, path->name + 3);
+}
+
+/**
+ * @brief Verifica si una clave tiene archivo, en la carpeta plana también si se está migrando
+ */
+static int dbFileExists(const char* key, const dbFilePath_t* path) {
+    if (utilsFileExistsAt(path->dirFd, path->name)) return 1;
+    if (!__atomic_load_n(&dbFileMigrating, __ATOMIC_ACQUIRE)) return 0;
+    char name[DB_NAME_LEN];
+    utilsKeyEncode(key, name);
+    return utilsFileExistsAt(dbFileFolderFd, name);
+}
+
+/**
+ * @brief Borra el archivo que una clave todavía tenga en la carpeta plana si se está migrando
+ * @return 1 si lo borró, 0 si no había
+ */
+static int dbFileUnlinkFlat(const char* key) {
+    if (!__atomic_load_n(&dbFileMigrating, __ATOMIC_ACQUIRE)) return 0;
+    char name[DB_NAME_LEN];
+    utilsKeyEncode(key, name);
+    if (unlinkat(dbFileFolderFd, name, 0) == 0) return 1;
+    if (errno != ENOENT) {
+        perror("Error in unlinkat");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+    return 0;
+}
+
+static int dbFileCreateKey(const char* key, const char* value, size_t valLen) {
+    dbFilePath_t path;
+    dbFilePathOf(key, &path);
+    // solo se pregunta al sistema de archivos si el conjunto no lo descarta
+    int fileExists = dbFileKeyMayExist(key) && dbFileExists(key, &path);
+
+    // se escribe en un temporal y se renombra: un GET que está enviando el
+    // valor anterior con sendfile() lo sigue viendo entero, no truncado
+    char tmpPath[MAX_PATH_LEN];
+    int fd = dbTmpOpen(tmpPath);
+    // escribo el archivo
+    ssize_t n;
+    if ((n = write(fd, value, valLen)) == -1) {
+        perror("Error in write");
+        close(fd);
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+    if ((size_t)n != valLen) {
+        fprintf(stderr, "ERROR writing file, value: %.*s, bytes: %ld, bytes written: %ld.\n", (int)valLen, value, valLen, n);
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+
+    if (close(fd) == -1) {
+        perror("Error in close");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+    if (dbFileRenameTo(AT_FDCWD, tmpPath, &path) == -1) {
+        perror("Error in renameat");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+    dbFileUnlinkFlat(key); // el valor viejo sin migrar ya no sirve
+    if (!fileExists) dbFileKeyAdd(key);
+    return fileExists;
+}
+
+static int dbFileOpenValue(const char* key, dbValueRef_t* ref) {
+    if (!dbFileKeyMayExist(key)) return 0;
+
+    // abro el archivo; si no existe la clave falla con ENOENT (sin un access() aparte)
+    dbFilePath_t path;
+    dbFilePathOf(key, &path);
+    int fd = openat(path.dirFd, path.name, O_RDONLY);
+    if (fd == -1 && errno == ENOENT && __atomic_load_n(&dbFileMigrating, __ATOMIC_ACQUIRE)) {
+        utilsKeyEncode(key, path.name); // todavía en la carpeta plana
+        fd = openat(dbFileFolderFd, path.name, O_RDONLY);
+    }
+    if (fd == -1) {
+        if (errno == ENOENT) return 0;
+        perror("Error in openat");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        perror("Error in fstat");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+    ref->fd = fd;
+    ref->off = 0;
+    ref->len = st.st_size;
+    return 1;
+}
+
+static int dbFileCommitStream(const char* key, dbStream_t* stream) {
+    dbFilePath_t path;
+    dbFilePathOf(key, &path);
+    int fileExists = dbFileKeyMayExist(key) && dbFileExists(key, &path);
+
+    // el temporal ya es el archivo final: basta con darle su nombre
+    if (dbFileRenameTo(AT_FDCWD, stream->path, &path) == -1) {
+        perror("Error in renameat");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+    dbFileUnlinkFlat(key);
+    if (!fileExists) dbFileKeyAdd(key);
+    return fileExists;
+}
+
+static int dbFileDeleteValue(const char* key) {
+    /*
+     * unlink() deletes a name from the filesystem.  If that name was the
+     *  last link to a file and no processes have the file open, the file
+     *  is deleted and the space it was using is made available for reuse.
+     * unlinkat() hace lo mismo relativo a un directorio abierto; si la clave
+     *  no existe falla con ENOENT, así no hace falta chequear antes.
+     */
+    if (!dbFileKeyMayExist(key)) return 0;
+    dbFilePath_t path;
+    dbFilePathOf(key, &path);
+    int found = 1;
+    if (unlinkat(path.dirFd, path.name, 0) != 0) {
+        if (errno != ENOENT) {
+            perror("Error in unlinkat");
+            utilsCleanupAndExit(EXIT_FAILURE);
+        }
+        found = 0;
+    }
+    found |= dbFileUnlinkFlat(key);
+    if (found) dbFileKeyRemove(key);
+    return found;
+}
+
+/**
+ * @brief Crea el archivo de una clave al cargar un volcado (ver dbFileRestore())
+ */
+static int dbFileRestoreRecord(uint32_t segId, const logRecordHeader_t* h, const char* key,
+                               const char* value, uint64_t recOff, void* arg) {
+    (void)segId;
+    (void)recOff;
+    (void)arg;
+    if (h->valLen == LOG_TOMBSTONE) return 0;
+    if (h->seq == 0) {
+        dbRestoreExpiry(h, key, value);
+        return 0;
+    }
+    dbFilePath_t path;
+    dbFilePathOf(key, &path);
+    int fd = openat(path.dirFd, path.name, O_WRONLY | O_CREAT | O_TRUNC, FILES_PERM);
+    if (fd == -1 && errno == ENOENT && config.fanout == 2) {
+        char sub[3] = { path.name[0], path.name[1], '\0' };
+        dbFileMkdirAt(path.dirFd, sub);
+        fd = openat(path.dirFd, path.name, O_WRONLY | O_CREAT | O_TRUNC, FILES_PERM);
+    }
+    if (fd == -1) {
+        perror("Error in openat");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+    if (write(fd, value, h->valLen) != (ssize_t)h->valLen) {
+        perror("Error in write");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+    close(fd);
+    dbFileKeyAdd(key);
+    return 0;
+}
+
+static void dbFileRestore(int fd, uint64_t size) {
+    for (int i = 0; i < KEYSET_SHARDS; i++) {
+        if (dbKeySet[i].used != 0) {
+            fprintf(stderr, "ERROR %s no está vacía, no se puede cargar el volcado\n", PATH_DB_FOLDER);
+            utilsCleanupAndExit(EXIT_FAILURE);
+        }
+    }
+    // sin temporales ni renombres: nadie lee la base todavía, y al final va un solo syncfs()
+    if (logScanSegment(fd, 0, dbFileRestoreRecord, NULL) != size) {
+        fprintf(stderr, "ERROR el volcado está cortado o corrupto\n");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+}
+
+/*********************** motor "log": segmentos de solo-agregado ************************/
+/**
+ * @brief Devuelve la porción del índice que corresponde a un hash
+ */
+static inline logIndexShard_t* logIndexShardOf(uint64_t hash) {
+    return &logIndex[(hash >> 56) % LOG_INDEX_SHARDS];
+}
+
+/**
+ * @brief Devuelve el slot de la tabla de segmentos de un id
+ */
+static inline logSegment_t* logSegmentOf(uint32_t id) {
+    return &logSegments[id % LOG_MAX_SEGMENTS];
+}
+
+/**
+ * @brief Bytes que ocupa en disco un registro
+ */
+static inline uint64_t logRecordSize(uint32_t keyLen, uint32_t valLen) {
+    return sizeof(logRecordHeader_t) + keyLen + (valLen == LOG_TOMBSTONE ? 0 : valLen);
+}
+
+/**
+ * @brief CRC de un registro: encabezado (sin el campo crc), clave y valor
+ */
+static uint32_t logRecordCrc(const logRecordHeader_t* h, const char* key, const char* value) {
+    uint32_t crc = utilsCrc32(0, (const char*)h + sizeof(h->crc), sizeof(*h) - sizeof(h->crc));
+    crc = utilsCrc32(crc, key, h->keyLen);
+    return utilsCrc32(crc, value, h->valLen == LOG_TOMBSTONE ? 0 : h->valLen);
+}
+
+/**
+ * @brief Arma la ruta de un archivo del log: <carpeta>/<id>.<ext>
+ */
+static void logFilePath(uint32_t id, const char* ext, char* path) {
+    snprintf(path, MAX_PATH_LEN, "%s/%08u.%s", PATH_LOG_FOLDER, id, ext);
+}
+
+/**
+ * @brief Busca el slot de una clave en una porción del índice
+ * @return Índice del slot, o del primer slot libre donde iría si no está
+ */
+static size_t logIndexFindSlot(logIndexShard_t* shard, uint64_t hash, const char* key) {
+    size_t i = hash & shard->mask;
+    while (shard->slots[i].hash != 0) {
+        if (shard->slots[i].hash == hash && strcmp(shard->slots[i].key, key) == 0) break;
+        i = (i + 1) & shard->mask;
+    }
+    return i;
+}
+
+/**
+ * @brief Duplica la tabla de una porción del índice y reubica las entradas
+ */
+static void logIndexGrow(logIndexShard_t* shard) {
+    size_t oldCap = shard->mask + 1;
+    logIndexEntry_t* old = shard->slots;
+    size_t cap = oldCap * 2;
+
+    shard->slots = calloc(cap, sizeof(logIndexEntry_t));
+    if (shard->slots == NULL) {
+        perror("Error in calloc");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+    shard->mask = cap - 1;
+    for (size_t i = 0; i < oldCap; i++) {
+        if (old[i].hash == 0) continue;
+        size_t j = old[i].hash & shard->mask;
+        while (shard->slots[j].hash != 0) j = (j + 1) & shard->mask;
+        shard->slots[j] = old[i];
+    }
+    free(old);
+}
+
+/**
+ * @brief Libera el slot i y corre hacia atrás las entradas siguientes (ver cacheRemoveSlot())
+ */
+static void logIndexRemoveSlot(logIndexShard_t* shard, size_t i) {
+    free(shard->slots[i].key);
+    shard->slots[i].hash = 0;
+    shard->used--;
+
+    size_t j = i;
+    while (1) {
+        j = (j + 1) & shard->mask;
+        if (shard->slots[j].hash == 0) break;
+        size_t home = shard->slots[j].hash & shard->mask;
+        int movable = (i <= j) ? (home <= i || home > j) : (home <= i && home > j);
+        if (movable) {
+            shard->slots[i] = shard->slots[j];
+            shard->slots[j].hash = 0;
+            i = j;
+        }
+    }
+}
+
+/**
+ * @brief Inserta o actualiza la posición de una clave
+ *
+ * Gana siempre el registro con mayor número de secuencia, así al
+ * reconstruir el índice no importa el orden en que se leen los segmentos.
+ * @param key Clave
+ * @param entry Nueva posición (segId, valOff, valLen, seq)
+ * @param loser Recibe la entrada que quedó descartada (para contar basura)
+ * @return 0 si la clave era nueva, 1 si se pisó la anterior, 2 si la nueva era más vieja
+ */
+static int logIndexPut(const char* key, const logIndexEntry_t* entry, logIndexEntry_t* loser) {
+    uint64_t hash = utilsHashString(key) | 1; // 0 marca slot libre
+    logIndexShard_t* shard = logIndexShardOf(hash);
+    int result;
+
+    pthread_mutex_lock(&shard->lock);
+    size_t i = logIndexFindSlot(shard, hash, key);
+    logIndexEntry_t* e = &shard->slots[i];
+    if (e->hash != 0) {
+        if (e->seq < entry->seq) {
+            *loser = *e;
+            e->segId = entry->segId;
+            e->valLen = entry->valLen;
+            e->valOff = entry->valOff;
+            e->seq = entry->seq;
+            result = 1;
+        } else {
+            *loser = *entry;
+            result = 2;
+        }
+    } else {
+        char* keyCopy = strdup(key);
+        if (keyCopy == NULL) {
+            perror("Error in strdup");
+            utilsCleanupAndExit(EXIT_FAILURE);
+        }
+        if ((shard->used + 1) * 4 > (shard->mask + 1) * 3) {
+            logIndexGrow(shard);
+            i = logIndexFindSlot(shard, hash, key);
+        }
+        e = &shard->slots[i];
+        *e = *entry;
+        e->hash = hash;
+        e->key = keyCopy;
+        shard->used++;
+        result = 0;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return result;
+}
+
+/**
+ * @brief Busca la posición del valor de una clave
+ * @param key Clave
+ * @param out Recibe la entrada encontrada
+ * @return 1 si la clave existe, 0 si no
+ */
+static int logIndexLookup(const char* key, logIndexEntry_t* out) {
+    uint64_t hash = utilsHashString(key) | 1;
+    logIndexShard_t* shard = logIndexShardOf(hash);
+
+    pthread_mutex_lock(&shard->lock);
+    logIndexEntry_t* e = &shard->slots[logIndexFindSlot(shard, hash, key)];
+    int found = (e->hash != 0 && e->valLen != LOG_TOMBSTONE);
+    if (found) *out = *e;
+    pthread_mutex_unlock(&shard->lock);
+    return found;
+}
+
+/**
+ * @brief Quita una clave del índice
+ * @param key Clave
+ * @param old Recibe la entrada quitada
+ * @return 1 si la clave existía, 0 si no
+ */
+static int logIndexRemove(const char* key, logIndexEntry_t* old) {
+    uint64_t hash = utilsHashString(key) | 1;
+    logIndexShard_t* shard = logIndexShardOf(hash);
+
+    pthread_mutex_lock(&shard->lock);
+    size_t i = logIndexFindSlot(shard, hash, key);
+    int found = (shard->slots[i].hash != 0);
+    if (found) {
+        *old = shard->slots[i];
+        logIndexRemoveSlot(shard, i);
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return found;
+}
+
+/**
+ * @brief Mueve una clave a su copia compactada, si nadie la cambió mientras tanto
+ * @return 1 si se repuntó, 0 si la clave ya apunta a otro registro
+ */
+static int logIndexRepoint(const char* key, uint32_t oldSeg, uint64_t oldOff, uint32_t newSeg, uint64_t newOff) {
+    uint64_t hash = utilsHashString(key) | 1;
+    logIndexShard_t* shard = logIndexShardOf(hash);
+
+    pthread_mutex_lock(&shard->lock);
+    logIndexEntry_t* e = &shard->slots[logIndexFindSlot(shard, hash, key)];
+    int same = (e->hash != 0 && e->segId == oldSeg && e->valOff == oldOff);
+    if (same) {
+        e->segId = newSeg;
+        e->valOff = newOff;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return same;
+}
+
+/**
+ * @brief Abre un segmento y lo registra en la tabla de segmentos
+ * @param id Número de segmento
+ * @param path Ruta del archivo
+ * @param flags Flags de open()
+ * @return Segmento registrado
+ */
+static logSegment_t* logSegmentOpen(uint32_t id, const char* path, int flags) {
+    logSegment_t* seg = logSegmentOf(id);
+    if (seg->fd != -1) {
+        fprintf(stderr, "ERROR demasiados segmentos abiertos (máximo %d)\n", LOG_MAX_SEGMENTS);
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+
+    int fd = open(path, flags, FILES_PERM);
+    if (fd == -1) {
+        perror("Error in open");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+    seg->fd = fd;
+    seg->id = id;
+    seg->size = 0;
+    seg->dead = 0;
+    return seg;
+}
+
+/**
+ * @brief Abre un segmento activo nuevo (con logWriteLock tomado)
+ */
+static void logRotate(void) {
+    // lo escrito en el activo que se cierra tiene que quedar durable antes
+    // de que el hilo de fsync pase a sincronizar el nuevo
+    if (logActiveId != 0 && config.durability != DURABILITY_NONE) {
+        if (fdatasync(logSegmentOf(logActiveId)->fd) == -1) {
+            perror("Error in fdatasync");
+            utilsCleanupAndExit(EXIT_FAILURE);
+        }
+    }
+
+    char path[MAX_PATH_LEN];
+    uint32_t id = logNextId++;
+    logFilePath(id, "log", path);
+    // sin O_APPEND: se escribe en posiciones explícitas, y así copy_file_range() acepta el segmento
+    logSegmentOpen(id, path, O_RDWR | O_CREAT | O_TRUNC);
+    logActiveId = id;
+    TRACE_INFO("log: segmento activo %08u", id);
+}
+
+/**
+ * @brief Agrega un registro al segmento activo (con logWriteLock tomado)
+ * @param key Clave
+ * @param value Valor (NULL para una lápida)
+ * @param valLen Largo del valor, LOG_TOMBSTONE para una lápida
+ * @param seq Recibe el número de secuencia asignado
+ * @return Posición del registro dentro del segmento activo
+ */
+static uint64_t logAppend(const char* key, const char* value, uint32_t valLen, uint64_t* seq) {
+    if (logSegmentOf(logActiveId)->size >= LOG_SEGMENT_MAX) logRotate();
+    logSegment_t* seg = logSegmentOf(logActiveId);
+
+    logRecordHeader_t h;
+    h.seq = ++logSeq;
+    h.keyLen = strlen(key);
+    h.valLen = valLen;
+    h.crc = logRecordCrc(&h, key, value);
+
+    // encabezado, clave y valor en una sola llamada
+    struct iovec iov[3] = {
+        { &h, sizeof(h) },
+        { (void*)key, h.keyLen },
+        { (void*)value, valLen == LOG_TOMBSTONE ? 0 : valLen },
+    };
+    ssize_t total = logRecordSize(h.keyLen, valLen);
+    ssize_t n = pwritev(seg->fd, iov, 3, seg->size);
+    if (n == -1) {
+        perror("Error in pwritev");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+    if (n != total) {
+        fprintf(stderr, "ERROR writing log, bytes: %ld, bytes written: %ld.\n", total, n);
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+
+    uint64_t off = seg->size;
+    seg->size += total;
+    *seq = h.seq;
+    return off;
+}
+
+/**
+ * @brief Apunta la clave al registro recién agregado (con logWriteLock tomado)
+ * @return 1 si la clave ya existía, 0 si es nueva
+ */
+static int logIndexUpdate(const char* key, uint64_t recOff, uint32_t valLen, uint64_t seq) {
+    logIndexEntry_t e = { 0 }, old;
+    e.segId = logActiveId;
+    e.valLen = valLen;
+    e.valOff = recOff + sizeof(logRecordHeader_t) + strlen(key);
+    e.seq = seq;
+    int keyExists = (logIndexPut(key, &e, &old) != 0);
+    if (keyExists) {
+        // el registro anterior pasa a ser basura para la compactación
+        logSegmentOf(old.segId)->dead += logRecordSize(strlen(key), old.valLen);
+    }
+    return keyExists;
+}
+
+static int logCreateKey(const char* key, const char* value, size_t valLen) {
+    pthread_mutex_lock(&logWriteLock);
+    uint64_t seq;
+    uint64_t recOff = logAppend(key, value, valLen, &seq);
+    int keyExists = logIndexUpdate(key, recOff, valLen, seq);
+    pthread_mutex_unlock(&logWriteLock);
+    return keyExists;
+}
+
+static int logCommitStream(const char* key, dbStream_t* stream) {
+    pthread_mutex_lock(&logWriteLock);
+    if (logSegmentOf(logActiveId)->size >= LOG_SEGMENT_MAX) logRotate();
+    logSegment_t* seg = logSegmentOf(logActiveId);
+
+    logRecordHeader_t h;
+    h.seq = ++logSeq;
+    h.keyLen = strlen(key);
+    h.valLen = stream->len;
+    // el CRC del valor se fue calculando al recibirlo: se lo encadena al del encabezado y la clave
+    uint32_t crc = utilsCrc32(0, (const char*)&h + sizeof(h.crc), sizeof(h) - sizeof(h.crc));
+    crc = utilsCrc32(crc, key, h.keyLen);
+    h.crc = utilsCrc32Combine(crc, stream->crc, stream->len);
+
+    // encabezado y clave desde memoria, el valor del temporal al segmento dentro del kernel
+    struct iovec iov[2] = {
+        { &h, sizeof(h) },
+        { (void*)key, h.keyLen },
+    };
+    ssize_t headLen = sizeof(h) + h.keyLen;
+    if (pwritev(seg->fd, iov, 2, seg->size) != headLen) {
+        perror("Error in pwritev");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+    utilsCopyFile(stream->fd, 0, seg->fd, seg->size + headLen, stream->len);
+
+    uint64_t recOff = seg->size;
+    seg->size += logRecordSize(h.keyLen, h.valLen);
+    int keyExists = logIndexUpdate(key, recOff, h.valLen, h.seq);
+    pthread_mutex_unlock(&logWriteLock);
+
+    unlink(stream->path);
+    return keyExists;
+}
+
+static int logOpenValue(const char* key, dbValueRef_t* ref) {
+    int found = 0;
+
+    // el lock impide que una compactación cierre el segmento antes del dup(); después
+    // el descriptor propio sigue leyendo el segmento aunque la compactación lo borre
+    pthread_rwlock_rdlock(&logSegmentsLock);
+    logIndexEntry_t e;
+    if (logIndexLookup(key, &e)) {
+        ref->fd = dup(logSegmentOf(e.segId)->fd);
+        if (ref->fd == -1) {
+            perror("Error in dup");
+            utilsCleanupAndExit(EXIT_FAILURE);
+        }
+        ref->off = e.valOff;
+        ref->len = e.valLen;
+        found = 1;
+    }
+    pthread_rwlock_unlock(&logSegmentsLock);
+    return found;
+}
+
+static int logDeleteValue(const char* key) {
+    pthread_mutex_lock(&logWriteLock);
+    logIndexEntry_t old;
+    int keyExists = logIndexRemove(key, &old);
+    if (keyExists) {
+        uint64_t seq;
+        logAppend(key, NULL, LOG_TOMBSTONE, &seq);
+        // tanto el valor viejo como la lápida se van en la próxima compactación
+        logSegmentOf(old.segId)->dead += logRecordSize(strlen(key), old.valLen);
+        logSegmentOf(logActiveId)->dead += logRecordSize(strlen(key), LOG_TOMBSTONE);
+    }
+    pthread_mutex_unlock(&logWriteLock);
+    return keyExists;
+}
+
+static void logSync(void) {
+    // el lock impide que una compactación cierre el segmento durante el fdatasync()
+    pthread_rwlock_rdlock(&logSegmentsLock);
+    pthread_mutex_lock(&logWriteLock);
+    int fd = logSegmentOf(logActiveId)->fd;
+    pthread_mutex_unlock(&logWriteLock);
+
+    if (fdatasync(fd) == -1) {
+        perror("Error in fdatasync");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+    pthread_rwlock_unlock(&logSegmentsLock);
+}
+
+static uint64_t logScanSegment(int fd, uint32_t segId, logScanFn fn, void* arg) {
+    size_t cap = LOG_SCAN_BUF_LEN;
+    char* buf = malloc(cap);
+    size_t keyCap = MAX_MSG_LENGTH;
+    char* key = malloc(keyCap);
+    if (buf == NULL || key == NULL) {
+        perror("Error in malloc");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+
+    uint64_t base = 0; // posición en el archivo de buf[0]
+    size_t len = 0, pos = 0;
+    int eof = 0;
+    while (1) {
+        size_t avail = len - pos;
+        uint64_t need = sizeof(logRecordHeader_t);
+        logRecordHeader_t h;
+        if (avail >= need) {
+            memcpy(&h, buf + pos, sizeof(h));
+            need = logRecordSize(h.keyLen, h.valLen);
+        }
+
+        if (avail < need) {
+            if (eof) break; // registro cortado al final (caída a mitad de escritura)
+            // se corre lo pendiente al inicio y se lee más
+            memmove(buf, buf + pos, avail);
+            base += pos;
+            pos = 0;
+            len = avail;
+            if (need > cap) {
+                char* bigger = realloc(buf, need);
+                if (bigger == NULL) break; // largo absurdo: encabezado roto
+                buf = bigger;
+                cap = need;
+            }
+            ssize_t n = pread(fd, buf + len, cap - len, base + len);
+            if (n == -1) {
+                perror("Error in pread");
+                utilsCleanupAndExit(EXIT_FAILURE);
+            }
+            if (n == 0) eof = 1;
+            len += n;
+            continue;
+        }
+
+        const char* recKey = buf + pos + sizeof(h);
+        const char* value = recKey + h.keyLen;
+        if (logRecordCrc(&h, recKey, value) != h.crc) {
+            TRACE_WARN("log: registro corrupto en el segmento %08u, posición %lu", segId, base + pos);
+            break;
+        }
+
+        // la clave se pasa terminada en null
+        if (h.keyLen + 1 > keyCap) {
+            keyCap = h.keyLen + 1;
+            char* bigger = realloc(key, keyCap);
+            if (bigger == NULL) {
+                perror("Error in realloc");
+                utilsCleanupAndExit(EXIT_FAILURE);
+            }
+            key = bigger;
+        }
+        memcpy(key, recKey, h.keyLen);
+        key[h.keyLen] = '\0';
+
+        if (fn(segId, &h, key, value, base + pos, arg) == -1) break;
+        pos += need;
+    }
+
+    free(key);
+    free(buf);
+    return base + pos;
+}
+
+/**
+ * @brief Carga en el índice un registro leído al arrancar (ver logScanFn)
+ */
+static int logRebuildRecord(uint32_t segId, const logRecordHeader_t* h, const char* key,
+                            const char* value, uint64_t recOff, void* arg) {
+    (void)value;
+    (void)arg;
+    if (h->seq == 0) {
+        // vencimiento de un volcado cargado con -r: no es un valor, se va en la compactación
+        logSegmentOf(segId)->dead += logRecordSize(h->keyLen, h->valLen);
+        return 0;
+    }
+    logIndexEntry_t e = { 0 }, loser;
+    e.segId = segId;
+    e.valLen = h->valLen;
+    e.valOff = recOff + sizeof(*h) + h->keyLen;
+    e.seq = h->seq;
+    if (logIndexPut(key, &e, &loser) != 0) {
+        logSegmentOf(loser.segId)->dead += logRecordSize(h->keyLen, loser.valLen);
+    }
+    if (h->seq > logSeq) logSeq = h->seq;
+    return 0;
+}
+
+/**
+ * @brief Carga en el índice el archivo de pistas de un segmento compactado
+ * @return 1 si se pudo usar, 0 si no existe o está incompleto
+ */
+static int logLoadHint(uint32_t segId) {
+    char path[MAX_PATH_LEN];
+    logFilePath(segId, "hint", path);
+    FILE* f = fopen(path, "rb");
+    if (f == NULL) return 0;
+
+    logHintHeader_t h;
+    size_t keyCap = MAX_MSG_LENGTH;
+    char* key = malloc(keyCap);
+    if (key == NULL) {
+        perror("Error in malloc");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+    int ok = 1;
+    while (fread(&h, sizeof(h), 1, f) == 1) {
+        if (h.keyLen + 1 > keyCap) {
+            char* bigger = realloc(key, h.keyLen + 1);
+            if (bigger == NULL) {
+                ok = 0;
+                break;
+            }
+            key = bigger;
+            keyCap = h.keyLen + 1;
+        }
+        if (fread(key, 1, h.keyLen, f) != h.keyLen) {
+            ok = 0;
+            break;
+        }
+        key[h.keyLen] = '\0';
+
+        logIndexEntry_t e = { 0 }, loser;
+        e.segId = segId;
+        e.valLen = h.valLen;
+        e.valOff = h.valOff;
+        e.seq = h.seq;
+        if (logIndexPut(key, &e, &loser) != 0) {
+            logSegmentOf(loser.segId)->dead += logRecordSize(h.keyLen, loser.valLen);
+        }
+        if (h.seq > logSeq) logSeq = h.seq;
+    }
+    free(key);
+    fclose(f);
+    return ok;
+}
+
+/**
+ * @brief Quita del índice las lápidas que quedaron de la reconstrucción
+ */
+static void logIndexPurgeTombstones(void) {
+    for (int s = 0; s < LOG_INDEX_SHARDS; s++) {
+        logIndexShard_t* shard = &logIndex[s];
+        size_t i = 0;
+        while (i <= shard->mask) {
+            logIndexEntry_t* e = &shard->slots[i];
+            if (e->hash != 0 && e->valLen == LOG_TOMBSTONE) {
+                logSegmentOf(e->segId)->dead += logRecordSize(strlen(e->key), LOG_TOMBSTONE);
+                // el corrimiento puede traer otra entrada al slot i: se revisa de nuevo
+                logIndexRemoveSlot(shard, i);
+            } else {
+                i++;
+            }
+        }
+    }
+}
+
+/**
+ * @brief Sincroniza la carpeta del log (para que los rename() sean durables)
+ */
+static void logSyncFolder(void) {
+    int fd = open(PATH_LOG_FOLDER, O_RDONLY | O_DIRECTORY);
+    if (fd == -1 || fsync(fd) == -1) {
+        perror("Error in fsync");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+    close(fd);
+}
+
+/**
+ * @brief Termina una compactación que se cortó y borra salidas a medio escribir
+ *
+ * merge.pending se escribe cuando los segmentos compactados ya tienen su
+ * nombre definitivo y lista los segmentos viejos a borrar. Si existe al
+ * arrancar, se termina de borrarlos: si quedara alguno, sus lápidas
+ * perdidas podrían revivir claves borradas.
+ */
+static void logRecoverMerge(void) {
+    char path[MAX_PATH_LEN];
+    snprintf(path, sizeof(path), "%s/merge.pending", PATH_LOG_FOLDER);
+    FILE* f = fopen(path, "r");
+    if (f != NULL) {
+        unsigned id;
+        char segPath[MAX_PATH_LEN];
+        while (fscanf(f, "%u", &id) == 1) {
+            logFilePath(id, "log", segPath);
+            unlink(segPath);
+            logFilePath(id, "hint", segPath);
+            unlink(segPath);
+        }
+        fclose(f);
+        unlink(path);
+        TRACE_INFO("log: se completó una compactación interrumpida");
+    }
+
+    DIR* dir = opendir(PATH_LOG_FOLDER);
+    if (dir == NULL) {
+        perror("Error in opendir");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+    struct dirent* d;
+    while ((d = readdir(dir)) != NULL) {
+        size_t len = strlen(d->d_name);
+        if (len > 4 && strcmp(d->d_name + len - 4, ".tmp") == 0) {
+            snprintf(path, sizeof(path), "%s/%s", PATH_LOG_FOLDER, d->d_name);
+            unlink(path);
+        }
+    }
+    closedir(dir);
+}
+
+/**
+ * @brief Compara ids de segmento para qsort()
+ */
+static int logCompareIds(const void* a, const void* b) {
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Hilo de fondo que compacta periódicamente
+ */
+static void* logMergeThread(void* arg) {
+    (void)arg;
+    while (1) {
+        sleep(LOG_MERGE_INTERVAL);
+        logMerge(0);
+    }
+    return NULL;
+}
+
+static void logForEachKey(dbKeyFn fn, void* arg) {
+    // se copian las claves de cada porción y se suelta su lock antes de
+    // llamar a fn, que puede tomar el lock de la clave y escribir
+    size_t cap = 0;
+    char** keys = NULL;
+    for (int i = 0; i < LOG_INDEX_SHARDS; i++) {
+        logIndexShard_t* shard = &logIndex[i];
+        size_t n = 0;
+        pthread_mutex_lock(&shard->lock);
+        if (shard->used > cap) {
+            cap = shard->used * 2;
+            char** bigger = realloc(keys, cap * sizeof(char*));
+            if (bigger == NULL) {
+                perror("Error in realloc");
+                utilsCleanupAndExit(EXIT_FAILURE);
+            }
+            keys = bigger;
+        }
+        for (size_t j = 0; j <= shard->mask; j++) {
+            if (shard->slots[j].hash == 0) continue;
+            if ((keys[n++] = strdup(shard->slots[j].key)) == NULL) {
+                perror("Error in strdup");
+                utilsCleanupAndExit(EXIT_FAILURE);
+            }
+        }
+        pthread_mutex_unlock(&shard->lock);
+
+        for (size_t j = 0; j < n; j++) {
+            fn(keys[j], arg);
+            free(keys[j]);
+        }
+    }
+    free(keys);
+}
+
+/**
+ * @brief Carga en el índice un registro del volcado de -r (ver logScanFn)
+ *
+ * Como logRebuildRecord(), pero los vencimientos pasan al diario.
+ */
+static int logRestoreRecord(uint32_t segId, const logRecordHeader_t* h, const char* key,
+                            const char* value, uint64_t recOff, void* arg) {
+    if (h->seq == 0) dbRestoreExpiry(h, key, value);
+    return logRebuildRecord(segId, h, key, value, recOff, arg);
+}
+
+static void logRestore(int fd, uint64_t size) {
+    for (int i = 0; i < LOG_INDEX_SHARDS; i++) {
+        if (logIndex[i].used != 0) {
+            fprintf(stderr, "ERROR %s no está vacía, no se puede cargar el volcado\n", PATH_LOG_FOLDER);
+            utilsCleanupAndExit(EXIT_FAILURE);
+        }
+    }
+
+    /*
+     * El volcado ya tiene el formato de un segmento: se copia entero dentro
+     *  del kernel al segmento activo (recién creado y vacío) y se lo recorre
+     *  una vez para armar el índice, las dos cosas en forma secuencial.
+     */
+    pthread_mutex_lock(&logWriteLock);
+    logSegment_t* seg = logSegmentOf(logActiveId);
+    utilsCopyFile(fd, 0, seg->fd, 0, size);
+    if (logScanSegment(seg->fd, logActiveId, logRestoreRecord, NULL) != size) {
+        fprintf(stderr, "ERROR el volcado está cortado o corrupto\n");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+    seg->size = size;
+    pthread_mutex_unlock(&logWriteLock);
+}
+
+static void logInit(void) {
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    utilsEnsureDirectoryExists(PATH_LOG_FOLDER);
+    utilsCrc32(0, NULL, 0); // arma la tabla antes de que haya otros hilos
+    for (int i = 0; i < LOG_INDEX_SHARDS; i++) {
+        pthread_mutex_init(&logIndex[i].lock, NULL);
+        logIndex[i].mask = LOG_INDEX_MIN_SLOTS - 1;
+        logIndex[i].slots = calloc(LOG_INDEX_MIN_SLOTS, sizeof(logIndexEntry_t));
+        if (logIndex[i].slots == NULL) {
+            perror("Error in calloc");
+            utilsCleanupAndExit(EXIT_FAILURE);
+        }
+    }
+    for (int i = 0; i < LOG_MAX_SEGMENTS; i++) logSegments[i].fd = -1;
+
+    logRecoverMerge();
+
+    // lista de segmentos existentes
+    uint32_t ids[LOG_MAX_SEGMENTS];
+    int numIds = 0;
+    DIR* dir = opendir(PATH_LOG_FOLDER);
+    if (dir == NULL) {
+        perror("Error in opendir");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+    struct dirent* d;
+    unsigned id;
+    char ext[8];
+    while ((d = readdir(dir)) != NULL) {
+        if (sscanf(d->d_name, "%8u.%7s", &id, ext) == 2 && strcmp(ext, "log") == 0) {
+            if (numIds == LOG_MAX_SEGMENTS) {
+                fprintf(stderr, "ERROR demasiados segmentos en %s\n", PATH_LOG_FOLDER);
+                utilsCleanupAndExit(EXIT_FAILURE);
+            }
+            ids[numIds++] = id;
+        }
+    }
+    closedir(dir);
+    qsort(ids, numIds, sizeof(ids[0]), logCompareIds);
+
+    // reconstrucción del índice: con archivo de pistas si hay, si no leyendo el segmento
+    int hinted = 0;
+    for (int i = 0; i < numIds; i++) {
+        char path[MAX_PATH_LEN];
+        logFilePath(ids[i], "log", path);
+        logSegment_t* seg = logSegmentOpen(ids[i], path, O_RDONLY);
+        if (logLoadHint(ids[i])) {
+            struct stat st;
+            if (fstat(seg->fd, &st) == -1) {
+                perror("Error in fstat");
+                utilsCleanupAndExit(EXIT_FAILURE);
+            }
+            seg->size = st.st_size;
+            hinted++;
+        } else {
+            seg->size = logScanSegment(seg->fd, ids[i], logRebuildRecord, NULL);
+        }
+        logNextId = ids[i] + 1;
+    }
+    logIndexPurgeTombstones();
+
+    // siempre se escribe en un segmento nuevo: los viejos pueden tener la cola rota
+    logRotate();
+
+    size_t keys = 0;
+    for (int i = 0; i < LOG_INDEX_SHARDS; i++) keys += logIndex[i].used;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    TRACE_INFO("log: índice reconstruido: %zu claves de %d segmentos (%d con pistas) en %.1f ms", keys, numIds, hinted,
+               (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, logMergeThread, NULL) != 0) {
+        fprintf(stderr, "ERROR creando el hilo de compactación\n");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+    pthread_detach(thread);
+}
+
+/**
+ * @brief Cierra el segmento de salida actual de una compactación
+ *
+ * Sincroniza el segmento y sus pistas y les da su nombre definitivo.
+ */
+static void logMergeFinishOutput(logMergeState_t* st) {
+    if (st->out == NULL) return;
+
+    char tmpPath[MAX_PATH_LEN], path[MAX_PATH_LEN];
+    if (fflush(st->hint) != 0 || fsync(fileno(st->hint)) == -1 || fsync(st->out->fd) == -1) {
+        perror("Error in fsync");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+    fclose(st->hint);
+
+    logFilePath(st->out->id, "log.tmp", tmpPath);
+    logFilePath(st->out->id, "log", path);
+    if (rename(tmpPath, path) == -1) {
+        perror("Error in rename");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+    logFilePath(st->out->id, "hint.tmp", tmpPath);
+    logFilePath(st->out->id, "hint", path);
+    if (rename(tmpPath, path) == -1) {
+        perror("Error in rename");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+    st->out = NULL;
+    st->hint = NULL;
+}
+
+/**
+ * @brief Abre un segmento de salida nuevo para una compactación
+ */
+static void logMergeStartOutput(logMergeState_t* st) {
+    char path[MAX_PATH_LEN];
+    pthread_mutex_lock(&logWriteLock);
+    uint32_t id = logNextId++;
+    logFilePath(id, "log.tmp", path);
+    st->out = logSegmentOpen(id, path, O_RDWR | O_CREAT | O_TRUNC | O_APPEND);
+    pthread_mutex_unlock(&logWriteLock);
+
+    logFilePath(id, "hint.tmp", path);
+    st->hint = fopen(path, "wb");
+    if (st->hint == NULL) {
+        perror("Error in fopen");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * @brief Copia un registro vivo a la salida de la compactación (ver logScanFn)
+ */
+static int logMergeRecord(uint32_t segId, const logRecordHeader_t* h, const char* key,
+                          const char* value, uint64_t recOff, void* arg) {
+    logMergeState_t* st = arg;
+
+    // las lápidas no pasan: todos los registros anteriores de la clave
+    // están en segmentos que se compactan en esta misma pasada
+    if (h->valLen == LOG_TOMBSTONE) return 0;
+
+    // solo se copia si el índice todavía apunta a este registro
+    uint64_t valOff = recOff + sizeof(*h) + h->keyLen;
+    logIndexEntry_t e;
+    if (!logIndexLookup(key, &e) || e.segId != segId || e.valOff != valOff) return 0;
+
+    if (st->out == NULL || st->out->size >= LOG_SEGMENT_MAX) {
+        logMergeFinishOutput(st);
+        logMergeStartOutput(st);
+    }
+
+    struct iovec iov[3] = {
+        { (void*)h, sizeof(*h) },
+        { (void*)key, h->keyLen },
+        { (void*)value, h->valLen },
+    };
+    ssize_t total = logRecordSize(h->keyLen, h->valLen);
+    if (writev(st->out->fd, iov, 3) != total) {
+        perror("Error in writev");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+    uint64_t newValOff = st->out->size + sizeof(*h) + h->keyLen;
+    st->out->size += total;
+
+    logHintHeader_t hint = { h->seq, newValOff, h->keyLen, h->valLen };
+    if (fwrite(&hint, sizeof(hint), 1, st->hint) != 1 || fwrite(key, 1, h->keyLen, st->hint) != h->keyLen) {
+        perror("Error in fwrite");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+    st->copied++;
+
+    // si entretanto llegó un SET/DEL de la clave, la copia ya nace muerta
+    if (!logIndexRepoint(key, segId, valOff, st->out->id, newValOff)) {
+        pthread_mutex_lock(&logWriteLock);
+        st->out->dead += total;
+        pthread_mutex_unlock(&logWriteLock);
+    }
+    return 0;
+}
+
+static void logMerge(int force) {
+    static pthread_mutex_t mergeLock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_mutex_lock(&mergeLock);
+
+    // se eligen los segmentos a compactar: todos menos el activo
+    pthread_mutex_lock(&logWriteLock);
+    logSegment_t* active = logSegmentOf(logActiveId);
+    if ((force && active->size > 0) || (active->dead >= LOG_MERGE_MIN_DEAD && active->dead * 2 >= active->size)) {
+        // el activo juntó mucha basura: se lo cierra para que entre en esta pasada
+        logRotate();
+    }
+    uint32_t inputs[LOG_MAX_SEGMENTS];
+    int numInputs = 0;
+    uint64_t size = 0, dead = 0;
+    for (int i = 0; i < LOG_MAX_SEGMENTS; i++) {
+        if (logSegments[i].fd != -1 && logSegments[i].id != logActiveId) {
+            inputs[numInputs++] = logSegments[i].id;
+            size += logSegments[i].size;
+            dead += logSegments[i].dead;
+        }
+    }
+    pthread_mutex_unlock(&logWriteLock);
+
+    if (numInputs == 0 || (!force && (dead < LOG_MERGE_MIN_DEAD || dead * 2 < size))) {
+        pthread_mutex_unlock(&mergeLock);
+        return;
+    }
+    qsort(inputs, numInputs, sizeof(inputs[0]), logCompareIds);
+    TRACE_INFO("log: compactando %d segmentos (%lu de %lu bytes son basura)", numInputs, dead, size);
+
+    // 1. copia de los registros vivos a segmentos nuevos
+    logMergeState_t st = { 0 };
+    for (int i = 0; i < numInputs; i++) {
+        logScanSegment(logSegmentOf(inputs[i])->fd, inputs[i], logMergeRecord, &st);
+    }
+    logMergeFinishOutput(&st);
+    logSyncFolder();
+
+    // 2. se anota qué hay que borrar, por si se corta a mitad
+    char pendingPath[MAX_PATH_LEN];
+    snprintf(pendingPath, sizeof(pendingPath), "%s/merge.pending", PATH_LOG_FOLDER);
+    FILE* pending = fopen(pendingPath, "w");
+    if (pending == NULL) {
+        perror("Error in fopen");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < numInputs; i++) fprintf(pending, "%u\n", inputs[i]);
+    if (fflush(pending) != 0 || fsync(fileno(pending)) == -1) {
+        perror("Error in fsync");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+    fclose(pending);
+    logSyncFolder();
+
+    // 3. se cierran los segmentos viejos (esperando a los GET en curso) y se borran
+    pthread_rwlock_wrlock(&logSegmentsLock);
+    pthread_mutex_lock(&logWriteLock);
+    for (int i = 0; i < numInputs; i++) {
+        logSegment_t* seg = logSegmentOf(inputs[i]);
+        close(seg->fd);
+        seg->fd = -1;
+    }
+    pthread_mutex_unlock(&logWriteLock);
+    pthread_rwlock_unlock(&logSegmentsLock);
+
+    char path[MAX_PATH_LEN];
+    for (int i = 0; i < numInputs; i++) {
+        logFilePath(inputs[i], "log", path);
+        unlink(path);
+        logFilePath(inputs[i], "hint", path);
+        unlink(path);
+    }
+    unlink(pendingPath);
+    TRACE_INFO("log: compactación terminada, %lu registros vivos copiados", st.copied);
+
+    pthread_mutex_unlock(&mergeLock);
+}
+
+/*********************** SNAPSHOT: volcado consistente ************************/
+/**
+ * @brief Toma o suelta el lock de escritura de todas las franjas de claves
+ *
+ * En orden creciente, como dbLockKeys(), así no se cruza con un lote.
+ */
+static void dbSnapshotBarrier(int lock) {
+    for (int i = 0; i < KEY_LOCK_STRIPES; i++) {
+        if (lock) {
+            pthread_rwlock_wrlock(&keyLocks[i]);
+        } else {
+            pthread_rwlock_unlock(&keyLocks[i]);
+        }
+    }
+}
+
+/**
+ * @brief Escribe en el archivo los registros acumulados (con dbSnap.lock tomado)
+ */
+static void dbSnapshotFlush(void) {
+    size_t done = 0;
+    while (done < dbSnap.len) {
+        ssize_t n = pwrite(dbSnap.fd, dbSnap.buf + done, dbSnap.len - done, dbSnap.off + done);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            perror("Error in pwrite");
+            utilsCleanupAndExit(EXIT_FAILURE);
+        }
+        done += n;
+    }
+    dbSnap.off += dbSnap.len;
+    dbSnap.len = 0;
+}
+
+/**
+ * @brief Agrega al volcado el registro de una clave (con dbSnap.lock tomado)
+ * @param key Clave
+ * @param ref Valor a copiar
+ */
+static void dbSnapshotAppend(const char* key, const dbValueRef_t* ref) {
+    logRecordHeader_t h;
+    h.seq = ++dbSnap.keys;
+    h.keyLen = strlen(key);
+    h.valLen = ref->len;
+    size_t total = logRecordSize(h.keyLen, h.valLen);
+    if (dbSnap.len + total > SNAPSHOT_BUF_LEN) dbSnapshotFlush();
+
+    if (total <= SNAPSHOT_BUF_LEN) {
+        // el valor se lee directo a su lugar en el buffer y el CRC se calcula ahí
+        char* rec = dbSnap.buf + dbSnap.len;
+        char* value = rec + sizeof(h) + h.keyLen;
+        memcpy(rec + sizeof(h), key, h.keyLen);
+        if (pread(ref->fd, value, ref->len, ref->off) != (ssize_t)ref->len) {
+            perror("Error in pread");
+            utilsCleanupAndExit(EXIT_FAILURE);
+        }
+        h.crc = logRecordCrc(&h, key, value);
+        memcpy(rec, &h, sizeof(h));
+        dbSnap.len += total;
+        return;
+    }
+
+    // valor más grande que el buffer: CRC leyendo por bloques y copia dentro del kernel
+    uint32_t crc = utilsCrc32(0, (const char*)&h + sizeof(h.crc), sizeof(h) - sizeof(h.crc));
+    crc = utilsCrc32(crc, key, h.keyLen);
+    for (size_t done = 0; done < ref->len;) {
+        size_t chunk = ref->len - done < SNAPSHOT_BUF_LEN ? ref->len - done : SNAPSHOT_BUF_LEN;
+        ssize_t n = pread(ref->fd, dbSnap.buf, chunk, ref->off + done);
+        if (n <= 0) {
+            perror("Error in pread");
+            utilsCleanupAndExit(EXIT_FAILURE);
+        }
+        crc = utilsCrc32(crc, dbSnap.buf, n);
+        done += n;
+    }
+    h.crc = crc;
+    struct iovec iov[2] = {
+        { &h, sizeof(h) },
+        { (void*)key, h.keyLen },
+    };
+    ssize_t headLen = sizeof(h) + h.keyLen;
+    if (pwritev(dbSnap.fd, iov, 2, dbSnap.off) != headLen) {
+        perror("Error in pwritev");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+    utilsCopyFile(ref->fd, ref->off, dbSnap.fd, dbSnap.off + headLen, ref->len);
+    dbSnap.off += total;
+}
+
+/**
+ * @brief Agrega al volcado el vencimiento de una clave (con dbSnap.lock tomado)
+ */
+static void dbSnapshotAppendExpiry(const char* key, uint64_t expireMs) {
+    if (dbSnap.len + sizeof(logRecordHeader_t) + MAX_MSG_LENGTH + sizeof(expireMs) > SNAPSHOT_BUF_LEN) {
+        dbSnapshotFlush();
+    }
+    dbSnap.len += ttlJournalEncode(key, expireMs, dbSnap.buf + dbSnap.len);
+}
+
+/**
+ * @brief Agrega al volcado el valor actual de una clave y su vencimiento, si existe (con el lock de la clave tomado)
+ */
+static void dbSnapshotSave(const char* key) {
+    dbValueRef_t ref;
+    if (!db->openValue(key, &ref)) return;
+    uint64_t expireMs = ttlGet(key);
+    pthread_mutex_lock(&dbSnap.lock);
+    dbSnapshotAppend(key, &ref);
+    if (expireMs) dbSnapshotAppendExpiry(key, expireMs);
+    pthread_mutex_unlock(&dbSnap.lock);
+    close(ref.fd);
+}
+
+static void dbSnapshotPreserve(const char* key) {
+    if (!__atomic_load_n(&dbSnap.active, __ATOMIC_ACQUIRE)) return;
+    // solo la primera escritura de una clave que el volcado todavía no alcanzó
+    if (dbKeySetAdd(dbSnap.touched, utilsHashString(key) | 1) == 0) dbSnapshotSave(key);
+}
+
+/**
+ * @brief Vuelca una clave del recorrido, salvo que una escritura ya haya guardado su valor
+ *
+ * Como el conjunto de claves, compara hashes: dos claves con el mismo hash
+ * de 64 bits harían que la segunda falte en el volcado.
+ */
+static void dbSnapshotKey(const char* key, void* arg) {
+    (void)arg;
+    dbLockKey(key, 0);
+    if (dbKeySetAdd(dbSnap.touched, utilsHashString(key) | 1) == 0) dbSnapshotSave(key);
+    dbUnlockKey(key);
+}
+
+static void dbSnapshotFinish(void) {
+    db->forEachKey(dbSnapshotKey, NULL);
+
+    // todas las claves del momento del snapshot ya están en el volcado: las
+    // escrituras dejan de guardar valores (la barrera espera a las que lo hacían)
+    dbSnapshotBarrier(1);
+    dbSnap.active = 0;
+    dbSnapshotBarrier(0);
+
+    dbSnapshotFlush();
+    if (fsync(dbSnap.fd) == -1) {
+        perror("Error in fsync");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+    close(dbSnap.fd);
+    dbSnap.fd = -1;
+    if (rename(dbSnap.path, dbSnap.dest) == -1) {
+        perror("Error in rename");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+    TRACE_INFO("snapshot: %lu claves, %.1f MB en %s, en %.1f s", dbSnap.keys, dbSnap.off / 1e6, dbSnap.dest,
+               (utilsNowNs() - dbSnap.start) / 1e9);
+
+    free(dbSnap.buf);
+    dbKeySetFree(dbSnap.touched);
+    __atomic_store_n(&dbSnap.running, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Hilo que recorre todas las claves y escribe el volcado
+ */
+static void* dbSnapshotThread(void* arg) {
+    (void)arg;
+    dbSnapshotFinish();
+    return NULL;
+}
+
+static int dbSnapshotBegin(const char* dest) {
+    if (__atomic_load_n(&dbFileMigrating, __ATOMIC_ACQUIRE)) return -2;
+    int idle = 0;
+    if (!__atomic_compare_exchange_n(&dbSnap.running, &idle, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) return -1;
+
+    dbKeySetInit(dbSnap.touched);
+    dbSnap.fd = dbTmpOpen(dbSnap.path);
+    if ((dbSnap.buf = malloc(SNAPSHOT_BUF_LEN)) == NULL) {
+        perror("Error in malloc");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+    dbSnap.len = 0;
+    dbSnap.off = 0;
+    dbSnap.keys = 0;
+    dbSnap.start = utilsNowNs();
+    snprintf(dbSnap.dest, sizeof(dbSnap.dest), "%s", dest);
+
+    /*
+     * El momento del volcado es cuando no hay ninguna escritura a medias: un
+     *  MSET queda entero antes o entero después. Desde ahí el volcado es como
+     *  una copia con copy-on-write, pero por clave y sobre el almacenamiento:
+     *  quien escribe primero guarda el valor anterior.
+     */
+    dbSnapshotBarrier(1);
+    dbSnap.active = 1;
+    // las escrituras se agregan al flujo de replicación con el lock de su clave tomado
+    dbSnap.replOffset = __atomic_load_n(&replLog.end, __ATOMIC_ACQUIRE);
+    dbSnapshotBarrier(0);
+    return 0;
+}
+
+static int dbSnapshotStart(void) {
+    int ret = dbSnapshotBegin(PATH_SNAPSHOT);
+    if (ret != 0) return ret;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, dbSnapshotThread, NULL) != 0) {
+        fprintf(stderr, "ERROR creando el hilo de snapshot\n");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+    pthread_detach(thread);
+    TRACE_INFO("snapshot: iniciado");
+    return 0;
+}
+
+static void dbRestoreExpiry(const logRecordHeader_t* h, const char* key, const char* value) {
+    if (h->valLen != sizeof(uint64_t)) return;
+    // el registro ya tiene el formato del diario: se copia tal cual
+    if (fwrite(h, sizeof(*h), 1, dbRestoreTtl) != 1 || fwrite(key, 1, h->keyLen, dbRestoreTtl) != h->keyLen ||
+        fwrite(value, h->valLen, 1, dbRestoreTtl) != 1) {
+        perror("Error in fwrite");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+    dbRestoreTtlKeys++;
+}
+
+static void dbRestore(const char* path) {
+    uint64_t start = utilsNowNs();
+    // los vencimientos de la base vacía no valen: el diario queda con los del volcado (ttlInit() lo carga)
+    if ((dbRestoreTtl = fopen(PATH_TTL_JOURNAL, "w")) == NULL) {
+        perror("Error in fopen");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        perror("Error in open");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        perror("Error in fstat");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    db->restore(fd, st.st_size);
+    close(fd);
+    if (fflush(dbRestoreTtl) != 0 || fsync(fileno(dbRestoreTtl)) == -1) {
+        perror("Error in fsync");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+    fclose(dbRestoreTtl);
+    dbRestoreTtl = NULL;
+    db->sync(); // lo cargado queda durable antes de atender
+    double secs = (utilsNowNs() - start) / 1e9;
+    TRACE_INFO("db: volcado %s cargado, %.1f MB y %lu vencimientos en %.2f s (%.1f MB/s)", path, st.st_size / 1e6,
+               dbRestoreTtlKeys, secs, st.st_size / 1e6 / (secs > 0 ? secs : 1e-9));
+}
+
+/*********************** replicación: líder y réplicas ************************/
+static int replIsReplica(void) {
+    return config.replLeader != NULL;
+}
+
+/**
+ * @brief Largo de un registro en el anillo (los REF no llevan el valor)
+ */
+static inline size_t replRecordLen(const replHeader_t* h) {
+    return sizeof(*h) + h->keyLen + (h->type == REPL_SET ? h->valLen : 0);
+}
+
+/**
+ * @brief Copia bytes del anillo a partir de una posición del flujo (con replLog.lock tomado)
+ */
+static void replRingRead(uint64_t pos, char* dst, size_t len) {
+    size_t at = pos % REPL_BUF_LEN;
+    size_t first = REPL_BUF_LEN - at < len ? REPL_BUF_LEN - at : len;
+    memcpy(dst, replLog.buf + at, first);
+    memcpy(dst + first, replLog.buf, len - first);
+}
+
+/**
+ * @brief Copia bytes al anillo en una posición del flujo (con replLog.lock tomado)
+ */
+static void replRingWrite(uint64_t pos, const void* src, size_t len) {
+    size_t at = pos % REPL_BUF_LEN;
+    size_t first = REPL_BUF_LEN - at < len ? REPL_BUF_LEN - at : len;
+    memcpy(replLog.buf + at, src, first);
+    memcpy(replLog.buf, (const char*)src + first, len - first);
+}
+
+static void replAppend(replType_t type, const char* key, const char* value, size_t valLen) {
+    if (replLog.buf == NULL) return;
+
+    replHeader_t h;
+    h.type = type;
+    h.keyLen = strlen(key);
+    h.valLen = valLen;
+    h.timeNs = utilsWallNs();
+    // un valor grande no pasa por el anillo: al enviarlo se lee el actual de la base
+    if (type == REPL_SET && (value == NULL || valLen > REPL_INLINE_MAX)) h.type = REPL_REF;
+
+    pthread_mutex_lock(&replLog.lock);
+    uint64_t pos = replLog.end;
+    h.offset = pos + replRecordLen(&h);
+    replRingWrite(pos, &h, sizeof(h));
+    replRingWrite(pos + sizeof(h), key, h.keyLen);
+    if (h.type == REPL_SET) replRingWrite(pos + sizeof(h) + h.keyLen, value, valLen);
+    __atomic_store_n(&replLog.end, h.offset, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&replLog.cond);
+    pthread_mutex_unlock(&replLog.lock);
+}
+
+/**
+ * @brief Envía todos los bytes por un socket bloqueante
+ * @return 0 si se enviaron, -1 si se cortó la conexión
+ */
+static int replSendAll(int fd, const void* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data = (const char*)data + n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * @brief Envía parte de un archivo por un socket bloqueante, sin copiarla
+ * @return 0 si se envió, -1 si se cortó la conexión
+ */
+static int replSendFile(int fd, int in, off_t off, size_t len) {
+    while (len > 0) {
+        ssize_t n = sendfile(fd, in, &off, len);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * @brief Envía un registro REF con el valor que tiene ahora la clave
+ *
+ * Puede ser más nuevo que el de la escritura que agregó el REF: la réplica
+ * se adelanta y el registro de la escritura posterior lo vuelve a aplicar.
+ * Si la clave ya no existe se envía un DEL.
+ */
+static int replSendRef(int fd, const replHeader_t* ringHeader, const char* key) {
+    replHeader_t h = *ringHeader;
+    dbValueRef_t ref;
+    dbLockKey(key, 0);
+    int found = dbOpenValue(key, &ref);
+    dbUnlockKey(key);
+    h.type = found ? REPL_SET : REPL_DEL;
+    h.valLen = found ? ref.len : 0;
+
+    int ret = replSendAll(fd, &h, sizeof(h));
+    if (ret == 0) ret = replSendAll(fd, key, h.keyLen);
+    if (found) {
+        if (ret == 0) ret = replSendFile(fd, ref.fd, ref.off, ref.len);
+        close(ref.fd);
+    }
+    return ret;
+}
+
+/**
+ * @brief Envía a una réplica un volcado de toda la base
+ * @param f Réplica
+ * @param start Recibe la posición del flujo en el momento del volcado
+ * @return 0 si se envió, -1 si se cortó la conexión
+ */
+static int replSendFullSync(replFollower_t* f, uint64_t* start) {
+    char path[MAX_PATH_LEN];
+    snprintf(path, sizeof(path), "%s/repl-%ld", PATH_TMP_FOLDER, (long)(f - replLog.followers));
+    // un SNAPSHOT (o el de otra réplica) en curso, o la migración a subcarpetas: se reintenta
+    while (dbSnapshotBegin(path) != 0) usleep(REPL_RETRY_MS * 1000);
+    *start = dbSnap.replOffset;
+    dbSnapshotFinish();
+
+    int in = open(path, O_RDONLY);
+    if (in == -1) {
+        perror("Error in open");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+    unlink(path); // el descriptor alcanza para enviarlo
+    struct stat st;
+    if (fstat(in, &st) == -1) {
+        perror("Error in fstat");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+    TRACE_INFO("repl: sincronización completa de %s, %.1f MB", f->addr, st.st_size / 1e6);
+
+    replHeader_t h = { .type = REPL_FULLSYNC, .keyLen = 16, .valLen = st.st_size, .offset = *start,
+                       .timeNs = utilsWallNs() };
+    int ret = replSendAll(f->fd, &h, sizeof(h));
+    if (ret == 0) ret = replSendAll(f->fd, replLog.runId, h.keyLen);
+    if (ret == 0) ret = replSendFile(f->fd, in, 0, st.st_size);
+    close(in);
+    return ret;
+}
+
+/**
+ * @brief Lee las confirmaciones de la réplica que ya llegaron, sin esperar
+ *
+ * Cada confirmación son 8 bytes: la posición del flujo aplicada.
+ * @param f Réplica
+ * @param buf Confirmaciones a medio recibir (16 bytes)
+ * @param len Bytes válidos en buf
+ * @return 0 si la conexión sigue, -1 si se cortó
+ */
+static int replReadAcks(replFollower_t* f, char* buf, size_t* len) {
+    while (1) {
+        ssize_t n = recv(f->fd, buf + *len, 16 - *len, MSG_DONTWAIT);
+        if (n == 0) return -1;
+        if (n == -1) return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+        *len += n;
+        if (*len < sizeof(uint64_t)) continue;
+        uint64_t acked;
+        size_t last = *len / sizeof(acked) * sizeof(acked) - sizeof(acked);
+        memcpy(&acked, buf + last, sizeof(acked));
+        memmove(buf, buf + last + sizeof(acked), *len - last - sizeof(acked));
+        *len -= last + sizeof(acked);
+        __atomic_store_n(&f->acked, acked, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * @brief Hilo que atiende a una réplica: saludo, sincronización y flujo de escrituras
+ *
+ * El saludo es "REPLICATE <corrida> <posición>\n". Si la réplica viene de
+ * esta misma corrida y lo que le falta sigue en el anillo, sigue desde ahí;
+ * si no, primero recibe un volcado de toda la base. Después se le envían
+ * las escrituras por tandas de hasta REPL_CHUNK_LEN bytes, cada una seguida
+ * de un PING con el fin del flujo, y sin escrituras un PING cada
+ * REPL_PING_MS. Una réplica que queda más de REPL_BUF_LEN bytes atrás se
+ * desconecta: al volver hace una sincronización completa.
+ */
+static void* replFollowerThread(void* arg) {
+    replFollower_t* f = arg;
+    char* chunk = malloc(REPL_CHUNK_LEN);
+    if (chunk == NULL) {
+        perror("Error in malloc");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+
+    // saludo: la réplica no manda nada más hasta recibir la respuesta
+    char line[MAX_MSG_LENGTH];
+    size_t lineLen = 0;
+    while (lineLen < sizeof(line) - 1 && memchr(line, '\n', lineLen) == NULL) {
+        ssize_t n = recv(f->fd, line + lineLen, sizeof(line) - 1 - lineLen, 0);
+        if (n <= 0) break;
+        lineLen += n;
+    }
+    line[lineLen] = '\0';
+    char runId[17];
+    uint64_t sent;
+    int ok = sscanf(line, "REPLICATE %16s %lu", runId, &sent) == 2;
+
+    if (ok) {
+        pthread_mutex_lock(&replLog.lock);
+        int partial = strcmp(runId, replLog.runId) == 0 && sent <= replLog.end && replLog.end - sent <= REPL_BUF_LEN;
+        pthread_mutex_unlock(&replLog.lock);
+        if (partial) {
+            TRACE_INFO("repl: %s sigue desde la posición %lu", f->addr, sent);
+            replHeader_t h = { .type = REPL_CONTINUE, .keyLen = 16, .offset = sent, .timeNs = utilsWallNs() };
+            ok = replSendAll(f->fd, &h, sizeof(h)) == 0 && replSendAll(f->fd, replLog.runId, h.keyLen) == 0;
+        } else {
+            ok = replSendFullSync(f, &sent) == 0;
+        }
+        f->sent = f->acked = sent;
+    }
+
+    char acks[16];
+    size_t acksLen = 0;
+    while (ok) {
+        pthread_mutex_lock(&replLog.lock);
+        if (sent == replLog.end) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += REPL_PING_MS * 1000000L;
+            deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+            deadline.tv_nsec %= 1000000000L;
+            pthread_cond_timedwait(&replLog.cond, &replLog.lock, &deadline);
+        }
+        uint64_t end = replLog.end;
+        int behind = end - sent > REPL_BUF_LEN;
+        size_t len = end - sent < REPL_CHUNK_LEN ? end - sent : REPL_CHUNK_LEN;
+        if (!behind) replRingRead(sent, chunk, len);
+        pthread_mutex_unlock(&replLog.lock);
+        if (behind) {
+            TRACE_WARN("repl: %s quedó más de %d MB atrás, se desconecta", f->addr, REPL_BUF_LEN >> 20);
+            break;
+        }
+
+        // solo registros enteros; lo que sigue a un REF sale después de su valor
+        size_t pos = 0, from = 0;
+        while (ok && pos + sizeof(replHeader_t) <= len) {
+            replHeader_t h;
+            memcpy(&h, chunk + pos, sizeof(h));
+            size_t recLen = replRecordLen(&h);
+            if (pos + recLen > len) break;
+            if (h.type == REPL_REF) {
+                char key[MAX_MSG_LENGTH];
+                memcpy(key, chunk + pos + sizeof(h), h.keyLen);
+                key[h.keyLen] = '\0';
+                ok = replSendAll(f->fd, chunk + from, pos - from) == 0 && replSendRef(f->fd, &h, key) == 0;
+                from = pos + recLen;
+            }
+            pos += recLen;
+        }
+        replHeader_t ping = { .type = REPL_PING, .offset = end, .timeNs = utilsWallNs() };
+        ok = ok && replSendAll(f->fd, chunk + from, pos - from) == 0 && replSendAll(f->fd, &ping, sizeof(ping)) == 0;
+        sent += pos;
+        __atomic_store_n(&f->sent, sent, __ATOMIC_RELAXED);
+        ok = ok && replReadAcks(f, acks, &acksLen) == 0;
+    }
+
+    TRACE_INFO("repl: %s desconectada", f->addr);
+    free(chunk);
+    close(f->fd);
+    pthread_mutex_lock(&replLog.lock);
+    f->used = 0;
+    pthread_mutex_unlock(&replLog.lock);
+    return NULL;
+}
+
+/**
+ * @brief Hilo que acepta réplicas en el puerto de -R
+ */
+static void* replAcceptThread(void* arg) {
+    int soc = *(int*)arg;
+    while (1) {
+        struct sockaddr_in addr;
+        socklen_t addrLen = sizeof(addr);
+        int fd = accept(soc, (struct sockaddr*)&addr, &addrLen);
+        if (fd == -1) {
+            if (errno != EINTR && errno != ECONNABORTED) perror("Error in accept");
+            continue;
+        }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        replFollower_t* f = NULL;
+        pthread_mutex_lock(&replLog.lock);
+        for (int i = 0; i < REPL_MAX_FOLLOWERS && f == NULL; i++) {
+            if (!replLog.followers[i].used) f = &replLog.followers[i];
+        }
+        if (f != NULL) {
+            f->used = 1;
+            f->fd = fd;
+            f->sent = f->acked = 0;
+            snprintf(f->addr, sizeof(f->addr), "%s:%d", inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
+        }
+        pthread_mutex_unlock(&replLog.lock);
+        if (f == NULL) {
+            TRACE_WARN("repl: ya hay %d réplicas, se rechaza otra", REPL_MAX_FOLLOWERS);
+            close(fd);
+            continue;
+        }
+
+        TRACE_INFO("repl: réplica conectada desde %s", f->addr);
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, replFollowerThread, f) != 0) {
+            fprintf(stderr, "ERROR creando el hilo de réplica\n");
+            utilsCleanupAndExit(EXIT_FAILURE);
+        }
+        pthread_detach(thread);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Recibe más bytes del líder en replReplica.buf
+ *
+ * Se llama cuando ya se aplicó todo lo recibido: antes de esperar se
+ * confirma al líder lo aplicado (una confirmación por tanda, no por
+ * registro) y se anota para el hilo de fsync.
+ * @return 0 si llegó algo, -1 si se cortó la conexión
+ */
+static int replReplicaFill(void) {
+    replReplica_t* r = &replReplica;
+    if (r->off == r->len) {
+        r->off = r->len = 0;
+    } else if (r->off > 0) {
+        memmove(r->buf, r->buf + r->off, r->len - r->off);
+        r->len -= r->off;
+        r->off = 0;
+    }
+    if (r->applied != r->acked) {
+        if (config.durability != DURABILITY_NONE) dbSyncTicket();
+        if (replSendAll(r->fd, &r->applied, sizeof(r->applied)) == -1) return -1;
+        r->acked = r->applied;
+    }
+    while (1) {
+        ssize_t n = recv(r->fd, r->buf + r->len, REPL_CHUNK_LEN - r->len, 0);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        r->len += n;
+        return 0;
+    }
+}
+
+/**
+ * @brief Toma bytes de lo recibido del líder, esperando lo que falte
+ * @return 0 si se completaron, -1 si se cortó la conexión
+ */
+static int replReplicaRead(void* dst, size_t len) {
+    replReplica_t* r = &replReplica;
+    while (len > 0) {
+        if (r->off == r->len && replReplicaFill() == -1) return -1;
+        size_t n = r->len - r->off < len ? r->len - r->off : len;
+        memcpy(dst, r->buf + r->off, n);
+        r->off += n;
+        dst = (char*)dst + n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * @brief Aplica una clave del volcado de una sincronización completa (ver logScanFn)
+ */
+static int replApplyDumpRecord(uint32_t segId, const logRecordHeader_t* h, const char* key,
+                               const char* value, uint64_t recOff, void* arg) {
+    (void)segId;
+    (void)recOff;
+    (void)arg;
+    if (h->valLen == LOG_TOMBSTONE) return 0;
+    if (h->seq == 0) {
+        // vencimiento: va detrás del valor de la clave, que ya le quitó el que tenía
+        uint64_t expireMs;
+        if (h->valLen != sizeof(expireMs)) return 0;
+        memcpy(&expireMs, value, sizeof(expireMs));
+        dbLockKey(key, 1);
+        ttlSet(key, expireMs);
+        dbUnlockKey(key);
+        return 0;
+    }
+    dbLockKey(key, 1);
+    dbCreateKey(key, value, h->valLen, 0);
+    if (h->valLen <= REPL_INLINE_MAX) {
+        cachePut(key, value, h->valLen);
+    } else {
+        cacheInvalidate(key);
+    }
+    dbUnlockKey(key);
+    dbKeySetAdd(replReplica.dumpKeys, utilsHashString(key) | 1);
+    return 0;
+}
+
+/**
+ * @brief Borra una clave local que no vino en el volcado (ver dbKeyFn)
+ */
+static void replDropStale(const char* key, void* arg) {
+    (void)arg;
+    if (dbKeySetAdd(replReplica.dumpKeys, utilsHashString(key) | 1) != 0) return;
+    dbLockKey(key, 1);
+    cacheInvalidate(key);
+    dbDeleteValue(key);
+    dbUnlockKey(key);
+}
+
+/**
+ * @brief Recibe el volcado del líder y deja la base igual a él
+ *
+ * Se aplica sobre lo que ya hay, clave por clave, así la réplica sigue
+ * respondiendo (con datos viejos) durante la sincronización; al final se
+ * borran las claves que el volcado no trae.
+ * @param size Largo del volcado
+ * @return 0 si se aplicó, -1 si se cortó la conexión o llegó roto
+ */
+static int replReplicaFullSync(uint64_t size) {
+    replReplica_t* r = &replReplica;
+    char path[MAX_PATH_LEN];
+    int fd = dbTmpOpen(path);
+    unlink(path);
+    for (uint64_t done = 0; done < size;) {
+        size_t chunk = size - done < REPL_INLINE_MAX ? size - done : REPL_INLINE_MAX;
+        if (replReplicaRead(r->value, chunk) == -1) {
+            close(fd);
+            return -1;
+        }
+        if (pwrite(fd, r->value, chunk, done) != (ssize_t)chunk) {
+            perror("Error in pwrite");
+            utilsCleanupAndExit(EXIT_FAILURE);
+        }
+        done += chunk;
+    }
+
+    // desde acá la base no corresponde a ninguna posición del flujo
+    strcpy(r->runId, "-");
+    uint64_t start = utilsNowNs();
+    dbKeySetInit(r->dumpKeys);
+    uint64_t valid = logScanSegment(fd, 0, replApplyDumpRecord, NULL);
+    close(fd);
+    if (valid == size) db->forEachKey(replDropStale, NULL);
+    dbKeySetFree(r->dumpKeys);
+    if (valid != size) {
+        TRACE_ERROR("repl: el volcado del líder llegó roto");
+        return -1;
+    }
+    r->fullSyncs++;
+    TRACE_INFO("repl: volcado de %.1f MB aplicado en %.2f s", size / 1e6, (utilsNowNs() - start) / 1e9);
+    return 0;
+}
+
+/**
+ * @brief Recibe y aplica un registro del flujo cuyo encabezado ya se leyó
+ * @return 0 si se aplicó, -1 si se cortó la conexión o llegó algo inválido
+ */
+static int replReplicaApply(const replHeader_t* h) {
+    replReplica_t* r = &replReplica;
+    char key[MAX_MSG_LENGTH];
+    if (h->keyLen >= MAX_MSG_LENGTH || (h->type != REPL_SET && h->type != REPL_DEL && h->type != REPL_EXPIRE)) {
+        TRACE_ERROR("repl: registro inválido del líder");
+        return -1;
+    }
+    if (replReplicaRead(key, h->keyLen) == -1) return -1;
+    key[h->keyLen] = '\0';
+
+    if (h->type == REPL_DEL) {
+        dbLockKey(key, 1);
+        cacheInvalidate(key);
+        dbDeleteValue(key);
+        dbUnlockKey(key);
+    } else if (h->type == REPL_EXPIRE) {
+        // solo el vencimiento: la clave se borra cuando llega el DEL del líder
+        dbLockKey(key, 1);
+        if (h->valLen) {
+            ttlSet(key, h->valLen);
+        } else {
+            ttlClear(key);
+        }
+        dbUnlockKey(key);
+    } else if (h->valLen <= REPL_INLINE_MAX) {
+        if (replReplicaRead(r->value, h->valLen) == -1) return -1;
+        dbLockKey(key, 1);
+        // el líder manda un REPL_EXPIRE cada vez que quita un vencimiento
+        dbCreateKey(key, r->value, h->valLen, 1);
+        cachePut(key, r->value, h->valLen);
+        dbUnlockKey(key);
+    } else {
+        // valor grande: por bloques a un temporal, como un SETL
+        dbStream_t stream;
+        dbStreamOpen(&stream, h->valLen);
+        for (uint64_t done = 0; done < h->valLen;) {
+            size_t chunk = h->valLen - done < REPL_INLINE_MAX ? h->valLen - done : REPL_INLINE_MAX;
+            if (replReplicaRead(r->value, chunk) == -1) {
+                dbStreamAbort(&stream);
+                return -1;
+            }
+            dbStreamWrite(&stream, r->value, chunk);
+            done += chunk;
+        }
+        dbLockKey(key, 1);
+        cacheInvalidate(key);
+        dbStreamCommit(key, &stream, 1);
+        dbUnlockKey(key);
+    }
+    __atomic_store_n(&r->applied, h->offset, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/**
+ * @brief Conecta con el líder
+ * @return Socket conectado, -1 si no se pudo
+ */
+static int replReplicaConnect(void) {
+    struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_STREAM }, *res;
+    if (getaddrinfo(replReplica.host, replReplica.port, &hints, &res) != 0) return -1;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd != -1 && connect(fd, res->ai_addr, res->ai_addrlen) == -1) {
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd != -1) {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    return fd;
+}
+
+/**
+ * @brief Hilo de la réplica: se conecta al líder, se sincroniza y aplica el flujo
+ *
+ * Si se corta la conexión se reintenta cada REPL_RETRY_MS, pidiendo seguir
+ * desde lo ya aplicado.
+ */
+static void* replReplicaThread(void* arg) {
+    (void)arg;
+    replReplica_t* r = &replReplica;
+    int warned = 0;
+    while (1) {
+        int fd = replReplicaConnect();
+        if (fd == -1) {
+            if (!warned) TRACE_WARN("repl: no se pudo conectar con el líder %s", config.replLeader);
+            warned = 1;
+            usleep(REPL_RETRY_MS * 1000);
+            continue;
+        }
+        warned = 0;
+        r->off = r->len = 0;
+        r->fd = fd;
+
+        char hello[64];
+        snprintf(hello, sizeof(hello), "REPLICATE %.16s %lu\n", r->runId, r->applied);
+        replHeader_t h;
+        char runId[17] = { 0 };
+        int ok = replSendAll(fd, hello, strlen(hello)) == 0 && replReplicaRead(&h, sizeof(h)) == 0 &&
+                 h.keyLen == 16 && replReplicaRead(runId, h.keyLen) == 0;
+        if (ok && h.type == REPL_FULLSYNC) {
+            ok = replReplicaFullSync(h.valLen) == 0;
+        } else if (ok) {
+            ok = h.type == REPL_CONTINUE && h.offset == r->applied;
+        }
+        if (ok) {
+            strcpy(r->runId, runId);
+            r->applied = r->acked = r->leaderEnd = h.offset;
+            TRACE_INFO("repl: conectada con el líder %s, corrida %s, posición %lu", config.replLeader, runId,
+                       h.offset);
+        }
+
+        while (ok && replReplicaRead(&h, sizeof(h)) == 0) {
+            __atomic_store_n(&r->nextTimeNs, h.timeNs, __ATOMIC_RELAXED);
+            if (h.offset > r->leaderEnd) __atomic_store_n(&r->leaderEnd, h.offset, __ATOMIC_RELAXED);
+            if (h.type != REPL_PING) ok = replReplicaApply(&h) == 0;
+        }
+
+        TRACE_WARN("repl: se cortó la conexión con el líder %s", config.replLeader);
+        r->fd = -1;
+        close(fd);
+        usleep(REPL_RETRY_MS * 1000);
+    }
+    return NULL;
+}
+
+static void replInit(void) {
+    if (config.replPort) {
+        if ((replLog.buf = malloc(REPL_BUF_LEN)) == NULL) {
+            perror("Error in malloc");
+            utilsCleanupAndExit(EXIT_FAILURE);
+        }
+        // las posiciones empiezan de cero en cada corrida: el id las distingue
+        snprintf(replLog.runId, sizeof(replLog.runId), "%016lx", utilsNowNs() ^ ((uint64_t)getpid() << 40));
+
+        // mismo armado que el socket de métricas
+        static int soc;
+        soc = serverSocketSet(config.replPort, SERVER_BACKLOG);
+        int flags = fcntl(soc, F_GETFL);
+        if (flags == -1 || fcntl(soc, F_SETFL, flags & ~O_NONBLOCK) == -1) {
+            perror("Error in fcntl");
+            utilsCleanupAndExit(EXIT_FAILURE);
+        }
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, replAcceptThread, &soc) != 0) {
+            fprintf(stderr, "ERROR creando el hilo de replicación\n");
+            utilsCleanupAndExit(EXIT_FAILURE);
+        }
+        pthread_detach(thread);
+        TRACE_INFO("repl: réplicas en 127.0.0.1:%d, corrida %s", config.replPort, replLog.runId);
+    }
+
+    if (config.replLeader) {
+        replReplica_t* r = &replReplica;
+        const char* colon = strrchr(config.replLeader, ':');
+        snprintf(r->host, sizeof(r->host), "%.*s", (int)(colon - config.replLeader), config.replLeader);
+        snprintf(r->port, sizeof(r->port), "%s", colon + 1);
+        r->buf = malloc(REPL_CHUNK_LEN);
+        r->value = malloc(REPL_INLINE_MAX);
+        if (r->buf == NULL || r->value == NULL) {
+            perror("Error in malloc");
+            utilsCleanupAndExit(EXIT_FAILURE);
+        }
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, replReplicaThread, NULL) != 0) {
+            fprintf(stderr, "ERROR creando el hilo de replicación\n");
+            utilsCleanupAndExit(EXIT_FAILURE);
+        }
+        pthread_detach(thread);
+        TRACE_INFO("repl: réplica de solo lectura de %s", config.replLeader);
+    }
+}
+
+static void replStatsWrite(FILE* out, int prometheus) {
+    uint64_t now = utilsWallNs();
+    if (replLog.buf != NULL) {
+        pthread_mutex_lock(&replLog.lock);
+        uint64_t end = replLog.end;
+        if (prometheus) {
+            fprintf(out, "# HELP kv_repl_offset Posición del flujo de replicación.\n# TYPE kv_repl_offset counter\n");
+            fprintf(out, "kv_repl_offset %lu\n", end);
+            fprintf(out, "# HELP kv_repl_follower_lag_bytes Bytes del flujo sin confirmar por cada réplica.\n");
+            fprintf(out, "# TYPE kv_repl_follower_lag_bytes gauge\n");
+        } else {
+            fprintf(out, "repl_role leader\nrepl_offset %lu\n", end);
+        }
+        for (int i = 0; i < REPL_MAX_FOLLOWERS; i++) {
+            const replFollower_t* f = &replLog.followers[i];
+            if (!f->used) continue;
+            uint64_t acked = __atomic_load_n(&f->acked, __ATOMIC_RELAXED);
+            uint64_t sent = __atomic_load_n(&f->sent, __ATOMIC_RELAXED);
+            // la demora es la edad de la primera escritura sin confirmar, si sigue en el anillo
+            double lagMs = 0;
+            if (acked < end && end - acked <= REPL_BUF_LEN - sizeof(replHeader_t)) {
+                replHeader_t h;
+                replRingRead(acked, (char*)&h, sizeof(h));
+                lagMs = now > h.timeNs ? (now - h.timeNs) / 1e6 : 0;
+            }
+            if (prometheus) {
+                fprintf(out, "kv_repl_follower_lag_bytes{follower=\"%s\"} %lu\n", f->addr, end - acked);
+            } else {
+                fprintf(out, "repl_follower addr=%s sent=%lu acked=%lu lag_bytes=%lu lag_ms=%.1f\n", f->addr, sent,
+                        acked, end - acked, lagMs);
+            }
+        }
+        pthread_mutex_unlock(&replLog.lock);
+    }
+
+    if (replIsReplica()) {
+        const replReplica_t* r = &replReplica;
+        uint64_t applied = __atomic_load_n(&r->applied, __ATOMIC_RELAXED);
+        uint64_t leaderEnd = __atomic_load_n(&r->leaderEnd, __ATOMIC_RELAXED);
+        uint64_t next = __atomic_load_n(&r->nextTimeNs, __ATOMIC_RELAXED);
+        uint64_t lagBytes = leaderEnd > applied ? leaderEnd - applied : 0;
+        // atrasada: lo aplicado es del momento del primer registro que todavía falta
+        double lagMs = lagBytes > 0 && now > next ? (now - next) / 1e6 : 0;
+        int connected = __atomic_load_n(&r->fd, __ATOMIC_RELAXED) != -1;
+        if (prometheus) {
+            fprintf(out, "# HELP kv_repl_connected 1 si la réplica está conectada al líder.\n");
+            fprintf(out, "# TYPE kv_repl_connected gauge\nkv_repl_connected %d\n", connected);
+            fprintf(out, "# HELP kv_repl_applied_offset Posición del flujo aplicada.\n");
+            fprintf(out, "# TYPE kv_repl_applied_offset counter\nkv_repl_applied_offset %lu\n", applied);
+            fprintf(out, "# HELP kv_repl_lag_bytes Bytes del flujo del líder sin aplicar.\n");
+            fprintf(out, "# TYPE kv_repl_lag_bytes gauge\nkv_repl_lag_bytes %lu\n", lagBytes);
+            fprintf(out, "# HELP kv_repl_lag_seconds Edad de la primera escritura del líder sin aplicar.\n");
+            fprintf(out, "# TYPE kv_repl_lag_seconds gauge\nkv_repl_lag_seconds %.6f\n", lagMs / 1e3);
+            fprintf(out, "# HELP kv_repl_full_syncs_total Sincronizaciones completas.\n");
+            fprintf(out, "# TYPE kv_repl_full_syncs_total counter\nkv_repl_full_syncs_total %lu\n", r->fullSyncs);
+        } else {
+            fprintf(out, "repl_role replica\nrepl_leader %s\nrepl_connected %d\nrepl_applied_offset %lu\n",
+                    config.replLeader, connected, applied);
+            fprintf(out, "repl_lag_bytes %lu\nrepl_lag_ms %.1f\nrepl_full_syncs %lu\n", lagBytes, lagMs, r->fullSyncs);
+        }
+    }
+}
+
+/*********************** vencimientos: rueda de tiempos ************************/
+/**
+ * @brief Devuelve la porción de los vencimientos que corresponde a un hash
+ */
+static inline ttlShard_t* ttlShardOf(uint64_t hash) {
+    return &ttlShards[(hash >> 56) % TTL_SHARDS];
+}
+
+/**
+ * @brief Busca el slot de una clave en una porción
+ * @return Índice del slot, o del primer slot libre donde iría si no está
+ */
+static size_t ttlFindSlot(const ttlShard_t* shard, uint64_t hash, const char* key) {
+    size_t i = hash & shard->mask;
+    while (shard->slots[i] != NULL) {
+        if (shard->slots[i]->hash == hash && strcmp(shard->slots[i]->key, key) == 0) break;
+        i = (i + 1) & shard->mask;
+    }
+    return i;
+}
+
+/**
+ * @brief Duplica la tabla de una porción y reubica las entradas
+ */
+static void ttlGrow(ttlShard_t* shard) {
+    size_t oldCap = shard->mask + 1;
+    ttlEntry_t** old = shard->slots;
+    size_t cap = oldCap * 2;
+
+    shard->slots = calloc(cap, sizeof(ttlEntry_t*));
+    if (shard->slots == NULL) {
+        perror("Error in calloc");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+    shard->mask = cap - 1;
+    for (size_t i = 0; i < oldCap; i++) {
+        if (old[i] == NULL) continue;
+        size_t j = old[i]->hash & shard->mask;
+        while (shard->slots[j] != NULL) j = (j + 1) & shard->mask;
+        shard->slots[j] = old[i];
+    }
+    free(old);
+}
+
+/**
+ * @brief Libera el slot i y corre hacia atrás las entradas siguientes (ver cacheRemoveSlot())
+ */
+static void ttlRemoveSlot(ttlShard_t* shard, size_t i) {
+    shard->slots[i] = NULL;
+    shard->used--;
+
+    size_t j = i;
+    while (1) {
+        j = (j + 1) & shard->mask;
+        if (shard->slots[j] == NULL) break;
+        size_t home = shard->slots[j]->hash & shard->mask;
+        int movable = (i <= j) ? (home <= i || home > j) : (home <= i && home > j);
+        if (movable) {
+            shard->slots[i] = shard->slots[j];
+            shard->slots[j] = NULL;
+            i = j;
+        }
+    }
+}
+
+/**
+ * @brief Saca una entrada de su casillero de la rueda, si está en alguno
+ */
+static void ttlWheelUnlink(ttlEntry_t* e) {
+    if (e->head == NULL) return;
+    if (e->prev != NULL) {
+        e->prev->next = e->next;
+    } else {
+        *e->head = e->next;
+    }
+    if (e->next != NULL) e->next->prev = e->prev;
+    e->head = NULL;
+}
+
+/**
+ * @brief Pone una entrada en el casillero de la rueda que le toca según su vencimiento
+ *
+ * Una entrada ya vencida va al próximo tick; una que vence más allá de lo
+ * que abarca la rueda va al último casillero y se reubica al llegar a él.
+ */
+static void ttlWheelInsert(ttlShard_t* shard, ttlEntry_t* e) {
+    uint64_t tick = e->expireMs / TTL_TICK_MS;
+    uint64_t span = 1ULL << (TTL_WHEEL_BITS * TTL_WHEEL_LEVELS);
+    if (tick <= shard->tick) tick = shard->tick + 1;
+    if (tick - shard->tick >= span) tick = shard->tick + span - 1;
+
+    int level = 0;
+    while (level < TTL_WHEEL_LEVELS - 1 && tick - shard->tick >= 1ULL << (TTL_WHEEL_BITS * (level + 1))) level++;
+    ttlEntry_t** head = &shard->wheel[level][(tick >> (TTL_WHEEL_BITS * level)) & (TTL_WHEEL_SLOTS - 1)];
+    e->prev = NULL;
+    e->next = *head;
+    if (*head != NULL) (*head)->prev = e;
+    *head = e;
+    e->head = head;
+}
+
+/**
+ * @brief Claves vencidas juntadas al avanzar la rueda, para borrarlas sin el lock de la porción
+ */
+typedef struct {
+    char** keys;    /**< Claves (memoria propia) */
+    size_t n;       /**< Cantidad */
+    size_t cap;     /**< Capacidad reservada */
+} ttlDue_t;
+
+/**
+ * @brief Vacía un casillero de la rueda: lo vencido se junta en due, el resto se reubica
+ */
+static void ttlWheelDrain(ttlShard_t* shard, ttlEntry_t** head, uint64_t nowMs, ttlDue_t* due) {
+    ttlEntry_t* e = *head;
+    *head = NULL;
+    while (e != NULL) {
+        ttlEntry_t* next = e->next;
+        e->head = NULL;
+        if (e->expireMs > nowMs) {
+            ttlWheelInsert(shard, e);
+        } else {
+            // queda en la tabla, fuera de la rueda: se borra con el lock de la clave
+            if (due->n == due->cap) {
+                due->cap = due->cap ? due->cap * 2 : 64;
+                char** bigger = realloc(due->keys, due->cap * sizeof(char*));
+                if (bigger == NULL) {
+                    perror("Error in realloc");
+                    utilsCleanupAndExit(EXIT_FAILURE);
+                }
+                due->keys = bigger;
+            }
+            if ((due->keys[due->n++] = strdup(e->key)) == NULL) {
+                perror("Error in strdup");
+                utilsCleanupAndExit(EXIT_FAILURE);
+            }
+        }
+        e = next;
+    }
+}
+
+/**
+ * @brief Avanza la rueda de una porción hasta un tick (con el lock de la porción tomado)
+ */
+static void ttlWheelAdvance(ttlShard_t* shard, uint64_t tick, uint64_t nowMs, ttlDue_t* due) {
+    if (tick > shard->tick + TTL_WHEEL_SLOTS * TTL_WHEEL_SLOTS) {
+        // salto grande del reloj: se rearma la rueda en lugar de recorrer cada tick
+        shard->tick = tick - 1;
+        for (int level = 0; level < TTL_WHEEL_LEVELS; level++) {
+            for (int slot = 0; slot < TTL_WHEEL_SLOTS; slot++) {
+                ttlWheelDrain(shard, &shard->wheel[level][slot], 0, due);
+            }
+        }
+    }
+    while (shard->tick < tick) {
+        uint64_t t = ++shard->tick;
+        // al completar una vuelta de un nivel se reparte el casillero que sigue del nivel de arriba
+        for (int level = 1; level < TTL_WHEEL_LEVELS; level++) {
+            if (t & ((1ULL << (TTL_WHEEL_BITS * level)) - 1)) break;
+            ttlWheelDrain(shard, &shard->wheel[level][(t >> (TTL_WHEEL_BITS * level)) & (TTL_WHEEL_SLOTS - 1)],
+                          nowMs, due);
+        }
+        ttlWheelDrain(shard, &shard->wheel[0][t & (TTL_WHEEL_SLOTS - 1)], nowMs, due);
+    }
+}
+
+/**
+ * @brief Guarda el vencimiento de una clave en la tabla y la rueda, sin el diario
+ */
+static void ttlPut(const char* key, uint64_t expireMs) {
+    uint64_t hash = utilsHashString(key) | 1; // 0 nunca se usa como hash
+    ttlShard_t* shard = ttlShardOf(hash);
+
+    pthread_mutex_lock(&shard->lock);
+    size_t i = ttlFindSlot(shard, hash, key);
+    ttlEntry_t* e = shard->slots[i];
+    if (e == NULL) {
+        e = calloc(1, sizeof(ttlEntry_t));
+        if (e == NULL || (e->key = strdup(key)) == NULL) {
+            perror("Error in calloc");
+            utilsCleanupAndExit(EXIT_FAILURE);
+        }
+        e->hash = hash;
+        if ((shard->used + 1) * 4 > (shard->mask + 1) * 3) {
+            ttlGrow(shard);
+            i = ttlFindSlot(shard, hash, key);
+        }
+        shard->slots[i] = e;
+        shard->used++;
+        __atomic_add_fetch(&ttlCount, 1, __ATOMIC_RELEASE);
+        __atomic_add_fetch(&ttlJournalLive, logRecordSize(strlen(key), sizeof(uint64_t)), __ATOMIC_RELAXED);
+    } else {
+        ttlWheelUnlink(e);
+    }
+    e->expireMs = expireMs;
+    ttlWheelInsert(shard, e);
+    pthread_mutex_unlock(&shard->lock);
+}
+
+/**
+ * @brief Quita el vencimiento de una clave de la tabla y la rueda, sin el diario
+ * @return 1 si tenía, 0 si no
+ */
+static int ttlRemove(const char* key) {
+    uint64_t hash = utilsHashString(key) | 1;
+    ttlShard_t* shard = ttlShardOf(hash);
+
+    pthread_mutex_lock(&shard->lock);
+    size_t i = ttlFindSlot(shard, hash, key);
+    ttlEntry_t* e = shard->slots[i];
+    if (e != NULL) {
+        ttlWheelUnlink(e);
+        ttlRemoveSlot(shard, i);
+        __atomic_sub_fetch(&ttlCount, 1, __ATOMIC_RELEASE);
+        __atomic_sub_fetch(&ttlJournalLive, logRecordSize(strlen(key), sizeof(uint64_t)), __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&shard->lock);
+    if (e == NULL) return 0;
+    free(e->key);
+    free(e);
+    return 1;
+}
+
+static size_t ttlJournalEncode(const char* key, uint64_t expireMs, char* rec) {
+    logRecordHeader_t h;
+    h.seq = 0;
+    h.keyLen = strlen(key);
+    h.valLen = expireMs ? sizeof(expireMs) : 0;
+    char* value = rec + sizeof(h) + h.keyLen;
+    memcpy(rec + sizeof(h), key, h.keyLen);
+    memcpy(value, &expireMs, h.valLen);
+    h.crc = logRecordCrc(&h, key, value);
+    memcpy(rec, &h, sizeof(h));
+    return logRecordSize(h.keyLen, h.valLen);
+}
+
+/**
+ * @brief Agrega un registro al diario (sin locks de porciones tomados)
+ */
+static void ttlJournalAppend(const char* key, uint64_t expireMs) {
+    char rec[sizeof(logRecordHeader_t) + MAX_MSG_LENGTH + sizeof(uint64_t)];
+    size_t len = ttlJournalEncode(key, expireMs, rec);
+    // O_APPEND: los agregados de varios hilos no se pisan
+    pthread_rwlock_rdlock(&ttlJournalLock);
+    if (write(ttlJournalFd, rec, len) != (ssize_t)len) {
+        perror("Error in write");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+    __atomic_add_fetch(&ttlJournalBytes, len, __ATOMIC_RELAXED);
+    __atomic_store_n(&ttlJournalDirty, 1, __ATOMIC_RELEASE);
+    pthread_rwlock_unlock(&ttlJournalLock);
+}
+
+/**
+ * @brief Reescribe el diario con solo los vencimientos vigentes
+ *
+ * Frena por un momento los agregados al diario (no las escrituras de
+ * valores ni las lecturas).
+ */
+static void ttlJournalRewrite(void) {
+    uint64_t start = utilsNowNs();
+    char path[MAX_PATH_LEN];
+    char* buf = malloc(LOG_SCAN_BUF_LEN);
+    if (buf == NULL) {
+        perror("Error in malloc");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+
+    pthread_rwlock_wrlock(&ttlJournalLock);
+    int fd = dbTmpOpen(path);
+    size_t len = 0;
+    uint64_t total = 0;
+    for (int s = 0; s < TTL_SHARDS; s++) {
+        ttlShard_t* shard = &ttlShards[s];
+        pthread_mutex_lock(&shard->lock);
+        for (size_t i = 0; i <= shard->mask; i++) {
+            if (shard->slots[i] == NULL) continue;
+            if (len + sizeof(logRecordHeader_t) + MAX_MSG_LENGTH + sizeof(uint64_t) > LOG_SCAN_BUF_LEN) {
+                if (write(fd, buf, len) != (ssize_t)len) {
+                    perror("Error in write");
+                    utilsCleanupAndExit(EXIT_FAILURE);
+                }
+                total += len;
+                len = 0;
+            }
+            len += ttlJournalEncode(shard->slots[i]->key, shard->slots[i]->expireMs, buf + len);
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+    if (write(fd, buf, len) != (ssize_t)len) {
+        perror("Error in write");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+    total += len;
+    if (fsync(fd) == -1 || rename(path, PATH_TTL_JOURNAL) == -1 || fcntl(fd, F_SETFL, O_APPEND) == -1) {
+        perror("Error reescribiendo el diario de vencimientos");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+    if (ttlJournalFd != -1) close(ttlJournalFd);
+    ttlJournalFd = fd;
+    ttlJournalBytes = total;
+    ttlJournalDirty = 0;
+    pthread_rwlock_unlock(&ttlJournalLock);
+    free(buf);
+    TRACE_INFO("ttl: diario reescrito, %.1f MB en %.1f ms", total / 1e6, (utilsNowNs() - start) / 1e6);
+}
+
+static void ttlSet(const char* key, uint64_t expireMs) {
+    dbSnapshotPreserve(key); // un SNAPSHOT en curso se queda con el vencimiento anterior
+    ttlPut(key, expireMs);
+    replAppend(REPL_EXPIRE, key, NULL, expireMs);
+    ttlJournalAppend(key, expireMs);
+}
+
+static int ttlClear(const char* key) {
+    // sin claves con vencimiento (lo común) no se toca ningún lock
+    if (__atomic_load_n(&ttlCount, __ATOMIC_ACQUIRE) == 0) return 0;
+    dbSnapshotPreserve(key);
+    if (!ttlRemove(key)) return 0;
+    replAppend(REPL_EXPIRE, key, NULL, 0);
+    ttlJournalAppend(key, 0);
+    return 1;
+}
+
+static uint64_t ttlGet(const char* key) {
+    if (__atomic_load_n(&ttlCount, __ATOMIC_ACQUIRE) == 0) return 0;
+    uint64_t hash = utilsHashString(key) | 1;
+    ttlShard_t* shard = ttlShardOf(hash);
+    pthread_mutex_lock(&shard->lock);
+    ttlEntry_t* e = shard->slots[ttlFindSlot(shard, hash, key)];
+    uint64_t expireMs = e != NULL ? e->expireMs : 0;
+    pthread_mutex_unlock(&shard->lock);
+    return expireMs;
+}
+
+/**
+ * @brief Borra una clave si sigue vencida, con el lock de la clave tomado
+ */
+static void ttlExpireKey(const char* key) {
+    if (replIsReplica()) return; // en la réplica borra el DEL que manda el líder
+    dbLockKey(key, 1);
+    uint64_t expireMs = ttlGet(key);
+    if (expireMs != 0 && expireMs <= utilsWallNs() / 1000000) {
+        // como un DEL: también va al flujo de replicación y quita el vencimiento del diario
+        cacheInvalidate(key);
+        dbDeleteValue(key);
+        __atomic_add_fetch(&ttlExpired, 1, __ATOMIC_RELAXED);
+        TRACE_DEBUG("ttl: clave vencida: %s", key);
+    }
+    dbUnlockKey(key);
+}
+
+static void ttlExpireIfDue(const char* key) {
+    uint64_t expireMs = ttlGet(key);
+    if (expireMs != 0 && expireMs <= utilsWallNs() / 1000000) ttlExpireKey(key);
+}
+
+/**
+ * @brief Hilo de la rueda: cada TTL_TICK_MS borra las claves vencidas
+ *
+ * También reescribe el diario cuando la mayor parte son registros viejos.
+ */
+static void* ttlThread(void* arg) {
+    (void)arg;
+    ttlDue_t due = { 0 };
+    while (1) {
+        usleep(TTL_TICK_MS * 1000);
+        uint64_t nowMs = utilsWallNs() / 1000000;
+        for (int s = 0; s < TTL_SHARDS; s++) {
+            due.n = 0;
+            pthread_mutex_lock(&ttlShards[s].lock);
+            ttlWheelAdvance(&ttlShards[s], nowMs / TTL_TICK_MS, nowMs, &due);
+            pthread_mutex_unlock(&ttlShards[s].lock);
+            for (size_t i = 0; i < due.n; i++) {
+                ttlExpireKey(due.keys[i]);
+                free(due.keys[i]);
+            }
+        }
+
+        uint64_t bytes = __atomic_load_n(&ttlJournalBytes, __ATOMIC_RELAXED);
+        if (bytes > TTL_JOURNAL_MIN_REWRITE && bytes > 2 * __atomic_load_n(&ttlJournalLive, __ATOMIC_RELAXED)) {
+            ttlJournalRewrite();
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Carga un registro del diario al arrancar (ver logScanFn)
+ */
+static int ttlLoadRecord(uint32_t segId, const logRecordHeader_t* h, const char* key,
+                         const char* value, uint64_t recOff, void* arg) {
+    (void)segId;
+    (void)recOff;
+    (void)arg;
+    if (h->valLen == sizeof(uint64_t)) {
+        uint64_t expireMs;
+        memcpy(&expireMs, value, sizeof(expireMs));
+        ttlPut(key, expireMs);
+    } else {
+        ttlRemove(key);
+    }
+    return 0;
+}
+
+static void ttlInit(void) {
+    uint64_t start = utilsNowNs();
+    uint64_t tick = utilsWallNs() / 1000000 / TTL_TICK_MS;
+    for (int i = 0; i < TTL_SHARDS; i++) {
+        pthread_mutex_init(&ttlShards[i].lock, NULL);
+        ttlShards[i].mask = TTL_MIN_SLOTS - 1;
+        ttlShards[i].tick = tick;
+        ttlShards[i].slots = calloc(TTL_MIN_SLOTS, sizeof(ttlEntry_t*));
+        if (ttlShards[i].slots == NULL) {
+            perror("Error in calloc");
+            utilsCleanupAndExit(EXIT_FAILURE);
+        }
+    }
+
+    // el último registro de cada clave manda; lo que venció mientras tanto se borra en el primer tick
+    int fd = open(PATH_TTL_JOURNAL, O_RDONLY | O_CREAT, FILES_PERM);
+    if (fd == -1) {
+        perror("Error in open");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+    logScanSegment(fd, 0, ttlLoadRecord, NULL);
+    close(fd);
+    TRACE_INFO("ttl: %lu claves con vencimiento, cargadas en %.1f ms", ttlCount, (utilsNowNs() - start) / 1e6);
+    ttlJournalRewrite();
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, ttlThread, NULL) != 0) {
+        fprintf(stderr, "ERROR creando el hilo de vencimientos\n");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+    pthread_detach(thread);
+}
+
+static void ttlSync(void) {
+    if (!__atomic_exchange_n(&ttlJournalDirty, 0, __ATOMIC_ACQ_REL)) return;
+    pthread_rwlock_rdlock(&ttlJournalLock);
+    if (fdatasync(ttlJournalFd) == -1) {
+        perror("Error in fdatasync");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+    pthread_rwlock_unlock(&ttlJournalLock);
+}
+
+static void ttlStatsWrite(FILE* out, int prometheus) {
+    uint64_t count = __atomic_load_n(&ttlCount, __ATOMIC_RELAXED);
+    uint64_t expired = __atomic_load_n(&ttlExpired, __ATOMIC_RELAXED);
+    if (prometheus) {
+        fprintf(out, "# HELP kv_ttl_keys Claves con vencimiento.\n# TYPE kv_ttl_keys gauge\nkv_ttl_keys %lu\n", count);
+        fprintf(out, "# HELP kv_expired_keys_total Claves borradas por vencidas.\n");
+        fprintf(out, "# TYPE kv_expired_keys_total counter\nkv_expired_keys_total %lu\n", expired);
+    } else {
+        fprintf(out, "ttl_keys %lu\nexpired_keys %lu\n", count, expired);
+    }
+}
+
+/*********************** índice ordenado: lista con saltos ************************/
+/**
+ * @brief Altura al azar para un nodo nuevo: cada nivel con probabilidad 1/4 (con el lock de escritura)
+ */
+static int idxRandomHeight(void) {
+    // xorshift64: alcanza para repartir alturas
+    idx.rng ^= idx.rng << 13;
+    idx.rng ^= idx.rng >> 7;
+    idx.rng ^= idx.rng << 17;
+    uint64_t bits = idx.rng;
+    int height = 1;
+    while (height < IDX_MAX_LEVEL && (bits & 3) == 0) {
+        height++;
+        bits >>= 2;
+    }
+    return height;
+}
+
+/**
+ * @brief Busca el último nodo menor a una clave en cada nivel
+ * @param key Clave
+ * @param inclusive 1 para buscar el último nodo menor o igual
+ * @param prev Recibe, por nivel, el nodo después del cual iría la clave
+ * @return Primer nodo del nivel 0 que no es menor (o mayor, con inclusive) que la clave
+ */
+static idxNode_t* idxSeek(const char* key, int inclusive, idxNode_t* prev[IDX_MAX_LEVEL]) {
+    idxNode_t* node = idx.head;
+    for (int level = idx.height - 1; level >= 0; level--) {
+        while (node->next[level] != NULL) {
+            int cmp = strcmp(node->next[level]->key, key);
+            if (cmp > 0 || (cmp == 0 && !inclusive)) break;
+            node = node->next[level];
+        }
+        if (prev != NULL) prev[level] = node;
+    }
+    return node->next[0];
+}
+
+static void idxAdd(const char* key) {
+    idxNode_t* prev[IDX_MAX_LEVEL];
+    size_t keyLen = strlen(key);
+
+    pthread_rwlock_wrlock(&idx.lock);
+    idxNode_t* found = idxSeek(key, 0, prev);
+    if (found != NULL && strcmp(found->key, key) == 0) {
+        pthread_rwlock_unlock(&idx.lock);
+        return;
+    }
+    int height = idxRandomHeight();
+    idxNode_t* node = malloc(sizeof(idxNode_t) + height * sizeof(idxNode_t*) + keyLen + 1);
+    if (node == NULL) {
+        perror("Error in malloc");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+    char* copy = (char*)&node->next[height];
+    memcpy(copy, key, keyLen + 1);
+    node->key = copy;
+    node->height = height;
+    for (int level = idx.height; level < height; level++) prev[level] = idx.head;
+    if (height > idx.height) idx.height = height;
+    for (int level = 0; level < height; level++) {
+        node->next[level] = prev[level]->next[level];
+        prev[level]->next[level] = node;
+    }
+    idx.count++;
+    pthread_rwlock_unlock(&idx.lock);
+}
+
+static void idxRemove(const char* key) {
+    idxNode_t* prev[IDX_MAX_LEVEL];
+
+    pthread_rwlock_wrlock(&idx.lock);
+    idxNode_t* node = idxSeek(key, 0, prev);
+    if (node != NULL && strcmp(node->key, key) == 0) {
+        for (int level = 0; level < node->height; level++) prev[level]->next[level] = node->next[level];
+        while (idx.height > 1 && idx.head->next[idx.height - 1] == NULL) idx.height--;
+        idx.count--;
+        free(node);
+    }
+    pthread_rwlock_unlock(&idx.lock);
+}
+
+/**
+ * @brief Indica si una clave del índice cumple con el prefijo y el tope de una página
+ */
+static int idxMatches(const char* key, const char* prefix, size_t prefixLen, const char* end) {
+    if (prefix != NULL && strncmp(key, prefix, prefixLen) != 0) return 0;
+    if (end != NULL && strcmp(key, end) >= 0) return 0;
+    return 1;
+}
+
+static int idxScan(const char* from, int after, const char* prefix, const char* end, size_t max,
+                   idxKeyFn fn, void* arg) {
+    size_t prefixLen = prefix != NULL ? strlen(prefix) : 0;
+    // las claves con el prefijo están todas juntas: se empieza por la primera
+    if (prefix != NULL && strcmp(from, prefix) < 0) {
+        from = prefix;
+        after = 0;
+    }
+
+    pthread_rwlock_rdlock(&idx.lock);
+    idxNode_t* node = idxSeek(from, after, NULL);
+    for (size_t n = 0; n < max && node != NULL && idxMatches(node->key, prefix, prefixLen, end); n++) {
+        fn(node->key, arg);
+        node = node->next[0];
+    }
+    int more = node != NULL && idxMatches(node->key, prefix, prefixLen, end);
+    pthread_rwlock_unlock(&idx.lock);
+    return more;
+}
+
+/**
+ * @brief Agrega una clave existente al índice al arrancar (ver dbKeyFn)
+ */
+static void idxLoadKey(const char* key, void* arg) {
+    (void)arg;
+    idxAdd(key);
+}
+
+static void idxInit(void) {
+    uint64_t start = utilsNowNs();
+    idx.head = calloc(1, sizeof(idxNode_t) + IDX_MAX_LEVEL * sizeof(idxNode_t*));
+    if (idx.head == NULL) {
+        perror("Error in calloc");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+    idx.head->key = "";
+    idx.head->height = IDX_MAX_LEVEL;
+    idx.height = 1;
+    idx.rng = utilsNowNs() | 1;
+
+    db->forEachKey(idxLoadKey, NULL);
+    TRACE_INFO("idx: índice ordenado de %lu claves armado en %.1f ms", idx.count, (utilsNowNs() - start) / 1e6);
+}
+
+static void idxStatsWrite(FILE* out, int prometheus) {
+    pthread_rwlock_rdlock(&idx.lock);
+    uint64_t count = idx.count;
+    pthread_rwlock_unlock(&idx.lock);
+    if (prometheus) {
+        fprintf(out, "# HELP kv_index_keys Claves en el índice ordenado.\n# TYPE kv_index_keys gauge\nkv_index_keys %lu\n",
+                count);
+    } else {
+        fprintf(out, "index_keys %lu\n", count);
+    }
+}
 
+/*********************** claves calientes: Count-Min y top-K ************************/
 /**
- * @brief Elimina una clave de la base de datos
- * @param pathKey Ruta del archivo de la clave
+ * @brief Columnas de una clave en cada fila del sketch (doble hash)
  */
-void dbDeleteValue(const char* pathKey);
+static inline void hotColumns(uint64_t hash, uint32_t cols[HOT_DEPTH]) {
+    uint32_t h1 = (uint32_t)hash;
+    uint32_t h2 = (uint32_t)(hash >> 32) | 1;
+    for (int d = 0; d < HOT_DEPTH; d++) cols[d] = (h1 + d * h2) & (HOT_WIDTH - 1);
+}
 
 /**
- * @brief Tokeniza una cadena separada por espacios
- * @param string Cadena a tokenizar
- * @param maxTokens Número máximo de tokens
- * @param array Array donde almacenar los tokens
- * @return Número de tokens encontrados
+ * @brief Menor contador de una clave en un período y métrica (la estimación de Count-Min)
  */
-static int utilsStringTokenize(char* string, int maxTokens, char* array[]);
+static inline uint64_t hotSketchMin(const hotTracker_t* hot, const uint32_t cols[HOT_DEPTH], int half, int metric) {
+    uint64_t min = hot->sketch[0][cols[0]].n[half][metric];
+    for (int d = 1; d < HOT_DEPTH; d++) {
+        uint64_t n = hot->sketch[d][cols[d]].n[half][metric];
+        if (n < min) min = n;
+    }
+    return min;
+}
 
 /**
- * @brief Asegura que un directorio existe, lo crea si no existe
- * @param path Ruta del directorio
+ * @brief Suma w[métrica] a una clave y deja en est su estimación en la ventana
+ *
+ * Actualización conservadora: solo suben los contadores que quedarían por
+ * debajo de la nueva estimación, así las colisiones la inflan menos.
  */
-static void utilsEnsureDirectoryExists(const char* path);
+static void hotSketchAdd(hotTracker_t* hot, uint64_t hash, const uint64_t w[2], uint64_t est[2]) {
+    uint32_t cols[HOT_DEPTH];
+    hotColumns(hash, cols);
+    int cur = hot->epoch & 1;
+    hotCell_t* cells[HOT_DEPTH];
+    uint64_t min[2][2] = { { UINT64_MAX, UINT64_MAX }, { UINT64_MAX, UINT64_MAX } };
+    for (int d = 0; d < HOT_DEPTH; d++) {
+        cells[d] = &hot->sketch[d][cols[d]];
+        for (int h = 0; h < 2; h++) {
+            for (int m = 0; m < 2; m++) min[h][m] = cells[d]->n[h][m] < min[h][m] ? cells[d]->n[h][m] : min[h][m];
+        }
+    }
+    uint64_t target[2] = { min[cur][0] + w[0], min[cur][1] + w[1] };
+    for (int d = 0; d < HOT_DEPTH; d++) {
+        // sin saltos: cuál sube depende de las colisiones y no se puede predecir
+        for (int m = 0; m < 2; m++) {
+            uint64_t* n = &cells[d]->n[cur][m];
+            *n = *n < target[m] ? target[m] : *n;
+        }
+    }
+    for (int m = 0; m < 2; m++) est[m] = target[m] + min[cur ^ 1][m];
+}
 
 /**
- * @brief Verifica si un archivo existe
- * @param path Ruta del archivo
- * @return 1 si existe, 0 si no existe
+ * @brief Estimación de una clave en la ventana que termina en el período epoch
+ *
+ * Sirve para el sketch de otro hilo: solo cuentan sus períodos epoch y
+ * epoch - 1 (un hilo sin pedidos no rotó y puede tener períodos viejos).
  */
-static int utilsFileExists(const char* path);
+static uint64_t hotSketchEstimate(const hotTracker_t* hot, hotList_t metric, uint64_t hash, uint64_t epoch) {
+    uint32_t cols[HOT_DEPTH];
+    hotColumns(hash, cols);
+    uint64_t own = hot->epoch;
+    uint64_t total = 0;
+    for (uint64_t e = own - 1; e != own + 1; e++) {
+        if (e + 1 < epoch || e > epoch) continue;
+        total += hotSketchMin(hot, cols, e & 1, metric);
+    }
+    return total;
+}
 
-/**
- * @brief Genera la ruta completa de un archivo
- * @param folder Carpeta base
- * @param filename Nombre del archivo
- * @param fullpath Buffer donde almacenar la ruta completa
- */
-static void utilsGenerateFilePath(const char* folder, const char* filename, char* fullpath);
+static inline void hotHeapSwap(hotTop_t* top, int a, int b) {
+    uint8_t t = top->heap[a];
+    top->heap[a] = top->heap[b];
+    top->heap[b] = t;
+    top->pos[top->heap[a]] = a;
+    top->pos[top->heap[b]] = b;
+}
 
-/**
- * @brief Limpia recursos y termina el programa
- * @param code Código de salida
- */
-static void utilsCleanupAndExit(int code);
+static inline uint64_t hotHeapCount(const hotTop_t* top, int i) {
+    return top->slots[top->heap[i]].count;
+}
+
+static void hotHeapUp(hotTop_t* top, int i) {
+    while (i > 0 && hotHeapCount(top, (i - 1) / 2) > hotHeapCount(top, i)) {
+        hotHeapSwap(top, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static void hotHeapDown(hotTop_t* top, int i) {
+    while (1) {
+        int min = i;
+        int l = 2 * i + 1;
+        if (l < top->used && hotHeapCount(top, l) < hotHeapCount(top, min)) min = l;
+        if (l + 1 < top->used && hotHeapCount(top, l + 1) < hotHeapCount(top, min)) min = l + 1;
+        if (min == i) return;
+        hotHeapSwap(top, i, min);
+        i = min;
+    }
+}
 
 /**
- * @brief Manejador de señales
- * @param sig Número de señal recibida
+ * @brief Busca una clave en el índice de una lista
+ * @return Posición de la clave en index, o de la libre donde iría si no está
  */
-static void utilsSignalHandler(int sig);
+static size_t hotIndexFind(const hotTop_t* top, uint64_t hash) {
+    size_t i = hash & (HOT_INDEX_LEN - 1);
+    while (top->index[i] != 0 && top->hashes[top->index[i] - 1] != hash) i = (i + 1) & (HOT_INDEX_LEN - 1);
+    return i;
+}
 
 /**
- * @brief Agrega múltiples señales al manejador
- * @param sa Estructura sigaction
- * @param array Array de señales
- * @param len Longitud del array
+ * @brief Libera la posición i del índice y corre hacia atrás las siguientes (ver cacheRemoveSlot())
  */
-static void utilsAddSignalsToHandler(struct sigaction* sa, int array[], int len);
-
-/************************ variables globales *************************/
-/** @brief Ruta de la carpeta de base de datos */
-const char* PATH_DB_FOLDER = "./db";
-
-/** @brief Socket del servidor */
-int serverSoc;
-
-/** @brief Socket del cliente actual */
-int clientSoc;
+static void hotIndexRemove(hotTop_t* top, size_t i) {
+    top->index[i] = 0;
+    size_t j = i;
+    while (1) {
+        j = (j + 1) & (HOT_INDEX_LEN - 1);
+        if (top->index[j] == 0) break;
+        size_t home = top->hashes[top->index[j] - 1] & (HOT_INDEX_LEN - 1);
+        int movable = (i <= j) ? (home <= i || home > j) : (home <= i && home > j);
+        if (movable) {
+            top->index[i] = top->index[j];
+            top->index[j] = 0;
+            i = j;
+        }
+    }
+}
 
-/*************************** main function ***************************/
 /**
- * @brief Función principal del servidor TCP
- *
- * Configura el manejo de señales, crea el socket del servidor y entra en un
- * bucle infinito para atender clientes. Procesa comandos SET, GET y DEL.
- *
- * Si recibe Ctrl+C termina controladamente cerrando los sockets.
+ * @brief Ofrece una clave a una lista con su cuenta actual
  *
- * @return EXIT_SUCCESS en caso de terminación controlada.
+ * Las cuentas de una clave solo crecen dentro de la ventana, así que una
+ * clave de la lista nunca tiene menos que el mínimo: si count no llega al
+ * mínimo, la clave no está y tampoco entra, sin recorrer la lista.
  */
-int main(void) {
-    
-    struct sigaction sa = { 0 };
-    sa.sa_handler = utilsSignalHandler;
-    sa.sa_flags = 0;
-    sigemptyset(&sa.sa_mask);
-
-    int signals[] = { SIGINT, SIGPIPE };
-    utilsAddSignalsToHandler(&sa, signals, sizeof(signals) / sizeof(signals[0]));
+static void hotTopOffer(hotTracker_t* hot, hotList_t list, uint64_t hash, const char* key, uint64_t count) {
+    hotTop_t* top = &hot->top[list];
+    if (top->used == config.hotTop && count < hotHeapCount(top, 0)) return;
 
-    // Seteamos el socket del server
-    serverSoc = serverSocketSet(SERVER_PORT);
+    size_t at = hotIndexFind(top, hash);
+    if (top->index[at] != 0) {
+        int i = top->index[at] - 1;
+        hotSlot_t* slot = &top->slots[i];
+        slot->epoch = hot->epoch;
+        if (count > slot->count) {
+            slot->count = count;
+            hotHeapDown(top, top->pos[i]);
+        }
+        return;
+    }
 
-    while (1) {
+    // entra en un lugar libre o en el de la de menor cuenta
+    int fresh = top->used < config.hotTop;
+    int i = fresh ? top->used : top->heap[0];
+    if (!fresh && count <= top->slots[i].count) return;
+    if (!fresh) {
+        hotIndexRemove(top, hotIndexFind(top, top->hashes[i]));
+        at = hotIndexFind(top, hash);
+    }
+    top->index[at] = i + 1;
+    hotSlot_t* slot = &top->slots[i];
+    pthread_mutex_lock(&hot->lock);
+    top->hashes[i] = slot->hash = hash;
+    strcpy(slot->key, key);
+    slot->count = count;
+    slot->epoch = hot->epoch;
+    if (fresh) {
+        top->heap[i] = i;
+        top->pos[i] = i;
+        top->used++;
+    }
+    pthread_mutex_unlock(&hot->lock);
+    if (fresh) hotHeapUp(top, i);
+    else hotHeapDown(top, 0);
+}
 
-        // Espera conexión entrante
-        clientSoc = serverSocketAccept(serverSoc);
+/**
+ * @brief Pasa al período epoch: vacía la mitad más vieja del sketch y recalcula las listas
+ */
+static void hotRotate(hotTracker_t* hot, uint64_t epoch) {
+    // sin pedidos durante más de un período, el anterior también quedó afuera
+    int both = epoch != hot->epoch + 1;
+    for (int d = 0; d < HOT_DEPTH; d++) {
+        for (int c = 0; c < HOT_WIDTH; c++) {
+            hotCell_t* cell = &hot->sketch[d][c];
+            memset(cell->n[epoch & 1], 0, sizeof(cell->n[0]));
+            if (both) memset(cell->n[(epoch & 1) ^ 1], 0, sizeof(cell->n[0]));
+        }
+    }
 
-        // Leemos mensaje de cliente
-        char msg[MAX_MSG_LENGTH] = { 0 };
-        int bytesRead = serverReadMessage(clientSoc, msg);
+    pthread_mutex_lock(&hot->lock);
+    hot->epoch = epoch;
+    for (int list = 0; list < HOT_LISTS; list++) {
+        hotTop_t* top = &hot->top[list];
+        int kept = 0;
+        for (int i = 0; i < top->used; i++) {
+            hotSlot_t* slot = &top->slots[i];
+            if (slot->epoch + 1 < epoch) continue; // no se vio en la ventana
+            if (list != HOT_SIZE) slot->count = hotSketchEstimate(hot, list, slot->hash, epoch);
+            if (slot->count == 0) continue;
+            if (kept != i) top->slots[kept] = *slot;
+            top->hashes[kept++] = slot->hash;
+        }
+        top->used = kept;
+        memset(top->index, 0, sizeof(top->index));
+        for (int i = 0; i < kept; i++) {
+            top->heap[i] = top->pos[i] = i;
+            top->index[hotIndexFind(top, top->hashes[i])] = i + 1;
+        }
+        for (int i = kept / 2 - 1; i >= 0; i--) hotHeapDown(top, i);
+    }
+    pthread_mutex_unlock(&hot->lock);
+}
 
-        // Procesamiento del mensaje
-        char* words[MAX_WORDS] = { 0 };
-        if (bytesRead > 5) { // 3 del comando + 1 espacio + al menos 1 clave
-            int params = utilsStringTokenize(msg, MAX_WORDS, words);
-            printf("server: parámetros recibidos %d\n", params);
+static hotTracker_t* hotNew(void) {
+    // alineado para que ninguna celda del sketch quede entre dos líneas de cache
+    hotTracker_t* hot;
+    int err = posix_memalign((void**)&hot, 64, sizeof(hotTracker_t));
+    if (err != 0) {
+        errno = err;
+        perror("Error in posix_memalign");
+        utilsCleanupAndExit(EXIT_FAILURE);
+    }
+    memset(hot, 0, sizeof(hotTracker_t));
+    hot->rng = utilsNowNs() | 1;
+    pthread_mutex_init(&hot->lock, NULL);
+    return hot;
+}
 
-            if (params > 1) { // ademas del comando hay algo mas
-                // aseguro q exista la carpeta
-                utilsEnsureDirectoryExists(PATH_DB_FOLDER);
+static void hotRecord(serverConn_t* conn, const char* key, ssize_t valLen) {
+    if (config.hotTop == 0) return;
+    hotTracker_t* hot = conn->worker->hot;
+    // el momento del pedido ya lo tomaron las estadísticas: no hace falta otro clock_gettime()
+    uint64_t epoch = conn->statStart / HOT_PERIOD_NS;
+    if (epoch != hot->epoch) hotRotate(hot, epoch);
 
-                if (strcmp(words[0], "SET") == 0) {
-                    if (params == 3) {
-                        serverHandleSetCmd(clientSoc, words[1], words[2]);
-                    } else {
-                        serverSendError(clientSoc, "ERROR: el comando SET requiere clave y valor.\n", 1);
-                    }
-                } else if (strcmp(words[0], "GET") == 0) {
-                    if (params == 2) {
-                        serverHandleGetCmd(clientSoc, words[1]);
-                    } else {
-                        serverSendError(clientSoc, "ERROR: el comando GET solo requiere clave.\n", 1);
-                    }
-                } else if (strcmp(words[0], "DEL") == 0) {
-                    if (params == 2) {
-                        serverHandleDelCmd(clientSoc, words[1]);
-                    } else {
-                        serverSendError(clientSoc, "ERROR: el comando DEL solo requiere clave.\n", 1);
-                    }
-                } else {
-                    serverSendError(clientSoc, "ERROR: ningún comando válido detectado.\n", 1);
-                }
-            } else {
-                serverSendError(clientSoc, "ERROR: comando muy corto.\n", 1);
-            }
-        } else if (bytesRead > 0) {
-            serverSendError(clientSoc, "ERROR: comando muy corto.\n", 1);
-        }
+    // pedidos y bytes: uno de cada HOT_SAMPLE pedidos al azar, con peso HOT_SAMPLE
+    hot->rng ^= hot->rng << 13;
+    hot->rng ^= hot->rng >> 7;
+    hot->rng ^= hot->rng << 17;
+    int sampled = hot->rng % HOT_SAMPLE == 0;
+    // valores más grandes: todos, pero uno menor que el último de la lista ni se busca
+    hotTop_t* sizes = &hot->top[HOT_SIZE];
+    int sized = valLen > 0 && (sizes->used < config.hotTop || (uint64_t)valLen > hotHeapCount(sizes, 0));
+    if (!sampled && !sized) return;
 
-        // Active Close
-        close(clientSoc);
+    uint64_t hash = utilsHashString(key);
+    if (sampled) {
+        uint64_t w[2] = { HOT_SAMPLE, HOT_SAMPLE * (strlen(key) + (valLen > 0 ? valLen : 0)) };
+        uint64_t est[2];
+        hotSketchAdd(hot, hash, w, est);
+        hotTopOffer(hot, HOT_REQUESTS, hash, key, est[HOT_REQUESTS]);
+        hotTopOffer(hot, HOT_BYTES, hash, key, est[HOT_BYTES]);
     }
+    if (sized) hotTopOffer(hot, HOT_SIZE, hash, key, valLen);
+}
 
-    // para consistencia
-    close(serverSoc);
-    return EXIT_SUCCESS;
+static int hotCompareHash(const void* a, const void* b) {
+    uint64_t x = ((const hotSlot_t*)a)->hash;
+    uint64_t y = ((const hotSlot_t*)b)->hash;
+    return x < y ? -1 : x > y;
 }
 
-/*********************** funciones del servidor ************************/
-int serverSocketSet(int port) {
-    // se crea el socket
-    int s = socket(AF_INET, SOCK_STREAM, 0);
+static int hotCompareCount(const void* a, const void* b) {
+    uint64_t x = ((const hotSlot_t*)a)->count;
+    uint64_t y = ((const hotSlot_t*)b)->count;
+    return x > y ? -1 : x < y; // de mayor a menor
+}
 
-    // Cargamos datos de IP:PORT del server
-    struct sockaddr_in serveraddr = { 0 };
-    serveraddr.sin_family = AF_INET;
-    serveraddr.sin_port = htons(port);
-    if (inet_pton(AF_INET, "127.0.0.1", &(serveraddr.sin_addr)) <= 0) {
-        fprintf(stderr, "ERROR invalid server IP\n");
+static void hotWrite(FILE* out, size_t count) {
+    static const char* names[HOT_LISTS] = { "requests", "bytes", "value_size" };
+    uint64_t epoch = utilsNowNs() / HOT_PERIOD_NS;
+    hotSlot_t* all = malloc((size_t)config.workers * config.hotTop * sizeof(hotSlot_t));
+    if (all == NULL) {
+        perror("Error in malloc");
         utilsCleanupAndExit(EXIT_FAILURE);
     }
 
-    // Abrimos puerto
-    if (bind(s, (struct sockaddr*)&serveraddr, sizeof(serveraddr)) == -1) {
-        perror("Error in bind");
-        utilsCleanupAndExit(EXIT_FAILURE);
-    }
+    fprintf(out, "window_s %.0f\n", 2 * HOT_PERIOD_NS / 1e9);
+    for (int list = 0; list < HOT_LISTS; list++) {
+        // candidatas: las claves de la lista de cada hilo vistas dentro de la ventana
+        size_t n = 0;
+        for (int w = 0; w < config.workers; w++) {
+            hotTracker_t* hot = workers[w].hot;
+            pthread_mutex_lock(&hot->lock);
+            for (int i = 0; i < hot->top[list].used; i++) {
+                const hotSlot_t* slot = &hot->top[list].slots[i];
+                if (slot->epoch + 1 >= epoch) all[n++] = *slot;
+            }
+            pthread_mutex_unlock(&hot->lock);
+        }
 
-    // Seteamos socket en modo Listening
-    if (listen(s, 1) == -1) {
-        perror("Error in listen");
-        utilsCleanupAndExit(EXIT_FAILURE);
+        // una clave que está en varios hilos cuenta una vez, con lo de todos
+        qsort(all, n, sizeof(hotSlot_t), hotCompareHash);
+        size_t unique = 0;
+        for (size_t i = 0; i < n; i++) {
+            if (unique > 0 && all[unique - 1].hash == all[i].hash) {
+                if (all[i].count > all[unique - 1].count) all[unique - 1].count = all[i].count;
+                continue;
+            }
+            all[unique++] = all[i];
+        }
+        if (list != HOT_SIZE) {
+            // pedidos y bytes: suma de lo que estima cada hilo (se leen sin lock, como STATS)
+            for (size_t i = 0; i < unique; i++) {
+                all[i].count = 0;
+                for (int w = 0; w < config.workers; w++) {
+                    all[i].count += hotSketchEstimate(workers[w].hot, list, all[i].hash, epoch);
+                }
+            }
+        }
+        qsort(all, unique, sizeof(hotSlot_t), hotCompareCount);
+        for (size_t i = 0; i < unique && i < count; i++) {
+            fprintf(out, "%s %s %lu\n", names[list], all[i].key, all[i].count);
+        }
     }
+    free(all);
+}
 
-    return s;
+/*********************** funciones de cache ************************/
+/**
+ * @brief Devuelve la porción de la cache que corresponde a un hash
+ */
+static inline cacheShard_t* cacheShardOf(uint64_t hash) {
+    // bits altos para la porción, bajos para el slot: no se correlacionan
+    return &cacheShards[(hash >> 56) % CACHE_SHARDS];
 }
 
-int serverSocketAccept(int serverSoc) {
-    // Ejecutamos accept() para recibir conexiones entrantes
-    socklen_t addr_len = sizeof(struct sockaddr_in);
-    struct sockaddr_in clientaddr;
-    int clientSoc;
-    printf("server: esperando una conexión...\n");
-    if ((clientSoc = accept(serverSoc, (struct sockaddr*)&clientaddr, &addr_len)) == -1) {
-        perror("Error in accept");
-        utilsCleanupAndExit(EXIT_FAILURE);
+/**
+ * @brief Busca el slot de una clave en una porción
+ * @return Índice del slot, o del primer slot libre donde iría si no está
+ */
+static size_t cacheFindSlot(cacheShard_t* shard, uint64_t hash, const char* key) {
+    size_t i = hash & shard->mask;
+    while (shard->slots[i].hash != 0) {
+        if (shard->slots[i].hash == hash && strcmp(shard->slots[i].key, key) == 0) break;
+        i = (i + 1) & shard->mask;
     }
+    return i;
+}
 
-    char ipClient[32];
-    inet_ntop(AF_INET, &(clientaddr.sin_addr), ipClient, sizeof(ipClient));
-    printf("server: conexión desde:  %s\n", ipClient);
+/**
+ * @brief Libera el slot i y corre hacia atrás las entradas siguientes
+ *
+ * Con sondeo lineal no se puede dejar un hueco sin más: una entrada que
+ * quedó más adelante por colisión ya no se encontraría. Se corren las
+ * entradas del mismo "racimo" que pueden ocupar el hueco.
+ */
+static void cacheRemoveSlot(cacheShard_t* shard, size_t i) {
+    cacheEntry_t* e = &shard->slots[i];
+    shard->bytes -= strlen(e->key) + 1 + e->valLen;
+    shard->used--;
+    free(e->key);
+    free(e->value);
+    e->hash = 0;
 
-    return clientSoc;
+    size_t j = i;
+    while (1) {
+        j = (j + 1) & shard->mask;
+        if (shard->slots[j].hash == 0) break;
+        size_t home = shard->slots[j].hash & shard->mask;
+        // la entrada j puede ir al hueco i si su posición ideal no está en (i, j]
+        int movable = (i <= j) ? (home <= i || home > j) : (home <= i && home > j);
+        if (movable) {
+            shard->slots[i] = shard->slots[j];
+            shard->slots[j].hash = 0;
+            i = j;
+        }
+    }
 }
 
-int serverReadMessage(int s, char* buffer) {
-    int n;
-    if ((n = read(s, buffer, MAX_MSG_LENGTH)) == -1) {
-        perror("Error in read");
-        utilsCleanupAndExit(EXIT_FAILURE);
+/**
+ * @brief Desaloja una entrada con el algoritmo CLOCK
+ *
+ * La aguja recorre la tabla: si la entrada tiene el bit de referencia
+ * prendido lo apaga y sigue (segunda oportunidad), si no lo tiene la
+ * desaloja.
+ */
+static void cacheEvictOne(cacheShard_t* shard) {
+    while (shard->used > 0) {
+        cacheEntry_t* e = &shard->slots[shard->hand];
+        if (e->hash != 0) {
+            if (!e->ref) {
+                // tras el corrimiento el slot de la aguja puede tener otra
+                // entrada: no se avanza, se revisa en la próxima vuelta
+                cacheRemoveSlot(shard, shard->hand);
+                return;
+            }
+            e->ref = 0;
+        }
+        shard->hand = (shard->hand + 1) & shard->mask;
     }
-    if (n > 0) buffer[n - 1] = 0x00; // sobrescribo el salto de linea
-    printf("server: recibidos %d bytes:%s\n", n, n ? buffer : "");
-    return n;
 }
 
-int serverSendMessage(int s, char* buffer) {
-    int n;
-    int len = strlen(buffer);
-    if (len > MAX_MSG_LENGTH) {
-        fprintf(stderr, "ERROR in serverSendMessage: message too long.\n");
-        utilsCleanupAndExit(EXIT_FAILURE);
+static void cacheInit(size_t budgetMB) {
+    if (budgetMB == 0) {
+        TRACE_INFO("cache: desactivada");
+        return;
     }
-    if ((n = write(s, buffer, len)) == -1) {
-        perror("Error in write");
+
+    cacheShards = calloc(CACHE_SHARDS, sizeof(cacheShard_t));
+    if (cacheShards == NULL) {
+        perror("Error in calloc");
         utilsCleanupAndExit(EXIT_FAILURE);
     }
-    printf("server: enviados %d bytes\n", n);
-    return n;
-}
 
-void serverSendUsageMsg(int s) {
-    serverSendMessage(s, "Usage:\n<CMD> <key> [<value>]\nComandos:\n\tSET\tSetea un registro clave-valor nuevo.\n");
-    serverSendMessage(s, "\tGET\tObtiene el valor de una clave.\n\tDEL\tElimina un registro a partir de su clave.\n");
+    // se dimensiona la tabla para un tamaño de entrada promedio
+    size_t budget = budgetMB * 1024 * 1024 / CACHE_SHARDS;
+    size_t slots = CACHE_MIN_SLOTS;
+    while (slots < budget / CACHE_AVG_ENTRY_LEN) slots *= 2;
+
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        pthread_mutex_init(&cacheShards[i].lock, NULL);
+        cacheShards[i].budget = budget;
+        cacheShards[i].mask = slots - 1;
+        cacheShards[i].slots = calloc(slots, sizeof(cacheEntry_t));
+        if (cacheShards[i].slots == NULL) {
+            perror("Error in calloc");
+            utilsCleanupAndExit(EXIT_FAILURE);
+        }
+    }
+    TRACE_INFO("cache: %zu MB, %d porciones de %zu slots", budgetMB, CACHE_SHARDS, slots);
 }
 
-static void serverHandleSetCmd(int clientSoc, const char * key, const char * value) {
-    printf("server: comando SET detectado - SET %s %s\n", key, value);
+static ssize_t cacheGet(const char* key, char* value, size_t maxLen) {
+    if (cacheShards == NULL) return -1;
 
-    char fullpath[MAX_PATH_LEN];
-    utilsGenerateFilePath(PATH_DB_FOLDER, key, fullpath);
+    uint64_t hash = utilsHashString(key) | 1; // 0 marca slot libre
+    cacheShard_t* shard = cacheShardOf(hash);
+    ssize_t len = -1;
 
-    // crear/actualizar el registro
-    int fileExists = utilsFileExists(fullpath);
-    dbCreateKey(fullpath, value);
-    if (fileExists) {
-        printf("server: archivo actualizado: %s, valor: %s\n", fullpath, value);
-    } else {
-        printf("server: archivo creado: %s, valor: %s\n", fullpath, value);
+    pthread_mutex_lock(&shard->lock);
+    cacheEntry_t* e = &shard->slots[cacheFindSlot(shard, hash, key)];
+    if (e->hash != 0 && e->valLen < maxLen) {
+        memcpy(value, e->value, e->valLen);
+        value[e->valLen] = '\0';
+        e->ref = 1;
+        len = e->valLen;
     }
-    serverSendMessage(clientSoc, "OK\n");
+    pthread_mutex_unlock(&shard->lock);
+    return len;
 }
 
-static void serverHandleGetCmd(int clientSoc, const char * key) {
-    printf("server: comando GET detectado - GET %s\n", key);
+static void cachePut(const char* key, const char* value, size_t valLen) {
+    if (cacheShards == NULL) return;
+
+    uint64_t hash = utilsHashString(key) | 1; // 0 marca slot libre
+    cacheShard_t* shard = cacheShardOf(hash);
+    size_t keyLen = strlen(key);
+    size_t size = keyLen + 1 + valLen;
+    if (size > shard->budget) return; // no entra nunca
 
-    char fullpath[MAX_PATH_LEN];
-    utilsGenerateFilePath(PATH_DB_FOLDER, key, fullpath);
+    char* valCopy = malloc(valLen + 1);
+    if (valCopy == NULL) return; // la cache es opcional, se sigue sin ella
+    memcpy(valCopy, value, valLen);
+    valCopy[valLen] = '\0';
 
-    // chequeo si existe la clave
-    if (utilsFileExists(fullpath)) {
-        // obtengo el valor
-        char value[MAX_VAL_READ_LEN];
-        dbGetValue(fullpath, value);
-        printf("server: valor a devolver %s\n", value);
-        // y lo devuelvo
-        char resp[MAX_MSG_LENGTH];
-        sprintf(resp, "OK\n%s\n", value);
-        serverSendMessage(clientSoc, resp);
+    pthread_mutex_lock(&shard->lock);
+    size_t i = cacheFindSlot(shard, hash, key);
+    if (shard->slots[i].hash != 0) {
+        // ya estaba: se reemplaza el valor
+        cacheEntry_t* e = &shard->slots[i];
+        shard->bytes = shard->bytes - e->valLen + valLen;
+        free(e->value);
+        e->value = valCopy;
+        e->valLen = valLen;
+        e->ref = 1;
     } else {
-        printf("server: archivo solicitado no existe: %s\n", fullpath);
-        serverSendMessage(clientSoc, "NOTFOUND\n");
+        char* keyCopy = strdup(key);
+        if (keyCopy == NULL) {
+            pthread_mutex_unlock(&shard->lock);
+            free(valCopy);
+            return;
+        }
+        // se desaloja hasta que entre y la carga quede por debajo de 3/4
+        while (shard->used > 0 &&
+               (shard->bytes + size > shard->budget || (shard->used + 1) * 4 > (shard->mask + 1) * 3)) {
+            cacheEvictOne(shard);
+        }
+        i = cacheFindSlot(shard, hash, key);
+        cacheEntry_t* e = &shard->slots[i];
+        e->hash = hash;
+        e->key = keyCopy;
+        e->value = valCopy;
+        e->valLen = valLen;
+        e->ref = 0; // recién entra: si no se vuelve a leer es la primera en salir
+        shard->used++;
+        shard->bytes += size;
     }
+    // un reemplazo más grande puede haber pasado el presupuesto
+    while (shard->bytes > shard->budget && shard->used > 1) cacheEvictOne(shard);
+    pthread_mutex_unlock(&shard->lock);
 }
 
-static void serverHandleDelCmd(int clientSoc, const char * key) {
-    printf("server: comando DEL detectado - DEL %s\n", key);
+static void cacheInvalidate(const char* key) {
+    if (cacheShards == NULL) return;
 
-    char fullpath[MAX_PATH_LEN];
-    utilsGenerateFilePath(PATH_DB_FOLDER, key, fullpath);
+    uint64_t hash = utilsHashString(key) | 1; // 0 marca slot libre
+    cacheShard_t* shard = cacheShardOf(hash);
 
-    // chequeo si existe la clave
-    if (utilsFileExists(fullpath)) {
-        // eliminar el registro
-        printf("server: archivo a eliminar %s\n", fullpath);
-        dbDeleteValue(fullpath);
-        serverSendMessage(clientSoc, "OK\n");
-    } else {
-        printf("server: archivo solicitado no existe: %s\n", fullpath);
-        serverSendMessage(clientSoc, "NOTFOUND\n");
+    pthread_mutex_lock(&shard->lock);
+    size_t i = cacheFindSlot(shard, hash, key);
+    if (shard->slots[i].hash != 0) cacheRemoveSlot(shard, i);
+    pthread_mutex_unlock(&shard->lock);
+}
+
+/*********************** funciones utilitarias ************************/
+static int utilsStringTokenize(const char* string, size_t len, int maxTokens, utilsSlice_t array[]) {
+    /*
+     * Como strtok(), pero sin escribir '\0' en la línea: cada token es un
+     *  puntero al comienzo y un largo. La línea queda intacta, no necesita
+     *  terminar en null y varios hilos pueden tokenizar a la vez.
+     */
+    int i = 0;
+    size_t pos = 0;
+    while (1) {
+        while (pos < len && string[pos] == ' ') pos++; // separadores repetidos
+        if (pos == len) break;
+        if (i == maxTokens) return -1; // sobra un token: error para el cliente, no para el server
+
+        size_t start = pos;
+        while (pos < len && string[pos] != ' ') pos++;
+        array[i].ptr = string + start;
+        array[i].len = pos - start;
+        i++;
     }
+    return i;
 }
 
-static void serverSendError(int s, const char * errorMsg, int sendUsage) {
-    printf("server: %s\n", errorMsg);
-    serverSendMessage(s, (char *)errorMsg);
-    if(sendUsage) serverSendUsageMsg(s);
+static int utilsSliceEquals(utilsSlice_t slice, const char* string) {
+    size_t len = strlen(string);
+    return slice.len == len && memcmp(slice.ptr, string, len) == 0;
 }
 
-/*********************** funciones de base de datos ************************/
-void dbCreateKey(const char* pathKey, const char* value) {
-    // creo el archivo y lo abro
-    // O_TRUNC: Trunca el archivo a longitud 0 si ya existe (borra el contenido anterior)
-    int fd = open(pathKey, O_WRONLY | O_CREAT | O_TRUNC, FILES_PERM);
-    if (fd == -1) {
-        perror("Error in open");
-        utilsCleanupAndExit(EXIT_FAILURE);
-    }
-    // escribo el archivo
-    ssize_t n;
-    if ((n = write(fd, value, strlen(value))) == -1) {
-        perror("Error in write");
-        close(fd);
-        utilsCleanupAndExit(EXIT_FAILURE);
-    }
-    if ((size_t)n != strlen(value)) {
-        fprintf(stderr, "ERROR writing file, value: %s, bytes: %ld, bytes written: %ld.\n", value, strlen(value), n);
-        utilsCleanupAndExit(EXIT_FAILURE);
+static int utilsSliceToSize(utilsSlice_t slice, size_t* out) {
+    if (slice.len == 0) return -1;
+    size_t n = 0;
+    for (size_t i = 0; i < slice.len; i++) {
+        char c = slice.ptr[i];
+        if (c < '0' || c > '9') return -1;
+        if (n > (SIZE_MAX - (c - '0')) / 10) return -1; // desborde
+        n = n * 10 + (c - '0');
     }
+    *out = n;
+    return 0;
+}
 
-    if (close(fd) == -1) {
-        perror("Error in close");
-        utilsCleanupAndExit(EXIT_FAILURE);
+static int utilsSliceToInt64(utilsSlice_t slice, int64_t* out) {
+    int negative = slice.len > 0 && slice.ptr[0] == '-';
+    if (negative) {
+        slice.ptr++;
+        slice.len--;
     }
+    size_t n;
+    if (slice.len > 19 || utilsSliceToSize(slice, &n) == -1) return -1;
+    // el más negativo no tiene opuesto positivo
+    if (n > (uint64_t)INT64_MAX + negative) return -1;
+    *out = negative ? (int64_t)(0 - n) : (int64_t)n;
+    return 0;
 }
 
-void dbGetValue(const char* pathKey, char* value) {
-    // abro el archivo
-    int fd = open(pathKey, O_RDONLY);
-    if (fd == -1) {
-        perror("Error in open");
-        utilsCleanupAndExit(EXIT_FAILURE);
+static uint32_t utilsCrc32(uint32_t crc, const void* data, size_t len) {
+    // tabla de 256 entradas calculada la primera vez (hilo principal, al arrancar)
+    static uint32_t table[256];
+    static int ready = 0;
+    if (!ready) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) c = (c & 1) ? 0xEDB88320U ^ (c >> 1) : c >> 1;
+            table[i] = c;
+        }
+        ready = 1;
     }
 
-    ssize_t n;
-    if ((n = read(fd, value, MAX_VAL_READ_LEN)) == -1) {
-        perror("Error in read");
-        close(fd);
-        utilsCleanupAndExit(EXIT_FAILURE);
-    }
-    value[n] = '\0'; // me aseguro que tenga caracter null al final
+    const unsigned char* p = data;
+    crc = ~crc;
+    while (len--) crc = table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
 
-    if (close(fd) == -1) {
-        perror("Error in close");
-        utilsCleanupAndExit(EXIT_FAILURE);
+/**
+ * @brief Multiplica un vector por una matriz sobre GF(2) (ver utilsCrc32Combine())
+ */
+static uint32_t utilsGf2MatrixTimes(const uint32_t* mat, uint32_t vec) {
+    uint32_t sum = 0;
+    while (vec) {
+        if (vec & 1) sum ^= *mat;
+        vec >>= 1;
+        mat++;
     }
+    return sum;
 }
 
-void dbDeleteValue(const char* pathKey) {
-    /*
-     * unlink() deletes a name from the filesystem.  If that name was the
-     *  last link to a file and no processes have the file open, the file
-     *  is deleted and the space it was using is made available for reuse.
-     */
-    if (unlink(pathKey) != 0) {
-        perror("Error in unlink");
-        utilsCleanupAndExit(EXIT_FAILURE);
-    }
+/**
+ * @brief Eleva al cuadrado una matriz de 32x32 sobre GF(2)
+ */
+static void utilsGf2MatrixSquare(uint32_t* square, const uint32_t* mat) {
+    for (int n = 0; n < 32; n++) square[n] = utilsGf2MatrixTimes(mat, mat[n]);
 }
 
-/*********************** funciones utilitarias ************************/
-static int utilsStringTokenize(char* string, int maxTokens, char* array[]) {
+static uint32_t utilsCrc32Combine(uint32_t crc1, uint32_t crc2, size_t len2) {
     /*
-     * strtok() function breaks a string into a sequence of zero or more
-     *  nonempty tokens.  On the first call to strtok(), the string
-     *  to be parsed should be specified in str. In each subsequent call
-     *  that should parse the same string, str must be NULL.
-     *  It returns a pointer to the next token, or NULL if there are no more tokens.
+     * Igual que crc32_combine() de zlib: agregar len2 ceros al primer bloque
+     *  es aplicarle al CRC un operador lineal, que se arma elevando al cuadrado
+     *  el operador de "un bit cero" (log2(len2) pasos en vez de len2 bytes).
      */
-    int i = 0;
-    char* p = strtok(string, " ");
+    if (len2 == 0) return crc1;
 
-    while (p != NULL && i < maxTokens) {
-        array[i++] = p;
-        p = strtok(NULL, " ");
+    uint32_t even[32], odd[32];
+    odd[0] = 0xEDB88320U; // operador de un bit cero
+    uint32_t row = 1;
+    for (int n = 1; n < 32; n++) {
+        odd[n] = row;
+        row <<= 1;
     }
-    if (p != NULL && i >= maxTokens) {
-        fprintf(stderr, "ERROR invalid command.\nUsage:\n<CMD> <key> [<value>]\n");
-        utilsCleanupAndExit(EXIT_FAILURE);
+    utilsGf2MatrixSquare(even, odd); // dos bits cero
+    utilsGf2MatrixSquare(odd, even); // cuatro bits cero
+
+    do {
+        utilsGf2MatrixSquare(even, odd); // el primero es de un byte cero
+        if (len2 & 1) crc1 = utilsGf2MatrixTimes(even, crc1);
+        len2 >>= 1;
+        if (len2 == 0) break;
+        utilsGf2MatrixSquare(odd, even);
+        if (len2 & 1) crc1 = utilsGf2MatrixTimes(odd, crc1);
+        len2 >>= 1;
+    } while (len2 != 0);
+    return crc1 ^ crc2;
+}
+
+static void utilsCopyFile(int in, off_t inOff, int out, off_t outOff, size_t len) {
+    while (len > 0) {
+        ssize_t n = copy_file_range(in, &inOff, out, &outOff, len, 0);
+        if (n == -1 && (errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP || errno == EINVAL)) {
+            // el sistema de archivos no lo soporta: se copia con un buffer
+            char buf[STREAM_CHUNK_LEN];
+            n = pread(in, buf, len < sizeof(buf) ? len : sizeof(buf), inOff);
+            if (n > 0 && pwrite(out, buf, n, outOff) != n) n = -1;
+            if (n > 0) {
+                inOff += n;
+                outOff += n;
+            }
+        }
+        if (n == -1) {
+            perror("Error in copy_file_range");
+            utilsCleanupAndExit(EXIT_FAILURE);
+        }
+        if (n == 0) {
+            fprintf(stderr, "ERROR copiando archivo: terminó antes de lo esperado\n");
+            utilsCleanupAndExit(EXIT_FAILURE);
+        }
+        len -= n;
     }
+}
 
-    return i;
+static uint64_t utilsHashString(const char* string) {
+    uint64_t hash = 14695981039346656037ULL; // FNV offset basis
+    for (const unsigned char* p = (const unsigned char*)string; *p; p++) {
+        hash ^= *p;
+        hash *= 1099511628211ULL; // FNV prime
+    }
+    return hash;
 }
 
-static void utilsGenerateFilePath(const char* folder, const char* filename, char* fullpath) {
-    /*
-     * Esto también se podría hacer con snprintf:
-     *   snprintf(fullpath, MAX_PATH_LEN, "%s/%s", folder, filename);
-     *  pero me pareció más acorde al programa hacerlo con funciones bajo nivel
-     *  (aunque es mucho más propenso a errores)
-     */
-    if ((strlen(folder) + strlen(filename) + 2) < MAX_PATH_LEN) { // +2 para la barra y el \0
-        strncpy(fullpath, folder, MAX_PATH_LEN - 1);
-        strcat(fullpath, "/");
-        // sumo 1 por la barra, resto 1 para no llegar al final (explicito solo para que sea mas claro)
-        strncat(fullpath, filename, MAX_PATH_LEN - strlen(folder) + 1 - 1);
-        fullpath[strlen(folder) + strlen(filename) + 1] = '\0'; // Asegura el null character
-        printf("utils: fullpath del archivo: %s\n", fullpath);
+/** @brief Alfabeto base64url: sin '/', sirve en nombres de archivo */
+static const char utilsKeyAlphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+
+static void utilsKeyEncodeBase64(const char* key, char* name) {
+    // 127 bytes de clave son a lo sumo 1 + 170 caracteres, bajo NAME_MAX
+    const unsigned char* in = (const unsigned char*)key;
+    size_t len = strlen(key);
+    char* out = name;
+    *out++ = '~';
+    for (size_t i = 0; i < len; i += 3) {
+        uint32_t v = (uint32_t)in[i] << 16;
+        if (i + 1 < len) v |= (uint32_t)in[i + 1] << 8;
+        if (i + 2 < len) v |= in[i + 2];
+        size_t chars = (len - i >= 3) ? 4 : len - i + 1; // sin relleno '='
+        for (size_t j = 0; j < chars; j++) *out++ = utilsKeyAlphabet[(v >> (18 - 6 * j)) & 63];
+    }
+    *out = '\0';
+}
+
+static void utilsKeyEncode(const char* key, char* name) {
+    int plain = key[0] != '~' && strcmp(key, ".") != 0 && strcmp(key, "..") != 0;
+    for (const unsigned char* p = (const unsigned char*)key; plain && *p; p++) {
+        if (*p == '/' || *p < 0x20 || *p == 0x7f) plain = 0;
+    }
+    if (plain) {
+        strcpy(name, key); // las claves miden menos de MAX_MSG_LENGTH
     } else {
-        fprintf(stderr, "ERROR path+archivo muy largo\n");
-        utilsCleanupAndExit(EXIT_FAILURE);
+        utilsKeyEncodeBase64(key, name);
+    }
+}
+
+static int utilsKeyDecode(const char* name, char* key) {
+    if (name[0] != '~') {
+        if (strlen(name) >= MAX_MSG_LENGTH) return -1;
+        strcpy(key, name);
+        return 0;
     }
+    size_t len = 0;
+    uint32_t bits = 0, acc = 0;
+    for (const char* p = name + 1; *p; p++) {
+        const char* c = strchr(utilsKeyAlphabet, *p);
+        if (c == NULL) return -1;
+        acc = (acc << 6) | (uint32_t)(c - utilsKeyAlphabet);
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            if (len + 1 >= MAX_MSG_LENGTH) return -1;
+            key[len] = (char)((acc >> bits) & 0xff);
+            if (key[len++] == '\0') return -1;
+        }
+    }
+    key[len] = '\0';
+    return len > 0 ? 0 : -1;
+}
+
+static uint64_t utilsNowNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 }
 
-static int utilsFileExists(const char* path) {
+static uint64_t utilsWallNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int utilsFileExistsAt(int dirFd, const char* name) {
     /*
      * access() checks whether the calling process can access the file
      *  F_OK tests for the existence of the file.
      *  On success (all requested permissions granted, or mode is F_OK and the
      *  file exists), zero is returned. Otherwise, -1 is returned, and errno is set
      *  to indicate the error.
+     * faccessat() es igual pero con la ruta relativa a dirFd.
      */
-    return (access(path, F_OK) != -1);
+    return (faccessat(dirFd, name, F_OK, 0) != -1);
 }
 
 static void utilsEnsureDirectoryExists(const char* path) {
     if (access(path, F_OK) == 0) {
         // Ya existe
-        printf("utils: Carpeta detectada correctamente.\n");
+        TRACE_INFO("utils: Carpeta detectada correctamente.");
     } else {
-        // No existe, intento crearlo
-        if (mkdir(path, DB_FOLDER_PERM) != 0) {
+        // No existe, intento crearlo (EEXIST: otro hilo la creó recién)
+        if (mkdir(path, DB_FOLDER_PERM) != 0 && errno != EEXIST) {
             perror("mkdir"); // Fallo al crear
             utilsCleanupAndExit(EXIT_FAILURE);
         }
-        printf("utils: Carpeta creada correctamente.\n");
+        TRACE_INFO("utils: Carpeta creada correctamente.");
+    }
+}
+
+static void utilsParseArgs(int argc, char* argv[], serverConfig_t* cfg) {
+    int opt;
+    while ((opt = getopt(argc, argv, "p:L:1t:b:C:I:T:O:m:s:d:M:l:e:f:r:R:F:K:h")) != -1) {
+        switch (opt) {
+        case 'p':
+            cfg->port = atoi(optarg);
+            if (cfg->port <= 0 || cfg->port > 65535) {
+                fprintf(stderr, "ERROR puerto inválido: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'L':
+            if (cfg->listenerCount == SERVER_MAX_LISTENERS) {
+                fprintf(stderr, "ERROR demasiadas direcciones de escucha (hasta %d)\n", SERVER_MAX_LISTENERS);
+                exit(EXIT_FAILURE);
+            }
+            if (serverListenerParse(optarg, &cfg->listeners[cfg->listenerCount]) == -1) {
+                fprintf(stderr, "ERROR dirección de escucha inválida: %s (host:puerto, unix:<ruta> o @<nombre>)\n",
+                        optarg);
+                exit(EXIT_FAILURE);
+            }
+            cfg->listenerCount++;
+            break;
+        case '1':
+            cfg->oneShot = 1;
+            break;
+        case 't':
+            cfg->workers = atoi(optarg);
+            if (cfg->workers <= 0 || cfg->workers > MAX_WORKERS) {
+                fprintf(stderr, "ERROR cantidad de hilos inválida: %s (1 a %d)\n", optarg, MAX_WORKERS);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'b':
+            cfg->backlog = atoi(optarg);
+            if (cfg->backlog <= 0) {
+                fprintf(stderr, "ERROR backlog inválido: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'C':
+            cfg->maxConns = atoi(optarg);
+            if (cfg->maxConns < 0) {
+                fprintf(stderr, "ERROR máximo de conexiones inválido: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'I':
+            cfg->idleTimeout = atoi(optarg);
+            if (cfg->idleTimeout < 0) {
+                fprintf(stderr, "ERROR plazo de inactividad inválido: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'T':
+            cfg->readTimeout = atoi(optarg);
+            if (cfg->readTimeout < 0) {
+                fprintf(stderr, "ERROR plazo de lectura inválido: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'O':
+            cfg->outLimitMB = strtoul(optarg, NULL, 10);
+            break;
+        case 'm':
+            cfg->cacheMB = strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            cfg->storage = optarg;
+            break;
+        case 'd': {
+            int found = 0;
+            for (int i = 0; i <= DURABILITY_ALWAYS; i++) {
+                if (strcmp(optarg, dbDurabilityNames[i]) == 0) {
+                    cfg->durability = i;
+                    found = 1;
+                }
+            }
+            if (!found) {
+                fprintf(stderr, "ERROR modo de durabilidad inválido: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        }
+        case 'M':
+            cfg->metricsPort = atoi(optarg);
+            if (cfg->metricsPort <= 0 || cfg->metricsPort > 65535) {
+                fprintf(stderr, "ERROR puerto de métricas inválido: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'l':
+            cfg->traceLevel = TRACE_LEVEL_OFF + 1;
+            for (int i = 0; i <= TRACE_LEVEL_OFF; i++) {
+                if (strcmp(optarg, traceLevelNames[i]) == 0) cfg->traceLevel = i;
+            }
+            if (cfg->traceLevel > TRACE_LEVEL_OFF) {
+                fprintf(stderr, "ERROR nivel de registro inválido: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'e':
+            if (strcmp(optarg, serverEngineNames[ENGINE_EPOLL]) == 0) {
+                cfg->engine = ENGINE_EPOLL;
+            } else if (strcmp(optarg, serverEngineNames[ENGINE_URING]) == 0) {
+                cfg->engine = ENGINE_URING;
+            } else {
+                fprintf(stderr, "ERROR mecanismo de E/S inválido: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'f':
+            cfg->fanout = atoi(optarg);
+            if (cfg->fanout < 0 || cfg->fanout > DB_FANOUT_MAX) {
+                fprintf(stderr, "ERROR niveles de subcarpetas inválidos: %s (0 a %d)\n", optarg, DB_FANOUT_MAX);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'r':
+            cfg->restore = optarg;
+            break;
+        case 'R':
+            cfg->replPort = atoi(optarg);
+            if (cfg->replPort <= 0 || cfg->replPort > 65535) {
+                fprintf(stderr, "ERROR puerto de replicación inválido: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'F': {
+            const char* colon = strrchr(optarg, ':');
+            int port = colon != NULL ? atoi(colon + 1) : 0;
+            if (colon == NULL || colon == optarg || colon - optarg >= MAX_PATH_LEN || port <= 0 || port > 65535) {
+                fprintf(stderr, "ERROR líder inválido: %s (host:puerto)\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            cfg->replLeader = optarg;
+            break;
+        }
+        case 'K':
+            cfg->hotTop = atoi(optarg);
+            if (cfg->hotTop < 0 || cfg->hotTop > HOT_MAX_TOP) {
+                fprintf(stderr, "ERROR tamaño de las listas de claves inválido: %s (0 a %d)\n", optarg, HOT_MAX_TOP);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'h':
+        default:
+            fprintf(stderr, "Usage: %s [-p <puerto>] [-L <dirección>]... [-t <hilos>] [-b <backlog>] [-C <conexiones>] "
+                            "[-I <s>] [-T <s>] [-O <MB>] [-m <MB>] [-s file|log] "
+                            "[-d none|everysec|always] [-M <puerto>] [-l <nivel>] [-e epoll|uring] [-f <niveles>] [-r <volcado>] "
+                            "[-R <puerto>] [-F <host:puerto>] [-K <claves>] [-1]\n", argv[0]);
+            fprintf(stderr, "\t-p\tPuerto de escucha en 127.0.0.1 si no hay -L (default %d).\n", SERVER_PORT);
+            fprintf(stderr, "\t-L\tDirección de escucha, repetible: host:puerto, [ipv6]:puerto, unix:<ruta> o @<nombre> (abstracto).\n");
+            fprintf(stderr, "\t-t\tHilos de atención, cada uno con su socket SO_REUSEPORT (default 1).\n");
+            fprintf(stderr, "\t-b\tLargo de la cola de conexiones pendientes (default %d).\n", SERVER_BACKLOG);
+            fprintf(stderr, "\t-C\tConexiones abiertas como máximo, las demás reciben BUSY, 0 sin límite (default %d).\n",
+                    SERVER_MAX_CONNS);
+            fprintf(stderr, "\t-I\tSegundos sin actividad antes de cerrar una conexión, 0 sin plazo (default %d).\n",
+                    CONN_IDLE_TIMEOUT_S);
+            fprintf(stderr, "\t-T\tSegundos para completar un pedido o leer la respuesta, 0 sin plazo (default %d).\n",
+                    CONN_READ_TIMEOUT_S);
+            fprintf(stderr, "\t-O\tRespuestas sin enviar por conexión en MB antes de cerrarla, 0 sin límite (default %d).\n",
+                    CONN_OUT_LIMIT_MB);
+            fprintf(stderr, "\t-m\tMemoria para la cache de valores en MB, 0 la desactiva (default %d).\n", CACHE_DEFAULT_MB);
+            fprintf(stderr, "\t-s\tMotor de almacenamiento: file (un archivo por clave) o log (default file).\n");
+            fprintf(stderr, "\t-d\tDurabilidad: none, everysec (fsync por segundo) o always (OK tras el fsync) (default none).\n");
+            fprintf(stderr, "\t-M\tPuerto del endpoint de métricas para Prometheus (default desactivado).\n");
+            fprintf(stderr, "\t-l\tNivel de los mensajes: debug, info, warn, error u off (default info).\n");
+            fprintf(stderr, "\t-e\tMecanismo de E/S: epoll o uring (io_uring) (default epoll).\n");
+            fprintf(stderr, "\t-f\tNiveles de subcarpetas del motor file, 0 a %d (default 0, carpeta plana).\n", DB_FANOUT_MAX);
+            fprintf(stderr, "\t-r\tCarga un volcado de SNAPSHOT en la base vacía al arrancar.\n");
+            fprintf(stderr, "\t-R\tPuerto en el que acepta réplicas (default desactivado).\n");
+            fprintf(stderr, "\t-F\tRéplica de solo lectura del líder en host:puerto (su puerto de -R).\n");
+            fprintf(stderr, "\t-K\tClaves por lista de HOTKEYS en cada hilo, 0 a %d, 0 lo desactiva (default %d).\n",
+                    HOT_MAX_TOP, HOT_DEFAULT_TOP);
+            fprintf(stderr, "\t-1\tModo compatibilidad: cierra la conexión tras cada respuesta.\n");
+            exit(opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
     }
 }
 
 static void utilsCleanupAndExit(int code) {
-    if (clientSoc) close(clientSoc);
-    if (serverSoc) close(serverSoc);
+    traceFlush(); // lo encolado sale antes del cierre
+    for (int j = 0; j < config.listenerCount; j++) {
+        // la ruta de un socket Unix queda en el sistema de archivos si no se borra
+        if (config.listeners[j].kind == LISTEN_UNIX && config.listeners[j].fd > 0) unlink(config.listeners[j].addr);
+    }
+    for (int i = 0; i < MAX_WORKERS; i++) {
+        if (workers[i].epollFd) close(workers[i].epollFd);
+        for (int j = 0; j < config.listenerCount; j++) {
+            if (config.listeners[j].kind == LISTEN_TCP && workers[i].listen[j].fd) close(workers[i].listen[j].fd);
+        }
+        if (workers[i].syncFd) close(workers[i].syncFd);
+        if (workers[i].uring.fd) close(workers[i].uring.fd);
+    }
     exit(code);
 }
 
@@ -536,20 +9386,15 @@ static void utilsAddSignalsToHandler(struct sigaction* sa, int array[], int len)
     }
 }
 
-static void utilsSignalHandler(int sig) {
-    printf("handler: señal recibida %d.\n", sig);
-    switch (sig) {
-    case SIGPIPE:
-        printf("handler: cliente corto la conexión. Cerrando socket del cliente.\n");
-        if (clientSoc) close(clientSoc);
-        break;
-    case SIGINT:
-        printf("handler: desconectando server.\n");
-        utilsCleanupAndExit(EXIT_SUCCESS);
-        break;
-    default:
-        break;
-    }
+static void* utilsSignalThread(void* arg) {
+    const sigset_t* set = arg;
+    int sig;
+    while (sigwait(set, &sig) != 0 || sig != SIGINT) {}
+    TRACE_INFO("handler: señal recibida %d.", sig);
+    TRACE_INFO("handler: desconectando server.");
+    dbSyncReport();
+    utilsCleanupAndExit(EXIT_SUCCESS);
+    return NULL;
 }
 
-/*********************** end of file ************************/
\ No newline at end of file
+/*********************** end of file ************************/